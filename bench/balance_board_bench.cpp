@@ -0,0 +1,359 @@
+#include "bench.h"
+#include "simulated_remote.h"
+#include "wiimote_calibration.h"
+#include "wiimote_extension.h"
+#include "wiimote_input.h"
+#include "calibration_cache.h"
+#include "wiimote_protocol.h"
+#include <atomic>
+#include <memory>
+#include <cmath>
+#include <random>
+
+using namespace WiimoteProtocol;
+
+constexpr uint64_t BOARD_ADDRESS = 0x00BEEF000100ull;
+constexpr uint64_t BOARD_ID = 0x0000A4200402ull;
+// The board reports continuously; this is as fast as a remote sends 0x34
+constexpr auto BOARD_REPORT_PERIOD = std::chrono::milliseconds(5);
+constexpr auto BOARD_RUN_TIME = std::chrono::milliseconds(1000);
+constexpr auto BOARD_SETUP_TIMEOUT = std::chrono::seconds(2);
+constexpr int LOOP_REPORTS = 2000000;
+
+// Raw load cell readings at 0, 17 and 34 kg, different for every sensor as
+// on a real board
+static void MakeCalibration(int board, uint16_t points[3][BALANCE_SENSOR_COUNT])
+{
+    for (int sensor = 0; sensor < BALANCE_SENSOR_COUNT; ++sensor)
+    {
+        const uint16_t zero = static_cast<uint16_t>(1800 + 97 * sensor + 13 * board);
+        const uint16_t per_17kg = static_cast<uint16_t>(1700 + 41 * sensor);
+        points[0][sensor] = zero;
+        points[1][sensor] = static_cast<uint16_t>(zero + per_17kg);
+        // The cells are not quite linear; the upper half is a little steeper
+        points[2][sensor] = static_cast<uint16_t>(zero + 2 * per_17kg + 60);
+    }
+}
+
+// The board's calibration block at 0xA40020, as the remote answers the read
+static void MakeBlock(const uint16_t points[3][BALANCE_SENSOR_COUNT], uint8_t block[32])
+{
+    std::fill(block, block + 32, 0);
+    for (int point = 0; point < BalanceBoardCalibration::POINT_COUNT; ++point)
+    {
+        for (int sensor = 0; sensor < BALANCE_SENSOR_COUNT; ++sensor)
+        {
+            uint8_t* value = block + 4 + (point * BALANCE_SENSOR_COUNT + sensor) * 2;
+            value[0] = static_cast<uint8_t>(points[point][sensor] >> 8);
+            value[1] = static_cast<uint8_t>(points[point][sensor] & 0xFF);
+        }
+    }
+}
+
+// The load on each sensor at `step`: a person of 40 - 90 kg swaying about
+static void MakeLoad(int board, uint32_t step, float kg[BALANCE_SENSOR_COUNT])
+{
+    const float weight = 65.0f + 25.0f * std::sin(step * 0.003f + board);
+    const float x = 0.6f * std::sin(step * 0.021f + board);
+    const float y = 0.6f * std::cos(step * 0.017f);
+    kg[BALANCE_TOP_RIGHT] = weight * (1.0f + x) * (1.0f + y) / 4.0f;
+    kg[BALANCE_BOTTOM_RIGHT] = weight * (1.0f + x) * (1.0f - y) / 4.0f;
+    kg[BALANCE_TOP_LEFT] = weight * (1.0f - x) * (1.0f + y) / 4.0f;
+    kg[BALANCE_BOTTOM_LEFT] = weight * (1.0f - x) * (1.0f - y) / 4.0f;
+}
+
+// A 0x34 report carrying the board's sensor bytes for `kg`
+static void MakeReport(const uint16_t points[3][BALANCE_SENSOR_COUNT], const float kg[BALANCE_SENSOR_COUNT],
+                       std::vector<uint8_t>& report)
+{
+    report.assign(GetInputReportSize(INPUT_CORE_EXT19), 0);
+    report[0] = INPUT_CORE_EXT19;
+    uint8_t* data = report.data() + 3;
+    for (int sensor = 0; sensor < BALANCE_SENSOR_COUNT; ++sensor)
+    {
+        const bool upper = kg[sensor] >= BalanceBoardCalibration::POINT_SPACING_KG;
+        const float base = upper ? points[1][sensor] : points[0][sensor];
+        const float span = upper ? points[2][sensor] - points[1][sensor] : points[1][sensor] - points[0][sensor];
+        const float part = (kg[sensor] - (upper ? BalanceBoardCalibration::POINT_SPACING_KG : 0.0f)) /
+                           BalanceBoardCalibration::POINT_SPACING_KG;
+        const uint16_t raw = static_cast<uint16_t>(std::lround(base + part * span));
+        data[sensor * 2] = static_cast<uint8_t>(raw >> 8);
+        data[sensor * 2 + 1] = static_cast<uint8_t>(raw & 0xFF);
+    }
+    data[8] = 0x19;
+    data[10] = 0x83;
+}
+
+namespace
+{
+    // A simulated remote with a Balance Board as its extension, identified
+    // and calibrated through the register engine as WiimoteDevice does
+    class SimulatedBoard
+    {
+    public:
+        explicit SimulatedBoard(int board)
+            : m_board(board),
+              m_registers([this](const uint8_t* report, size_t size) { return m_remote->Send(report, size); }),
+              m_extension(m_registers, board),
+              m_calibration(m_registers, BOARD_ADDRESS + board, board)
+        {
+            MakeCalibration(board, m_points);
+            CalibrationCache::Instance().Invalidate(BOARD_ADDRESS + board, BOARD_ID);
+
+            m_remote = std::make_unique<SimulatedRemote>(SimulatedRemote::Link(),
+                [this](const uint8_t* report, size_t size) { HandleReport(report, size); });
+            uint8_t id[EXTENSION_ID_SIZE];
+            for (size_t i = 0; i < EXTENSION_ID_SIZE; ++i)
+                id[i] = static_cast<uint8_t>(BOARD_ID >> (8 * (EXTENSION_ID_SIZE - 1 - i)));
+            m_remote->SetMemory(ADDRESS_SPACE_REGISTER, EXTENSION_ID, id, sizeof(id));
+            uint8_t block[32];
+            MakeBlock(m_points, block);
+            m_remote->SetMemory(ADDRESS_SPACE_REGISTER, EXTENSION_CALIBRATION, block, sizeof(block));
+
+            m_extension.SetChangedCallback([this](ExtensionType type) {
+                m_calibration.LoadExtension(type, m_extension.GetId());
+            });
+            m_remote->SetTickHandler(std::chrono::milliseconds(10), [this](Bench::Clock::time_point now) {
+                m_registers.Tick(now);
+                m_extension.Tick(now);
+            });
+            m_extension.HandleStatus(true, Bench::Clock::now());
+        }
+
+        ~SimulatedBoard()
+        {
+            m_remote.reset();
+            CalibrationCache::Instance().Invalidate(BOARD_ADDRESS + m_board, BOARD_ID);
+        }
+
+        bool IsReady() const
+        {
+            BalanceBoardCalibration calibration;
+            return m_calibration.GetBalanceBoard(calibration) && m_registers.IsIdle();
+        }
+
+        void StartReports()
+        {
+            m_remote->SetDataReports(BOARD_REPORT_PERIOD, [this](Bench::Clock::time_point, std::vector<uint8_t>& report) {
+                float kg[BALANCE_SENSOR_COUNT];
+                MakeLoad(m_board, m_step, kg);
+                m_expected[m_step % EXPECTED_HISTORY] = kg[0] + kg[1] + kg[2] + kg[3];
+                MakeReport(m_points, kg, report);
+                report[1] = static_cast<uint8_t>(m_step);
+                m_step++;
+            });
+        }
+
+        void StopReports()
+        {
+            m_remote->SetDataReports(std::chrono::microseconds::zero(), nullptr);
+        }
+
+        uint32_t Sent() const { return m_step; }
+        uint32_t Decoded() const { return m_decoded; }
+        double MaxWeightError() const { return m_max_error_kg; }
+        const std::vector<double>& DecodeNanoseconds() const { return m_decode_ns; }
+
+    private:
+        // Reports arrive a few periods after they are made; their expected
+        // weight is kept until then, keyed by the low bits of the step the
+        // report carries in its button bytes
+        static constexpr uint32_t EXPECTED_HISTORY = 256;
+
+        int m_board;
+        uint16_t m_points[3][BALANCE_SENSOR_COUNT];
+        std::unique_ptr<SimulatedRemote> m_remote;
+        WiimoteRegisterEngine m_registers;
+        WiimoteExtension m_extension;
+        WiimoteCalibration m_calibration;
+
+        // Written on the remote's thread only
+        std::atomic<uint32_t> m_step{ 0 };
+        float m_expected[EXPECTED_HISTORY] = {};
+        std::atomic<uint32_t> m_decoded{ 0 };
+        double m_max_error_kg = 0.0;
+        std::vector<double> m_decode_ns;
+
+        void HandleReport(const uint8_t* report, size_t size)
+        {
+            if (m_registers.HandleInputReport(report, size) || report[0] != INPUT_CORE_EXT19)
+                return;
+
+            // What WiimoteDevice does for each board report
+            const Bench::Clock::time_point start = Bench::Clock::now();
+            WiimoteInputState input;
+            ExtensionState state;
+            BalanceBoardCalibration calibration;
+            const bool decoded = DecodeInputReport(report, size, input) &&
+                                 m_extension.Decode(input.extension, input.extension_size, state, start) &&
+                                 m_calibration.GetBalanceBoard(calibration);
+            if (decoded)
+                calibration.Apply(state.balance_board);
+            const Bench::Clock::time_point end = Bench::Clock::now();
+            if (!decoded || state.type != ExtensionType::BalanceBoard)
+                return;
+
+            m_decode_ns.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+            const float expected = m_expected[report[1] % EXPECTED_HISTORY];
+            m_max_error_kg = std::max(m_max_error_kg, std::fabs(static_cast<double>(state.balance_board.weight_kg - expected)));
+            m_decoded++;
+        }
+    };
+
+    // One sensor at a time with a branch on its segment, as the
+    // interpolation would be written without the select-based form
+    void ApplyPerSensor(const BalanceBoardCalibration& calibration, BalanceBoardState& state)
+    {
+        float kg[BALANCE_SENSOR_COUNT];
+        for (int sensor = 0; sensor < BALANCE_SENSOR_COUNT; ++sensor)
+        {
+            const float raw = state.sensors[sensor];
+            if (raw < calibration.points[1][sensor])
+                kg[sensor] = (raw - calibration.points[0][sensor]) * calibration.kg_per_count[0][sensor];
+            else
+            {
+                kg[sensor] = BalanceBoardCalibration::POINT_SPACING_KG +
+                             (raw - calibration.points[1][sensor]) * calibration.kg_per_count[1][sensor];
+            }
+            kg[sensor] = std::max(0.0f, kg[sensor]);
+        }
+        const float weight = kg[0] + kg[1] + kg[2] + kg[3];
+        std::copy(kg, kg + BALANCE_SENSOR_COUNT, state.sensor_kg);
+        state.weight_kg = weight;
+        state.center_x = weight >= 1.0f ? (kg[BALANCE_TOP_RIGHT] + kg[BALANCE_BOTTOM_RIGHT] -
+                                           kg[BALANCE_TOP_LEFT] - kg[BALANCE_BOTTOM_LEFT]) / weight : 0.0f;
+        state.center_y = weight >= 1.0f ? (kg[BALANCE_TOP_RIGHT] + kg[BALANCE_TOP_LEFT] -
+                                           kg[BALANCE_BOTTOM_RIGHT] - kg[BALANCE_BOTTOM_LEFT]) / weight : 0.0f;
+        state.calibrated = true;
+    }
+}
+
+// Boards connected through simulated links, each identified, calibrated
+// from its own block and then sending 0x34 reports every 5 ms. Every report
+// is decoded and interpolated on the remote's thread as the device does it,
+// and the weight checked against the load the report was made from.
+BENCH(balance_board_decode, "Balance Board decode and calibration cost at full report rate for 1 - 8 boards")
+{
+    bool ok = true;
+    for (int count : { 1, 4, 8 })
+    {
+        std::vector<std::unique_ptr<SimulatedBoard>> boards;
+        for (int board = 0; board < count; ++board)
+            boards.push_back(std::make_unique<SimulatedBoard>(board));
+
+        const Bench::Clock::time_point deadline = Bench::Clock::now() + BOARD_SETUP_TIMEOUT;
+        while (Bench::Clock::now() < deadline &&
+               std::find_if(boards.begin(), boards.end(),
+                            [](const std::unique_ptr<SimulatedBoard>& board) { return !board->IsReady(); }) != boards.end())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        for (auto& board : boards)
+            board->StartReports();
+        std::this_thread::sleep_for(BOARD_RUN_TIME);
+        for (auto& board : boards)
+            board->StopReports();
+        // Let the reports still on the links arrive
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        uint64_t sent = 0;
+        uint64_t decoded = 0;
+        double max_error_kg = 0.0;
+        std::vector<double> decode_ns;
+        for (auto& board : boards)
+        {
+            sent += board->Sent();
+            decoded += board->Decoded();
+            max_error_kg = std::max(max_error_kg, board->MaxWeightError());
+            decode_ns.insert(decode_ns.end(), board->DecodeNanoseconds().begin(), board->DecodeNanoseconds().end());
+        }
+        boards.clear();
+
+        const double mean_ns = Bench::Mean(decode_ns);
+        const double reports_per_second = decoded / std::chrono::duration<double>(BOARD_RUN_TIME).count();
+        std::printf("  %d boards: %llu/%llu reports decoded, %.0f reports/s, decode p50 %.0f ns, p99 %.0f ns, "
+                    "%.3f%% of a core, max weight error %.3f kg\n",
+                    count, static_cast<unsigned long long>(decoded), static_cast<unsigned long long>(sent),
+                    reports_per_second, Bench::Percentile(decode_ns, 0.5), Bench::Percentile(decode_ns, 0.99),
+                    100.0 * mean_ns * reports_per_second / 1e9, max_error_kg);
+        if (decoded == 0 || decoded != sent)
+            ok = Bench::Fail("board reports were not all decoded");
+        // One raw count is about 10 g per sensor
+        if (max_error_kg > 0.1)
+            ok = Bench::Fail("the decoded weight is off");
+    }
+    return ok;
+}
+
+// Time the interpolation alone over `recorded`, as done and as one sensor
+// at a time; returns false when the two disagree
+static bool TimeInterpolation(const BalanceBoardCalibration& calibration,
+                              const std::vector<BalanceBoardState>& recorded, double& select_ns, double& branch_ns)
+{
+    double sum = 0.0;
+    BalanceBoardState state;
+    Bench::Clock::time_point start = Bench::Clock::now();
+    for (int i = 0; i < LOOP_REPORTS; ++i)
+    {
+        state = recorded[i % recorded.size()];
+        calibration.Apply(state);
+        sum += state.weight_kg;
+    }
+    select_ns = std::chrono::duration<double, std::nano>(Bench::Clock::now() - start).count() / LOOP_REPORTS;
+
+    double reference_sum = 0.0;
+    start = Bench::Clock::now();
+    for (int i = 0; i < LOOP_REPORTS; ++i)
+    {
+        state = recorded[i % recorded.size()];
+        ApplyPerSensor(calibration, state);
+        reference_sum += state.weight_kg;
+    }
+    branch_ns = std::chrono::duration<double, std::nano>(Bench::Clock::now() - start).count() / LOOP_REPORTS;
+    return std::fabs(sum - reference_sum) <= 1e-3 * std::fabs(reference_sum);
+}
+
+// The interpolation alone over recorded reports, against one sensor at a
+// time with a branch on its segment. With someone swaying the segment of
+// each sensor changes slowly and the branches are predicted; with someone
+// of 68 kg standing still every sensor sits at its 17 kg point, and the
+// noise of the cells picks the segment at random. Printed only: the
+// difference depends on the compiler and the optimization level.
+BENCH(balance_board_interpolation, "Balance Board interpolation of all four sensors against one sensor at a time")
+{
+    uint16_t points[3][BALANCE_SENSOR_COUNT];
+    MakeCalibration(0, points);
+    uint8_t block[32];
+    MakeBlock(points, block);
+    const BalanceBoardCalibration calibration = BalanceBoardCalibration::Parse(block);
+    if (!calibration.valid)
+        return Bench::Fail("the calibration block did not parse");
+
+    std::vector<BalanceBoardState> swaying(4096);
+    std::vector<BalanceBoardState> standing(4096);
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> noise(-3, 3);
+    std::vector<uint8_t> report;
+    for (size_t i = 0; i < swaying.size(); ++i)
+    {
+        float kg[BALANCE_SENSOR_COUNT];
+        MakeLoad(0, static_cast<uint32_t>(i), kg);
+        MakeReport(points, kg, report);
+        for (int sensor = 0; sensor < BALANCE_SENSOR_COUNT; ++sensor)
+        {
+            swaying[i].sensors[sensor] = static_cast<uint16_t>((report[3 + sensor * 2] << 8) | report[4 + sensor * 2]);
+            standing[i].sensors[sensor] = static_cast<uint16_t>(points[1][sensor] + noise(random));
+        }
+    }
+
+    bool ok = true;
+    for (const auto& [name, recorded] : { std::make_pair("swaying", &swaying), std::make_pair("standing still", &standing) })
+    {
+        double select_ns = 0.0;
+        double branch_ns = 0.0;
+        if (!TimeInterpolation(calibration, *recorded, select_ns, branch_ns))
+            ok = Bench::Fail("the two interpolations disagree");
+        std::printf("  %-14s all four at once: %.1f ns per report; one sensor at a time: %.1f ns per report\n",
+                    name, select_ns, branch_ns);
+    }
+    return ok;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdio>
+#include <cstddef>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <ctime>
+#endif
+
+// Benchmarks and checks that run without a remote attached. Each one is a
+// function registered with BENCH(); it prints what it measured and returns
+// false when a property it checks does not hold. Timings depend on the
+// machine: they are only checked where the expected difference is several
+// times any scheduling noise.
+namespace Bench
+{
+    using Clock = std::chrono::steady_clock;
+    using Function = bool (*)();
+
+    struct Entry
+    {
+        const char* name;
+        const char* description;
+        Function run;
+    };
+
+    std::vector<Entry>& Registry();
+
+    struct Registrar
+    {
+        Registrar(const char* name, const char* description, Function run)
+        {
+            Registry().push_back({ name, description, run });
+        }
+    };
+
+    inline double Microseconds(Clock::duration duration)
+    {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    }
+
+    inline double Milliseconds(Clock::duration duration)
+    {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    // The `fraction` quantile of `values`, which it sorts
+    inline double Percentile(std::vector<double>& values, double fraction)
+    {
+        if (values.empty())
+            return 0.0;
+        std::sort(values.begin(), values.end());
+        const size_t index = static_cast<size_t>(fraction * (values.size() - 1) + 0.5);
+        return values[std::min(index, values.size() - 1)];
+    }
+
+    inline double Mean(const std::vector<double>& values)
+    {
+        double sum = 0.0;
+        for (double value : values)
+            sum += value;
+        return values.empty() ? 0.0 : sum / values.size();
+    }
+
+    // CPU time used by every thread of the process so far
+    inline double ProcessCpuMicroseconds()
+    {
+#ifdef _WIN32
+        FILETIME creation, exit, kernel, user;
+        GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+        const auto ticks = [](const FILETIME& time) {
+            return (static_cast<unsigned long long>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+        };
+        return (ticks(kernel) + ticks(user)) / 10.0;
+#else
+        timespec time;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+        return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+#endif
+    }
+
+    // Report a failed check and fail the benchmark
+    inline bool Fail(const char* what)
+    {
+        std::printf("  FAILED: %s\n", what);
+        return false;
+    }
+}
+
+#define BENCH(name, description)                                                  \
+    static bool Bench_##name();                                                   \
+    static Bench::Registrar Bench_registrar_##name(#name, description, Bench_##name); \
+    static bool Bench_##name()
@@ -0,0 +1,52 @@
+#include "bench.h"
+#include <cstring>
+
+std::vector<Bench::Entry>& Bench::Registry()
+{
+    static std::vector<Entry> entries;
+    return entries;
+}
+
+// Runs the benchmarks named on the command line, or all of them. --list
+// prints their names.
+int main(int argc, char* argv[])
+{
+    std::vector<Bench::Entry>& entries = Bench::Registry();
+    std::sort(entries.begin(), entries.end(), [](const Bench::Entry& a, const Bench::Entry& b) {
+        return std::strcmp(a.name, b.name) < 0;
+    });
+
+    if (argc == 2 && std::strcmp(argv[1], "--list") == 0)
+    {
+        for (const Bench::Entry& entry : entries)
+            std::printf("%-28s %s\n", entry.name, entry.description);
+        return 0;
+    }
+
+    int failed = 0;
+    int run = 0;
+    for (const Bench::Entry& entry : entries)
+    {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc && !selected; ++i)
+            selected = std::strcmp(argv[i], entry.name) == 0;
+        if (!selected)
+            continue;
+
+        std::printf("[%s] %s\n", entry.name, entry.description);
+        std::fflush(stdout);
+        const bool passed = entry.run();
+        std::printf("[%s] %s\n", entry.name, passed ? "ok" : "FAILED");
+        std::fflush(stdout);
+        run++;
+        if (!passed)
+            failed++;
+    }
+
+    if (run == 0)
+    {
+        std::printf("No benchmark matched\n");
+        return 1;
+    }
+    return failed == 0 ? 0 : 1;
+}
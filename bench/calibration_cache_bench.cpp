@@ -0,0 +1,106 @@
+#include "bench.h"
+#include "simulated_remote.h"
+#include "wiimote_calibration.h"
+#include "calibration_cache.h"
+#include "wiimote_protocol.h"
+#include <algorithm>
+#include <atomic>
+#include <cwctype>
+#include <string>
+
+using namespace WiimoteProtocol;
+
+constexpr uint64_t BENCH_ADDRESS = 0x00BEEF000001ull;
+// A remote whose Bluetooth address could not be found
+constexpr const wchar_t* BENCH_PATH = L"\\\\?\\hid#{00001124-0000-1000-8000-00805f9b34fb}_vid&0002057e_pid&0306#bench";
+constexpr int TRIALS = 10;
+constexpr auto TRIAL_TIMEOUT = std::chrono::seconds(2);
+
+// Connect one simulated remote cached under `key` reporting core buttons
+// and accelerometer at 100 Hz, and return the time from Load to its first
+// calibrated sample, or a negative value when none arrived
+static double MeasureConnect(uint64_t key)
+{
+    SimulatedRemote* remote_pointer = nullptr;
+    WiimoteRegisterEngine registers([&remote_pointer](const uint8_t* report, size_t size) {
+        return remote_pointer->Send(report, size);
+    });
+    WiimoteCalibration calibration(registers, key, 0);
+    std::atomic<int64_t> first_sample_ns(-1);
+    const Bench::Clock::time_point connected = Bench::Clock::now();
+
+    SimulatedRemote remote(SimulatedRemote::Link(), [&](const uint8_t* report, size_t size) {
+        if (registers.HandleInputReport(report, size) || report[0] != INPUT_CORE_ACCEL)
+            return;
+        AccelCalibration accel;
+        if (!calibration.GetAccel(accel) || first_sample_ns >= 0)
+            return;
+        const Bench::Clock::time_point now = Bench::Clock::now();
+        calibration.NoteCalibratedSample(now);
+        first_sample_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - connected).count();
+    });
+    remote_pointer = &remote;
+    remote.SetAccelCalibration(0x200, 0x260);
+    remote.SetTickHandler(std::chrono::milliseconds(10), [&registers](Bench::Clock::time_point now) {
+        registers.Tick(now);
+    });
+
+    calibration.Load(connected);
+    remote.SetDataReports(std::chrono::milliseconds(10), [](Bench::Clock::time_point, std::vector<uint8_t>& report) {
+        report = { INPUT_CORE_ACCEL, 0, 0, 0x80, 0x80, 0x98 };
+    });
+
+    const Bench::Clock::time_point deadline = connected + TRIAL_TIMEOUT;
+    while ((first_sample_ns < 0 || !registers.IsIdle()) && Bench::Clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return first_sample_ns >= 0 ? first_sample_ns / 1e6 : -1.0;
+}
+
+BENCH(calibration_cache, "Connect-to-calibrated-sample latency with and without the calibration cache")
+{
+    std::vector<double> uncached;
+    std::vector<double> cached;
+    for (int trial = 0; trial < TRIALS; ++trial)
+    {
+        CalibrationCache::Instance().Invalidate(BENCH_ADDRESS, CalibrationCache::CORE_CALIBRATION);
+        uncached.push_back(MeasureConnect(BENCH_ADDRESS));
+        cached.push_back(MeasureConnect(BENCH_ADDRESS));
+    }
+    CalibrationCache::Instance().Invalidate(BENCH_ADDRESS, CalibrationCache::CORE_CALIBRATION);
+
+    // Without an address the remote is cached under its device path
+    const uint64_t path_key = CalibrationCache::KeyFor(0, BENCH_PATH);
+    std::wstring upper_path(BENCH_PATH);
+    for (wchar_t& c : upper_path)
+        c = static_cast<wchar_t>(std::towupper(c));
+    const uint64_t hits_before = CalibrationCache::Instance().GetStats().hits;
+    CalibrationCache::Instance().Invalidate(path_key, CalibrationCache::CORE_CALIBRATION);
+    const bool path_connected = MeasureConnect(path_key) >= 0.0 && MeasureConnect(path_key) >= 0.0;
+    const uint64_t path_hits = CalibrationCache::Instance().GetStats().hits - hits_before;
+    CalibrationCache::Instance().Invalidate(path_key, CalibrationCache::CORE_CALIBRATION);
+
+    if (std::find_if(uncached.begin(), uncached.end(), [](double ms) { return ms < 0.0; }) != uncached.end() ||
+        std::find_if(cached.begin(), cached.end(), [](double ms) { return ms < 0.0; }) != cached.end())
+        return Bench::Fail("a connect produced no calibrated sample");
+
+    const CalibrationCache::Stats stats = CalibrationCache::Instance().GetStats();
+    std::printf("  link: 3 ms one way, 1.25 ms per report, data reports every 10 ms\n");
+    std::printf("  without cache: mean %.2f ms, p50 %.2f ms, max %.2f ms\n",
+                Bench::Mean(uncached), Bench::Percentile(uncached, 0.5), Bench::Percentile(uncached, 1.0));
+    std::printf("  with cache:    mean %.2f ms, p50 %.2f ms, max %.2f ms\n",
+                Bench::Mean(cached), Bench::Percentile(cached, 0.5), Bench::Percentile(cached, 1.0));
+    std::printf("  cache hits %llu, misses %llu, stale %llu; keyed by device path: %llu hits in 2 connects\n",
+                static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.misses),
+                static_cast<unsigned long long>(stats.stale), static_cast<unsigned long long>(path_hits));
+
+    if (stats.hits < TRIALS)
+        return Bench::Fail("known remotes did not hit the cache");
+    if (path_key == 0 || path_key != CalibrationCache::KeyFor(0, upper_path) ||
+        path_key == CalibrationCache::KeyFor(0, L"\\\\?\\hid#other") || CalibrationCache::KeyFor(0, L"") != 0)
+        return Bench::Fail("device path keys are not stable, case-blind and distinct");
+    if (!path_connected || path_hits != 1)
+        return Bench::Fail("a remote without an address was not cached by its device path");
+    if (Bench::Mean(cached) >= Bench::Mean(uncached))
+        return Bench::Fail("the cache did not shorten the connect");
+    return true;
+}
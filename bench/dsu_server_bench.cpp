@@ -0,0 +1,313 @@
+#include "bench.h"
+#include "dsu_server.h"
+#include <atomic>
+#include <thread>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+// Off the default port so a running bridge does not get in the way
+constexpr uint16_t BENCH_PORT = DsuServer::DEFAULT_PORT + 1;
+constexpr int CLIENTS = 4;
+constexpr int RATE_REPORTS = 20000;
+// Reports a client may be behind before the sender waits for it
+constexpr int RATE_WINDOW = 64;
+constexpr int LATENCY_REPORTS = 1000;
+constexpr auto LATENCY_PERIOD = std::chrono::milliseconds(1);
+constexpr size_t DATA_PACKET_SIZE = 100;
+constexpr uint32_t MESSAGE_VERSION = 0x100000;
+constexpr uint32_t MESSAGE_DATA = 0x100002;
+// Where the pad data starts, and the timestamp in it
+constexpr size_t TIMESTAMP_OFFSET = 31 + 37;
+
+static uint32_t Crc32(const uint8_t* data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; ++i)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+static uint32_t Get32(const uint8_t* in)
+{
+    return static_cast<uint32_t>(in[0]) | (static_cast<uint32_t>(in[1]) << 8) |
+           (static_cast<uint32_t>(in[2]) << 16) | (static_cast<uint32_t>(in[3]) << 24);
+}
+
+static void Put32(uint8_t* out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out[i] = static_cast<uint8_t>(value >> (i * 8));
+}
+
+// A packet whose checksum matches its contents
+static bool CheckCrc(const uint8_t* packet, size_t size)
+{
+    uint8_t copy[DATA_PACKET_SIZE];
+    if (size < 16 || size > sizeof(copy))
+        return false;
+    memcpy(copy, packet, size);
+    Put32(copy + 8, 0);
+    return Crc32(copy, size) == Get32(packet + 8);
+}
+
+namespace
+{
+    // One emulator on its own UDP socket, talking to the server as a DSU
+    // client does
+    class LoopbackClient
+    {
+    public:
+        LoopbackClient() : m_socket(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)), m_id(0)
+        {
+            sockaddr_in local = {};
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(m_socket, reinterpret_cast<const sockaddr*>(&local), sizeof(local));
+            timeval timeout = { 0, 200000 };
+            setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            m_id = static_cast<uint32_t>(m_socket);
+        }
+
+        ~LoopbackClient() { close(m_socket); }
+
+        bool IsOpen() const { return m_socket >= 0; }
+
+        void RequestVersion()
+        {
+            uint8_t request[20] = {};
+            Send(request, sizeof(request), MESSAGE_VERSION);
+        }
+
+        // Flags 0 for every pad, 1 for the one in `pad`
+        void RegisterData(uint8_t flags, uint8_t pad)
+        {
+            uint8_t request[28] = {};
+            request[20] = flags;
+            request[21] = pad;
+            Send(request, sizeof(request), MESSAGE_DATA);
+        }
+
+        // Size of the packet received, 0 on timeout
+        size_t Receive(uint8_t* packet, size_t size)
+        {
+            const ssize_t received = recv(m_socket, packet, size, 0);
+            return received > 0 ? static_cast<size_t>(received) : 0;
+        }
+
+    private:
+        int m_socket;
+        uint32_t m_id;
+
+        void Send(uint8_t* request, size_t size, uint32_t type)
+        {
+            memcpy(request, "DSUC", 4);
+            request[4] = 1001 & 0xFF;
+            request[5] = 1001 >> 8;
+            request[6] = static_cast<uint8_t>(size - 16);
+            request[7] = 0;
+            Put32(request + 8, 0);
+            Put32(request + 12, m_id);
+            Put32(request + 16, type);
+            Put32(request + 8, Crc32(request, size));
+
+            sockaddr_in server = {};
+            server.sin_family = AF_INET;
+            server.sin_port = htons(BENCH_PORT);
+            server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            sendto(m_socket, request, size, 0, reinterpret_cast<const sockaddr*>(&server), sizeof(server));
+        }
+    };
+
+    struct ClientResult
+    {
+        std::atomic<uint64_t> received{ 0 };
+        std::atomic<uint64_t> bad{ 0 };
+        std::vector<double> latency_us;   // only while measuring latency
+    };
+}
+
+// Wait for the server thread to take its input from exactly `pads`
+static bool WaitForPads(uint32_t pads, std::chrono::milliseconds timeout)
+{
+    const Bench::Clock::time_point give_up = Bench::Clock::now() + timeout;
+    while (DsuServer::Instance().GetStats().subscribed_pads != pads)
+    {
+        if (Bench::Clock::now() > give_up)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+static uint64_t NowMicroseconds()
+{
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(Bench::Clock::now().time_since_epoch()).count());
+}
+
+// Loopback clients against the server on its own port. The server asks a
+// remote for data only while some client's registration covers its pad, and
+// lets go once every registration has lapsed. While four clients are
+// registered, reports of pad 0 are sent as fast as the clients take them,
+// for the sustained packet rate, then once a millisecond for the time from
+// HandleInput to a client having the packet. Every packet's checksum is
+// checked; the lapse takes the protocol's five seconds.
+BENCH(dsu_loopback, "DSU server against loopback clients: registrations, packet rate and latency")
+{
+    DsuServer& server = DsuServer::Instance();
+    if (!server.Start(BENCH_PORT))
+        return Bench::Fail("the server could not be started");
+
+    std::vector<std::unique_ptr<LoopbackClient>> clients;
+    for (int i = 0; i < CLIENTS; ++i)
+        clients.push_back(std::make_unique<LoopbackClient>());
+    for (const auto& client : clients)
+    {
+        if (!client->IsOpen())
+        {
+            server.Stop();
+            return Bench::Fail("a client socket could not be opened");
+        }
+    }
+
+    bool ok = true;
+    uint8_t packet[DATA_PACKET_SIZE];
+    clients[0]->RequestVersion();
+    const size_t version_size = clients[0]->Receive(packet, sizeof(packet));
+    if (version_size != 22 || !CheckCrc(packet, version_size) || Get32(packet + 16) != MESSAGE_VERSION)
+        ok = Bench::Fail("no valid version reply");
+
+    // Nothing is subscribed before a registration, and one pad's
+    // registration subscribes that pad only
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    const uint32_t before = server.GetStats().subscribed_pads;
+    clients[1]->RegisterData(1, 1);
+    const bool one_pad = WaitForPads(0x02, std::chrono::milliseconds(500));
+    for (const auto& client : clients)
+        client->RegisterData(0, 0);
+    const bool every_pad = WaitForPads(0x0F, std::chrono::milliseconds(500));
+    std::printf("  subscribed pads: %#x before any registration, %s for pad 1, %s for every pad\n", before,
+                one_pad ? "0x2" : "wrong", every_pad ? "0xf" : "wrong");
+    if (before != 0 || !one_pad || !every_pad)
+        ok = Bench::Fail("the pads subscribed do not follow the registrations");
+
+    std::atomic<bool> running(true);
+    std::atomic<bool> timing(false);
+    std::vector<ClientResult> results(CLIENTS);
+    std::vector<std::thread> receivers;
+    for (int i = 0; i < CLIENTS; ++i)
+    {
+        receivers.emplace_back([&, i]() {
+            uint8_t data[DATA_PACKET_SIZE];
+            ClientResult& result = results[i];
+            while (running)
+            {
+                const size_t size = clients[i]->Receive(data, sizeof(data));
+                if (size == 0)
+                    continue;
+                if (size != DATA_PACKET_SIZE || !CheckCrc(data, size) || Get32(data + 16) != MESSAGE_DATA ||
+                    data[20] != 0)
+                {
+                    result.bad++;
+                    continue;
+                }
+                if (timing)
+                {
+                    uint64_t sampled_us = 0;
+                    for (int byte = 7; byte >= 0; --byte)
+                        sampled_us = (sampled_us << 8) | data[TIMESTAMP_OFFSET + byte];
+                    result.latency_us.push_back(static_cast<double>(NowMicroseconds() - sampled_us));
+                }
+                result.received++;
+            }
+        });
+    }
+
+    WiimoteInputState input;
+    input.accel_calibrated = true;
+    const ExtensionState extension;
+    const DsuServer::Stats rate_before = server.GetStats();
+    const Bench::Clock::time_point rate_start = Bench::Clock::now();
+    for (int i = 0; i < RATE_REPORTS; ++i)
+    {
+        for (const ClientResult& result : results)
+        {
+            const Bench::Clock::time_point give_up = Bench::Clock::now() + std::chrono::milliseconds(100);
+            while (result.received + RATE_WINDOW < static_cast<uint64_t>(i) && Bench::Clock::now() < give_up)
+                std::this_thread::yield();
+        }
+        input.sampled = Bench::Clock::now();
+        input.buttons = static_cast<uint16_t>(i);
+        server.HandleInput(0, 0x00BEEF000043ull, input, extension);
+    }
+    uint64_t rate_received = 0;
+    for (const ClientResult& result : results)
+    {
+        const Bench::Clock::time_point give_up = Bench::Clock::now() + std::chrono::milliseconds(200);
+        while (result.received < RATE_REPORTS && Bench::Clock::now() < give_up)
+            std::this_thread::yield();
+        rate_received += result.received;
+    }
+    const double rate_us = Bench::Microseconds(Bench::Clock::now() - rate_start);
+    const DsuServer::Stats rate_after = server.GetStats();
+
+    timing = true;
+    Bench::Clock::time_point next = Bench::Clock::now();
+    for (int i = 0; i < LATENCY_REPORTS; ++i)
+    {
+        next += LATENCY_PERIOD;
+        std::this_thread::sleep_until(next);
+        input.sampled = Bench::Clock::now();
+        server.HandleInput(0, 0x00BEEF000043ull, input, extension);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    running = false;
+    for (std::thread& receiver : receivers)
+        receiver.join();
+
+    std::vector<double> latency_us;
+    uint64_t bad = 0;
+    for (ClientResult& result : results)
+    {
+        latency_us.insert(latency_us.end(), result.latency_us.begin(), result.latency_us.end());
+        bad += result.bad;
+    }
+    const uint64_t sent = rate_after.packets_sent - rate_before.packets_sent;
+    const uint64_t calls = rate_after.send_calls - rate_before.send_calls;
+    std::printf("  %d clients, %d reports: %llu packets sent in %llu calls, %llu received, %.0f packets/s, %llu bad\n",
+                CLIENTS, RATE_REPORTS, static_cast<unsigned long long>(sent), static_cast<unsigned long long>(calls),
+                static_cast<unsigned long long>(rate_received), rate_received * 1e6 / rate_us,
+                static_cast<unsigned long long>(bad));
+    std::printf("  report every ms: %zu/%d packets, HandleInput to client p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                latency_us.size(), LATENCY_REPORTS * CLIENTS, Bench::Percentile(latency_us, 0.5),
+                Bench::Percentile(latency_us, 0.99), Bench::Percentile(latency_us, 1.0));
+    if (bad != 0)
+        ok = Bench::Fail("a client got a packet with a bad checksum");
+    if (calls != RATE_REPORTS || sent != static_cast<uint64_t>(RATE_REPORTS) * CLIENTS)
+        ok = Bench::Fail("the clients' packets did not go out in one call per report");
+    if (rate_received < sent * 9 / 10 || latency_us.size() < LATENCY_REPORTS * CLIENTS * 9 / 10)
+        ok = Bench::Fail("the clients lost packets");
+
+    // No client repeats its registration; once they lapse the server lets
+    // go of every remote
+    const Bench::Clock::time_point lapse_start = Bench::Clock::now();
+    const bool released = WaitForPads(0, DsuServer::CLIENT_TIMEOUT + std::chrono::seconds(1));
+    std::printf("  registrations lapsed: pads released after %.1f s\n",
+                Bench::Milliseconds(Bench::Clock::now() - lapse_start) / 1000.0);
+    if (!released)
+        ok = Bench::Fail("the server kept its subscriptions after the registrations lapsed");
+
+    server.Stop();
+    return ok;
+}
+
+#endif
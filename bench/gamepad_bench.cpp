@@ -0,0 +1,379 @@
+#include "bench.h"
+#include "simulated_remote.h"
+#include "virtual_gamepad.h"
+#include "input_remapper.h"
+#include "reporting_mode_manager.h"
+#include "wiimote_extension.h"
+#include "wiimote_protocol.h"
+#include <mutex>
+#include <thread>
+
+using namespace WiimoteProtocol;
+
+constexpr int REPORTS = 200000;
+constexpr int THROUGHPUT_REPORTS = 2000000;
+constexpr int STATUS_REQUESTS = 10;
+constexpr auto STATUS_INTERVAL = std::chrono::milliseconds(100);
+constexpr auto DATA_PERIOD = std::chrono::milliseconds(10);
+// A status report to the next data report, when the mode is sent again:
+// the 0x12 crossing the link, a report period and the report crossing back
+constexpr double MAX_RESUME_MS = 50.0;
+
+// Report received to events written, for the built-in profile into the
+// null sink: decode, remap and diff of one 0x31 report per iteration. The
+// A button toggles on every report, so each one writes events.
+BENCH(gamepad_path, "Report-to-events latency of the virtual gamepad path into the null sink")
+{
+    VirtualGamepad gamepad(0);
+    const uint64_t bt_address = 0x00BEEF000044ull;
+    const ExtensionState extension;
+
+    std::vector<double> latencies;
+    latencies.reserve(REPORTS);
+    uint64_t events = 0;
+    for (int i = 0; i < REPORTS; ++i)
+    {
+        const uint16_t buttons = (i & 1) ? BUTTON_A : 0;
+        const uint8_t report[] = { INPUT_CORE_ACCEL, static_cast<uint8_t>(buttons >> 8),
+                                   static_cast<uint8_t>(buttons & 0xFF), 0x80, 0x80, 0x98 };
+
+        WiimoteInputState input;
+        input.received = Bench::Clock::now();
+        DecodeInputReport(report, sizeof(report), input);
+        input.sampled = input.received;
+
+        GamepadState state;
+        InputRemapper::Instance().Remap(0, bt_address, input, extension, state);
+        const int written = gamepad.Emit(state);
+        latencies.push_back(Bench::Microseconds(Bench::Clock::now() - input.received));
+
+        if (written <= 0)
+            return Bench::Fail("a changed report wrote no events");
+        if (((state.buttons & GAMEPAD_BUTTON_A) != 0) != ((buttons & BUTTON_A) != 0))
+            return Bench::Fail("remote.a did not map to the gamepad's A");
+        events += static_cast<uint64_t>(written);
+    }
+
+    std::printf("  %d reports, %.2f events each\n", REPORTS, static_cast<double>(events) / REPORTS);
+    std::printf("  report to events written: mean %.3f us, p50 %.3f us, p99 %.3f us\n",
+                Bench::Mean(latencies), Bench::Percentile(latencies, 0.5), Bench::Percentile(latencies, 0.99));
+    return true;
+}
+
+// The remotes are asked for what the loaded profiles read: the IR camera is
+// only switched on once a profile reads the pointer, the accelerometer once
+// one reads tilt, and continuous reports once one predicts. The gamepads
+// hear of every reload so their subscription can follow.
+BENCH(remap_features, "Remap profiles ask the remotes for IR, motion and continuous reports only when they need them")
+{
+    InputRemapper& remapper = InputRemapper::Instance();
+    int changes = 0;
+    remapper.SetChangedCallback([&changes]() { changes++; });
+
+    std::string error;
+    bool ok = true;
+    const uint32_t builtin = remapper.GetFeatures();
+    if (!remapper.LoadProfilesFromText("profile aim\ndevice 00:BE:EF:00:00:45\n"
+                                       "axis right_x = pointer.x\naxis right_y = pointer.y\n", error))
+        ok = Bench::Fail(error.c_str());
+    const uint32_t pointer = remapper.GetFeatures();
+    if (!remapper.LoadProfilesFromText("profile steer\ndefault\naxis left_x = tilt.roll\n", error))
+        ok = Bench::Fail(error.c_str());
+    const uint32_t tilt = remapper.GetFeatures();
+    if (!remapper.LoadProfilesFromText("profile steer\ndefault\naxis left_x = tilt.roll\npredict 12\n", error))
+        ok = Bench::Fail(error.c_str());
+    const uint32_t predicted = remapper.GetFeatures();
+    remapper.LoadProfilesFromText("", error);
+    const uint32_t unloaded = remapper.GetFeatures();
+    remapper.SetChangedCallback(nullptr);
+
+    std::printf("  built-in 0x%X, with a pointer profile 0x%X, tilt 0x%X, predicted tilt 0x%X, after unloading 0x%X, "
+                "%d reloads seen\n",
+                builtin, pointer, tilt, predicted, unloaded, changes);
+    const uint32_t motion = INPUT_FEATURE_IR | INPUT_FEATURE_ACCEL | INPUT_FEATURE_CONTINUOUS;
+    if (builtin & motion || unloaded & motion)
+        ok = Bench::Fail("motion data was asked for without a profile reading it");
+    if (!(pointer & INPUT_FEATURE_IR))
+        ok = Bench::Fail("a profile reading the pointer did not ask for IR");
+    if (!(tilt & INPUT_FEATURE_ACCEL) || tilt & INPUT_FEATURE_CONTINUOUS)
+        ok = Bench::Fail("a profile reading tilt did not ask for just the accelerometer");
+    if ((predicted & (INPUT_FEATURE_ACCEL | INPUT_FEATURE_CONTINUOUS)) != (INPUT_FEATURE_ACCEL | INPUT_FEATURE_CONTINUOUS))
+        ok = Bench::Fail("a profile predicting tilt did not ask for continuous reports");
+    if (changes != 4)
+        ok = Bench::Fail("a reload was not reported");
+    return ok;
+}
+
+namespace
+{
+    struct ModeCase
+    {
+        uint32_t features;
+        size_t extension_bytes;
+        uint8_t mode;
+        IrMode ir_mode;
+    };
+
+    struct StatusRun
+    {
+        int statuses = 0;
+        // Status reports a data report came after
+        int resumed = 0;
+        double max_resume_ms = 0.0;
+        uint64_t wrong_mode = 0;
+        uint8_t remote_mode = 0;
+    };
+}
+
+// What the consumers of a remote subscribe to and the payload of the
+// extension plugged in, against the data reporting mode picked for them:
+// the smallest report that carries everything, the IR format that fits it,
+// and as much of the extension as fits beside accelerometer and IR when
+// nothing carries all three. The manager only asks for reconfiguration
+// when the selection changes.
+BENCH(reporting_mode_selection, "Reporting mode chosen for each subscription and extension payload")
+{
+    const uint32_t accel = INPUT_FEATURE_ACCEL;
+    const uint32_t ir = INPUT_FEATURE_IR;
+    const uint32_t ext = INPUT_FEATURE_EXTENSION;
+    const size_t nunchuk = GetExtensionDataSize(ExtensionType::Nunchuk);
+    const size_t board = GetExtensionDataSize(ExtensionType::BalanceBoard);
+    const ModeCase cases[] = {
+        { 0, 0, INPUT_CORE, IrMode::Off },
+        { accel, 0, INPUT_CORE_ACCEL, IrMode::Off },
+        { accel, nunchuk, INPUT_CORE_ACCEL, IrMode::Off },
+        { ext, 0, INPUT_CORE, IrMode::Off },
+        { ext, nunchuk, INPUT_CORE_EXT8, IrMode::Off },
+        { ext, board, INPUT_CORE_EXT19, IrMode::Off },
+        { accel | ext, nunchuk, INPUT_CORE_ACCEL_EXT16, IrMode::Off },
+        { accel | ext, board, INPUT_CORE_ACCEL_EXT16, IrMode::Off },
+        { accel | ir, 0, INPUT_CORE_ACCEL_IR12, IrMode::Extended },
+        { ir, 0, INPUT_CORE_ACCEL_IR12, IrMode::Extended },
+        { ir | ext, nunchuk, INPUT_CORE_IR10_EXT9, IrMode::Basic },
+        { accel | ir | ext, nunchuk, INPUT_CORE_ACCEL_IR10_EXT6, IrMode::Basic },
+        { accel | ir | ext, board, INPUT_CORE_ACCEL_IR10_EXT6, IrMode::Basic },
+    };
+
+    bool ok = true;
+    int checked = 0;
+    int wrong = 0;
+    for (const ModeCase& test : cases)
+    {
+        for (uint32_t continuous : { 0u, static_cast<uint32_t>(INPUT_FEATURE_CONTINUOUS) })
+        {
+            const uint32_t features = INPUT_FEATURE_BUTTONS | test.features | continuous;
+            checked++;
+            const ReportingModeManager::Selection selection =
+                ReportingModeManager::Select(features, test.extension_bytes);
+            if (selection.mode == test.mode && selection.ir_mode == test.ir_mode &&
+                selection.continuous == (continuous != 0))
+            {
+                continue;
+            }
+            std::printf("  features 0x%X with %zu extension bytes: 0x%02X, IR mode %d; expected 0x%02X, IR mode %d\n",
+                        features, test.extension_bytes, selection.mode, static_cast<int>(selection.ir_mode),
+                        test.mode, static_cast<int>(test.ir_mode));
+            wrong++;
+        }
+    }
+
+    // Subscriptions and extensions coming and going on one remote
+    ReportingModeManager manager;
+    ReportingModeManager::Selection selection;
+    const bool first = manager.Update(selection);
+    const bool same = manager.Update(selection);
+    manager.SetFeatures(ext);
+    const bool unplugged = manager.Update(selection);
+    manager.SetExtensionBytes(nunchuk);
+    const bool plugged = manager.Update(selection) && selection.mode == INPUT_CORE_EXT8;
+    manager.SetFeatures(accel | ext);
+    const bool subscribed = manager.Update(selection) && selection.mode == INPUT_CORE_ACCEL_EXT16;
+    const bool buttons = (manager.GetFeatures() & INPUT_FEATURE_BUTTONS) != 0;
+
+    std::printf("  %d subscriptions, %d picked the wrong mode\n", checked, wrong);
+    if (wrong != 0)
+        ok = Bench::Fail("a subscription got the wrong reporting mode");
+    if (!first || same || unplugged)
+        ok = Bench::Fail("reconfiguration was asked for without the selection changing");
+    if (!plugged || !subscribed)
+        ok = Bench::Fail("a changed extension or subscription did not change the mode");
+    if (!buttons)
+        ok = Bench::Fail("buttons were dropped from the subscription");
+    return ok;
+}
+
+// Status requests to a simulated remote streaming the selected mode, which
+// stops its data reports after each status report. With `resend` the host
+// sets the mode again on every 0x20, as WiimoteDevice::HandleStatusReport
+// does.
+static StatusRun RunStatusRequests(bool resend)
+{
+    ReportingModeManager manager;
+    manager.SetFeatures(INPUT_FEATURE_ACCEL | INPUT_FEATURE_EXTENSION);
+    manager.SetExtensionBytes(GetExtensionDataSize(ExtensionType::Nunchuk));
+    ReportingModeManager::Selection selection;
+    manager.Update(selection);
+
+    SimulatedRemote* remote_pointer = nullptr;
+    const auto send_mode = [&remote_pointer, &manager]() {
+        const ReportingModeManager::Selection current = manager.GetSelection();
+        const uint8_t report[] = { OUTPUT_REPORT_MODE,
+                                   static_cast<uint8_t>(current.continuous ? REPORT_MODE_CONTINUOUS : 0),
+                                   current.mode };
+        remote_pointer->Send(report, sizeof(report));
+    };
+
+    std::mutex mutex;
+    StatusRun run;
+    Bench::Clock::time_point status_time;
+    bool waiting = false;
+    SimulatedRemote remote(SimulatedRemote::Link(), [&](const uint8_t* report, size_t) {
+        const Bench::Clock::time_point now = Bench::Clock::now();
+        if (report[0] == INPUT_STATUS)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                run.statuses++;
+                status_time = now;
+                waiting = true;
+            }
+            if (resend)
+                send_mode();
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (report[0] != selection.mode)
+            run.wrong_mode++;
+        if (waiting)
+        {
+            waiting = false;
+            run.resumed++;
+            run.max_resume_ms = std::max(run.max_resume_ms, Bench::Milliseconds(now - status_time));
+        }
+    });
+    remote_pointer = &remote;
+
+    send_mode();
+    std::this_thread::sleep_for(DATA_PERIOD * 2);
+    remote.SetDataReports(DATA_PERIOD, [&remote](Bench::Clock::time_point, std::vector<uint8_t>& report) {
+        const uint8_t mode = remote.GetReportMode();
+        report.assign(GetInputReportSize(mode), 0);
+        report[0] = mode;
+    });
+    for (int request = 0; request < STATUS_REQUESTS; ++request)
+    {
+        const uint8_t status_request[] = { OUTPUT_STATUS_REQUEST, 0x00 };
+        remote.Send(status_request, sizeof(status_request));
+        std::this_thread::sleep_for(STATUS_INTERVAL);
+    }
+    remote.SetDataReports(std::chrono::microseconds::zero(), nullptr);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    run.remote_mode = remote.GetReportMode();
+    return run;
+}
+
+// A remote stops its data reports after every 0x20 status report until the
+// host sets the reporting mode again. Each status report has to be followed
+// by data reports in the mode the manager selected within a report period
+// and a round trip of the link. Without the mode sent again the simulated
+// remote has to fall silent, or the check would prove nothing.
+BENCH(reporting_mode_status, "Reporting mode sent again after every status report")
+{
+    const StatusRun resent = RunStatusRequests(true);
+    const StatusRun silent = RunStatusRequests(false);
+    std::printf("  mode sent again: %d of %d status reports followed by data, at most %.1f ms later, "
+                "%llu reports in another mode\n",
+                resent.resumed, resent.statuses, resent.max_resume_ms,
+                static_cast<unsigned long long>(resent.wrong_mode));
+    std::printf("  mode not sent again: %d of %d status reports followed by data\n", silent.resumed,
+                silent.statuses);
+
+    bool ok = true;
+    if (resent.statuses != STATUS_REQUESTS || silent.statuses == 0)
+        ok = Bench::Fail("a status request was not answered");
+    if (resent.resumed != resent.statuses)
+        ok = Bench::Fail("data reports did not resume after a status report");
+    if (resent.max_resume_ms > MAX_RESUME_MS)
+        ok = Bench::Fail("data reports resumed more than 50 ms after a status report");
+    if (resent.wrong_mode != 0 || resent.remote_mode != INPUT_CORE_ACCEL_EXT16)
+        ok = Bench::Fail("the remote reported in another mode than the one selected");
+    if (silent.resumed != 0)
+        ok = Bench::Fail("the simulated remote kept reporting after a status report");
+    return ok;
+}
+
+namespace
+{
+    struct ThroughputCase
+    {
+        const char* name;
+        const char* profile;   // none for the built-in one
+        ExtensionType extension;
+    };
+}
+
+// Reports per second through InputRemapper::Remap, the slot's cached
+// profile included, for the built-in profile with a Classic Controller, a
+// combo profile and a tilt-to-stick profile with deadzone and curve. Buttons,
+// sticks and tilt change on every report.
+BENCH(remap_throughput, "Remap throughput of built-in, combo and tilt profiles")
+{
+    const ThroughputCase cases[] = {
+        { "built-in, Classic Controller", nullptr, ExtensionType::ClassicController },
+        { "combos", "profile combos\ndefault\ncombo nunchuk.c + nunchuk.z -> guide\n"
+                    "combo remote.a + remote.b -> start\ncombo remote.1 + remote.2 -> back\n"
+                    "button remote.a -> a\nbutton remote.b -> b\n", ExtensionType::Nunchuk },
+        { "tilt to stick, deadzone and curve", "profile tilt\ndefault\n"
+                    "axis left_x = tilt.roll deadzone 0.1 curve 1.5\naxis left_y = tilt.pitch * 2 deadzone 0.1 curve 1.5\n"
+                    "button tilt.roll > 0.5 -> right\nbutton remote.a -> a\n", ExtensionType::None },
+    };
+
+    InputRemapper& remapper = InputRemapper::Instance();
+    const uint64_t bt_address = 0x00BEEF000045ull;
+    bool ok = true;
+    uint32_t checksum = 0;
+    for (const ThroughputCase& test : cases)
+    {
+        std::string error;
+        if (!remapper.LoadProfilesFromText(test.profile ? test.profile : "", error))
+        {
+            ok = Bench::Fail(error.c_str());
+            continue;
+        }
+
+        WiimoteInputState input;
+        input.accel_calibrated = true;
+        ExtensionState extension;
+        extension.type = test.extension;
+        GamepadState state;
+        const Bench::Clock::time_point start = Bench::Clock::now();
+        for (int i = 0; i < THROUGHPUT_REPORTS; ++i)
+        {
+            const float phase = static_cast<float>(i & 0xFF) / 128.0f - 1.0f;
+            input.buttons = static_cast<uint16_t>(i * 0x9E37);
+            input.accel_g[0] = phase;
+            input.accel_g[1] = -phase * 0.5f;
+            input.accel_g[2] = 0.8f;
+            extension.classic.buttons = static_cast<uint16_t>(i * 0x79B9);
+            extension.classic.left_x = static_cast<uint8_t>(i & 0x3F);
+            extension.classic.right_trigger = static_cast<uint8_t>(i & 0x1F);
+            extension.nunchuk.button_c = (i & 1) != 0;
+            extension.nunchuk.button_z = (i & 2) != 0;
+            extension.nunchuk.stick_x = static_cast<uint8_t>(i);
+            remapper.Remap(0, bt_address, input, extension, state);
+            checksum += state.buttons + static_cast<uint32_t>(state.axes[GAMEPAD_AXIS_LEFT_X] * 100.0f);
+        }
+        const double elapsed_us = Bench::Microseconds(Bench::Clock::now() - start);
+        std::printf("  %-34s %.1f M reports/s, %.1f ns each\n", test.name, THROUGHPUT_REPORTS / elapsed_us,
+                    elapsed_us * 1000.0 / THROUGHPUT_REPORTS);
+        // A report every 5 ms from 16 remotes is 3200 a second
+        if (THROUGHPUT_REPORTS / elapsed_us < 0.1)
+            ok = Bench::Fail("remapping took more than 10 us a report");
+    }
+    std::string error;
+    remapper.LoadProfilesFromText("", error);
+    std::printf("  (checksum %u)\n", checksum);
+    return ok;
+}
@@ -0,0 +1,354 @@
+#include "bench.h"
+#include "gesture_engine.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+constexpr float PI = 3.14159265f;
+constexpr auto SAMPLE_PERIOD = std::chrono::milliseconds(10);
+constexpr int TRACE_SLOTS = 4;
+// Replays per template count, the fastest taken
+constexpr int REPLAYS = 5;
+// Moving cost with every template loaded may be this many times the cost
+// with the built-in three when the added templates are of moves the trace
+// never comes near, each asleep at a few operations a report
+constexpr double MAX_COST_GROWTH = 2.0;
+// and this many times when some are set off by the trace's own gestures,
+// whose columns run while the motion is near them
+constexpr double MAX_MIXED_COST_GROWTH = 4.0;
+
+namespace
+{
+    enum class Kind
+    {
+        Swing,
+        Shake,
+        Twist
+    };
+
+    // A gesture performed in a recorded trace, samples [first, last)
+    struct Performed
+    {
+        Kind kind;
+        size_t first;
+        size_t last;
+    };
+
+    struct Trace
+    {
+        std::vector<std::array<float, 3>> accel;   // g
+        std::vector<Performed> gestures;
+    };
+
+    struct Detected
+    {
+        std::string name;
+        float confidence;
+        size_t first;
+        size_t last;
+    };
+
+    struct RunResult
+    {
+        double moving_us = 0.0;     // mean per moving sample
+        double moving_p99_us = 0.0;
+        double rest_us = 0.0;
+        double cells = 0.0;         // per moving sample
+        size_t hits = 0;
+        size_t false_positives = 0;
+        size_t other_events = 0;    // of the templates beyond the built-in three
+    };
+}
+
+static const char* KindName(Kind kind)
+{
+    return kind == Kind::Swing ? "swing" : kind == Kind::Shake ? "shake" : "twist";
+}
+
+// A session with a remote as it was recorded, 100 reports a second: held
+// still, then moved about slowly for half a second before each gesture, and
+// 10 swings of 2.0 - 3.8 g along the pointing axis, 5 shakes of 2 g at 3.8 -
+// 4.2 Hz and 10 quarter twists about the pointing axis, out and back. The
+// accelerometer has 0.04 g of noise on each axis.
+static Trace RecordTrace(int seed)
+{
+    std::mt19937 random(seed);
+    std::normal_distribution<float> noise(0.0f, 0.04f);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    Trace trace;
+    float roll = 0.0f;   // about the pointing axis
+    const auto hold = [&](int samples, float push_x, float push_y, float push_z) {
+        trace.accel.push_back({ std::sin(roll) + push_x + noise(random), push_y + noise(random),
+                                std::cos(roll) + push_z + noise(random) });
+        (void)samples;
+    };
+    const auto rest = [&](int samples) {
+        for (int i = 0; i < samples; ++i)
+            hold(1, 0.0f, 0.0f, 0.0f);
+    };
+    const auto wander = [&](int samples) {
+        const float phase = unit(random) * 2.0f * PI;
+        for (int i = 0; i < samples; ++i)
+        {
+            const float t = static_cast<float>(i) / samples;
+            // Up and down, along gravity whichever way the remote is rolled
+            const float lift = 0.4f * std::sin(4.0f * PI * t + phase);
+            hold(1, lift * std::sin(roll), 0.05f * std::sin(2.0f * PI * t), lift * std::cos(roll));
+        }
+    };
+
+    rest(100);
+    const Kind order[] = { Kind::Swing, Kind::Twist, Kind::Swing, Kind::Shake, Kind::Twist };
+    for (int round = 0; round < 5; ++round)
+    {
+        for (Kind kind : order)
+        {
+            wander(50);
+            rest(20);
+            Performed performed = { kind, trace.accel.size(), 0 };
+            if (kind == Kind::Swing)
+            {
+                const float peak = 2.0f + 1.8f * unit(random);
+                for (int i = 0; i < 20; ++i)
+                    hold(1, 0.0f, peak * std::sin(PI * (i + 0.5f) / 20.0f), 0.0f);
+            }
+            else if (kind == Kind::Shake)
+            {
+                const float frequency = 3.8f + 0.4f * unit(random);
+                const int samples = static_cast<int>(200.0f / frequency);
+                for (int i = 0; i < samples; ++i)
+                    hold(1, 0.0f, 2.0f * std::sin(2.0f * PI * frequency * i / 100.0f), 0.0f);
+            }
+            else
+            {
+                // Out to a quarter turn or back to level
+                const float from = roll;
+                const float to = roll == 0.0f ? (round % 2 ? -PI / 2.0f : PI / 2.0f) : 0.0f;
+                for (int i = 0; i < 30; ++i)
+                {
+                    roll = from + (to - from) * (1.0f - std::cos(PI * (i + 1) / 30.0f)) / 2.0f;
+                    hold(1, 0.0f, 0.0f, 0.0f);
+                }
+                roll = to;
+            }
+            performed.last = trace.accel.size();
+            trace.gestures.push_back(performed);
+            rest(100);
+        }
+    }
+    return trace;
+}
+
+// Templates on top of the built-in three, up to MAX_TEMPLATES: pushes along
+// one axis, MotionPlus turns, double swings and slow rolls, as programs
+// load them for their own moves. The `distant` ones leave out the pushes
+// along Y, which swings set off, and the double swings and slow rolls,
+// which shakes, swings and twists come near; the trace never comes near
+// pushes along X and Z, and without a MotionPlus it reads as not turning.
+static std::vector<GestureTemplate> CreateExtraTemplates(size_t count, bool distant)
+{
+    std::vector<GestureTemplate> templates;
+    for (size_t n = 0; templates.size() < count; ++n)
+    {
+        if (distant && !(n % 4 == 1 || (n % 4 == 0 && GESTURE_ACCEL_X + (n / 4) % 3 != GESTURE_ACCEL_Y)))
+            continue;
+        GestureTemplate gesture;
+        gesture.name = "extra" + std::to_string(n);
+        std::fill(std::begin(gesture.weights), std::end(gesture.weights), 0.0f);
+        const size_t length = 20 + (n * 7) % 45;
+        const float scale = 1.0f + 0.15f * static_cast<float>(n % 5);
+        for (size_t i = 0; i < length; ++i)
+        {
+            const float t = static_cast<float>(i) / static_cast<float>(length);
+            GestureSample sample = {};
+            switch (n % 4)
+            {
+            case 0:
+                // A push along X, Y or Z, gravity on Z
+                gesture.threshold = 0.3f;
+                gesture.weights[GESTURE_ACCEL_X] = gesture.weights[GESTURE_ACCEL_Y] = 1.0f;
+                gesture.weights[GESTURE_ACCEL_Z] = 1.0f;
+                sample[GESTURE_ACCEL_Z] = 1.0f;
+                sample[GESTURE_ACCEL_X + (n / 4) % 3] += 1.5f * scale * std::sin(PI * t);
+                break;
+            case 1:
+                // A turn about one MotionPlus axis
+                gesture.threshold = 0.2f;
+                gesture.weights[GESTURE_RATE_PITCH + (n / 4) % 3] = 1.0f;
+                sample[GESTURE_RATE_PITCH + (n / 4) % 3] = scale * std::sin(PI * t);
+                break;
+            case 2:
+                // Two pushes in a row
+                gesture.threshold = 0.5f;
+                gesture.weights[GESTURE_ACCEL_DYNAMIC] = 1.0f;
+                sample[GESTURE_ACCEL_DYNAMIC] = 2.0f * scale * std::fabs(std::sin(2.0f * PI * t));
+                break;
+            default:
+                // A slow roll with a push at its end
+                gesture.threshold = 0.15f;
+                gesture.weights[GESTURE_ROTATION] = gesture.weights[GESTURE_ACCEL_DYNAMIC] = 1.0f;
+                sample[GESTURE_ROTATION] = 0.6f * scale;
+                sample[GESTURE_ACCEL_DYNAMIC] = t > 0.7f ? 1.5f * scale : 0.0f;
+                break;
+            }
+            gesture.samples.push_back(sample);
+        }
+        templates.push_back(gesture);
+    }
+    return templates;
+}
+
+// Feed the trace to every bench slot, timing each report
+static RunResult Replay(const Trace& trace)
+{
+    GestureEngine& engine = GestureEngine::Instance();
+    std::vector<Detected> detected;
+    const Bench::Clock::time_point base = Bench::Clock::now();
+    const int subscription = engine.Subscribe([&](const GestureEvent& event) {
+        if (event.slot != 0)
+            return;
+        const auto index = [&](GestureEngine::Clock::time_point time) {
+            return static_cast<size_t>((time - base) / SAMPLE_PERIOD);
+        };
+        detected.push_back({ event.name, event.confidence, index(event.start), index(event.end) + 1 });
+    });
+
+    std::vector<double> moving_us;
+    std::vector<double> rest_us;
+    const ExtensionState extension;
+    WiimoteInputState input;
+    input.accel_calibrated = true;
+    const GestureEngine::Stats before = engine.GetStats();
+    for (size_t i = 0; i < trace.accel.size(); ++i)
+    {
+        input.sampled = base + i * SAMPLE_PERIOD;
+        std::copy(trace.accel[i].begin(), trace.accel[i].end(), input.accel_g);
+        for (int slot = 0; slot < TRACE_SLOTS; ++slot)
+        {
+            const uint64_t idle_before = engine.GetStats().idle_samples;
+            const Bench::Clock::time_point start = Bench::Clock::now();
+            engine.HandleInput(slot, input, extension);
+            const double us = Bench::Microseconds(Bench::Clock::now() - start);
+            (engine.GetStats().idle_samples != idle_before ? rest_us : moving_us).push_back(us);
+        }
+    }
+    const GestureEngine::Stats after = engine.GetStats();
+    engine.Unsubscribe(subscription);
+
+    RunResult result;
+    result.moving_us = Bench::Mean(moving_us);
+    result.rest_us = Bench::Mean(rest_us);
+    result.cells = static_cast<double>(after.cells - before.cells) / std::max<size_t>(moving_us.size(), 1);
+    result.moving_p99_us = Bench::Percentile(moving_us, 0.99);
+
+    std::vector<bool> found(trace.gestures.size(), false);
+    for (const Detected& event : detected)
+    {
+        if (event.name.compare(0, 5, "extra") == 0)
+        {
+            result.other_events++;
+            continue;
+        }
+        bool hit = false;
+        for (size_t g = 0; g < trace.gestures.size(); ++g)
+        {
+            const Performed& performed = trace.gestures[g];
+            if (event.name == KindName(performed.kind) && event.first < performed.last && event.last > performed.first)
+            {
+                hit = true;
+                if (!found[g])
+                {
+                    found[g] = true;
+                    result.hits++;
+                }
+            }
+        }
+        if (!hit)
+            result.false_positives++;
+    }
+    return result;
+}
+
+// The recorded session replayed on four remotes with the built-in three
+// templates and with more loaded, up to the most the engine takes: first
+// templates of moves the trace never comes near, then a mix some of which
+// its gestures set off. A moving remote's cost per report has to grow far
+// slower than the templates do: a template away from the motion may cost
+// next to nothing, and each added template may only keep as many cells of
+// its column under the threshold as the built-in ones do on average.
+// Detection of the built-in gestures must not change, and a remote at rest
+// costs the same throughout.
+BENCH(gesture_templates, "Gesture matching cost per report as templates grow, against a recorded trace")
+{
+    GestureEngine& engine = GestureEngine::Instance();
+    const Trace trace = RecordTrace(46);
+    const size_t builtin = engine.GetTemplateNames().size();
+
+    // The fastest of the replays, which the machine's noise slows least
+    const auto replay = [&trace]() {
+        RunResult result = Replay(trace);
+        for (int replay = 1; replay < REPLAYS; ++replay)
+        {
+            const RunResult again = Replay(trace);
+            if (again.moving_us < result.moving_us)
+                result = again;
+        }
+        return result;
+    };
+    const auto print = [&trace](const char* set, size_t total, const RunResult& result) {
+        std::printf("  %-8s %2zu templates: moving %.2f us (p99 %.2f us, %.0f cells), at rest %.2f us; "
+                    "%zu/%zu gestures, %zu false, %zu events of the added templates\n",
+                    set, total, result.moving_us, result.moving_p99_us, result.cells, result.rest_us, result.hits,
+                    trace.gestures.size(), result.false_positives, result.other_events);
+    };
+
+    bool ok = true;
+    const RunResult first = replay();
+    print("built-in", builtin, first);
+    if (first.hits != trace.gestures.size())
+        ok = Bench::Fail("a performed gesture was not detected");
+
+    for (bool distant : { true, false })
+    {
+        const std::vector<GestureTemplate> extras =
+            CreateExtraTemplates(GestureEngine::MAX_TEMPLATES - builtin, distant);
+        size_t loaded = 0;
+        for (size_t total : { size_t(8), size_t(16), GestureEngine::MAX_TEMPLATES })
+        {
+            for (; builtin + loaded < total; ++loaded)
+                engine.AddTemplate(extras[loaded]);
+            const RunResult result = replay();
+            print(distant ? "distant" : "mixed", total, result);
+            if (result.hits != first.hits || result.false_positives != first.false_positives)
+                ok = Bench::Fail("adding templates changed what the built-in ones detect");
+            if (result.cells / total > first.cells / builtin)
+                ok = Bench::Fail("an added template kept more cells under its threshold than the built-in ones");
+        }
+
+        // The built-in three and all templates timed in turn, so that a slow
+        // spell of the machine falls on both
+        double alone_us = 0.0;
+        double all_us = 0.0;
+        for (int round = 0; round < REPLAYS; ++round)
+        {
+            for (const GestureTemplate& gesture : extras)
+                engine.RemoveTemplate(gesture.name);
+            const double alone = Replay(trace).moving_us;
+            for (const GestureTemplate& gesture : extras)
+                engine.AddTemplate(gesture);
+            const double all = Replay(trace).moving_us;
+            alone_us = round == 0 ? alone : std::min(alone_us, alone);
+            all_us = round == 0 ? all : std::min(all_us, all);
+        }
+        const double growth = all_us / alone_us;
+        std::printf("  %-8s cost with %zu templates %.2f times that with the built-in three\n",
+                    distant ? "distant" : "mixed", GestureEngine::MAX_TEMPLATES, growth);
+        if (growth > (distant ? MAX_COST_GROWTH : MAX_MIXED_COST_GROWTH))
+            ok = Bench::Fail("a moving remote's cost grew with the templates");
+        for (const GestureTemplate& gesture : extras)
+            engine.RemoveTemplate(gesture.name);
+    }
+    return ok;
+}
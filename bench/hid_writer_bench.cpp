@@ -0,0 +1,91 @@
+#include "bench.h"
+#include "hid_writer.h"
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+constexpr int WRITES = 10;
+// How long the fake device holds each write before it fails
+constexpr auto STALL = std::chrono::milliseconds(20);
+
+// A device whose writes stall: one end of a socket pair with a full send
+// buffer and a send timeout, so write() waits STALL and fails, and the
+// control ioctl fails at once. Interrupt writes through the reactor are
+// failed by the completion, on the calling thread, as a reactor thread
+// would. Neither the caller of Write nor the completion may wait for the
+// device; the writer thread does.
+BENCH(hid_write_stall, "A stalled HID write blocks the writer thread, not the caller or the reactor")
+{
+#ifdef _WIN32
+    std::printf("  needs a socket pair as the device, skipped on Windows\n");
+    return true;
+#else
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) != 0)
+        return Bench::Fail("socketpair");
+    const timeval timeout = { 0, static_cast<suseconds_t>(std::chrono::microseconds(STALL).count()) };
+    setsockopt(sockets[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    const int buffer_size = 4096;
+    setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    const uint8_t fill[22] = { 0x11 };
+    while (send(sockets[0], fill, sizeof(fill), MSG_DONTWAIT) > 0)
+    {
+    }
+
+    HidWriter writer;
+    writer.Attach(sockets[0], sizeof(fill));
+    const uint8_t report[] = { 0x11, 0x10 };
+
+    // Before the reactor takes over, every write goes to the writer thread
+    std::vector<double> write_us;
+    const Bench::Clock::time_point start = Bench::Clock::now();
+    for (int i = 0; i < WRITES; ++i)
+    {
+        const Bench::Clock::time_point before = Bench::Clock::now();
+        writer.Write(report, sizeof(report));
+        write_us.push_back(Bench::Microseconds(Bench::Clock::now() - before));
+    }
+    while (writer.GetStats().methods[1].attempts < WRITES &&
+           Bench::Clock::now() - start < std::chrono::seconds(5))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    const double drained_ms = Bench::Milliseconds(Bench::Clock::now() - start);
+
+    // Through the reactor, a failed interrupt write is retried with the other
+    // method; the completion hands that to the writer thread
+    std::vector<double> completion_us;
+    writer.SetAsyncWrite([&](const uint8_t*, size_t, HidWriter::WriteCompletion completion) {
+        const Bench::Clock::time_point before = Bench::Clock::now();
+        completion(false, 0.0);
+        completion_us.push_back(Bench::Microseconds(Bench::Clock::now() - before));
+        return true;
+    });
+    for (int i = 0; i < WRITES; ++i)
+        writer.Write(report, sizeof(report));
+
+    const HidWriter::Stats stats = writer.GetStats();
+    writer.Detach();
+    close(sockets[0]);
+    close(sockets[1]);
+
+    const double write_p99 = Bench::Percentile(write_us, 0.99);
+    const double completion_p99 = Bench::Percentile(completion_us, 0.99);
+    std::printf("  Write: %.1f us p99; writer thread took %.1f ms for %d stalled writes\n",
+                write_p99, drained_ms, WRITES);
+    std::printf("  failed completion: %.1f us p99; %llu writes queued, %llu refused\n", completion_p99,
+                static_cast<unsigned long long>(stats.queued), static_cast<unsigned long long>(stats.queue_full));
+
+    // Each stalled write costs STALL on the writer thread; the callers must
+    // stay several times below one of them
+    if (drained_ms < WRITES * Bench::Milliseconds(STALL) * 0.8)
+        return Bench::Fail("the device did not stall the writer thread");
+    if (write_p99 > Bench::Microseconds(STALL) / 4.0)
+        return Bench::Fail("Write waited for the device");
+    if (completion_p99 > Bench::Microseconds(STALL) / 4.0)
+        return Bench::Fail("a completion waited for the device");
+    return true;
+#endif
+}
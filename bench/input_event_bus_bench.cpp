@@ -0,0 +1,211 @@
+#include "bench.h"
+#include "input_event_bus.h"
+#include <atomic>
+#include <thread>
+
+constexpr int FANOUT_REMOTES = 8;
+constexpr int FANOUT_SUBSCRIBERS = 8;
+// Every remote at the fastest rate it reports at
+constexpr auto REPORT_PERIOD = std::chrono::milliseconds(5);
+constexpr auto RUN_TIME = std::chrono::milliseconds(1000);
+constexpr int PUBLISH_ROUNDS = 100000;
+// Share of one core the fan-out may take
+constexpr double MAX_CPU_SHARE = 0.05;
+
+// Report `n` of a remote: accelerometer data every time, a button pressed
+// or released every 20th report
+static void MakeInput(uint32_t n, WiimoteInputState& input)
+{
+    input.sampled = Bench::Clock::now();
+    input.received = input.sampled;
+    input.buttons = static_cast<uint16_t>((n / 20) & 1 ? 0x0008 : 0);
+    input.has_accel = true;
+    for (int axis = 0; axis < 3; ++axis)
+        input.accel[axis] = static_cast<uint16_t>(512 + (n & 0x3F));
+}
+
+// Time `PUBLISH_ROUNDS` publishes of one remote's reports, in ns each
+static double TimePublish(InputEventBus& bus)
+{
+    WiimoteInputState input;
+    const ExtensionState extension;
+    const Bench::Clock::time_point start = Bench::Clock::now();
+    for (int i = 0; i < PUBLISH_ROUNDS; ++i)
+    {
+        MakeInput(static_cast<uint32_t>(i), input);
+        bus.Publish(0, input, extension);
+    }
+    return std::chrono::duration<double, std::nano>(Bench::Clock::now() - start).count() / PUBLISH_ROUNDS;
+}
+
+// One subscriber takes everything, one only button changes, the rest one
+// remote's motion each
+static std::vector<int> SubscribeConsumers(InputEventBus& bus)
+{
+    std::vector<int> subscriptions;
+    for (int i = 0; i < FANOUT_SUBSCRIBERS; ++i)
+    {
+        InputEventBus::Filter filter;
+        if (i == 1)
+            filter.kinds = INPUT_EVENT_BUTTONS;
+        else if (i > 1)
+        {
+            filter.slot = i % FANOUT_REMOTES;
+            filter.kinds = INPUT_EVENT_MOTION;
+        }
+        subscriptions.push_back(bus.Subscribe(filter));
+    }
+    return subscriptions;
+}
+
+// Publish from one thread per remote every 5 ms for `RUN_TIME`, as the
+// reactor delivers reports; returns the process's CPU time over the run as
+// a share of one core
+static double RunRemotes(InputEventBus& bus)
+{
+    const double cpu_start = Bench::ProcessCpuMicroseconds();
+    const Bench::Clock::time_point start = Bench::Clock::now();
+    std::vector<std::thread> producers;
+    for (int slot = 0; slot < FANOUT_REMOTES; ++slot)
+    {
+        producers.emplace_back([&bus, slot, start]() {
+            WiimoteInputState input;
+            const ExtensionState extension;
+            uint32_t n = 0;
+            for (Bench::Clock::time_point next = start; next - start < RUN_TIME; next += REPORT_PERIOD)
+            {
+                std::this_thread::sleep_until(next);
+                MakeInput(n++, input);
+                bus.Publish(slot, input, extension);
+            }
+        });
+    }
+    for (std::thread& producer : producers)
+        producer.join();
+    // Let the consumers catch up with the last reports
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const double wall_us = Bench::Microseconds(Bench::Clock::now() - start);
+    return (Bench::ProcessCpuMicroseconds() - cpu_start) / wall_us;
+}
+
+// Eight remotes reporting every 5 ms, fanned out to eight subscribers that
+// wait and poll as a consumer would. The whole process's CPU time over the
+// run has to stay within a few percent of one core, without a subscriber
+// losing an event; the remotes' threads alone, publishing to nobody, are
+// printed for comparison. Publishing with nobody subscribed has to cost next
+// to nothing.
+BENCH(input_event_fanout, "Input event fan-out of 8 remotes to 8 subscribers: CPU share and publish cost")
+{
+    InputEventBus& bus = InputEventBus::Instance();
+    if (bus.GetStats().subscribers != 0)
+        return Bench::Fail("the bus already has subscribers");
+    const double idle_ns = TimePublish(bus);
+
+    std::vector<int> subscriptions = SubscribeConsumers(bus);
+    const double fanout_ns = TimePublish(bus);
+    for (int id : subscriptions)
+        bus.Unsubscribe(id);
+    const double remotes_share = RunRemotes(bus);
+    subscriptions = SubscribeConsumers(bus);
+
+    std::atomic<bool> running(true);
+    std::vector<std::thread> consumers;
+    for (int id : subscriptions)
+    {
+        consumers.emplace_back([&bus, &running, id]() {
+            InputEvent events[32];
+            while (running)
+            {
+                if (bus.Wait(id, std::chrono::milliseconds(50)))
+                {
+                    while (bus.Poll(id, events, 32) > 0)
+                    {
+                    }
+                }
+            }
+        });
+    }
+
+    const uint64_t published_before = bus.GetStats().published;
+    const double cpu_share = RunRemotes(bus);
+    running = false;
+    for (std::thread& consumer : consumers)
+        consumer.join();
+
+    const uint64_t published = bus.GetStats().published - published_before;
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    uint64_t everything = 0;
+    for (size_t i = 0; i < subscriptions.size(); ++i)
+    {
+        const InputEventBus::SubscriberStats stats = bus.GetSubscriberStats(subscriptions[i]);
+        delivered += stats.delivered;
+        dropped += stats.dropped;
+        if (i == 0)
+            everything = stats.delivered;
+        bus.Unsubscribe(subscriptions[i]);
+    }
+
+    std::printf("  publish with no subscribers %.1f ns, with %d subscribers %.1f ns\n", idle_ns, FANOUT_SUBSCRIBERS,
+                fanout_ns);
+    std::printf("  %d remotes every %lld ms to %d subscribers: %llu published, %llu delivered, %llu dropped, "
+                "%.2f%% of a core, %.2f%% with nobody subscribed (%u cores)\n",
+                FANOUT_REMOTES, static_cast<long long>(REPORT_PERIOD.count()), FANOUT_SUBSCRIBERS,
+                static_cast<unsigned long long>(published), static_cast<unsigned long long>(delivered),
+                static_cast<unsigned long long>(dropped), 100.0 * cpu_share, 100.0 * remotes_share,
+                std::thread::hardware_concurrency());
+
+    bool ok = true;
+    if (everything != published || dropped != 0)
+        ok = Bench::Fail("a subscriber lost events");
+    if (cpu_share > MAX_CPU_SHARE)
+        ok = Bench::Fail("the fan-out took more than a few percent of a core");
+    if (idle_ns * 2.0 > fanout_ns)
+        ok = Bench::Fail("publishing without subscribers cost as much as with them");
+    return ok;
+}
+
+// A Block subscriber that never reads: the producer waits for it once, when
+// the ring first fills, and after that the subscriber is demoted and the
+// producer goes on at full speed. Publishes that took most of the timeout
+// are printed; on a busy machine scheduling can add one.
+BENCH(input_event_block_demotion, "A stalled Block subscriber holds up the input event producer only once")
+{
+    InputEventBus& bus = InputEventBus::Instance();
+    InputEventBus::Filter filter;
+    const int stalled = bus.Subscribe(filter, InputEventBus::OverflowPolicy::Block);
+    const InputEventBus::Stats before = bus.GetStats();
+
+    WiimoteInputState input;
+    const ExtensionState extension;
+    std::vector<double> publish_us;
+    for (size_t i = 0; i < InputEventBus::CAPACITY * 4; ++i)
+    {
+        MakeInput(static_cast<uint32_t>(i), input);
+        const Bench::Clock::time_point start = Bench::Clock::now();
+        bus.Publish(0, input, extension);
+        publish_us.push_back(Bench::Microseconds(Bench::Clock::now() - start));
+    }
+    const InputEventBus::Stats after = bus.GetStats();
+    const InputEventBus::SubscriberStats stats = bus.GetSubscriberStats(stalled);
+    bus.Unsubscribe(stalled);
+
+    const uint64_t timeouts = after.producer_timeouts - before.producer_timeouts;
+    // Publishes that waited out most of the timeout
+    const double block_us = Bench::Microseconds(InputEventBus::BLOCK_TIMEOUT);
+    size_t stalls = 0;
+    for (double us : publish_us)
+    {
+        if (us > block_us / 2.0)
+            stalls++;
+    }
+    std::printf("  %zu publishes: %llu producer waits, %llu timed out, %zu stalled, subscriber %s; "
+                "publish p50 %.2f us, max %.0f us\n",
+                publish_us.size(), static_cast<unsigned long long>(after.producer_waits - before.producer_waits),
+                static_cast<unsigned long long>(timeouts), stalls, stats.demoted ? "demoted" : "still blocking",
+                Bench::Percentile(publish_us, 0.5), Bench::Percentile(publish_us, 1.0));
+
+    if (timeouts != 1 || !stats.demoted)
+        return Bench::Fail("the stalled subscriber was not demoted after one timeout");
+    return true;
+}
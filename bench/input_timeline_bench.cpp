@@ -0,0 +1,237 @@
+#include "bench.h"
+#include "input_timeline.h"
+#include "report_clock.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <random>
+#include <thread>
+
+constexpr int TIMELINE_REMOTES = InputTimeline::MAX_SLOTS;
+constexpr double RUN_S = 4.0;
+constexpr double REPORT_PERIOD_S = 0.01;
+// Every remote presses once per round, paired with another remote that
+// presses up to 20 ms before or after it, and holds the button this long
+constexpr double ROUND_S = 0.08;
+constexpr double MAX_PAIR_GAP_S = 0.02;
+constexpr double HOLD_S = 0.025;
+// The stack hands a remote's reports over in batches, 7.5 - 22.5 ms apart
+constexpr double MIN_BATCH_S = 0.0075;
+constexpr double MAX_BATCH_S = 0.0225;
+constexpr uint16_t BUTTON = 0x0008;
+// Share of the events that may be late, as the scheduler on a busy machine
+// can hold up a batch
+constexpr double MAX_LATE = 0.01;
+
+namespace
+{
+    struct Report
+    {
+        int remote;
+        double sampled;   // by the remote's own clock, in host seconds
+        double arrived;
+        uint16_t buttons;
+    };
+
+    // Presses of remotes `a` and `b` at true times `time_a` and `time_b`
+    struct Pair
+    {
+        int a;
+        int b;
+        double time_a;
+        double time_b;
+    };
+
+    // Pairs in one band of how far apart the presses were, and how many of
+    // them each way of ordering got right
+    struct Band
+    {
+        const char* name;
+        int pairs = 0;
+        int by_arrival = 0;
+        int by_timeline = 0;
+        int by_sample = 0;
+    };
+}
+
+// Rounds of presses: each round pairs the remotes at random, one press of
+// the pair at a random time in the round and the other up to 20 ms from it
+static std::vector<Pair> PlanPresses(std::mt19937& random)
+{
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<Pair> pairs;
+    int remotes[TIMELINE_REMOTES];
+    for (int i = 0; i < TIMELINE_REMOTES; ++i)
+        remotes[i] = i;
+    for (double round = 0.1; round + ROUND_S < RUN_S - 0.1; round += ROUND_S)
+    {
+        std::shuffle(remotes, remotes + TIMELINE_REMOTES, random);
+        for (int i = 0; i < TIMELINE_REMOTES; i += 2)
+        {
+            const double first = round + MAX_PAIR_GAP_S + 0.01 * unit(random);
+            const double gap = (2.0 * unit(random) - 1.0) * MAX_PAIR_GAP_S;
+            pairs.push_back({ remotes[i], remotes[i + 1], first, first + gap });
+        }
+    }
+    return pairs;
+}
+
+// The reports of every remote: sampled every 10 ms of a clock off by up to
+// 80 ppm, at a phase of its own, and arriving in batches. Arrivals are
+// sorted as the host would see them.
+static std::vector<Report> RecordReports(const std::vector<Pair>& pairs, std::mt19937& random)
+{
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<std::vector<double>> presses(TIMELINE_REMOTES);
+    for (const Pair& pair : pairs)
+    {
+        presses[pair.a].push_back(pair.time_a);
+        presses[pair.b].push_back(pair.time_b);
+    }
+
+    std::vector<Report> reports;
+    for (int remote = 0; remote < TIMELINE_REMOTES; ++remote)
+    {
+        const double ppm = -80.0 + 160.0 * remote / (TIMELINE_REMOTES - 1);
+        const double period = REPORT_PERIOD_S * (1.0 + ppm * 1e-6);
+        const double phase = REPORT_PERIOD_S * unit(random);
+        double batch = 0.0;
+        double last = 0.0;
+        size_t press = 0;
+        for (double sampled = phase; sampled < RUN_S; sampled += period)
+        {
+            while (press < presses[remote].size() && presses[remote][press] + HOLD_S <= sampled)
+                press++;
+            const bool held = press < presses[remote].size() && presses[remote][press] <= sampled;
+            // The report goes with the first batch after it is sent
+            while (batch < sampled + 0.004)
+                batch += MIN_BATCH_S + (MAX_BATCH_S - MIN_BATCH_S) * unit(random);
+            last = std::max(batch, last) + 0.00005 * unit(random);
+            reports.push_back({ remote, sampled, last, static_cast<uint16_t>(held ? BUTTON : 0) });
+        }
+    }
+    std::sort(reports.begin(), reports.end(),
+              [](const Report& a, const Report& b) { return a.arrived < b.arrived; });
+    return reports;
+}
+
+// Sixteen simulated remotes whose clocks run from 80 ppm slow to 80 ppm fast
+// at random phases, each batched by Bluetooth on its own, fed to the
+// timeline in real time through report clocks as WiimoteDevice does. Pairs
+// of presses on two remotes are ordered by arrival, by the timeline and by
+// the remotes' true sample times, in bands of how far apart they were. The
+// timeline has to order them about as well as the true sample times do,
+// which the 10 ms report period limits, and better than arrival; events
+// must come out in sample time order unless marked late.
+BENCH(input_timeline_ordering, "Input timeline ordering of presses on 16 remotes with clock offsets and batching")
+{
+    std::mt19937 random(50);
+    const std::vector<Pair> pairs = PlanPresses(random);
+    const std::vector<Report> reports = RecordReports(pairs, random);
+
+    InputTimeline& timeline = InputTimeline::Instance();
+    std::mutex mutex;
+    std::vector<TimelineEvent> released;
+    const int subscription = timeline.Subscribe(
+        [&](const TimelineEvent& event) {
+            std::lock_guard<std::mutex> lock(mutex);
+            released.push_back(event);
+        },
+        0.0f, nullptr);
+    if (subscription < 0)
+        return Bench::Fail("the timeline could not start");
+
+    const Bench::Clock::time_point base = Bench::Clock::now() + std::chrono::milliseconds(50);
+    const auto at = [base](double seconds) {
+        return base + std::chrono::duration_cast<Bench::Clock::duration>(std::chrono::duration<double>(seconds));
+    };
+    ReportClock clocks[TIMELINE_REMOTES];
+    // Arrival and true sample time of each press, per remote
+    std::vector<std::vector<std::pair<double, double>>> presses(TIMELINE_REMOTES);
+    uint16_t previous[TIMELINE_REMOTES] = {};
+    for (const Report& report : reports)
+    {
+        std::this_thread::sleep_until(at(report.arrived));
+        WiimoteInputState input;
+        input.buttons = report.buttons;
+        input.received = at(report.arrived);
+        input.sampled = clocks[report.remote].Update(input.received, true);
+        input.accel_calibrated = true;
+        if (report.buttons && !previous[report.remote])
+            presses[report.remote].push_back({ report.arrived, report.sampled });
+        previous[report.remote] = report.buttons;
+        timeline.HandleInput(report.remote, input);
+    }
+    std::this_thread::sleep_for(InputTimeline::MAX_DELAY * 3);
+    const InputTimeline::Stats stats = timeline.GetStats();
+    timeline.Unsubscribe(subscription);
+
+    // Where each remote's presses were released
+    std::vector<std::vector<size_t>> order(TIMELINE_REMOTES);
+    size_t inversions = 0;
+    size_t late = 0;
+    for (size_t i = 0; i < released.size(); ++i)
+    {
+        if (released[i].buttons_pressed)
+            order[released[i].slot].push_back(i);
+        if (released[i].late)
+            late++;
+        else if (i > 0 && released[i].time < released[i - 1].time)
+            inversions++;
+    }
+
+    Band bands[3];
+    bands[0].name = "under 5 ms";
+    bands[1].name = "5 - 10 ms";
+    bands[2].name = "10 - 20 ms";
+    size_t next[TIMELINE_REMOTES] = {};
+    size_t missing = 0;
+    for (const Pair& pair : pairs)
+    {
+        const size_t a = next[pair.a]++;
+        const size_t b = next[pair.b]++;
+        if (a >= order[pair.a].size() || b >= order[pair.b].size() || a >= presses[pair.a].size() ||
+            b >= presses[pair.b].size())
+        {
+            missing++;
+            continue;
+        }
+        const bool truth = pair.time_a < pair.time_b;
+        const double gap = std::fabs(pair.time_a - pair.time_b);
+        Band& band = bands[gap < 0.005 ? 0 : gap < 0.01 ? 1 : 2];
+        band.pairs++;
+        band.by_arrival += (presses[pair.a][a].first < presses[pair.b][b].first) == truth;
+        band.by_timeline += (order[pair.a][a] < order[pair.b][b]) == truth;
+        band.by_sample += (presses[pair.a][a].second < presses[pair.b][b].second) == truth;
+    }
+
+    bool ok = true;
+    int arrival = 0;
+    int ordered = 0;
+    int sampled = 0;
+    for (const Band& band : bands)
+    {
+        std::printf("  %-10s %4d pairs: right by arrival %5.1f%%, by the timeline %5.1f%%, by true sample time %5.1f%%\n",
+                    band.name, band.pairs, 100.0 * band.by_arrival / std::max(band.pairs, 1),
+                    100.0 * band.by_timeline / std::max(band.pairs, 1), 100.0 * band.by_sample / std::max(band.pairs, 1));
+        arrival += band.by_arrival;
+        ordered += band.by_timeline;
+        sampled += band.by_sample;
+    }
+    std::printf("  %zu events, %zu late, %zu out of order, %zu pairs missing; released %.1f ms after sampling on "
+                "average, %.1f ms at most\n",
+                released.size(), late, inversions, missing,
+                stats.average_event_delay_us / 1000.0, stats.max_event_delay_us / 1000.0);
+
+    if (missing != 0)
+        ok = Bench::Fail("a press was not released");
+    if (inversions != 0)
+        ok = Bench::Fail("events were released out of sample time order");
+    if (late > released.size() * MAX_LATE)
+        ok = Bench::Fail("events came in behind the timeline");
+    if (ordered <= arrival)
+        ok = Bench::Fail("the timeline ordered presses no better than arrival");
+    if (ordered * 100 < sampled * 97)
+        ok = Bench::Fail("the timeline ordered presses worse than their sample times");
+    return ok;
+}
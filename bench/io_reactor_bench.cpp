@@ -0,0 +1,262 @@
+#include "bench.h"
+#include "io_reactor.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+constexpr auto REPORT_PERIOD = std::chrono::milliseconds(10);
+// How often each device is sent an output report from outside the reactor
+constexpr auto OUTPUT_PERIOD = std::chrono::milliseconds(2);
+constexpr auto RUN_TIME = std::chrono::milliseconds(400);
+constexpr size_t REPORT_SIZE = 22;
+// How long the last reports and writes may take to get through once the
+// devices stop, which a busy machine can stretch well past their latency
+constexpr auto DRAIN_TIME = std::chrono::seconds(5);
+
+#ifndef _WIN32
+
+// One end of a socket pair stands in for the remote, the other is the HID
+// handle the reactor serves
+struct FakeDevice
+{
+    int remote = -1;
+    int id = -1;
+    // Handlers of this device running now; more than one at a time is a bug
+    std::atomic<int> inside{ 0 };
+    std::atomic<uint64_t> overlaps{ 0 };
+    std::atomic<uint64_t> reads{ 0 };
+    std::atomic<uint64_t> writes{ 0 };
+    std::atomic<uint64_t> failed_writes{ 0 };
+    std::vector<double> latency_us;   // only touched by the device's handlers
+};
+
+struct ScalingResult
+{
+    uint64_t sent = 0;
+    uint64_t outputs = 0;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t failed_writes = 0;
+    uint64_t overlaps = 0;
+    double p50_us = 0.0;
+    double p99_us = 0.0;
+    double cpu_us_per_report = 0.0;
+    size_t threads = 0;
+};
+
+static void Enter(FakeDevice& device)
+{
+    if (device.inside.fetch_add(1) != 0)
+        device.overlaps++;
+    // Widen the window two handlers of one device would have to overlap in
+    std::this_thread::yield();
+}
+
+static void Leave(FakeDevice& device)
+{
+    device.inside.fetch_sub(1);
+}
+
+// Every device reports at 100 Hz, and every report read is answered with a
+// write. Another thread writes to every device every 2 ms, as the output
+// schedulers do, while a reactor thread may just have taken an event of the
+// same handle.
+static bool RunDevices(size_t count, ScalingResult& result)
+{
+    IoReactor& reactor = IoReactor::Instance();
+    std::vector<std::unique_ptr<FakeDevice>> devices;
+    for (size_t i = 0; i < count; ++i)
+    {
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) != 0)
+            return Bench::Fail("socketpair");
+        auto device = std::make_unique<FakeDevice>();
+        device->remote = sockets[0];
+        FakeDevice* pointer = device.get();
+        device->id = reactor.Register(sockets[1], REPORT_SIZE,
+            [pointer, &reactor](const uint8_t* data, size_t size) {
+                Enter(*pointer);
+                if (size == REPORT_SIZE)
+                {
+                    int64_t sent;
+                    std::memcpy(&sent, data + 1, sizeof(sent));
+                    const auto now = Bench::Clock::now().time_since_epoch();
+                    pointer->latency_us.push_back(Bench::Microseconds(now - Bench::Clock::duration(sent)));
+                }
+                pointer->reads++;
+                const uint8_t answer[] = { 0x10, 0x01 };
+                reactor.Write(pointer->id, answer, sizeof(answer), [pointer](bool success, double) {
+                    Enter(*pointer);
+                    (success ? pointer->writes : pointer->failed_writes)++;
+                    Leave(*pointer);
+                });
+                Leave(*pointer);
+            },
+            nullptr);
+        if (device->id < 0)
+            return Bench::Fail("Register");
+        devices.push_back(std::move(device));
+    }
+
+    std::atomic<bool> running(true);
+    std::thread output([&]() {
+        const uint8_t leds[] = { 0x11, 0x10 };
+        for (Bench::Clock::time_point next = Bench::Clock::now(); running; next += OUTPUT_PERIOD)
+        {
+            std::this_thread::sleep_until(next);
+            for (auto& device : devices)
+            {
+                FakeDevice* pointer = device.get();
+                if (reactor.Write(pointer->id, leds, sizeof(leds), [pointer](bool success, double) {
+                        Enter(*pointer);
+                        (success ? pointer->writes : pointer->failed_writes)++;
+                        Leave(*pointer);
+                    }))
+                    result.outputs++;
+            }
+        }
+    });
+
+    const double cpu_start = Bench::ProcessCpuMicroseconds();
+    const Bench::Clock::time_point start = Bench::Clock::now();
+    Bench::Clock::time_point next = start;
+    uint8_t report[REPORT_SIZE] = { 0x31 };
+    uint8_t answer[8];
+    while (Bench::Clock::now() - start < RUN_TIME)
+    {
+        std::this_thread::sleep_until(next);
+        next += REPORT_PERIOD;
+        for (auto& device : devices)
+        {
+            const int64_t sent = Bench::Clock::now().time_since_epoch().count();
+            std::memcpy(report + 1, &sent, sizeof(sent));
+            if (send(device->remote, report, sizeof(report), MSG_DONTWAIT) == sizeof(report))
+                result.sent++;
+            while (recv(device->remote, answer, sizeof(answer), MSG_DONTWAIT) > 0)
+            {
+            }
+        }
+    }
+    running = false;
+    output.join();
+    // Let the last reports and answers through: every report read and every
+    // write done, or the deadline passed
+    const Bench::Clock::time_point drain_deadline = Bench::Clock::now() + DRAIN_TIME;
+    for (;;)
+    {
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        for (auto& device : devices)
+        {
+            while (recv(device->remote, answer, sizeof(answer), MSG_DONTWAIT) > 0)
+            {
+            }
+            reads += device->reads;
+            writes += device->writes + device->failed_writes;
+        }
+        if ((reads == result.sent && writes == reads + result.outputs) || Bench::Clock::now() >= drain_deadline)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const double cpu_us = Bench::ProcessCpuMicroseconds() - cpu_start;
+
+    std::vector<double> latency_us;
+    for (auto& device : devices)
+    {
+        reactor.Unregister(device->id);
+        close(device->remote);
+        result.reads += device->reads;
+        result.writes += device->writes;
+        result.failed_writes += device->failed_writes;
+        result.overlaps += device->overlaps;
+        latency_us.insert(latency_us.end(), device->latency_us.begin(), device->latency_us.end());
+    }
+    result.p50_us = Bench::Percentile(latency_us, 0.5);
+    result.p99_us = Bench::Percentile(latency_us, 0.99);
+    result.cpu_us_per_report = result.reads > 0 ? cpu_us / result.reads : 0.0;
+    result.threads = reactor.GetStats().threads;
+    return true;
+}
+
+// Writes to a device that stopped reading pile up in the reactor once the
+// socket is full; unregistering it has to complete every one of them
+static bool DropQueuedWrites(uint64_t& queued, uint64_t& failed)
+{
+    IoReactor& reactor = IoReactor::Instance();
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) != 0)
+        return Bench::Fail("socketpair");
+    const int id = reactor.Register(sockets[1], REPORT_SIZE, [](const uint8_t*, size_t) {}, nullptr);
+    if (id < 0)
+        return Bench::Fail("Register");
+
+    std::atomic<uint64_t> succeeded(0);
+    std::atomic<uint64_t> failures(0);
+    const uint8_t leds[] = { 0x11, 0x10 };
+    for (int i = 0; i < 2000; ++i)
+    {
+        if (reactor.Write(id, leds, sizeof(leds), [&](bool success, double) { (success ? succeeded : failures)++; }))
+            queued++;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    reactor.Unregister(id);
+    close(sockets[0]);
+    failed = failures;
+    return succeeded + failures == queued;
+}
+
+#endif
+
+// The reactor's threads serve every handle: their number stays the same
+// from 1 to 128 remotes, and each read and write of one handle is handled
+// by one thread at a time, however many threads take its events. Writes
+// still queued for a device when it is unregistered complete with a failure.
+BENCH(reactor_scaling, "The I/O reactor serves 1 - 128 fake devices with its fixed threads, one handler per device at a time")
+{
+#ifdef _WIN32
+    std::printf("  needs socket pairs as devices, skipped on Windows\n");
+    return true;
+#else
+    bool ok = true;
+    size_t threads = 0;
+    for (size_t count : { 1, 8, 32, 128 })
+    {
+        ScalingResult result;
+        if (!RunDevices(count, result))
+            return false;
+        std::printf("  %3zu devices: %llu/%llu reports read, %llu/%llu writes done, %llu failed, "
+                    "latency p50 %.0f us p99 %.0f us, %.1f us process CPU per report, %zu threads\n",
+                    count, static_cast<unsigned long long>(result.reads),
+                    static_cast<unsigned long long>(result.sent), static_cast<unsigned long long>(result.writes),
+                    static_cast<unsigned long long>(result.reads + result.outputs),
+                    static_cast<unsigned long long>(result.failed_writes),
+                    result.p50_us, result.p99_us, result.cpu_us_per_report, result.threads);
+        if (result.overlaps != 0)
+            ok = Bench::Fail("two handlers of one device ran at once");
+        if (result.reads != result.sent || result.writes != result.reads + result.outputs)
+            ok = Bench::Fail("reports or writes were lost");
+        if (result.failed_writes != 0)
+            ok = Bench::Fail("writes failed");
+        if (threads != 0 && result.threads != threads)
+            ok = Bench::Fail("the thread count changed with the device count");
+        threads = result.threads;
+    }
+
+    uint64_t queued = 0;
+    uint64_t failed = 0;
+    const bool completed = DropQueuedWrites(queued, failed);
+    std::printf("  unregistered with writes queued: %llu writes, %llu of them failed\n",
+                static_cast<unsigned long long>(queued), static_cast<unsigned long long>(failed));
+    if (!completed)
+        ok = Bench::Fail("writes dropped by Unregister did not complete");
+    else if (failed == 0)
+        ok = Bench::Fail("no writes were left queued to drop");
+    return ok;
+#endif
+}
@@ -0,0 +1,213 @@
+#include "bench.h"
+#include "ir_tracker.h"
+#include <cmath>
+#include <random>
+
+constexpr int TRACE_FRAMES = 1000;
+constexpr auto FRAME_PERIOD = std::chrono::milliseconds(10);
+// Camera and bar as IrTracker assumes them
+constexpr float CAMERA_WIDTH = 1024.0f;
+constexpr float CAMERA_HEIGHT = 768.0f;
+constexpr float CAMERA_FOV_X = 33.0f * 3.14159265f / 180.0f;
+constexpr float BAR_WIDTH_M = 0.2f;
+// A pointer step this much larger than the true one is a jump
+constexpr float JUMP = 0.05f;
+
+namespace
+{
+    // One frame of a recorded trace: the dots as the camera reported them,
+    // and where the remote really pointed
+    struct TraceFrame
+    {
+        IrDot dots[4];
+        float x = 0.0f;
+        float y = 0.0f;
+        float roll = 0.0f;
+    };
+
+    struct TraceResult
+    {
+        double frame_us = 0.0;        // mean per remote and frame
+        double batch_p50_us = 0.0;    // one frame of every remote
+        double batch_p99_us = 0.0;
+        double pointer_error = 0.0;   // mean, in screen widths
+        double roll_error = 0.0;      // mean, radians
+        double visible = 0.0;         // share of frames with a pointer
+        uint64_t jumps = 0;
+        uint64_t raw_jumps = 0;
+    };
+}
+
+// A remote waved about in front of the bar at 1.5 - 3 m, rolled up to 125
+// degrees either way. It starts level: nothing in the dots tells a bar seen
+// upside down from one seen level, so the tracker takes the first bar it
+// sees as level and follows it from there. Dots jitter by a pixel, each is lost in 10% of the
+// frames, the camera reorders its slots every 37 frames and a dot that
+// leaves the image is gone.
+static void RecordTrace(int remote, std::vector<TraceFrame>& trace)
+{
+    std::mt19937 random(remote + 1);
+    std::uniform_real_distribution<float> jitter(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> chance(0.0f, 1.0f);
+    const float phase = remote * 0.7f;
+
+    trace.resize(TRACE_FRAMES);
+    int order[4] = { 0, 1, 2, 3 };
+    for (int frame = 0; frame < TRACE_FRAMES; ++frame)
+    {
+        const float t = frame * 0.01f;
+        TraceFrame& out = trace[frame];
+        out.x = 0.5f + 0.25f * std::sin(0.9f * t + phase);
+        out.y = 0.5f + 0.2f * std::sin(1.3f * t + 2.0f * phase);
+        out.roll = (1.6f + 0.1f * (remote % 7)) * std::sin(0.4f * t);
+        const float distance = 2.25f + 0.75f * std::sin(0.2f * t + phase);
+
+        // The inverse of IrTracker's pointer: the bar's middle is where the
+        // pointer is, mirrored and rotated by the roll
+        const float c = std::cos(out.roll);
+        const float s = std::sin(out.roll);
+        const float rx = (0.5f - out.x) * CAMERA_WIDTH;
+        const float ry = (0.5f - out.y) * CAMERA_HEIGHT;
+        const float mx = rx * c - ry * s + CAMERA_WIDTH / 2.0f;
+        const float my = rx * s + ry * c + CAMERA_HEIGHT / 2.0f;
+        const float separation = 2.0f * std::atan(BAR_WIDTH_M / (2.0f * distance)) * CAMERA_WIDTH / CAMERA_FOV_X;
+
+        if (frame % 37 == 0)
+            std::shuffle(order, order + 4, random);
+        for (IrDot& dot : out.dots)
+            dot = IrDot();
+        for (int end = 0; end < 2; ++end)
+        {
+            const float sign = end == 0 ? -0.5f : 0.5f;
+            const float x = mx + sign * separation * c + jitter(random);
+            const float y = my + sign * separation * s + jitter(random);
+            if (x < 0.0f || x >= CAMERA_WIDTH || y < 0.0f || y >= CAMERA_HEIGHT || chance(random) < 0.1f)
+                continue;
+            IrDot& dot = out.dots[order[end]];
+            dot.x = static_cast<uint16_t>(x);
+            dot.y = static_cast<uint16_t>(y);
+            dot.valid = true;
+        }
+    }
+}
+
+// The pointer straight from the dots, the first two valid slots taken as
+// the bar: what IrTracker replaces
+static bool RawPointer(const IrDot dots[4], float& x, float& y)
+{
+    const IrDot* ends[2] = {};
+    int count = 0;
+    for (int i = 0; i < 4 && count < 2; ++i)
+    {
+        if (dots[i].valid)
+            ends[count++] = &dots[i];
+    }
+    if (count < 2)
+        return false;
+    const float roll = std::atan2(static_cast<float>(ends[1]->y - ends[0]->y), static_cast<float>(ends[1]->x - ends[0]->x));
+    const float mx = (ends[0]->x + ends[1]->x) / 2.0f - CAMERA_WIDTH / 2.0f;
+    const float my = (ends[0]->y + ends[1]->y) / 2.0f - CAMERA_HEIGHT / 2.0f;
+    x = 0.5f - (mx * std::cos(roll) + my * std::sin(roll)) / CAMERA_WIDTH;
+    y = 0.5f - (-mx * std::sin(roll) + my * std::cos(roll)) / CAMERA_HEIGHT;
+    return true;
+}
+
+static float RollError(float a, float b)
+{
+    const float difference = std::fabs(std::remainder(a - b, 2.0f * 3.14159265f));
+    return difference;
+}
+
+// Replay the recorded traces of `remotes` remotes, one frame of every
+// remote per 10 ms batch, as the reports of one period arrive together
+static TraceResult ReplayTraces(const std::vector<std::vector<TraceFrame>>& traces, size_t remotes)
+{
+    std::vector<IrTracker> trackers(remotes);
+    std::vector<IrPointer> previous(remotes);
+    std::vector<float> raw_previous(remotes * 2, -1.0f);
+    std::vector<double> batch_us;
+    batch_us.reserve(TRACE_FRAMES);
+    std::vector<IrPointer> pointers(remotes);
+
+    TraceResult result;
+    double pointer_error = 0.0;
+    double roll_error = 0.0;
+    uint64_t visible = 0;
+    const Bench::Clock::time_point base = Bench::Clock::now();
+    for (int frame = 0; frame < TRACE_FRAMES; ++frame)
+    {
+        const Bench::Clock::time_point time = base + frame * FRAME_PERIOD;
+        const Bench::Clock::time_point start = Bench::Clock::now();
+        for (size_t remote = 0; remote < remotes; ++remote)
+            trackers[remote].Update(traces[remote % traces.size()][frame].dots, time, pointers[remote]);
+        batch_us.push_back(Bench::Microseconds(Bench::Clock::now() - start));
+
+        for (size_t remote = 0; remote < remotes; ++remote)
+        {
+            const std::vector<TraceFrame>& trace = traces[remote % traces.size()];
+            const TraceFrame& truth = trace[frame];
+            const IrPointer& pointer = pointers[remote];
+            const float true_step = frame > 0 ? std::hypot(truth.x - trace[frame - 1].x, truth.y - trace[frame - 1].y) : 0.0f;
+            if (pointer.visible)
+            {
+                visible++;
+                pointer_error += std::hypot(pointer.x - truth.x, pointer.y - truth.y);
+                roll_error += RollError(pointer.roll, truth.roll);
+                if (previous[remote].visible &&
+                    std::hypot(pointer.x - previous[remote].x, pointer.y - previous[remote].y) > true_step + JUMP)
+                    result.jumps++;
+            }
+            previous[remote] = pointer;
+
+            float x;
+            float y;
+            if (RawPointer(truth.dots, x, y))
+            {
+                if (raw_previous[remote * 2] >= -0.5f &&
+                    std::hypot(x - raw_previous[remote * 2], y - raw_previous[remote * 2 + 1]) > true_step + JUMP)
+                    result.raw_jumps++;
+                raw_previous[remote * 2] = x;
+                raw_previous[remote * 2 + 1] = y;
+            }
+        }
+    }
+
+    const double updates = static_cast<double>(remotes) * TRACE_FRAMES;
+    result.frame_us = Bench::Mean(batch_us) / remotes;
+    result.batch_p50_us = Bench::Percentile(batch_us, 0.5);
+    result.batch_p99_us = Bench::Percentile(batch_us, 0.99);
+    result.visible = visible / updates;
+    result.pointer_error = visible > 0 ? pointer_error / visible : 0.0;
+    result.roll_error = visible > 0 ? roll_error / visible : 0.0;
+    return result;
+}
+
+// IR frames of many remotes tracked in batches against recorded traces with
+// dropouts, slot swaps and roll past 90 degrees. A batch of every remote's
+// frame has to fit well inside the 10 ms between IR reports, and the tracked
+// pointer has to follow the remote without the jumps of taking dots as the
+// camera orders them.
+BENCH(ir_tracker_traces, "IR tracking of 1 - 64 remotes in batches per frame against recorded traces")
+{
+    std::vector<std::vector<TraceFrame>> traces(16);
+    for (size_t remote = 0; remote < traces.size(); ++remote)
+        RecordTrace(static_cast<int>(remote), traces[remote]);
+
+    bool ok = true;
+    for (size_t remotes : { size_t(1), size_t(16), size_t(64) })
+    {
+        const TraceResult result = ReplayTraces(traces, remotes);
+        std::printf("  %2zu remotes: %.2f us per frame, batch p50 %.1f us p99 %.1f us; pointer visible %.1f%%, "
+                    "error %.4f, roll error %.4f rad; jumps %llu tracked, %llu from raw dots\n",
+                    remotes, result.frame_us, result.batch_p50_us, result.batch_p99_us, 100.0 * result.visible,
+                    result.pointer_error, result.roll_error, static_cast<unsigned long long>(result.jumps),
+                    static_cast<unsigned long long>(result.raw_jumps));
+        if (result.batch_p99_us > Bench::Microseconds(FRAME_PERIOD) / 10.0)
+            ok = Bench::Fail("a batch took more than a tenth of the frame period");
+        if (result.visible < 0.9 || result.pointer_error > 0.01 || result.roll_error > 0.05)
+            ok = Bench::Fail("the tracked pointer does not follow the remote");
+        if (result.jumps * 10 > result.raw_jumps)
+            ok = Bench::Fail("the tracked pointer jumps as much as the raw dots");
+    }
+    return ok;
+}
@@ -0,0 +1,112 @@
+#include "bench.h"
+#include "led_animator.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <algorithm>
+
+constexpr uint32_t FRAME_RATE = 50;
+constexpr int ANIMATED_REMOTES = 8;
+constexpr auto RUN_TIME = std::chrono::milliseconds(1000);
+
+struct JitterResult
+{
+    size_t frames = 0;
+    double p50_ms = 0.0;
+    double p99_ms = 0.0;
+    double max_ms = 0.0;
+    uint64_t overruns = 0;
+};
+
+// Play a timeline that changes the LEDs of every remote on every frame and
+// take the time each frame reaches the output. A frame's error is how far it
+// is from its place on the grid of 20 ms steps from the first one.
+static JitterResult MeasureFrames(int busy_threads)
+{
+    std::atomic<bool> busy(true);
+    std::vector<std::thread> load;
+    for (int i = 0; i < busy_threads; ++i)
+    {
+        load.emplace_back([&busy]() {
+            volatile uint64_t spin = 0;
+            while (busy)
+                spin = spin + 1;
+        });
+    }
+
+    std::mutex mutex;
+    std::vector<Bench::Clock::time_point> frames;
+    LedAnimator& animator = LedAnimator::Instance();
+    animator.SetOutput([&](const std::vector<std::pair<std::wstring, uint8_t>>&) {
+        std::lock_guard<std::mutex> lock(mutex);
+        frames.push_back(Bench::Clock::now());
+    });
+    const LedTimeline timeline = LedAnimator::Rotation({ 0x01, 0x02, 0x04, 0x08 }, 1000 / FRAME_RATE);
+    for (int i = 0; i < ANIMATED_REMOTES; ++i)
+        animator.Play(L"bench-remote-" + std::to_wstring(i), timeline);
+
+    const LedAnimator::Stats before = animator.GetStats();
+    animator.Start(FRAME_RATE);
+    std::this_thread::sleep_for(RUN_TIME);
+    animator.Stop();
+    const LedAnimator::Stats after = animator.GetStats();
+    for (int i = 0; i < ANIMATED_REMOTES; ++i)
+        animator.StopAnimation(L"bench-remote-" + std::to_wstring(i));
+    animator.SetOutput(nullptr);
+
+    busy = false;
+    for (std::thread& thread : load)
+        thread.join();
+
+    JitterResult result;
+    result.frames = frames.size();
+    result.overruns = after.overruns - before.overruns;
+    if (frames.size() < 2)
+        return result;
+
+    // Frames are only ever late, so the earliest one relative to the grid
+    // is taken as on time
+    const Bench::Clock::duration period = Bench::Clock::duration(std::chrono::seconds(1)) / FRAME_RATE;
+    std::vector<double> offsets;
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        const Bench::Clock::duration offset = frames[i] - frames[0];
+        const Bench::Clock::duration step = (offset + period / 2) / period * period;
+        offsets.push_back(Bench::Milliseconds(offset - step));
+    }
+    const double on_time = *std::min_element(offsets.begin(), offsets.end());
+    std::vector<double> errors;
+    for (double offset : offsets)
+        errors.push_back(offset - on_time);
+    result.p50_ms = Bench::Percentile(errors, 0.5);
+    result.p99_ms = Bench::Percentile(errors, 0.99);
+    result.max_ms = Bench::Percentile(errors, 1.0);
+    return result;
+}
+
+// Frames are timed against absolute deadlines, so each one should land
+// within a few milliseconds of its place at 50 Hz, with the machine idle and
+// with every core kept busy. The error is printed rather than checked: under
+// load it is mostly the time slice the busy threads get before the animator
+// runs, which is as large as the error itself on a shared machine. What is
+// checked is that frames are not missed or skipped more than once a run; a
+// single overrun is the whole process being held up for a period, which a
+// shared one-core machine does now and then.
+BENCH(led_animator_jitter, "LED animator frame timing error at 50 Hz, idle and under load")
+{
+    const int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    bool ok = true;
+    for (int busy_threads : { 0, cores })
+    {
+        const JitterResult result = MeasureFrames(busy_threads);
+        std::printf("  %2d busy threads: %zu frames, error p50 %.3f ms, p99 %.3f ms, max %.3f ms, %llu overruns\n",
+                    busy_threads, result.frames, result.p50_ms, result.p99_ms, result.max_ms,
+                    static_cast<unsigned long long>(result.overruns));
+        if (result.frames < FRAME_RATE * 9 / 10)
+            ok = Bench::Fail("frames were missed");
+        if (result.overruns > 1)
+            ok = Bench::Fail("frames were a whole period late more than once");
+    }
+    return ok;
+}
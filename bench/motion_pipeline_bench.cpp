@@ -0,0 +1,145 @@
+#include "bench.h"
+#include "motion_pipeline.h"
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <thread>
+
+constexpr int REMOTES = 32;
+constexpr auto REPORT_PERIOD = std::chrono::milliseconds(10);
+constexpr int REPORTS = 150;
+// The stack hands reports over two at a time, the first a period late, and
+// up to this much later on top
+constexpr int BURST = 2;
+constexpr auto MAX_JITTER = std::chrono::milliseconds(3);
+constexpr float SIGNAL_HZ = 2.0f;
+// Mean error of a lane against the motion at the block's time, in g
+constexpr double MAX_ERROR = 0.01;
+// Share of a lane's blocks that may repeat the one before exactly
+constexpr double MAX_REPEATS = 0.05;
+// Share of the reports that may arrive behind the stream, as the scheduler
+// on a busy machine can hold up a burst
+constexpr double MAX_LATE = 0.01;
+
+// The motion of remote `lane` at `seconds` into the run: a 1 g swing at
+// 2 Hz in X and Y, each remote at its own phase, gravity in Z
+static void Motion(int lane, double seconds, float accel[3])
+{
+    const double angle = 2.0 * 3.14159265358979 * SIGNAL_HZ * seconds + 0.2 * lane;
+    accel[0] = static_cast<float>(std::sin(angle));
+    accel[1] = static_cast<float>(std::cos(angle));
+    accel[2] = 1.0f;
+}
+
+// 32 remotes reporting at 100 Hz, their reports arriving in bursts with
+// their sample times, through five chains of which most share a prefix. The
+// raw stream is checked against the motion at each block's time, and for
+// lanes repeating a block, as they would if a report were held until the
+// next came; for comparison the error of holding the latest arrived report
+// and stamping it with the tick's own time is printed. A tick over all
+// remotes has to take a small part of the period.
+BENCH(motion_pipeline_remotes, "Motion pipeline over 32 remotes with bursty reports: stream error and tick cost")
+{
+    MotionPipeline& pipeline = MotionPipeline::Instance();
+    const Bench::Clock::time_point base = Bench::Clock::now() + std::chrono::milliseconds(20);
+    const auto seconds = [base](Bench::Clock::time_point time) {
+        return std::chrono::duration<double>(time - base).count();
+    };
+    std::atomic<int> arrived(0);    // reports of every remote handed over
+
+    double error = 0.0;
+    double held_error = 0.0;
+    uint64_t values = 0;
+    uint64_t repeats = 0;
+    float previous[REMOTES] = {};
+    uint32_t seen = 0;
+    const int raw = pipeline.Subscribe({}, [&](const MotionBlock& block) {
+        const int latest = arrived.load() - 1;
+        for (int lane = 0; lane < REMOTES; ++lane)
+        {
+            if (!(block.lanes & (1u << lane)))
+                continue;
+            float truth[3];
+            float held[3];
+            Motion(lane, seconds(block.time), truth);
+            Motion(lane, seconds(base + latest * REPORT_PERIOD), held);
+            float current[3];
+            Motion(lane, seconds(Bench::Clock::now()), current);
+            error += std::fabs(block.values[MOTION_ACCEL_X][lane] - truth[0]);
+            held_error += std::fabs(held[0] - current[0]);
+            values++;
+            if ((seen & (1u << lane)) && block.values[MOTION_ACCEL_X][lane] == previous[lane])
+                repeats++;
+            previous[lane] = block.values[MOTION_ACCEL_X][lane];
+            seen |= 1u << lane;
+        }
+    });
+    if (raw < 0)
+        return Bench::Fail("the pipeline could not start");
+    const std::vector<std::vector<MotionStage>> chains = {
+        { MotionStage::RemoveBias(), MotionStage::LowPass(20.0f), MotionStage::Decimate(2) },
+        { MotionStage::RemoveBias(), MotionStage::LowPass(20.0f) },
+        { MotionStage::RemoveBias(), MotionStage::OneEuro(1.0f, 0.01f) },
+        { MotionStage::LowPass(40.0f), MotionStage::Resample(60.0f) },
+    };
+    std::vector<int> subscriptions;
+    for (const std::vector<MotionStage>& chain : chains)
+        subscriptions.push_back(pipeline.Subscribe(chain, [](const MotionBlock&) {}));
+    const MotionPipeline::Stats before = pipeline.GetStats();
+
+    std::mt19937 random(47);
+    std::uniform_int_distribution<int> jitter_us(0, static_cast<int>(MAX_JITTER.count() * 1000));
+    WiimoteInputState input;
+    input.accel_calibrated = true;
+    const ExtensionState extension;
+    for (int burst = 0; burst < REPORTS / BURST; ++burst)
+    {
+        const int first = burst * BURST;
+        std::this_thread::sleep_until(base + (first + BURST - 1) * REPORT_PERIOD +
+                                      std::chrono::microseconds(jitter_us(random)));
+        for (int report = first; report < first + BURST; ++report)
+        {
+            input.sampled = base + report * REPORT_PERIOD;
+            input.received = Bench::Clock::now();
+            for (int lane = 0; lane < REMOTES; ++lane)
+            {
+                Motion(lane, seconds(input.sampled), input.accel_g);
+                pipeline.HandleInput(lane, input, extension);
+            }
+            arrived = report + 1;
+        }
+    }
+    // Let the stream catch up with the last reports
+    std::this_thread::sleep_for(MotionPipeline::RESAMPLE_DELAY);
+
+    const MotionPipeline::Stats after = pipeline.GetStats();
+    for (int id : subscriptions)
+        pipeline.Unsubscribe(id);
+    pipeline.Unsubscribe(raw);
+
+    const uint64_t samples = after.samples - before.samples;
+    const uint64_t late = after.late_samples - before.late_samples;
+    const uint64_t ticks = after.ticks - before.ticks;
+    const double mean_error = values > 0 ? error / values : 1.0;
+    const double repeat_share = values > 0 ? static_cast<double>(repeats) / values : 1.0;
+    std::printf("  %d remotes, %llu reports, %llu late; %llu ticks, %zu stages, tick %.1f us mean, %.1f us max, "
+                "%llu overruns\n",
+                REMOTES, static_cast<unsigned long long>(samples), static_cast<unsigned long long>(late),
+                static_cast<unsigned long long>(ticks), after.stages, after.average_tick_us, after.max_tick_us,
+                static_cast<unsigned long long>(after.overruns - before.overruns));
+    std::printf("  raw stream: error %.4f g, %.1f%% of blocks repeated; holding the latest report: error %.4f g\n",
+                mean_error, 100.0 * repeat_share, values > 0 ? held_error / values : 0.0);
+
+    bool ok = true;
+    if (samples != static_cast<uint64_t>(REMOTES) * REPORTS)
+        ok = Bench::Fail("a report was not taken in");
+    if (late > samples * MAX_LATE)
+        ok = Bench::Fail("reports arrived behind the stream");
+    if (mean_error > MAX_ERROR)
+        ok = Bench::Fail("the stream does not follow the motion at its own time");
+    if (repeat_share > MAX_REPEATS)
+        ok = Bench::Fail("the stream repeated reports");
+    if (after.average_tick_us > 1e6 / MotionPipeline::BASE_RATE / 10.0)
+        ok = Bench::Fail("a tick took more than a tenth of the pipeline's period");
+    return ok;
+}
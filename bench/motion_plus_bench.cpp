@@ -0,0 +1,241 @@
+#include "bench.h"
+#include "simulated_remote.h"
+#include "wiimote_extension.h"
+#include "wiimote_input.h"
+#include "wiimote_protocol.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+
+using namespace WiimoteProtocol;
+
+constexpr int PLUGS = 12;
+constexpr auto REPORT_PERIOD = std::chrono::milliseconds(10);
+constexpr auto SETTLE_TIME = std::chrono::milliseconds(60);
+constexpr auto RUN_TIME = std::chrono::milliseconds(200);
+constexpr auto FIRST_SAMPLE_TIMEOUT = std::chrono::seconds(1);
+constexpr double MAX_FIRST_SAMPLE_MS = 100.0;
+
+// What the MotionPlus and the Nunchuk in it report, the Nunchuk's
+// accelerometer without its lowest bits, which passthrough drops
+constexpr uint16_t YAW = 9000;
+constexpr uint16_t ROLL = 7100;
+constexpr uint16_t PITCH = 8450;
+constexpr uint8_t STICK_X = 0x30;
+constexpr uint8_t STICK_Y = 0xC4;
+constexpr uint16_t NUNCHUK_ACCEL[3] = { 0x200, 0x1F4, 0x2A0 };
+
+// A MotionPlus frame of a 0x32 report, slow in yaw and pitch
+static void MakeMotionPlusFrame(bool nunchuk, uint8_t* data)
+{
+    data[0] = YAW & 0xFF;
+    data[1] = ROLL & 0xFF;
+    data[2] = PITCH & 0xFF;
+    data[3] = static_cast<uint8_t>(((YAW >> 6) & 0xFC) | 0x02 | 0x01);
+    data[4] = static_cast<uint8_t>(((ROLL >> 6) & 0xFC) | (nunchuk ? 0x01 : 0x00));
+    data[5] = static_cast<uint8_t>(((PITCH >> 6) & 0xFC) | 0x02);
+}
+
+// A passed-through Nunchuk frame with C held
+static void MakeNunchukFrame(uint8_t* data)
+{
+    const uint16_t* accel = NUNCHUK_ACCEL;
+    data[0] = STICK_X;
+    data[1] = STICK_Y;
+    data[2] = static_cast<uint8_t>(accel[0] >> 2);
+    data[3] = static_cast<uint8_t>(accel[1] >> 2);
+    data[4] = static_cast<uint8_t>(((accel[2] >> 3) << 1) | 0x01);
+    data[5] = static_cast<uint8_t>((((accel[2] >> 1) & 0x03) << 6) | (((accel[1] >> 1) & 0x01) << 5) |
+                                   (((accel[0] >> 1) & 0x01) << 4) | 0x04);
+}
+
+namespace
+{
+    struct PlugResult
+    {
+        double first_sample_ms = -1.0;
+        uint64_t samples = 0;
+        uint64_t wrong = 0;
+        uint64_t nunchuk_samples = 0;
+        uint8_t mode = 0;
+    };
+}
+
+// A remote reporting every 10 ms, served by the register engine and the
+// extension handler as WiimoteDevice does, into which a MotionPlus is
+// plugged at a random point of the probe period. The extension's changed
+// callback switches the remote to 0x32 reports.
+static PlugResult RunPlug(MotionPlusMode mode, bool nunchuk, std::mt19937& random)
+{
+    SimulatedRemote* remote_pointer = nullptr;
+    WiimoteRegisterEngine registers([&remote_pointer](const uint8_t* report, size_t size) {
+        return remote_pointer->Send(report, size);
+    });
+    WiimoteExtension extension(registers, 0);
+    extension.SetMotionPlusMode(mode);
+
+    std::mutex mutex;
+    PlugResult result;
+    Bench::Clock::time_point plugged = Bench::Clock::time_point::max();
+    SimulatedRemote remote(SimulatedRemote::Link(), [&](const uint8_t* report, size_t size) {
+        if (registers.HandleInputReport(report, size))
+            return;
+        const Bench::Clock::time_point now = Bench::Clock::now();
+        if (report[0] == INPUT_STATUS)
+        {
+            extension.HandleStatus((report[3] & STATUS_EXTENSION) != 0, now);
+            return;
+        }
+        WiimoteInputState input;
+        ExtensionState state;
+        if (!DecodeInputReport(report, size, input) ||
+            !extension.Decode(input.extension, input.extension_size, state, now) ||
+            state.type != ExtensionType::MotionPlus)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (result.samples++ == 0)
+            result.first_sample_ms = Bench::Milliseconds(now - plugged);
+        const MotionPlusState& motion_plus = state.motion_plus;
+        bool right = motion_plus.yaw == YAW && motion_plus.roll == ROLL && motion_plus.pitch == PITCH &&
+                     motion_plus.yaw_slow && motion_plus.pitch_slow && !motion_plus.roll_slow;
+        if (state.passthrough == ExtensionType::Nunchuk)
+        {
+            const NunchukState& decoded = state.nunchuk;
+            // Until the first Nunchuk frame its state is still empty
+            if (decoded.stick_x != 0 || decoded.stick_y != 0)
+            {
+                result.nunchuk_samples++;
+                right = right && decoded.stick_x == STICK_X && decoded.stick_y == STICK_Y && decoded.button_c &&
+                        !decoded.button_z && decoded.accel[0] == NUNCHUK_ACCEL[0] &&
+                        decoded.accel[1] == NUNCHUK_ACCEL[1] && decoded.accel[2] == NUNCHUK_ACCEL[2];
+            }
+        }
+        else if (nunchuk && result.samples > 1)
+        {
+            right = false;
+        }
+        if (!right)
+            result.wrong++;
+    });
+    remote_pointer = &remote;
+
+    extension.SetChangedCallback([&remote](ExtensionType type) {
+        const uint8_t report_mode[] = { OUTPUT_REPORT_MODE, REPORT_MODE_CONTINUOUS,
+                                        type == ExtensionType::None ? INPUT_CORE : INPUT_CORE_EXT8 };
+        remote.Send(report_mode, sizeof(report_mode));
+    });
+    remote.SetTickHandler(std::chrono::milliseconds(10), [&](Bench::Clock::time_point now) {
+        registers.Tick(now);
+        extension.Tick(now);
+    });
+    uint32_t frame = 0;
+    remote.SetDataReports(REPORT_PERIOD, [&](Bench::Clock::time_point, std::vector<uint8_t>& report) {
+        const uint8_t report_mode = remote.GetReportMode();
+        report.assign(GetInputReportSize(report_mode), 0);
+        report[0] = report_mode;
+        const uint8_t motion_plus = remote.GetMotionPlusMode();
+        if (report_mode != INPUT_CORE_EXT8 || motion_plus == 0)
+            return;
+        // In passthrough mode every other frame is the Nunchuk's
+        if (motion_plus == MOTION_PLUS_MODE_NUNCHUK && nunchuk && frame++ % 2 == 1)
+            MakeNunchukFrame(report.data() + 3);
+        else
+            MakeMotionPlusFrame(motion_plus == MOTION_PLUS_MODE_NUNCHUK && nunchuk, report.data() + 3);
+    });
+
+    // Plug in somewhere in the probe period, once the remote has been
+    // found empty
+    std::uniform_int_distribution<int> phase_us(
+        0, static_cast<int>(std::chrono::microseconds(WiimoteExtension::MOTION_PLUS_PROBE_PERIOD).count()));
+    std::this_thread::sleep_for(SETTLE_TIME + std::chrono::microseconds(phase_us(random)));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        plugged = Bench::Clock::now();
+    }
+    remote.PlugMotionPlus(nunchuk);
+
+    const Bench::Clock::time_point deadline = plugged + FIRST_SAMPLE_TIMEOUT;
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (result.samples > 0 || Bench::Clock::now() >= deadline)
+                break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(RUN_TIME);
+    remote.SetDataReports(std::chrono::microseconds::zero(), nullptr);
+    result.mode = remote.GetMotionPlusMode();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return result;
+}
+
+// A MotionPlus plugged into simulated remotes, alone and with a Nunchuk in
+// it, at random points of the probe period. It has to be found, activated
+// in the chosen mode and send its first sample within 100 ms of plug-in,
+// and every sample after has to decode to what the remote sent: the
+// interleaved Nunchuk frames into the Nunchuk's state, never into the
+// MotionPlus's.
+BENCH(motion_plus_activation, "MotionPlus plug-in to first sample, alone and passing a Nunchuk through")
+{
+    struct Case
+    {
+        const char* name;
+        MotionPlusMode mode;
+        bool nunchuk;
+        uint8_t expected_mode;
+    };
+    const Case cases[] = {
+        { "alone", MotionPlusMode::Alone, false, MOTION_PLUS_MODE_ALONE },
+        { "Nunchuk passthrough", MotionPlusMode::NunchukPassthrough, true, MOTION_PLUS_MODE_NUNCHUK },
+    };
+
+    std::mt19937 random(27);
+    bool ok = true;
+    for (const Case& test : cases)
+    {
+        std::vector<double> first_sample_ms;
+        uint64_t samples = 0;
+        uint64_t wrong = 0;
+        uint64_t nunchuk_samples = 0;
+        bool activated = true;
+        bool found = true;
+        for (int plug = 0; plug < PLUGS; ++plug)
+        {
+            const PlugResult result = RunPlug(test.mode, test.nunchuk, random);
+            if (result.samples == 0)
+                found = false;
+            else
+                first_sample_ms.push_back(result.first_sample_ms);
+            activated = activated && result.mode == test.expected_mode;
+            samples += result.samples;
+            wrong += result.wrong;
+            nunchuk_samples += result.nunchuk_samples;
+        }
+        const double worst = first_sample_ms.empty() ? 0.0 : Bench::Percentile(first_sample_ms, 1.0);
+        std::printf("  %-20s plug-in to first sample %.1f ms mean, %.1f ms max over %zu plugs; "
+                    "%llu samples, %llu with the Nunchuk, %llu wrong\n",
+                    test.name, Bench::Mean(first_sample_ms), worst, first_sample_ms.size(),
+                    static_cast<unsigned long long>(samples), static_cast<unsigned long long>(nunchuk_samples),
+                    static_cast<unsigned long long>(wrong));
+
+        if (!found)
+            ok = Bench::Fail("a MotionPlus sent no sample");
+        if (!activated)
+            ok = Bench::Fail("a MotionPlus was not activated in the chosen mode");
+        if (worst > MAX_FIRST_SAMPLE_MS)
+            ok = Bench::Fail("a first sample came later than 100 ms after plug-in");
+        if (wrong != 0)
+            ok = Bench::Fail("samples did not decode to what the remote sent");
+        if (test.nunchuk && nunchuk_samples * 3 < samples)
+            ok = Bench::Fail("the passed-through Nunchuk was not decoded");
+    }
+    return ok;
+}
@@ -0,0 +1,239 @@
+#include "bench.h"
+#include "motion_predictor.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+constexpr int TRACE_REMOTES = 8;
+constexpr int TRACE_REPORTS = 2000;
+constexpr double REPORT_PERIOD_S = 0.01;
+constexpr int COST_ROUNDS = 20;
+
+namespace
+{
+    // One report of a recorded trace: when the remote took it, by the
+    // host's estimate, when it was decoded, and the pointer it carried
+    struct TraceReport
+    {
+        double sampled = 0.0;   // seconds
+        double arrived = 0.0;
+        float pointer[2] = {};
+    };
+
+    // Where the pointer really was, for any time in the trace
+    struct Aim
+    {
+        double start;
+        double end;
+        float from[2];
+        float to[2];
+    };
+
+    struct Trace
+    {
+        std::vector<TraceReport> reports;
+        std::vector<Aim> aims;
+        float tremor_phase;
+    };
+
+    struct ReplayResult
+    {
+        double rms_error = 0.0;             // predicted, against the truth
+        double rms_error_unpredicted = 0.0;  // the report as is
+        double reported_rms_error = 0.0;     // as the predictor measured itself
+        double reported_rms_error_unpredicted = 0.0;
+    };
+}
+
+// A hand aiming: minimum-jerk moves from target to target, a dwell on each,
+// and 9 Hz tremor
+static void TruePointer(const Trace& trace, double time, float pointer[2])
+{
+    auto aim = std::upper_bound(trace.aims.begin(), trace.aims.end(), time,
+                                [](double t, const Aim& candidate) { return t < candidate.start; });
+    if (aim != trace.aims.begin())
+        --aim;
+    const double t = std::clamp((time - aim->start) / (aim->end - aim->start), 0.0, 1.0);
+    const double s = t * t * t * (10.0 - 15.0 * t + 6.0 * t * t);
+    const double tremor = 0.003 * std::sin(2.0 * 3.14159265358979 * 9.0 * time + trace.tremor_phase);
+    for (int axis = 0; axis < 2; ++axis)
+        pointer[axis] = static_cast<float>(aim->from[axis] + s * (aim->to[axis] - aim->from[axis]) + tremor);
+}
+
+// A pointer session of one remote as it was recorded: reports every 10 ms
+// by the remote's clock, 0.1% fast or slow, sample times estimated to within
+// 0.3 ms, decoded 8 - 15 ms later and two at a time now and then, with a
+// pixel of camera noise on the pointer
+static Trace RecordTrace(int remote)
+{
+    std::mt19937 random(remote + 48);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::normal_distribution<float> pixel(0.0f, 2.0f / 1024.0f);
+
+    Trace trace;
+    trace.tremor_phase = unit(random) * 6.28f;
+    const double length = TRACE_REPORTS * REPORT_PERIOD_S + 0.1;
+    float from[2] = { 0.0f, 0.0f };
+    for (double time = 0.0; time < length;)
+    {
+        Aim aim;
+        aim.start = time;
+        aim.end = time + 0.15 + 0.35 * unit(random);
+        std::copy(from, from + 2, aim.from);
+        for (float& axis : aim.to)
+            axis = 1.6f * unit(random) - 0.8f;
+        trace.aims.push_back(aim);
+        std::copy(aim.to, aim.to + 2, from);
+        // Resting on the target
+        Aim dwell = { aim.end, aim.end + 0.1 + 0.6 * unit(random), {}, {} };
+        std::copy(from, from + 2, dwell.from);
+        std::copy(from, from + 2, dwell.to);
+        trace.aims.push_back(dwell);
+        time = dwell.end;
+    }
+
+    const double period = REPORT_PERIOD_S * (1.0 + 0.002 * (unit(random) - 0.5));
+    bool held = false;
+    for (int i = 0; i < TRACE_REPORTS; ++i)
+    {
+        TraceReport report;
+        const double taken = i * period;
+        report.sampled = taken + 0.0003 * (2.0 * unit(random) - 1.0);
+        report.arrived = taken + 0.008 + 0.007 * unit(random);
+        // Now and then the stack holds a report for the one after it
+        if (held)
+        {
+            report.arrived = std::max(report.arrived, trace.reports.back().arrived);
+            trace.reports.back().arrived = report.arrived;
+            held = false;
+        }
+        else
+        {
+            held = unit(random) < 0.1f;
+        }
+        TruePointer(trace, taken, report.pointer);
+        for (float& axis : report.pointer)
+            axis += pixel(random);
+        trace.reports.push_back(report);
+    }
+    return trace;
+}
+
+static MotionPredictor::Clock::time_point At(MotionPredictor::Clock::time_point base, double seconds)
+{
+    return base + std::chrono::duration_cast<MotionPredictor::Clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+// Feed every trace to a predictor as InputRemapper does, each report as it
+// is decoded, and compare what it returns with where the pointer really was
+// at the time the prediction stands for: the decode time plus the horizon
+static ReplayResult Replay(const std::vector<Trace>& traces, const MotionPredictor::Config& config)
+{
+    const MotionPredictor::Clock::time_point base = MotionPredictor::Clock::now();
+    const double horizon = config.horizon_ms / 1000.0;
+    double squared = 0.0;
+    double squared_unpredicted = 0.0;
+    double reported = 0.0;
+    double reported_unpredicted = 0.0;
+    uint64_t compared = 0;
+    uint64_t checked = 0;
+    for (const Trace& trace : traces)
+    {
+        MotionPredictor predictor(2, config);
+        for (const TraceReport& report : trace.reports)
+        {
+            float predicted[2];
+            std::copy(report.pointer, report.pointer + 2, predicted);
+            predictor.Update(At(base, report.sampled), report.pointer);
+            predictor.Predict(At(base, report.arrived), predicted);
+            float truth[2];
+            TruePointer(trace, report.arrived + horizon, truth);
+            for (int axis = 0; axis < 2; ++axis)
+            {
+                squared += (predicted[axis] - truth[axis]) * (predicted[axis] - truth[axis]);
+                squared_unpredicted += (report.pointer[axis] - truth[axis]) * (report.pointer[axis] - truth[axis]);
+            }
+            compared += 2;
+        }
+        const MotionPredictor::Stats stats = predictor.GetStats();
+        reported += stats.rms_error * stats.rms_error * stats.checked;
+        reported_unpredicted += stats.rms_error_unpredicted * stats.rms_error_unpredicted * stats.checked;
+        checked += stats.checked;
+    }
+
+    ReplayResult result;
+    result.rms_error = std::sqrt(squared / compared);
+    result.rms_error_unpredicted = std::sqrt(squared_unpredicted / compared);
+    result.reported_rms_error = checked > 0 ? std::sqrt(reported / checked) : 0.0;
+    result.reported_rms_error_unpredicted = checked > 0 ? std::sqrt(reported_unpredicted / checked) : 0.0;
+    return result;
+}
+
+// Cost of one report through the predictor, Update and Predict of the two
+// pointer channels, in ns
+static double TimeReports(const std::vector<Trace>& traces, const MotionPredictor::Config& config)
+{
+    const MotionPredictor::Clock::time_point base = MotionPredictor::Clock::now();
+    MotionPredictor predictor(2, config);
+    float sink = 0.0f;
+    uint64_t reports = 0;
+    const Bench::Clock::time_point start = Bench::Clock::now();
+    for (int round = 0; round < COST_ROUNDS; ++round)
+    {
+        const double offset = round * (TRACE_REPORTS + 100) * REPORT_PERIOD_S;
+        for (const TraceReport& report : traces[round % traces.size()].reports)
+        {
+            float predicted[2];
+            predictor.Update(At(base, offset + report.sampled), report.pointer);
+            predictor.Predict(At(base, offset + report.arrived), predicted);
+            sink += predicted[0];
+            reports++;
+        }
+    }
+    const double ns = std::chrono::duration<double, std::nano>(Bench::Clock::now() - start).count() / reports;
+    if (sink == 12345.0f)
+        std::printf("  %f\n", sink);
+    return ns;
+}
+
+// Recorded pointer sessions of eight remotes replayed through the predictor
+// at a few settings. The prediction has to be closer to where the pointer
+// really was than the report as is, by a wide margin at the default
+// settings, and the error the predictor measures of itself has to be near
+// what it achieves. A report through the predictor has to cost well under a
+// microsecond.
+BENCH(motion_predictor_traces, "Pointer prediction error against recorded traces and cost per report")
+{
+    std::vector<Trace> traces;
+    for (int remote = 0; remote < TRACE_REMOTES; ++remote)
+        traces.push_back(RecordTrace(remote));
+
+    bool ok = true;
+    const MotionPredictor::Config defaults;
+    for (float horizon_ms : { 0.0f, 12.0f })
+    {
+        for (float smoothing : { 0.3f, 0.5f, 0.7f })
+        {
+            MotionPredictor::Config config;
+            config.horizon_ms = horizon_ms;
+            config.smoothing = smoothing;
+            const ReplayResult result = Replay(traces, config);
+            std::printf("  horizon %2.0f ms, smoothing %.1f: rms error %.4f, report as is %.4f; "
+                        "as measured by the predictor %.4f and %.4f\n",
+                        horizon_ms, smoothing, result.rms_error, result.rms_error_unpredicted,
+                        result.reported_rms_error, result.reported_rms_error_unpredicted);
+            if (horizon_ms != defaults.horizon_ms || smoothing != defaults.smoothing)
+                continue;
+            if (result.rms_error > 0.5 * result.rms_error_unpredicted)
+                ok = Bench::Fail("the prediction is not much closer than the report as is");
+            if (std::fabs(result.reported_rms_error - result.rms_error) > 0.1 * result.rms_error)
+                ok = Bench::Fail("the error the predictor measures is not the error it achieves");
+        }
+    }
+
+    const double ns = TimeReports(traces, defaults);
+    std::printf("  %.1f ns per report, update and prediction of two channels\n", ns);
+    if (ns > 1000.0)
+        ok = Bench::Fail("a report through the predictor took a microsecond");
+    return ok;
+}
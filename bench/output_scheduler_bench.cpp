@@ -0,0 +1,343 @@
+#include "bench.h"
+#include "simulated_remote.h"
+#include "output_scheduler.h"
+#include "io_reactor.h"
+#include "rumble_player.h"
+#include "wiimote_protocol.h"
+#include <memory>
+#include <atomic>
+#include <cmath>
+
+using namespace WiimoteProtocol;
+
+constexpr int PACED_REPORTS = 40;
+constexpr int LED_CHANGES = 150;
+// Reports queued behind an LED change
+constexpr int BACKLOG_REPORTS = 30;
+constexpr int RUMBLE_COMMANDS = 20;
+constexpr auto DUTY_RUN_TIME = std::chrono::milliseconds(1000);
+
+// An OutputScheduler feeding a simulated remote, wired as WiimoteDevice
+// wires it: a reactor timer armed by the wake function, next to the 10 ms
+// device tick that also drains
+class SchedulerOnLink
+{
+public:
+    explicit SchedulerOnLink(const SimulatedRemote::Link& link)
+        : m_output([this](const uint8_t* report, size_t size) { return m_remote->Send(report, size); }),
+          m_remote(std::make_unique<SimulatedRemote>(link, [this](const uint8_t* report, size_t size) {
+              m_output.HandleAck(report, size);
+          }))
+    {
+        IoReactor& reactor = IoReactor::Instance();
+        m_drain_timer = reactor.AddTimer(IoReactor::Clock::duration::zero(),
+                                         [this](IoReactor::Clock::time_point) { m_output.Drain(); });
+        m_tick_timer = reactor.AddTimer(std::chrono::milliseconds(10),
+                                        [this](IoReactor::Clock::time_point) { m_output.Drain(); });
+        m_output.SetWakeFunction([this](OutputScheduler::Clock::time_point when) {
+            IoReactor::Instance().ArmTimer(m_drain_timer, when);
+        });
+    }
+
+    ~SchedulerOnLink()
+    {
+        IoReactor::Instance().RemoveTimer(m_tick_timer);
+        IoReactor::Instance().RemoveTimer(m_drain_timer);
+        m_remote.reset();
+    }
+
+    OutputScheduler& Output() { return m_output; }
+    SimulatedRemote& Remote() { return *m_remote; }
+
+    bool WaitIdle(std::chrono::milliseconds timeout)
+    {
+        const Bench::Clock::time_point deadline = Bench::Clock::now() + timeout;
+        while (!m_output.IsIdle() && Bench::Clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return m_output.IsIdle();
+    }
+
+private:
+    OutputScheduler m_output;
+    std::unique_ptr<SimulatedRemote> m_remote;
+    int m_drain_timer;
+    int m_tick_timer;
+};
+
+// Reports submitted back to back leave at the rate cap
+BENCH(output_pacing, "Queued output reports leave at the 5 ms rate cap, not at the 10 ms tick")
+{
+    SchedulerOnLink link{ SimulatedRemote::Link() };
+    OutputScheduler& output = link.Output();
+    SimulatedRemote& remote = link.Remote();
+
+    for (int i = 0; i < PACED_REPORTS; ++i)
+    {
+        const uint8_t report[] = { OUTPUT_IR_LOGIC, static_cast<uint8_t>((i & 1) ? OUTPUT_FLAG_ENABLE : 0) };
+        output.Submit(report, sizeof(report));
+    }
+    link.WaitIdle(std::chrono::seconds(2));
+
+    const std::vector<SimulatedRemote::OutputRecord> outputs = remote.GetOutputs();
+    if (outputs.size() != PACED_REPORTS)
+        return Bench::Fail("not every report was sent");
+
+    std::vector<double> intervals;
+    for (size_t i = 1; i < outputs.size(); ++i)
+        intervals.push_back(Bench::Milliseconds(outputs[i].sent - outputs[i - 1].sent));
+    const double mean = Bench::Mean(intervals);
+    const double low = Bench::Percentile(intervals, 0.0);
+    std::printf("  %d reports, interval mean %.2f ms, min %.2f ms, p99 %.2f ms\n",
+                PACED_REPORTS, mean, low, Bench::Percentile(intervals, 0.99));
+
+    if (low < 4.9)
+        return Bench::Fail("reports left faster than the rate cap");
+    if (mean > 8.0)
+        return Bench::Fail("reports waited for the tick instead of the rate cap");
+    return true;
+}
+
+// LED changes over a link that loses 10% of the reports each way, the
+// acknowledgements included. An LED report not acknowledged in time is
+// replaced by the current value, so the remote ends on the last value set,
+// and every change is settled exactly once.
+BENCH(output_lossy_link, "Acknowledged LED state converges over a lossy link")
+{
+    SimulatedRemote::Link lossy;
+    lossy.loss = 0.1;
+    lossy.seed = 32;
+    SchedulerOnLink link(lossy);
+    OutputScheduler& output = link.Output();
+
+    std::atomic<int> settled(0);
+    std::atomic<int> settled_delivered(0);
+    uint8_t mask = 0;
+    for (int i = 0; i < LED_CHANGES; ++i)
+    {
+        mask = static_cast<uint8_t>(i % 15 + 1);
+        output.SetLeds(mask, [&](bool delivered) {
+            settled++;
+            if (delivered)
+                settled_delivered++;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(15));
+    }
+    if (!link.WaitIdle(std::chrono::seconds(5)))
+        return Bench::Fail("the scheduler did not settle");
+
+    // What the remote shows: the last LED report that reached it
+    uint8_t shown = 0xFF;
+    size_t sent = 0;
+    size_t lost = 0;
+    for (const SimulatedRemote::OutputRecord& record : link.Remote().GetOutputs())
+    {
+        if (record.report[0] != WiimoteProtocol::OUTPUT_LEDS)
+            continue;
+        sent++;
+        if (record.lost)
+            lost++;
+        else
+            shown = record.report[1] >> 4;
+    }
+
+    const OutputScheduler::Stats stats = output.GetStats();
+    std::printf("  %d changes, %zu LED reports sent, %zu lost on the way out\n", LED_CHANGES, sent, lost);
+    std::printf("  delivered %llu, timed out %llu, retransmits %llu, lost %llu, unmatched acks %llu\n",
+                static_cast<unsigned long long>(stats.delivered), static_cast<unsigned long long>(stats.timeouts),
+                static_cast<unsigned long long>(stats.retransmits), static_cast<unsigned long long>(stats.lost),
+                static_cast<unsigned long long>(stats.unmatched_acks));
+    // Each acknowledged report needs both directions: 1 - 0.9^2
+    std::printf("  loss rate %.3f, the link's 0.190\n", stats.loss_rate);
+    std::printf("  delivery mean %.2f ms, max %.2f ms\n", stats.average_delivery_ms, stats.max_delivery_ms);
+    std::printf("  %d changes settled, %d of them delivered\n", settled.load(), settled_delivered.load());
+
+    if (shown != mask)
+        return Bench::Fail("the remote did not end on the last LED value");
+    if (lost == 0)
+        return Bench::Fail("the link lost nothing; the seed no longer exercises recovery");
+    if (stats.unmatched_acks != 0)
+        return Bench::Fail("an ack matched no report");
+    if (stats.delivered + stats.timeouts != sent)
+        return Bench::Fail("an LED report was neither acknowledged nor timed out");
+    if (settled != LED_CHANGES)
+        return Bench::Fail("an LED change was not settled exactly once");
+    return true;
+}
+
+// An LED change followed by a backlog of other reports. The change is
+// delivered as soon as its own report is acknowledged; the queue only runs
+// empty once the backlog has gone out at the rate cap.
+BENCH(led_delivery, "An LED change is settled by its own acknowledgement, not by the output queue running empty")
+{
+    SchedulerOnLink link{ SimulatedRemote::Link() };
+    OutputScheduler& output = link.Output();
+
+    std::atomic<bool> delivered(false);
+    std::atomic<int64_t> delivered_at(0);
+    const Bench::Clock::time_point start = Bench::Clock::now();
+    output.SetLeds(0x05, [&](bool success) {
+        delivered_at = (Bench::Clock::now() - start).count();
+        delivered = success;
+    });
+    for (int i = 0; i < BACKLOG_REPORTS; ++i)
+    {
+        const uint8_t report[] = { OUTPUT_IR_LOGIC, static_cast<uint8_t>((i & 1) ? OUTPUT_FLAG_ENABLE : 0) };
+        output.Submit(report, sizeof(report));
+    }
+    if (!link.WaitIdle(std::chrono::seconds(2)))
+        return Bench::Fail("the scheduler did not settle");
+    const double idle_ms = Bench::Milliseconds(Bench::Clock::now() - start);
+    const double delivered_ms = Bench::Milliseconds(Bench::Clock::duration(delivered_at.load()));
+
+    std::printf("  LED change delivered after %.2f ms, output queue idle after %.2f ms\n", delivered_ms, idle_ms);
+    if (!delivered)
+        return Bench::Fail("the LED change was not delivered");
+    // One round trip against the 30 reports of the backlog at 5 ms each
+    if (delivered_ms * 4.0 > idle_ms)
+        return Bench::Fail("the LED change waited for the backlog");
+    return true;
+}
+
+// Time from a rumble command to the remote's motor changing; false, with
+// `latency_ms` untouched, when it did not change within 200 ms
+static bool MeasureRumbleLatency(RumblePlayer& player, SimulatedRemote& remote, bool on, double& latency_ms)
+{
+    const size_t before = remote.GetRumbleChanges().size();
+    const Bench::Clock::time_point command = Bench::Clock::now();
+    if (on)
+        player.SetIntensity(1.0f);
+    else
+        player.Stop();
+    while (Bench::Clock::now() - command < std::chrono::milliseconds(200))
+    {
+        const std::vector<SimulatedRemote::RumbleChange> changes = remote.GetRumbleChanges();
+        if (changes.size() > before && changes.back().on == on)
+        {
+            latency_ms = Bench::Milliseconds(changes.back().time - command);
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    return false;
+}
+
+// Share of [from, to) the remote's motor was on
+static double MeasureDuty(const std::vector<SimulatedRemote::RumbleChange>& changes,
+                          Bench::Clock::time_point from, Bench::Clock::time_point to)
+{
+    bool on = false;
+    Bench::Clock::time_point since = from;
+    Bench::Clock::duration on_time = Bench::Clock::duration::zero();
+    for (const SimulatedRemote::RumbleChange& change : changes)
+    {
+        if (change.time <= from)
+        {
+            on = change.on;
+            continue;
+        }
+        if (change.time >= to)
+            break;
+        if (on)
+            on_time += change.time - since;
+        on = change.on;
+        since = change.time;
+    }
+    if (on)
+        on_time += to - since;
+    return Bench::Milliseconds(on_time) / Bench::Milliseconds(to - from);
+}
+
+// The rumble player driven by a 10 ms device tick, as WiimoteDevice drives
+// it, into a simulated remote: how long a command takes to reach the motor,
+// and how close the modulated on-time comes to a partial intensity, alone
+// and with a report every 10 ms to carry the changes
+BENCH(rumble_sink, "Rumble commands reach the motor within a report, and partial intensity keeps its duty cycle")
+{
+    SchedulerOnLink link{ SimulatedRemote::Link() };
+    OutputScheduler& output = link.Output();
+    SimulatedRemote& remote = link.Remote();
+    RumblePlayer player([&output](bool on, RumblePlayer::Clock::duration slack) { output.SetRumble(on, slack); });
+    const int tick = IoReactor::Instance().AddTimer(std::chrono::milliseconds(10),
+        [&player](IoReactor::Clock::time_point now) { player.Update(now); });
+
+    bool ok = true;
+    std::vector<double> on_ms;
+    std::vector<double> off_ms;
+    for (int i = 0; i < RUMBLE_COMMANDS && ok; ++i)
+    {
+        // A command the motor never followed fails the bench and leaves no sample
+        double latency_ms = 0.0;
+        if (!MeasureRumbleLatency(player, remote, true, latency_ms))
+        {
+            ok = Bench::Fail("the motor did not start");
+            break;
+        }
+        on_ms.push_back(latency_ms);
+        std::this_thread::sleep_for(std::chrono::milliseconds(7));
+        if (!MeasureRumbleLatency(player, remote, false, latency_ms))
+        {
+            ok = Bench::Fail("the motor did not stop");
+            break;
+        }
+        off_ms.push_back(latency_ms);
+        std::this_thread::sleep_for(std::chrono::milliseconds(7));
+    }
+    if (ok)
+    {
+        std::printf("  command to motor: on p50 %.2f ms p99 %.2f ms, off p50 %.2f ms p99 %.2f ms\n",
+                    Bench::Percentile(on_ms, 0.5), Bench::Percentile(on_ms, 0.99),
+                    Bench::Percentile(off_ms, 0.5), Bench::Percentile(off_ms, 0.99));
+        // The link alone is 3 ms plus 1.25 ms air time; a command may also
+        // wait out the 5 ms rate cap
+        if (Bench::Percentile(on_ms, 0.5) > 12.0 || Bench::Percentile(off_ms, 0.5) > 12.0)
+            ok = Bench::Fail("rumble commands waited for the tick");
+    }
+
+    for (bool traffic : { false, true })
+    {
+        for (float intensity : { 0.3f, 0.5f })
+        {
+            if (!ok)
+                break;
+            std::atomic<bool> running(true);
+            std::thread carrier([&]() {
+                const uint8_t report[] = { OUTPUT_IR_LOGIC, 0x00 };
+                for (Bench::Clock::time_point next = Bench::Clock::now(); running && traffic;
+                     next += std::chrono::milliseconds(10))
+                {
+                    std::this_thread::sleep_until(next);
+                    output.Submit(report, sizeof(report));
+                }
+            });
+
+            remote.ClearOutputs();
+            const RumblePlayer::Stats before = player.GetStats();
+            const OutputScheduler::Stats output_before = output.GetStats();
+            const Bench::Clock::time_point start = Bench::Clock::now();
+            player.SetIntensity(intensity);
+            std::this_thread::sleep_for(DUTY_RUN_TIME);
+            const Bench::Clock::time_point end = Bench::Clock::now();
+            running = false;
+            carrier.join();
+            const RumblePlayer::Stats stats = player.GetStats();
+            const OutputScheduler::Stats output_stats = output.GetStats();
+            player.Stop();
+            link.WaitIdle(std::chrono::milliseconds(500));
+
+            // Measured at the remote, shifted by the link latency
+            const auto shift = std::chrono::microseconds(4250);
+            const double duty = MeasureDuty(remote.GetRumbleChanges(), start + shift, end + shift);
+            std::printf("  %.0f%% %s: duty at the remote %.1f%%, player error %.1f ms, %llu toggles, "
+                        "%llu carried, %llu own reports\n",
+                        intensity * 100.0f, traffic ? "with traffic" : "alone", duty * 100.0, stats.error_ms,
+                        static_cast<unsigned long long>(stats.toggles - before.toggles),
+                        static_cast<unsigned long long>(output_stats.rumble_carried - output_before.rumble_carried),
+                        static_cast<unsigned long long>(output_stats.rumble_reports - output_before.rumble_reports));
+            if (std::abs(duty - intensity) > 0.05)
+                ok = Bench::Fail("the duty cycle at the remote strayed from the intensity");
+        }
+    }
+
+    IoReactor::Instance().RemoveTimer(tick);
+    return ok;
+}
@@ -0,0 +1,186 @@
+#include "bench.h"
+#include "simulated_remote.h"
+#include "wiimote_register_engine.h"
+#include "wiimote_protocol.h"
+#include <mutex>
+
+using namespace WiimoteProtocol;
+
+constexpr uint32_t READ_ADDRESS = 0x0FCA;
+constexpr uint16_t READ_SIZE = 1024;
+constexpr uint32_t WRITE_ADDRESS = 0x1200;
+constexpr int BURST_WRITES = 8;
+// The write, counted from zero, whose 0x16 or 0x22 the link loses
+constexpr int LOST_WRITE = 3;
+
+struct BulkRead
+{
+    double milliseconds = 0.0;
+    bool correct = false;
+};
+
+static BulkRead MeasureBulkRead(const SimulatedRemote::Link& link, const WiimoteRegisterEngine::Config& config,
+                                const std::vector<uint8_t>& expected)
+{
+    SimulatedRemote* remote_pointer = nullptr;
+    WiimoteRegisterEngine registers([&remote_pointer](const uint8_t* report, size_t size) {
+        return remote_pointer->Send(report, size);
+    }, config);
+    SimulatedRemote remote(link, [&registers](const uint8_t* report, size_t size) {
+        registers.HandleInputReport(report, size);
+    });
+    remote_pointer = &remote;
+    remote.SetMemory(ADDRESS_SPACE_EEPROM, READ_ADDRESS, expected.data(), expected.size());
+    remote.SetTickHandler(std::chrono::milliseconds(10), [&registers](Bench::Clock::time_point now) {
+        registers.Tick(now);
+    });
+
+    const Bench::Clock::time_point start = Bench::Clock::now();
+    const RegisterReadResult result = registers.ReadAsync(ADDRESS_SPACE_EEPROM, READ_ADDRESS, READ_SIZE).get();
+    BulkRead read;
+    read.milliseconds = Bench::Milliseconds(Bench::Clock::now() - start);
+    read.correct = result.status == RegisterStatus::Ok && result.data == expected;
+    return read;
+}
+
+// A 1 KiB EEPROM read over a link with 3 ms each way and 1.25 ms of air
+// time per report, pipelined as configured by default and with one 16-byte
+// request at a time, which pays a round trip per chunk
+BENCH(bulk_read, "Bulk register reads against a simulated remote, pipelined and one chunk at a time")
+{
+    std::vector<uint8_t> expected(READ_SIZE);
+    for (size_t i = 0; i < expected.size(); ++i)
+        expected[i] = static_cast<uint8_t>(i * 7 + 3);
+
+    const SimulatedRemote::Link link;
+    WiimoteRegisterEngine::Config serial;
+    serial.max_reads_in_flight = 1;
+    serial.read_segment_size = MEMORY_READ_CHUNK_BYTES;
+
+    const BulkRead pipelined = MeasureBulkRead(link, WiimoteRegisterEngine::Config(), expected);
+    const BulkRead one_at_a_time = MeasureBulkRead(link, serial, expected);
+    if (!pipelined.correct || !one_at_a_time.correct)
+        return Bench::Fail("a bulk read returned wrong data");
+
+    // Every chunk takes one report's air time on the way back
+    const double chunks = READ_SIZE / MEMORY_READ_CHUNK_BYTES;
+    const double capacity_ms = chunks * std::chrono::duration<double, std::milli>(link.report_time).count();
+    std::printf("  %u bytes, %.0f chunks; the link needs %.1f ms for them\n", READ_SIZE, chunks, capacity_ms);
+    std::printf("  pipelined:          %.1f ms, %.0f%% of link capacity\n",
+                pipelined.milliseconds, 100.0 * capacity_ms / pipelined.milliseconds);
+    std::printf("  one chunk at a time: %.1f ms, %.0f%% of link capacity\n",
+                one_at_a_time.milliseconds, 100.0 * capacity_ms / one_at_a_time.milliseconds);
+
+    // Far apart on any machine: a round trip is almost seven report times
+    if (pipelined.milliseconds * 3.0 > one_at_a_time.milliseconds)
+        return Bench::Fail("pipelining did not shorten the read");
+    return true;
+}
+
+namespace
+{
+    struct WriteCompletion
+    {
+        int write;
+        RegisterStatus status;
+        Bench::Clock::time_point time;
+    };
+}
+
+// A burst of 16-byte writes submitted back to back, with the link losing
+// either the 0x16 of one write in the middle or the 0x22 acknowledging it.
+// Returns false with the reason printed if a write completed wrongly.
+static bool RunWriteBurst(bool lose_ack)
+{
+    const char* what = lose_ack ? "acknowledgement" : "write";
+    int writes_sent = 0;
+    int acks_seen = 0;
+    SimulatedRemote* remote_pointer = nullptr;
+    WiimoteRegisterEngine registers([&](const uint8_t* report, size_t size) {
+        if (report[0] == OUTPUT_WRITE_MEMORY && writes_sent++ == LOST_WRITE && !lose_ack)
+            return true;
+        return remote_pointer->Send(report, size);
+    });
+    SimulatedRemote remote(SimulatedRemote::Link(), [&](const uint8_t* report, size_t size) {
+        if (report[0] == INPUT_ACK && acks_seen++ == LOST_WRITE && lose_ack)
+            return;
+        registers.HandleInputReport(report, size);
+    });
+    remote_pointer = &remote;
+    remote.SetTickHandler(std::chrono::milliseconds(10), [&registers](Bench::Clock::time_point now) {
+        registers.Tick(now);
+    });
+
+    std::vector<uint8_t> data(BURST_WRITES * MEMORY_WRITE_MAX_BYTES);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8_t>(i * 13 + 5);
+
+    std::mutex mutex;
+    std::vector<WriteCompletion> completions;
+    const Bench::Clock::time_point start = Bench::Clock::now();
+    for (int write = 0; write < BURST_WRITES; ++write)
+    {
+        registers.Write(ADDRESS_SPACE_EEPROM, WRITE_ADDRESS + write * MEMORY_WRITE_MAX_BYTES,
+                        data.data() + write * MEMORY_WRITE_MAX_BYTES, MEMORY_WRITE_MAX_BYTES,
+                        [&, write](RegisterStatus status) {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            completions.push_back({ write, status, Bench::Clock::now() });
+                        });
+    }
+    const RegisterReadResult read_back =
+        registers.ReadAsync(ADDRESS_SPACE_EEPROM, WRITE_ADDRESS, static_cast<uint16_t>(data.size())).get();
+    const double milliseconds = Bench::Milliseconds(Bench::Clock::now() - start);
+
+    // When each write's last copy reached the remote
+    Bench::Clock::time_point arrived[BURST_WRITES] = {};
+    int sent = 0;
+    for (const SimulatedRemote::OutputRecord& output : remote.GetOutputs())
+    {
+        if (output.report[0] != OUTPUT_WRITE_MEMORY || output.lost)
+            continue;
+        sent++;
+        const uint32_t address = (output.report[2] << 16) | (output.report[3] << 8) | output.report[4];
+        const int write = static_cast<int>((address - WRITE_ADDRESS) / MEMORY_WRITE_MAX_BYTES);
+        if (write >= 0 && write < BURST_WRITES)
+            arrived[write] = output.arrived;
+    }
+    const WiimoteRegisterEngine::Stats stats = registers.GetStats();
+    std::printf("  lost %s of write %d: %zu of %d writes completed, %d reached the remote, %llu retries, "
+                "%.1f ms to the read-back\n",
+                what, LOST_WRITE, completions.size(), BURST_WRITES, sent,
+                static_cast<unsigned long long>(stats.retries), milliseconds);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    bool ok = true;
+    if (completions.size() != BURST_WRITES)
+        ok = Bench::Fail("a write did not complete");
+    for (size_t i = 0; i < completions.size(); ++i)
+    {
+        const WriteCompletion& completion = completions[i];
+        if (completion.write != static_cast<int>(i))
+            ok = Bench::Fail("writes completed out of order");
+        else if (completion.status != RegisterStatus::Ok)
+            ok = Bench::Fail("a write failed");
+        else if (arrived[completion.write] == Bench::Clock::time_point() ||
+                 completion.time < arrived[completion.write])
+            ok = Bench::Fail("a write completed before it reached the remote");
+    }
+    // Only the write whose report or acknowledgement was lost goes again
+    if (stats.retries != 1 || sent != BURST_WRITES + (lose_ack ? 1 : 0))
+        ok = Bench::Fail("more than the lost write was resent");
+    if (read_back.status != RegisterStatus::Ok || read_back.data != data)
+        ok = Bench::Fail("the remote's memory does not hold what was written");
+    return ok;
+}
+
+// Eight 16-byte writes in a burst while the link loses one write in the
+// middle, and again while it loses the acknowledgement of one. A 0x22 names
+// only the report it acknowledges, so each write has to complete only after
+// it reached the remote, in order and Ok, with the lost one resent alone and
+// the remote's memory reading back as written.
+BENCH(register_write_loss, "Register write burst with a lost write or acknowledgement in the middle")
+{
+    const bool lost_write = RunWriteBurst(false);
+    const bool lost_ack = RunWriteBurst(true);
+    return lost_write && lost_ack;
+}
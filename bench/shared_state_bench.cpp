@@ -0,0 +1,153 @@
+#include "bench.h"
+#include "shared_state_page.h"
+#include "mapped_file.h"
+#include <atomic>
+#include <thread>
+
+constexpr int BENCH_SLOT = SharedStatePage::MAX_SLOTS - 1;
+constexpr int READS = 1000000;
+constexpr int LATENCY_REPORTS = 1000;
+constexpr auto PUBLISH_PERIOD = std::chrono::milliseconds(1);
+
+// A report numbered `n`: buttons, accelerometer and extension bytes all
+// carry n, so a snapshot mixing two reports shows
+static void MakeInput(uint32_t n, WiimoteInputState& input)
+{
+    input = WiimoteInputState();
+    input.sampled = Bench::Clock::now();
+    input.received = input.sampled;
+    input.buttons = static_cast<uint16_t>(n);
+    for (int axis = 0; axis < 3; ++axis)
+        input.accel[axis] = static_cast<uint16_t>(n & 0x3FF);
+    input.extension_size = sizeof(input.extension);
+    for (uint8_t& byte : input.extension)
+        byte = static_cast<uint8_t>(n);
+}
+
+static bool IsTorn(const SharedRemoteState& state)
+{
+    if (state.report_count == 0)
+        return false;
+    const uint16_t n = state.buttons;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (state.accel_raw[axis] != (n & 0x3FF))
+            return true;
+    }
+    for (uint8_t byte : state.extension)
+    {
+        if (byte != static_cast<uint8_t>(n))
+            return true;
+    }
+    return false;
+}
+
+// Time `READS` snapshots of one slot; counts the torn ones
+static double TimeReads(const SharedStatePage::Slot& slot, uint64_t& torn)
+{
+    SharedRemoteState state;
+    const Bench::Clock::time_point start = Bench::Clock::now();
+    for (int i = 0; i < READS; ++i)
+    {
+        SharedStatePage::Read(slot, state);
+        if (IsTorn(state))
+            torn++;
+    }
+    return std::chrono::duration<double, std::nano>(Bench::Clock::now() - start).count() / READS;
+}
+
+// The reader maps the region by name, read-only, as another program would,
+// and reads with the header's inline functions only: no system calls and
+// no locks. Measured are the cost of a snapshot with the writer idle and
+// with it publishing as fast as it can, and the time from a report being
+// published to a polling reader seeing it. Snapshots are checked for
+// mixing two reports. On a machine with one core the reader only runs when
+// the writer is switched out, so the visibility latency there is the
+// scheduler's, not the page's.
+BENCH(shared_state_page, "Shared state page reader cost and writer-to-reader visibility latency")
+{
+    SharedStatePage& page = SharedStatePage::Instance();
+    WiimoteInputState input;
+    const ExtensionState extension;
+    uint32_t next = 1;
+    MakeInput(next++, input);
+    page.Publish(BENCH_SLOT, 0x00BEEF000041ull, input, extension);
+    if (!page.GetStats().open)
+        return Bench::Fail("the shared region could not be created");
+
+    MappedFile reader;
+    if (!reader.OpenShared(SharedStatePage::GetName(), sizeof(SharedStatePage::Layout), false))
+        return Bench::Fail("the shared region could not be opened for reading");
+    const auto* layout = static_cast<const SharedStatePage::Layout*>(reader.GetData());
+    if (layout->header.magic != SharedStatePage::MAGIC)
+        return Bench::Fail("the region has no valid header");
+    const SharedStatePage::Slot& slot = layout->slots[BENCH_SLOT];
+
+    uint64_t torn = 0;
+    const double idle_ns = TimeReads(slot, torn);
+
+    std::atomic<bool> running(true);
+    std::atomic<uint64_t> published(0);
+    std::thread writer([&]() {
+        WiimoteInputState busy_input;
+        for (uint32_t n = next; running; ++n)
+        {
+            MakeInput(n, busy_input);
+            page.Publish(BENCH_SLOT, 0x00BEEF000041ull, busy_input, extension);
+            published++;
+        }
+    });
+    const double busy_ns = TimeReads(slot, torn);
+    running = false;
+    writer.join();
+
+    // Publish every millisecond, timestamped, while the reader polls
+    std::vector<double> latency_us;
+    latency_us.reserve(LATENCY_REPORTS);
+    const uint32_t first_count = slot.state.report_count;
+    std::thread paced([&]() {
+        WiimoteInputState paced_input;
+        Bench::Clock::time_point deadline = Bench::Clock::now();
+        for (int i = 0; i < LATENCY_REPORTS; ++i)
+        {
+            deadline += PUBLISH_PERIOD;
+            std::this_thread::sleep_until(deadline);
+            MakeInput(static_cast<uint32_t>(i), paced_input);
+            page.Publish(BENCH_SLOT, 0x00BEEF000041ull, paced_input, extension);
+        }
+    });
+    uint32_t seen = first_count;
+    const Bench::Clock::time_point give_up = Bench::Clock::now() + PUBLISH_PERIOD * LATENCY_REPORTS * 2;
+    while (latency_us.size() < LATENCY_REPORTS && Bench::Clock::now() < give_up)
+    {
+        const uint32_t sequence = SharedStatePage::BeginRead(slot);
+        const uint32_t count = slot.state.report_count;
+        const uint64_t timestamp_us = slot.state.timestamp_us;
+        if (!SharedStatePage::EndRead(slot, sequence) || count == seen)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        const double now_us = std::chrono::duration<double, std::micro>(Bench::Clock::now().time_since_epoch()).count();
+        latency_us.push_back(now_us - static_cast<double>(timestamp_us));
+        seen = count;
+    }
+    paced.join();
+    reader.Close();
+    page.Clear(BENCH_SLOT);
+
+    std::printf("  snapshot of %zu bytes: %.1f ns with the writer idle, %.1f ns while it publishes "
+                "(%llu reports meanwhile), %llu torn\n",
+                sizeof(SharedRemoteState), idle_ns, busy_ns, static_cast<unsigned long long>(published.load()),
+                static_cast<unsigned long long>(torn));
+    std::printf("  handed to Publish to seen by the reader: %zu/%d reports, p50 %.1f us, p99 %.1f us, max %.1f us (%u cores)\n",
+                latency_us.size(), LATENCY_REPORTS, Bench::Percentile(latency_us, 0.5),
+                Bench::Percentile(latency_us, 0.99), Bench::Percentile(latency_us, 1.0),
+                std::thread::hardware_concurrency());
+
+    if (torn != 0)
+        return Bench::Fail("a snapshot mixed two reports");
+    if (latency_us.size() < LATENCY_REPORTS * 9 / 10)
+        return Bench::Fail("the reader missed reports published a millisecond apart");
+    return true;
+}
@@ -0,0 +1,374 @@
+#include "simulated_remote.h"
+#include "wiimote_protocol.h"
+#include <algorithm>
+
+using namespace WiimoteProtocol;
+
+static uint64_t MemoryKey(uint8_t address_space, uint32_t address)
+{
+    return (static_cast<uint64_t>(address_space & ADDRESS_SPACE_REGISTER) << 32) | address;
+}
+
+SimulatedRemote::SimulatedRemote(const Link& link, InputHandler on_input)
+    : m_link(link), m_on_input(std::move(on_input)), m_random(link.seed), m_tick_period(0),
+      m_data_period(0), m_rumble(false), m_report_mode(INPUT_CORE), m_reporting(true), m_extension(false), m_motion_plus(false),
+      m_motion_plus_nunchuk(false), m_motion_plus_initialised(false), m_motion_plus_mode(0), m_running(true)
+{
+    m_uplink_free = m_downlink_free = Clock::now();
+    m_thread = std::thread([this]() { ThreadProc(); });
+}
+
+SimulatedRemote::~SimulatedRemote()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+    }
+    m_wake.notify_all();
+    m_thread.join();
+}
+
+bool SimulatedRemote::Send(const uint8_t* report, size_t size)
+{
+    const Clock::time_point now = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        OutputRecord record;
+        record.sent = now;
+        record.report.assign(report, report + size);
+
+        const Clock::time_point start = std::max(now, m_uplink_free);
+        m_uplink_free = start + m_link.report_time;
+        record.lost = LoseLocked();
+        if (!record.lost)
+        {
+            Delivery delivery;
+            delivery.to_remote = true;
+            delivery.output_index = m_outputs.size();
+            delivery.report = record.report;
+            m_deliveries.emplace(m_uplink_free + m_link.latency, std::move(delivery));
+        }
+        m_outputs.push_back(std::move(record));
+    }
+    m_wake.notify_all();
+    return true;
+}
+
+void SimulatedRemote::SetTickHandler(std::chrono::microseconds period, TickHandler on_tick)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tick_period = period;
+        m_on_tick = std::move(on_tick);
+        m_next_tick = Clock::now() + period;
+    }
+    m_wake.notify_all();
+}
+
+void SimulatedRemote::SetDataReports(std::chrono::microseconds period, DataReportGenerator generator)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_data_period = period;
+        m_generator = std::move(generator);
+        m_next_data = Clock::now();
+    }
+    m_wake.notify_all();
+}
+
+void SimulatedRemote::SetMemory(uint8_t address_space, uint32_t address, const uint8_t* data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < size; ++i)
+        m_memory[MemoryKey(address_space, address + static_cast<uint32_t>(i))] = data[i];
+}
+
+void SimulatedRemote::SetAccelCalibration(uint16_t zero, uint16_t one_g)
+{
+    // Three axes of 10 bits: the high bytes, then the low two bits packed
+    uint8_t block[10] = {};
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        block[axis] = static_cast<uint8_t>(zero >> 2);
+        block[4 + axis] = static_cast<uint8_t>(one_g >> 2);
+    }
+    block[3] = static_cast<uint8_t>(((zero & 3) << 4) | ((zero & 3) << 2) | (zero & 3));
+    block[7] = static_cast<uint8_t>(((one_g & 3) << 4) | ((one_g & 3) << 2) | (one_g & 3));
+    uint8_t sum = 0x55;
+    for (int i = 0; i < 9; ++i)
+        sum = static_cast<uint8_t>(sum + block[i]);
+    block[9] = sum;
+    SetMemory(ADDRESS_SPACE_EEPROM, 0x16, block, sizeof(block));
+}
+
+void SimulatedRemote::PlugMotionPlus(bool nunchuk)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_motion_plus = true;
+        m_motion_plus_nunchuk = nunchuk;
+        m_motion_plus_initialised = false;
+        m_motion_plus_mode = 0;
+        SetIdLocked(MOTION_PLUS_ID, 0x0000A6200005ULL);
+        if (nunchuk)
+        {
+            SetIdLocked(EXTENSION_ID, 0x0000A4200000ULL);
+            m_extension = true;
+            QueueStatusLocked(Clock::now());
+        }
+    }
+    m_wake.notify_all();
+}
+
+uint8_t SimulatedRemote::GetMotionPlusMode() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_motion_plus_mode;
+}
+
+std::vector<SimulatedRemote::OutputRecord> SimulatedRemote::GetOutputs() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_outputs;
+}
+
+std::vector<SimulatedRemote::RumbleChange> SimulatedRemote::GetRumbleChanges() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_rumble_changes;
+}
+
+bool SimulatedRemote::IsRumbling() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_rumble;
+}
+
+uint8_t SimulatedRemote::GetReportMode() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_report_mode;
+}
+
+void SimulatedRemote::ClearOutputs()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_outputs.clear();
+    m_rumble_changes.clear();
+    // Reports still on the link no longer have a record
+    for (auto& entry : m_deliveries)
+        entry.second.output_index = SIZE_MAX;
+}
+
+bool SimulatedRemote::LoseLocked()
+{
+    if (m_link.loss <= 0.0)
+        return false;
+    return std::uniform_real_distribution<double>(0.0, 1.0)(m_random) < m_link.loss;
+}
+
+void SimulatedRemote::QueueInputLocked(std::vector<uint8_t> report, Clock::time_point now)
+{
+    const Clock::time_point start = std::max(now, m_downlink_free);
+    m_downlink_free = start + m_link.report_time;
+    if (LoseLocked())
+        return;
+
+    Delivery delivery;
+    delivery.report = std::move(report);
+    m_deliveries.emplace(m_downlink_free + m_link.latency, std::move(delivery));
+}
+
+void SimulatedRemote::QueueStatusLocked(Clock::time_point now)
+{
+    QueueInputLocked({ INPUT_STATUS, 0, 0, static_cast<uint8_t>(m_extension ? STATUS_EXTENSION : 0), 0, 0, 0xC0 },
+                     now);
+    m_reporting = false;
+}
+
+void SimulatedRemote::SetIdLocked(uint32_t address, uint64_t id)
+{
+    for (size_t i = 0; i < EXTENSION_ID_SIZE; ++i)
+    {
+        m_memory[MemoryKey(ADDRESS_SPACE_REGISTER, address + static_cast<uint32_t>(i))] =
+            static_cast<uint8_t>(id >> (8 * (EXTENSION_ID_SIZE - 1 - i)));
+    }
+}
+
+void SimulatedRemote::HandleExtensionWriteLocked(uint32_t address, uint8_t value, Clock::time_point now)
+{
+    if (!m_motion_plus)
+        return;
+
+    if (address == MOTION_PLUS_INIT && value == MOTION_PLUS_INIT_VALUE)
+    {
+        m_motion_plus_initialised = true;
+    }
+    else if (address == MOTION_PLUS_MODE && m_motion_plus_initialised && m_motion_plus_mode == 0)
+    {
+        m_motion_plus_mode = value;
+        SetIdLocked(MOTION_PLUS_ID, 0);
+        SetIdLocked(EXTENSION_ID, 0x0000A4200005ULL | (static_cast<uint64_t>(value) << 8));
+        m_extension = true;
+        QueueStatusLocked(now);
+    }
+    else if (address == EXTENSION_INIT1 && value == EXTENSION_INIT1_VALUE && m_motion_plus_mode != 0)
+    {
+        m_motion_plus_mode = 0;
+        m_motion_plus_initialised = false;
+        SetIdLocked(MOTION_PLUS_ID, 0x0000A6200005ULL);
+        SetIdLocked(EXTENSION_ID, m_motion_plus_nunchuk ? 0x0000A4200000ULL : 0);
+        m_extension = m_motion_plus_nunchuk;
+        QueueStatusLocked(now);
+    }
+}
+
+void SimulatedRemote::HandleOutputLocked(const std::vector<uint8_t>& report, Clock::time_point now)
+{
+    if (report.size() < 2)
+        return;
+
+    const bool rumble = (report[1] & OUTPUT_FLAG_RUMBLE) != 0;
+    if (rumble != m_rumble)
+    {
+        m_rumble = rumble;
+        m_rumble_changes.push_back({ now, rumble });
+    }
+
+    const uint8_t id = report[0];
+    bool acknowledge = (report[1] & OUTPUT_FLAG_ACKNOWLEDGE) != 0;
+    switch (id)
+    {
+    case OUTPUT_REPORT_MODE:
+        if (report.size() >= 3)
+        {
+            m_report_mode = report[2];
+            m_reporting = true;
+        }
+        break;
+
+    case OUTPUT_STATUS_REQUEST:
+        QueueStatusLocked(now);
+        break;
+
+    case OUTPUT_WRITE_MEMORY:
+        if (report.size() >= 6)
+        {
+            const uint32_t address = (report[2] << 16) | (report[3] << 8) | report[4];
+            const size_t size = std::min<size_t>({ report[5], MEMORY_WRITE_MAX_BYTES, report.size() - 6 });
+            for (size_t i = 0; i < size; ++i)
+                m_memory[MemoryKey(report[1], address + static_cast<uint32_t>(i))] = report[6 + i];
+            if (report[1] & ADDRESS_SPACE_REGISTER)
+            {
+                for (size_t i = 0; i < size; ++i)
+                    HandleExtensionWriteLocked(address + static_cast<uint32_t>(i), report[6 + i], now);
+            }
+        }
+        acknowledge = true;
+        break;
+
+    case OUTPUT_READ_MEMORY:
+        if (report.size() >= 7)
+        {
+            // 21 BB BB SE AA AA DD*16, one chunk per 16 bytes
+            const uint32_t address = (report[2] << 16) | (report[3] << 8) | report[4];
+            const uint32_t size = (report[5] << 8) | report[6];
+            for (uint32_t offset = 0; offset < size; offset += MEMORY_READ_CHUNK_BYTES)
+            {
+                const uint32_t chunk_address = address + offset;
+                const uint32_t chunk_size = std::min<uint32_t>(MEMORY_READ_CHUNK_BYTES, size - offset);
+                std::vector<uint8_t> reply(GetInputReportSize(INPUT_READ_DATA), 0);
+                reply[0] = INPUT_READ_DATA;
+                reply[3] = static_cast<uint8_t>((chunk_size - 1) << 4);
+                reply[4] = static_cast<uint8_t>((chunk_address >> 8) & 0xFF);
+                reply[5] = static_cast<uint8_t>(chunk_address & 0xFF);
+                for (uint32_t i = 0; i < chunk_size; ++i)
+                {
+                    auto value = m_memory.find(MemoryKey(report[1], chunk_address + i));
+                    reply[6 + i] = value != m_memory.end() ? value->second : 0;
+                }
+                QueueInputLocked(std::move(reply), now);
+            }
+        }
+        acknowledge = false;
+        break;
+
+    default:
+        break;
+    }
+
+    if (acknowledge)
+        QueueInputLocked({ INPUT_ACK, 0, 0, id, 0 }, now);
+}
+
+void SimulatedRemote::ThreadProc()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_running)
+    {
+        Clock::time_point wake = Clock::time_point::max();
+        if (!m_deliveries.empty())
+            wake = m_deliveries.begin()->first;
+        if (m_on_tick)
+            wake = std::min(wake, m_next_tick);
+        if (m_generator)
+            wake = std::min(wake, m_next_data);
+
+        if (wake == Clock::time_point::max())
+        {
+            m_wake.wait(lock);
+            continue;
+        }
+        if (Clock::now() < wake)
+        {
+            m_wake.wait_until(lock, wake);
+            continue;
+        }
+
+        const Clock::time_point now = Clock::now();
+        if (!m_deliveries.empty() && m_deliveries.begin()->first <= now)
+        {
+            Delivery delivery = std::move(m_deliveries.begin()->second);
+            m_deliveries.erase(m_deliveries.begin());
+            if (delivery.to_remote)
+            {
+                if (delivery.output_index < m_outputs.size())
+                    m_outputs[delivery.output_index].arrived = now;
+                HandleOutputLocked(delivery.report, now);
+                continue;
+            }
+
+            InputHandler on_input = m_on_input;
+            lock.unlock();
+            on_input(delivery.report.data(), delivery.report.size());
+            lock.lock();
+            continue;
+        }
+
+        if (m_generator && m_next_data <= now)
+        {
+            DataReportGenerator generator = m_generator;
+            m_next_data += m_data_period;
+            if (now - m_next_data > m_data_period)
+                m_next_data = now + m_data_period;
+            lock.unlock();
+            std::vector<uint8_t> report;
+            generator(now, report);
+            lock.lock();
+            if (!report.empty() && m_reporting)
+                QueueInputLocked(std::move(report), now);
+            continue;
+        }
+
+        if (m_on_tick && m_next_tick <= now)
+        {
+            TickHandler on_tick = m_on_tick;
+            m_next_tick += m_tick_period;
+            if (now - m_next_tick > m_tick_period)
+                m_next_tick = now + m_tick_period;
+            lock.unlock();
+            on_tick(now);
+            lock.lock();
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <condition_variable>
+
+// A Wii Remote at the far end of a simulated Bluetooth link, for benchmarks
+// that run without hardware. Output reports cross the link after its latency
+// and air time and are answered as the remote would: 0x17 reads stream 0x21
+// chunks from the simulated memory, 0x16 writes and reports with the
+// acknowledge flag are answered with 0x22, 0x15 with a 0x20 status report.
+// As on a real remote, data reports stop after a status report until the
+// host sets the reporting mode again.
+// Every output report is recorded with the time it reached the remote, so
+// the remote is also a HID sink for measuring pacing and delivery.
+//
+// Input reports, the tick handler and the data report generator all run on
+// the remote's own thread, in time order, as a device's reactor would run
+// them.
+class SimulatedRemote
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using InputHandler = std::function<void(const uint8_t* report, size_t size)>;
+    using TickHandler = std::function<void(Clock::time_point now)>;
+    // Fill `report` with the data report sampled at `sampled`
+    using DataReportGenerator = std::function<void(Clock::time_point sampled, std::vector<uint8_t>& report)>;
+
+    struct Link
+    {
+        std::chrono::microseconds latency{ 3000 };      // one way
+        std::chrono::microseconds report_time{ 1250 };  // air time of one report, each direction
+        double loss = 0.0;                              // chance a report is lost, each direction
+        uint32_t seed = 1;
+    };
+
+    struct OutputRecord
+    {
+        Clock::time_point sent;
+        Clock::time_point arrived;   // at the remote; unset when lost
+        bool lost = false;
+        std::vector<uint8_t> report;
+    };
+
+    struct RumbleChange
+    {
+        Clock::time_point time;
+        bool on = false;
+    };
+
+    SimulatedRemote(const Link& link, InputHandler on_input);
+    ~SimulatedRemote();
+
+    SimulatedRemote(const SimulatedRemote&) = delete;
+    SimulatedRemote& operator=(const SimulatedRemote&) = delete;
+
+    // Host side: send an output report. Always succeeds, as writes to a
+    // Bluetooth HID device do; loss happens on the link.
+    bool Send(const uint8_t* report, size_t size);
+
+    // Run `on_tick` every `period` on the remote's thread
+    void SetTickHandler(std::chrono::microseconds period, TickHandler on_tick);
+    // Send a data report every `period`, sampled when it is sent
+    void SetDataReports(std::chrono::microseconds period, DataReportGenerator generator);
+
+    void SetMemory(uint8_t address_space, uint32_t address, const uint8_t* data, size_t size);
+    // Store a valid accelerometer calibration block at EEPROM 0x16
+    void SetAccelCalibration(uint16_t zero, uint16_t one_g);
+
+    // Plug in an inactive MotionPlus, with a Nunchuk in it if `nunchuk`. The
+    // MotionPlus answers at 0xA600FA and raises no status report; only the
+    // Nunchuk shows up as an extension. Writing 0x55 to 0xA600F0 and a mode
+    // to 0xA600FE moves it to 0xA400FA and the remote reports the extension,
+    // until 0x55 written to 0xA400F0 deactivates it again.
+    void PlugMotionPlus(bool nunchuk);
+    // The mode the MotionPlus was activated in, 0 while it is inactive
+    uint8_t GetMotionPlusMode() const;
+
+    std::vector<OutputRecord> GetOutputs() const;
+    std::vector<RumbleChange> GetRumbleChanges() const;
+    bool IsRumbling() const;
+    uint8_t GetReportMode() const;
+    void ClearOutputs();
+
+private:
+    struct Delivery
+    {
+        bool to_remote = false;
+        size_t output_index = 0;       // into m_outputs, for reports to the remote
+        std::vector<uint8_t> report;
+    };
+
+    Link m_link;
+    InputHandler m_on_input;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::multimap<Clock::time_point, Delivery> m_deliveries;
+    Clock::time_point m_uplink_free;
+    Clock::time_point m_downlink_free;
+    std::mt19937 m_random;
+
+    std::chrono::microseconds m_tick_period;
+    TickHandler m_on_tick;
+    Clock::time_point m_next_tick;
+    std::chrono::microseconds m_data_period;
+    DataReportGenerator m_generator;
+    Clock::time_point m_next_data;
+
+    std::map<uint64_t, uint8_t> m_memory;
+    std::vector<OutputRecord> m_outputs;
+    std::vector<RumbleChange> m_rumble_changes;
+    bool m_rumble;
+    uint8_t m_report_mode;
+    // Cleared by a status report, set again by 0x12
+    bool m_reporting;
+    bool m_extension;
+    bool m_motion_plus;
+    bool m_motion_plus_nunchuk;
+    bool m_motion_plus_initialised;
+    uint8_t m_motion_plus_mode;
+
+    bool m_running;
+    std::thread m_thread;
+
+    void ThreadProc();
+    // The remote's side of an output report that arrived; replies are queued
+    void HandleOutputLocked(const std::vector<uint8_t>& report, Clock::time_point now);
+    void QueueInputLocked(std::vector<uint8_t> report, Clock::time_point now);
+    void QueueStatusLocked(Clock::time_point now);
+    // What the extension port makes of a byte written to its registers
+    void HandleExtensionWriteLocked(uint32_t address, uint8_t value, Clock::time_point now);
+    void SetIdLocked(uint32_t address, uint64_t id);
+    bool LoseLocked();
+};
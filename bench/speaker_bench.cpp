@@ -0,0 +1,226 @@
+#include "bench.h"
+#include "simulated_remote.h"
+#include "adpcm_encoder.h"
+#include "output_scheduler.h"
+#include "wiimote_register_engine.h"
+#include "wiimote_speaker.h"
+#include "speaker_streamer.h"
+#include "io_reactor.h"
+#include "wiimote_protocol.h"
+#include <atomic>
+#include <memory>
+#include <cmath>
+
+using namespace WiimoteProtocol;
+
+constexpr size_t ENCODE_SAMPLES = 40;
+constexpr int ENCODE_ROUNDS = 20000;
+constexpr int STREAM_REMOTES = 4;
+constexpr auto STREAM_TIME = std::chrono::milliseconds(1000);
+// Other output while the speakers play: an LED or IR report every 5 ms
+constexpr auto TRAFFIC_PERIOD = std::chrono::milliseconds(5);
+
+// Samples per second through the multi-lane encoder, against encoding the
+// same lanes one stream at a time
+BENCH(adpcm_encoder, "ADPCM encoder throughput, lanes side by side against one stream at a time")
+{
+    std::vector<int16_t> input(ENCODE_SAMPLES * AdpcmEncoder::MAX_LANES);
+    for (size_t i = 0; i < input.size(); ++i)
+        input[i] = static_cast<int16_t>(8000.0 * std::sin(i * 0.05) + 3000.0 * std::sin(i * 0.37));
+
+    uint8_t data[AdpcmEncoder::MAX_LANES][ENCODE_SAMPLES / 2];
+    uint8_t* outputs[AdpcmEncoder::MAX_LANES];
+    for (size_t lane = 0; lane < AdpcmEncoder::MAX_LANES; ++lane)
+        outputs[lane] = data[lane];
+
+    bool ok = true;
+    uint32_t checksum = 0;
+    for (size_t lanes : { size_t(1), size_t(4), size_t(16) })
+    {
+        AdpcmEncoder encoder;
+        Bench::Clock::time_point start = Bench::Clock::now();
+        for (int round = 0; round < ENCODE_ROUNDS; ++round)
+            encoder.Encode(input.data(), lanes, ENCODE_SAMPLES, outputs);
+        const double lanes_us = Bench::Microseconds(Bench::Clock::now() - start);
+        checksum += data[lanes - 1][0];
+
+        // One encoder per stream, each encoding its own contiguous block
+        std::vector<AdpcmEncoder> single(lanes);
+        start = Bench::Clock::now();
+        for (int round = 0; round < ENCODE_ROUNDS; ++round)
+        {
+            for (size_t lane = 0; lane < lanes; ++lane)
+                single[lane].Encode(input.data() + lane * ENCODE_SAMPLES, ENCODE_SAMPLES, data[lane]);
+        }
+        const double single_us = Bench::Microseconds(Bench::Clock::now() - start);
+        checksum += data[lanes - 1][0];
+
+        const double samples = static_cast<double>(ENCODE_ROUNDS) * ENCODE_SAMPLES * lanes;
+        std::printf("  %2zu lanes: %.1f M samples/s side by side, %.1f M samples/s one at a time, "
+                    "%.2f us per 13.3 ms period\n",
+                    lanes, samples / lanes_us, samples / single_us, lanes_us / ENCODE_ROUNDS);
+        // Far below a period either way; the point is it does not grow with
+        // the remotes the way one stream at a time does
+        if (lanes == AdpcmEncoder::MAX_LANES && lanes_us > single_us * 1.5)
+            ok = Bench::Fail("the lanes were slower than one stream at a time");
+    }
+    std::printf("  (checksum %u)\n", checksum);
+    return ok;
+}
+
+namespace
+{
+    // A simulated remote with its register engine, output scheduler and
+    // speaker, wired as WiimoteDevice wires them. With `bypass` the speaker
+    // data goes through SendNow, otherwise through the queue as before.
+    class SpeakerRemote
+    {
+    public:
+        explicit SpeakerRemote(bool bypass)
+            : m_output([this](const uint8_t* report, size_t size) { return m_remote->Send(report, size); }),
+              m_registers([this](const uint8_t* report, size_t size) { return m_output.Submit(report, size); }),
+              m_speaker(m_registers,
+                        [this](const uint8_t* report, size_t size) { return m_output.Submit(report, size); },
+                        [this, bypass](const uint8_t* report, size_t size) {
+                            return bypass ? m_output.SendNow(report, size) : m_output.Submit(report, size);
+                        })
+        {
+            m_remote = std::make_unique<SimulatedRemote>(SimulatedRemote::Link(),
+                [this](const uint8_t* report, size_t size) {
+                    if (!m_registers.HandleInputReport(report, size))
+                        m_output.HandleAck(report, size);
+                });
+            m_remote->SetTickHandler(std::chrono::milliseconds(10), [this](Bench::Clock::time_point now) {
+                m_registers.Tick(now);
+                m_output.Drain();
+            });
+            m_drain_timer = IoReactor::Instance().AddTimer(IoReactor::Clock::duration::zero(),
+                [this](IoReactor::Clock::time_point) { m_output.Drain(); });
+            m_output.SetWakeFunction([this](OutputScheduler::Clock::time_point when) {
+                IoReactor::Instance().ArmTimer(m_drain_timer, when);
+            });
+        }
+
+        ~SpeakerRemote()
+        {
+            m_speaker.Disable();
+            IoReactor::Instance().RemoveTimer(m_drain_timer);
+            m_remote.reset();
+        }
+
+        OutputScheduler& Output() { return m_output; }
+        WiimoteSpeaker& Speaker() { return m_speaker; }
+        SimulatedRemote& Remote() { return *m_remote; }
+
+    private:
+        std::unique_ptr<SimulatedRemote> m_remote;
+        OutputScheduler m_output;
+        WiimoteRegisterEngine m_registers;
+        WiimoteSpeaker m_speaker;
+        int m_drain_timer = -1;
+    };
+
+    struct PacingResult
+    {
+        size_t reports = 0;
+        double mean_ms = 0.0;
+        double p50_error_ms = 0.0;
+        double p99_error_ms = 0.0;
+        double max_error_ms = 0.0;
+    };
+}
+
+// Stream a tone to every remote with other output going on and take the
+// spacing of the 0x18 reports as they leave for the link, which is what the
+// host controls
+static bool MeasureStream(bool bypass, PacingResult& result)
+{
+    std::vector<std::unique_ptr<SpeakerRemote>> remotes;
+    for (int i = 0; i < STREAM_REMOTES; ++i)
+        remotes.push_back(std::make_unique<SpeakerRemote>(bypass));
+
+    const SpeakerConfig config = SpeakerStreamer::Instance().GetConfig();
+    const size_t samples = config.sample_rate * (STREAM_TIME.count() + 200) / 1000;
+    std::vector<int16_t> tone(samples);
+    for (size_t i = 0; i < samples; ++i)
+        tone[i] = static_cast<int16_t>(10000.0 * std::sin(i * 2.0 * 3.14159265 * 440.0 / config.sample_rate));
+
+    for (auto& remote : remotes)
+    {
+        remote->Speaker().Queue(tone.data(), std::min(tone.size(), WiimoteSpeaker::MAX_BUFFERED_SAMPLES));
+        remote->Speaker().Enable(config.volume);
+    }
+
+    std::atomic<bool> running(true);
+    std::thread traffic([&]() {
+        uint8_t step = 0;
+        for (Bench::Clock::time_point next = Bench::Clock::now(); running; next += TRAFFIC_PERIOD)
+        {
+            std::this_thread::sleep_until(next);
+            step++;
+            for (auto& remote : remotes)
+            {
+                if (step & 1)
+                    remote->Output().SetLeds(step & 0x0F);
+                else
+                {
+                    const uint8_t report[] = { OUTPUT_IR_LOGIC, static_cast<uint8_t>((step & 2) ? OUTPUT_FLAG_ENABLE : 0) };
+                    remote->Output().Submit(report, sizeof(report));
+                }
+            }
+        }
+    });
+    std::this_thread::sleep_for(STREAM_TIME);
+    running = false;
+    traffic.join();
+
+    const double period_ms = 1000.0 * config.SamplesPerReport() / config.sample_rate;
+    std::vector<double> intervals;
+    std::vector<double> errors;
+    for (auto& remote : remotes)
+    {
+        Bench::Clock::time_point previous;
+        for (const SimulatedRemote::OutputRecord& record : remote->Remote().GetOutputs())
+        {
+            if (record.report[0] != OUTPUT_SPEAKER_DATA)
+                continue;
+            if (previous != Bench::Clock::time_point())
+            {
+                const double interval = Bench::Milliseconds(record.sent - previous);
+                intervals.push_back(interval);
+                errors.push_back(std::abs(interval - period_ms));
+            }
+            previous = record.sent;
+        }
+    }
+    remotes.clear();
+
+    result.reports = intervals.size() + STREAM_REMOTES;
+    result.mean_ms = Bench::Mean(intervals);
+    result.p50_error_ms = Bench::Percentile(errors, 0.5);
+    result.p99_error_ms = Bench::Percentile(errors, 0.99);
+    result.max_error_ms = Bench::Percentile(errors, 1.0);
+    return !intervals.empty();
+}
+
+// Speaker reports are timed by the streamer; going through the output queue
+// they wait behind other reports and the rate cap, and their spacing turns
+// uneven, which is audible as crackle. The typical error is checked; the
+// tail also holds whatever the machine's scheduling adds to both.
+BENCH(speaker_pacing, "Speaker data keeps the streamer's 13.3 ms spacing at the remote while other output goes on")
+{
+    PacingResult queued;
+    PacingResult bypass;
+    if (!MeasureStream(false, queued) || !MeasureStream(true, bypass))
+        return Bench::Fail("no speaker data reached the remotes");
+
+    std::printf("  %d remotes, LED or IR report every 5 ms each\n", STREAM_REMOTES);
+    std::printf("  through the queue: %zu reports, interval mean %.2f ms, error p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                queued.reports, queued.mean_ms, queued.p50_error_ms, queued.p99_error_ms, queued.max_error_ms);
+    std::printf("  sent at once:      %zu reports, interval mean %.2f ms, error p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                bypass.reports, bypass.mean_ms, bypass.p50_error_ms, bypass.p99_error_ms, bypass.max_error_ms);
+
+    if (bypass.p50_error_ms * 3.0 > queued.p50_error_ms)
+        return Bench::Fail("sending at once did not even out the spacing");
+    return true;
+}
@@ -0,0 +1,68 @@
+#include "bench.h"
+#include "wiimote_status_cache.h"
+#include <atomic>
+#include <thread>
+
+constexpr auto RUN_TIME = std::chrono::milliseconds(300);
+
+// One remote after another takes slot 0 while a second writer clears it,
+// as a reader thread publishing and Close clearing do. Each address is
+// published with its own battery byte, so a reader that got the address of
+// one update and the status of another sees them disagree. The clearer
+// pauses between clears; yielding instead, on one core it is often the last
+// writer to run before the reader and the reader finds nothing.
+BENCH(status_cache, "Status cache readers never mix the address and status of different updates")
+{
+    const uint64_t addresses[] = { 0x00BEEF000011ull, 0x00BEEF000022ull, 0x00BEEF000033ull };
+    WiimoteStatusCache& cache = WiimoteStatusCache::Instance();
+    std::atomic<bool> running(true);
+
+    std::thread publisher([&]() {
+        for (size_t i = 0; running; ++i)
+        {
+            const uint64_t address = addresses[i % 3];
+            cache.Publish(0, address, 0x10, static_cast<uint8_t>(address & 0xFF));
+        }
+    });
+    std::thread clearer([&]() {
+        while (running)
+        {
+            cache.Clear(0);
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    });
+
+    uint64_t reads = 0;
+    uint64_t found = 0;
+    uint64_t mismatches = 0;
+    const Bench::Clock::time_point start = Bench::Clock::now();
+    while (Bench::Clock::now() - start < RUN_TIME)
+    {
+        for (int i = 0; i < 1000; ++i)
+        {
+            WiimoteStatus status;
+            if (cache.Get(0, status))
+            {
+                found++;
+                if (status.battery_raw != (status.bt_address & 0xFF) || status.leds != 1)
+                    mismatches++;
+            }
+            reads++;
+        }
+    }
+    const double elapsed_us = Bench::Microseconds(Bench::Clock::now() - start);
+
+    running = false;
+    publisher.join();
+    clearer.join();
+    cache.Clear(0);
+
+    std::printf("  %llu reads under two writers, %llu found a status, %.0f ns per read\n",
+                static_cast<unsigned long long>(reads), static_cast<unsigned long long>(found),
+                elapsed_us * 1000.0 / reads);
+    if (mismatches != 0)
+        return Bench::Fail("a read mixed two updates");
+    if (found == 0)
+        return Bench::Fail("no read found a published status");
+    return true;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Yamaha 4-bit ADPCM, the compressed format the Wii Remote speaker plays.
+//
+// ADPCM is a running prediction, so the samples of one stream have to be
+// encoded one after the other. The encoder runs several independent streams
+// side by side instead, one per lane: state is kept as one array per field
+// and every step is the same branch-free arithmetic across all lanes, which
+// the compiler turns into vector instructions.
+class AdpcmEncoder
+{
+public:
+    static constexpr size_t MAX_LANES = 16;
+
+    struct LaneState
+    {
+        int32_t predictor;
+        int32_t step;
+    };
+
+    AdpcmEncoder();
+
+    // Back to the initial predictor and step size, as the remote expects at
+    // the start of a stream
+    void Reset(size_t lane);
+    void ResetAll();
+
+    // Lanes that are encoded but whose output is not sent have to be put
+    // back, or the encoder drifts away from the remote's decoder
+    LaneState GetState(size_t lane) const;
+    void SetState(size_t lane, const LaneState& state);
+
+    // Encode `count` samples (a multiple of 2) for `lanes` streams. Input is
+    // interleaved by sample, input[i * lanes + lane]; each lane's output goes
+    // to output[lane], count / 2 bytes with the first sample in the high
+    // nibble.
+    void Encode(const int16_t* input, size_t lanes, size_t count, uint8_t* const* output);
+
+    // Single stream on lane 0
+    void Encode(const int16_t* input, size_t count, uint8_t* output);
+
+private:
+    alignas(64) int32_t m_predictor[MAX_LANES];
+    alignas(64) int32_t m_step[MAX_LANES];
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <mutex>
+#include "mapped_file.h"
+
+// Persistent store of calibration blocks read from remotes and extensions,
+// kept in a small memory-mapped file next to wiimote_bridge.log. Entries are
+// keyed by remote and extension ID; an extension ID of 0 holds the remote's
+// own accelerometer calibration. A remote is keyed by its Bluetooth address,
+// or by its device path where the address is unknown (see KeyFor).
+class CalibrationCache
+{
+public:
+    static constexpr uint64_t CORE_CALIBRATION = 0;
+    static constexpr size_t MAX_BLOCK_SIZE = 32;
+
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t stale = 0;
+        double cached_latency_ms = 0.0;     // average connect-to-calibrated-sample
+        double uncached_latency_ms = 0.0;
+        uint64_t cached_samples = 0;
+        uint64_t uncached_samples = 0;
+    };
+
+    static CalibrationCache& Instance()
+    {
+        static CalibrationCache instance;
+        return instance;
+    }
+
+    // The key of a remote: its Bluetooth address, or when that is 0 a hash
+    // of its device path, which holds the device instance ID. Path keys have
+    // the top bit set, which no 48-bit address has. 0, which is never
+    // cached, when both are unknown.
+    static uint64_t KeyFor(uint64_t bt_address, const std::wstring& device_path);
+
+    // `key` as returned by KeyFor
+    bool Lookup(uint64_t key, uint64_t extension_id, std::vector<uint8_t>& data);
+    void Store(uint64_t key, uint64_t extension_id, const uint8_t* data, size_t size);
+    void Invalidate(uint64_t key, uint64_t extension_id);
+
+    // Connect-to-first-calibrated-sample latency, split by cache hit or miss
+    void RecordLatency(bool cache_hit, double milliseconds);
+    void RecordStale();
+    Stats GetStats();
+
+private:
+    static constexpr uint32_t FILE_MAGIC = 0x43434257;  // "WBCC"
+    static constexpr uint32_t FILE_VERSION = 1;
+    static constexpr uint32_t CAPACITY = 64;
+
+    struct FileHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t capacity;
+        uint32_t clock;
+    };
+
+    struct Entry
+    {
+        uint64_t bt_address;
+        uint64_t extension_id;
+        uint32_t last_used;
+        uint8_t size;
+        uint8_t reserved[3];
+        uint8_t data[MAX_BLOCK_SIZE];
+        uint32_t checksum;
+        uint32_t padding;
+    };
+
+    CalibrationCache() = default;
+    CalibrationCache(const CalibrationCache&) = delete;
+    CalibrationCache& operator=(const CalibrationCache&) = delete;
+
+    MappedFile m_file;
+    bool m_open_attempted = false;
+    std::mutex m_mutex;
+    Stats m_stats;
+
+    bool EnsureOpenLocked();
+    FileHeader* Header() const;
+    Entry* Entries() const;
+    Entry* FindLocked(uint64_t bt_address, uint64_t extension_id) const;
+    static uint32_t ComputeChecksum(const Entry& entry);
+};
@@ -7,7 +7,34 @@
 #include <chrono>
 #include <iomanip>
 #include <ctime>
+#include <cstdarg>
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <unistd.h>
+#include <climits>
+#endif
+
+// Directory of the running executable, with a trailing separator. Log and
+// cache files live next to the executable.
+inline std::string GetExecutableDirectory()
+{
+#ifdef _WIN32
+    char path[MAX_PATH];
+    GetModuleFileNameA(nullptr, path, MAX_PATH);
+    std::string exe_path(path);
+#else
+    char path[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    std::string exe_path(path, length > 0 ? static_cast<size_t>(length) : 0);
+#endif
+    size_t last_slash = exe_path.find_last_of("\\/");
+    if (last_slash != std::string::npos)
+    {
+        exe_path = exe_path.substr(0, last_slash + 1);
+    }
+    return exe_path;
+}
 
 class DebugLog
 {
@@ -24,16 +51,7 @@ public:
         
         if (!m_file.is_open())
         {
-            // Get executable directory
-            char path[MAX_PATH];
-            GetModuleFileNameA(nullptr, path, MAX_PATH);
-            std::string exe_path(path);
-            size_t last_slash = exe_path.find_last_of("\\/");
-            if (last_slash != std::string::npos)
-            {
-                exe_path = exe_path.substr(0, last_slash + 1);
-            }
-            m_log_path = exe_path + "wiimote_bridge.log";
+            m_log_path = GetExecutableDirectory() + "wiimote_bridge.log";
             m_file.open(m_log_path, std::ios::out | std::ios::app);
         }
 
@@ -45,7 +63,11 @@ public:
                 now.time_since_epoch()) % 1000;
 
             struct tm local_time;
+#ifdef _WIN32
             localtime_s(&local_time, &time);
+#else
+            localtime_r(&time, &local_time);
+#endif
 
             m_file << std::put_time(&local_time, "%Y-%m-%d %H:%M:%S")
                    << "." << std::setfill('0') << std::setw(3) << ms.count()
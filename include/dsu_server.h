@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "wiimote_input.h"
+#include "wiimote_extension.h"
+
+// Serves button and motion data of the first four remotes to emulators
+// over the DSU ("cemuhook") UDP protocol on localhost. Clients register by
+// sending data requests, which they repeat every few seconds; each decoded
+// report is then built into one 100-byte packet, in a buffer on the stack,
+// and sent to every client registered for its pad. On Linux the sends to
+// all clients go out in a single sendmmsg call.
+//
+// A pad's remote is only asked for motion data while some client's
+// registration covers it; the server thread subscribes and unsubscribes
+// as registrations come and lapse.
+class DsuServer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr uint16_t DEFAULT_PORT = 26760;
+    // The protocol has four pads; they are the remotes in slots 0 - 3
+    static constexpr int MAX_PADS = 4;
+    static constexpr int MAX_CLIENTS = 16;
+    // Clients that stop repeating their data requests are dropped
+    static constexpr std::chrono::seconds CLIENT_TIMEOUT{ 5 };
+
+    struct Stats
+    {
+        uint64_t requests = 0;
+        uint64_t bad_requests = 0;
+        uint64_t packets_sent = 0;
+        uint64_t send_calls = 0;
+        uint64_t send_errors = 0;
+        size_t clients = 0;
+        // Bit per pad the server takes input from
+        uint32_t subscribed_pads = 0;
+    };
+
+    static DsuServer& Instance()
+    {
+        static DsuServer instance;
+        return instance;
+    }
+
+    bool Start(uint16_t port = DEFAULT_PORT);
+    void Stop();
+    bool IsRunning() const { return m_running; }
+
+    // Send a decoded report of the remote in `slot` to the clients of its pad
+    void HandleInput(int slot, uint64_t bt_address, const WiimoteInputState& input,
+                     const ExtensionState& extension);
+
+    Stats GetStats() const;
+
+private:
+#ifdef _WIN32
+    using SocketHandle = uintptr_t;
+#else
+    using SocketHandle = int;
+#endif
+
+    struct Client
+    {
+        bool active;
+        uint8_t address[16];   // sockaddr_in
+        Clock::time_point all_until;
+        Clock::time_point pad_until[MAX_PADS];
+        uint8_t mac[6];
+        Clock::time_point mac_until;
+    };
+
+    struct PadInfo
+    {
+        bool connected;
+        uint8_t model;
+        uint8_t mac[6];
+        uint8_t battery;
+    };
+
+    DsuServer();
+    ~DsuServer();
+    DsuServer(const DsuServer&) = delete;
+    DsuServer& operator=(const DsuServer&) = delete;
+
+    SocketHandle m_socket;
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+    // Registry subscription of each pad, 0 while none; only the server
+    // thread changes them while it runs
+    int m_subscriptions[MAX_PADS];
+    uint32_t m_server_id;
+
+    mutable std::mutex m_mutex;
+    Client m_clients[MAX_CLIENTS];
+    PadInfo m_pads[MAX_PADS];
+    uint32_t m_packet_numbers[MAX_PADS];
+    Stats m_stats;
+
+    void ThreadProc();
+    void HandleRequest(const uint8_t* packet, size_t size, const uint8_t* address);
+    void UpdateSubscriptions();
+    void Unsubscribe(int pad);
+    uint32_t GetWantedPadsLocked(Clock::time_point now) const;
+    size_t BuildPadHeader(uint8_t* packet, uint32_t type, int pad) const;
+    void Send(const uint8_t* packet, size_t size, const uint8_t* const* addresses, size_t count);
+    Client* FindClientLocked(const uint8_t* address, Clock::time_point now);
+};
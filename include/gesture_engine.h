@@ -0,0 +1,246 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include "wiimote_input.h"
+#include "wiimote_extension.h"
+
+// Motion features of one report, which gesture templates are traces of
+enum GestureFeature
+{
+    GESTURE_ACCEL_X,        // g, gravity included
+    GESTURE_ACCEL_Y,
+    GESTURE_ACCEL_Z,
+    GESTURE_ACCEL_DYNAMIC,  // |accel| away from 1 g
+    GESTURE_RATE_PITCH,     // turns per second, from the MotionPlus; 0 without one
+    GESTURE_RATE_ROLL,
+    GESTURE_RATE_YAW,
+    GESTURE_ROTATION,       // turns per second; from the accelerometer without a MotionPlus
+    GESTURE_FEATURE_COUNT
+};
+
+using GestureSample = std::array<float, GESTURE_FEATURE_COUNT>;
+
+// A gesture as a trace of feature samples at the report rate, 100 Hz
+struct GestureTemplate
+{
+    static constexpr size_t MAX_LENGTH = 64;
+
+    std::string name;
+    // Mean distance per sample a match may have; confidence falls from 1 for
+    // a perfect match to 0 here
+    float threshold = 0.5f;
+    // Features that do not matter for the gesture get weight 0
+    float weights[GESTURE_FEATURE_COUNT] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+    std::vector<GestureSample> samples;
+};
+
+struct GestureEvent
+{
+    int slot = -1;
+    char name[32] = {};
+    float confidence = 0.0f;
+    float distance = 0.0f;      // mean per sample
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+};
+
+// Detects gestures in the motion of every remote while anyone subscribes.
+// Each template runs an incremental subsequence DTW (SPRING) over the
+// remote's feature stream: one column of the warping matrix per report.
+// Cells already past the template's threshold can never end in a match, so
+// they are dropped, and a column is only computed up to the last cell a
+// path under the threshold can reach. A template the motion does not
+// resemble costs a few cells per report rather than its whole length, so a
+// moving remote's cost grows with the cells still under a threshold, not
+// with the templates loaded; the bound stays MAX_TEMPLATES * MAX_LENGTH
+// cells. Before any cell, a template is checked against the range each
+// feature took over the last reports. Each of its samples has to be matched
+// to a report in that range, so a match is at least as far as the samples
+// are from the range; with a feature's samples sorted into groups, at least
+// each group's size times the squared distance of its mean. A template far
+// from the recent motion cannot end a path under its threshold, and it
+// sleeps at a few operations a report until the motion comes near it, when
+// its column is rebuilt from the kept features. Paths longer than
+// ENVELOPE_SPAN reports are not followed across a sleep. The cell distances
+// are computed feature by feature, a block of the template at a time, in a
+// loop the compiler vectorizes. While a remote is at rest the matchers are
+// reset and skipped, so an idle remote costs the same however many templates
+// are loaded.
+//
+// Swing, shake and twist are built in. More come from gestures.txt next to
+// the executable or from AddTemplate, in the text form
+//   gesture <name> <threshold>
+//   weights <one per feature>        (optional)
+//   <one line of feature values per sample>
+class GestureEngine
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using GestureCallback = std::function<void(const GestureEvent& event)>;
+
+    static constexpr size_t MAX_TEMPLATES = 32;   // a bit each in a remote's masks
+    static constexpr int MAX_SLOTS = 16;
+
+    struct Stats
+    {
+        uint64_t samples = 0;
+        uint64_t idle_samples = 0;
+        uint64_t cells = 0;         // DTW cells computed
+        uint64_t gestures = 0;
+        size_t templates = 0;
+    };
+
+    static GestureEngine& Instance()
+    {
+        static GestureEngine instance;
+        return instance;
+    }
+
+    bool LoadTemplates(const std::string& path);
+    bool LoadTemplatesFromText(const std::string& text, std::string& error);
+    // Replaces a template with the same name
+    bool AddTemplate(const GestureTemplate& gesture);
+    bool RemoveTemplate(const std::string& name);
+    std::vector<std::string> GetTemplateNames() const;
+
+    // Gestures of the remote in `slot`, or of every remote when slot is -1,
+    // matched with at least `min_confidence`. One movement can match several
+    // templates, a swing inside a shake say, mostly with low confidence.
+    // Callbacks run on the reactor thread of the remote.
+    int Subscribe(GestureCallback callback, int slot = -1, float min_confidence = 0.5f);
+    void Unsubscribe(int subscription_id);
+
+    // Feed one report of the remote in `slot`
+    void HandleInput(int slot, const WiimoteInputState& input, const ExtensionState& extension);
+
+    Stats GetStats() const;
+
+private:
+    // Reports the accelerometer's rotation is measured across; one report
+    // apart, its noise alone reads as a fast turn
+    static constexpr size_t ROTATION_BASELINE = 4;
+    // Cell distances are computed in blocks of this many, which compilers
+    // turn into vector instructions whatever the template length
+    static constexpr size_t CELL_BLOCK = 8;
+    // Reports kept for rebuilding a sleeping template's column, and the
+    // blocks the range of each feature over them is kept in
+    static constexpr size_t HISTORY = 2 * GestureTemplate::MAX_LENGTH;
+    static constexpr size_t ENVELOPE_BLOCK = 16;
+    static constexpr size_t ENVELOPE_BLOCKS = HISTORY / ENVELOPE_BLOCK;
+    // Reports the range always covers, the current block being partly filled
+    static constexpr size_t ENVELOPE_SPAN = HISTORY - ENVELOPE_BLOCK + 1;
+    // Groups of each feature's sorted samples the template is bounded by
+    static constexpr size_t BOUND_GROUPS = 4;
+
+    struct CompiledTemplate
+    {
+        std::string name;
+        size_t length;
+        size_t stride;      // length rounded up to whole CELL_BLOCKs
+        float epsilon;      // threshold over the whole length
+        float weights[GESTURE_FEATURE_COUNT];
+        // The features with a weight, which are all a cell's distance reads
+        uint8_t used_features[GESTURE_FEATURE_COUNT];
+        size_t used_count;
+        uint32_t used_mask;     // bit per used feature
+        // Means of each feature's samples, sorted and split into groups of
+        // group_sizes samples
+        float group_means[GESTURE_FEATURE_COUNT][BOUND_GROUPS];
+        float group_sizes[BOUND_GROUPS];
+        // Feature-major: all samples of feature 0, then of feature 1, ...,
+        // each padded to `stride`
+        std::vector<float> features;
+    };
+    using TemplateList = std::vector<std::shared_ptr<const CompiledTemplate>>;
+
+    // SPRING state of one template on one remote
+    struct Matcher
+    {
+        // Column of the warping matrix, 1 .. length; cells past the
+        // threshold are infinite, and so is every cell from `active` on
+        std::vector<float> distances;
+        size_t active;
+        std::vector<uint64_t> starts;   // sample each cell's path started at
+        float best;
+        uint64_t best_start;
+        uint64_t best_end;
+        // First sample a rebuilt path may start at, after a report or a
+        // column without a cell under the threshold
+        uint64_t floor;
+    };
+
+    struct RemoteState
+    {
+        std::mutex mutex;
+        std::shared_ptr<const TemplateList> templates;
+        std::vector<Matcher> matchers;
+        uint64_t sample = 0;
+        Clock::time_point times[HISTORY];
+        float history[HISTORY][GESTURE_FEATURE_COUNT];
+        float block_low[ENVELOPE_BLOCKS][GESTURE_FEATURE_COUNT];
+        float block_high[ENVELOPE_BLOCKS][GESTURE_FEATURE_COUNT];
+        // The range as the last match saw it; a sleeping template none of
+        // whose features' range changed stays asleep without its bound
+        float low[GESTURE_FEATURE_COUNT] = {};
+        float high[GESTURE_FEATURE_COUNT] = {};
+        // Bit per template: nothing of the motion in its range and nothing
+        // pending, its column stale until it wakes. And the templates each
+        // feature matters to.
+        uint32_t asleep = 0;
+        uint32_t feature_templates[GESTURE_FEATURE_COUNT] = {};
+        int quiet_samples = 0;
+        bool idle = true;
+        uint64_t moving_since = 0;  // no path starts before this sample
+        // Smoothed gravity directions of the last reports, for rotation
+        // without a MotionPlus
+        float directions[ROTATION_BASELINE][3] = {};
+        Clock::time_point direction_times[ROTATION_BASELINE];
+        uint64_t direction_count = 0;
+    };
+
+    struct Subscription
+    {
+        int id;
+        int slot;
+        float min_confidence;
+        GestureCallback callback;
+    };
+    using SubscriptionList = std::vector<Subscription>;
+
+    GestureEngine();
+    GestureEngine(const GestureEngine&) = delete;
+    GestureEngine& operator=(const GestureEngine&) = delete;
+
+    mutable std::mutex m_template_mutex;
+    std::shared_ptr<const TemplateList> m_templates;
+
+    mutable std::mutex m_subscription_mutex;
+    std::shared_ptr<const SubscriptionList> m_subscriptions;
+    int m_next_subscription_id;
+    int m_registry_subscription;
+
+    RemoteState m_remotes[MAX_SLOTS];
+
+    mutable std::mutex m_stats_mutex;
+    Stats m_stats;
+
+    bool ExtractFeatures(RemoteState& remote, const WiimoteInputState& input, const ExtensionState& extension,
+                         float* features) const;
+    size_t Match(RemoteState& remote, const float* features, GestureEvent* events, size_t max_events, uint64_t& cells);
+    void ResetMatchers(RemoteState& remote) const;
+    // Next column of `matcher` for the sample `now`; returns the cells computed
+    static size_t AdvanceColumn(const CompiledTemplate& gesture, Matcher& matcher, const float* features,
+                                uint64_t now);
+    // Fill `event` with the best match of `matcher`, which is then cleared
+    void Report(const RemoteState& remote, const CompiledTemplate& gesture, Matcher& matcher,
+                GestureEvent& event) const;
+    static std::shared_ptr<const CompiledTemplate> Compile(const GestureTemplate& gesture);
+};
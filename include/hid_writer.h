@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <atomic>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// How an output report reaches the remote. Interrupt goes over the HID
+// interrupt channel (WriteFile on Windows, write() on hidraw); Control sends a
+// SET_REPORT over the control channel (HidD_SetOutputReport, HIDIOCSOUTPUT).
+// Bluetooth stacks differ in which of the two they accept for a Wii Remote.
+enum class HidWriteMethod
+{
+    Interrupt,
+    Control
+};
+
+const char* GetHidWriteMethodName(HidWriteMethod method);
+
+// Writes output reports to one HID device. Both methods are probed when the
+// device connects and the one that works, or the faster of the two, is used
+// from then on. A failed write is retried with the other method, and the
+// preferred method is switched after repeated failures. Once the handle is
+// served by IoReactor, interrupt writes are handed to it and complete
+// asynchronously.
+//
+// Write never blocks. Control writes, interrupt writes before the reactor
+// takes over, and the retry of a failed write all block for up to a write
+// timeout, so they run on a writer thread of the device, started when first
+// needed. A reactor thread or the device tick never waits on the link.
+class HidWriter
+{
+public:
+    using Clock = std::chrono::steady_clock;
+#ifdef _WIN32
+    using NativeHandle = HANDLE;
+#else
+    using NativeHandle = int;
+#endif
+
+    struct MethodStats
+    {
+        uint64_t attempts = 0;
+        uint64_t successes = 0;
+        uint64_t failures = 0;
+        double average_ms = 0.0;
+        double max_ms = 0.0;
+    };
+
+    struct Stats
+    {
+        HidWriteMethod method = HidWriteMethod::Interrupt;
+        bool probed = false;
+        uint64_t fallbacks = 0;
+        uint64_t switches = 0;
+        // Blocking writes handed to the writer thread, and those refused
+        // because its queue was full
+        uint64_t queued = 0;
+        uint64_t queue_full = 0;
+        MethodStats methods[2];
+    };
+
+    using WriteCompletion = std::function<void(bool success, double latency_ms)>;
+    using AsyncWriteFunction = std::function<bool(const uint8_t* report, size_t size, WriteCompletion completion)>;
+
+    HidWriter();
+    ~HidWriter();
+
+    HidWriter(const HidWriter&) = delete;
+    HidWriter& operator=(const HidWriter&) = delete;
+
+    // The handle stays owned by the caller. On Windows it must be opened for
+    // overlapped I/O; reports are padded to report_size.
+    bool Attach(NativeHandle handle, size_t report_size);
+    void Detach();
+
+    // Route interrupt writes through `write`, which reports the outcome
+    // through the completion; an empty function goes back to blocking writes
+    void SetAsyncWrite(AsyncWriteFunction write);
+
+    // Send `report` with each method a few times and pick one. Use a report
+    // that is harmless to repeat. Returns false if neither method worked.
+    bool Probe(const uint8_t* report, size_t size);
+
+    // Hand the report to the reactor or the writer thread. False when it
+    // could not be taken; the outcome of the write itself is in the stats.
+    bool Write(const uint8_t* report, size_t size);
+    // Write the last report before the handle goes away and wait up to
+    // `timeout` for it. It is written after every report handed over before
+    // it, and further writes are refused until the next Attach.
+    bool WriteFinal(const uint8_t* report, size_t size, std::chrono::milliseconds timeout);
+
+    HidWriteMethod GetMethod() const;
+    Stats GetStats() const;
+
+private:
+    static constexpr size_t MAX_REPORT_BYTES = 64;
+    // Reports waiting for the writer thread; more means the link is not
+    // keeping up and the scheduler should see failures
+    static constexpr size_t MAX_QUEUED_WRITES = 32;
+
+    using DoneFunction = std::function<void(bool success)>;
+
+    struct PendingWrite
+    {
+        uint8_t data[MAX_REPORT_BYTES] = {};
+        size_t size = 0;
+        HidWriteMethod method = HidWriteMethod::Interrupt;
+        // `method` already failed for this report; only the other is tried
+        bool failed = false;
+        DoneFunction on_done;
+    };
+
+    NativeHandle m_handle;
+    size_t m_report_size;
+#ifdef _WIN32
+    HANDLE m_write_event;
+#endif
+
+    AsyncWriteFunction m_async_write;
+
+    std::mutex m_write_mutex;
+    // WriteFinal has been called since Attach
+    bool m_final;
+    mutable std::mutex m_stats_mutex;
+    HidWriteMethod m_method;
+    std::atomic<int> m_consecutive_failures;
+    Stats m_stats;
+
+    // The writer thread; it only runs between Attach and Detach
+    std::mutex m_queue_mutex;
+    std::condition_variable m_queue_ready;
+    std::deque<PendingWrite> m_queue;
+    std::thread m_thread;
+    bool m_accepting;
+
+    bool SubmitLocked(const uint8_t* report, size_t size, DoneFunction on_done);
+    bool Enqueue(const PendingWrite& write);
+    void ThreadProc();
+    bool WriteWith(HidWriteMethod method, uint8_t* buffer, size_t size);
+    bool TimedWrite(HidWriteMethod method, uint8_t* buffer, size_t size);
+    bool RecordResult(HidWriteMethod method, bool success, double ms);
+    bool WriteWithFallback(HidWriteMethod failed, uint8_t* buffer, size_t size);
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include "wiimote_input.h"
+#include "wiimote_extension.h"
+
+// What an input event carries; a report can be several kinds at once
+enum InputEventKind : uint32_t
+{
+    INPUT_EVENT_BUTTONS = 1 << 0,     // a button changed
+    INPUT_EVENT_MOTION = 1 << 1,      // accelerometer data
+    INPUT_EVENT_IR = 1 << 2,          // IR dots and pointer
+    INPUT_EVENT_EXTENSION = 1 << 3,   // extension data
+    INPUT_EVENT_ALL = 0x0F
+};
+
+struct InputEvent
+{
+    uint64_t sequence = 0;
+    int slot = -1;
+    uint32_t kinds = 0;
+    uint16_t buttons_pressed = 0;
+    uint16_t buttons_released = 0;
+    WiimoteInputState input;
+    ExtensionState extension;
+};
+
+// Every decoded report of every remote, in order and without gaps, for any
+// number of subscribers. Events are written once into a shared ring; each
+// subscriber keeps its own cursor into it and filters while reading, so
+// fanning out costs the producer nothing per subscriber.
+//
+// A subscriber that falls a whole ring behind is handled by its policy:
+// DropOldest skips ahead and counts the lost events, Block makes the
+// producer wait a bounded time for it, Disconnect drops the subscription.
+// The producer holds up every remote while it waits, so a Block subscriber
+// that lets a wait run out is demoted to DropOldest for good.
+class InputEventBus
+{
+public:
+    static constexpr size_t CAPACITY = 1024;
+    static constexpr int MAX_SLOTS = 16;
+    // Longest the producer waits for a Block subscriber, once; it runs on a
+    // reactor thread and cannot hold up the remotes for long
+    static constexpr std::chrono::milliseconds BLOCK_TIMEOUT{ 5 };
+
+    enum class OverflowPolicy
+    {
+        DropOldest,
+        Block,
+        Disconnect
+    };
+
+    struct Filter
+    {
+        int slot = -1;                      // -1 for every remote
+        uint32_t kinds = INPUT_EVENT_ALL;   // InputEventKind flags
+        // With INPUT_EVENT_BUTTONS, only changes of these buttons count
+        uint16_t buttons = 0xFFFF;
+    };
+
+    struct SubscriberStats
+    {
+        uint64_t delivered = 0;
+        uint64_t filtered = 0;
+        uint64_t dropped = 0;
+        bool disconnected = false;
+        // A Block subscriber that let the producer's wait run out
+        bool demoted = false;
+    };
+
+    struct Stats
+    {
+        uint64_t published = 0;
+        // Times the producer had to wait for a Block subscriber, and how
+        // many of those waits ran out
+        uint64_t producer_waits = 0;
+        uint64_t producer_timeouts = 0;
+        size_t subscribers = 0;
+    };
+
+    static InputEventBus& Instance()
+    {
+        static InputEventBus instance;
+        return instance;
+    }
+
+    // Returns an id for the calls below. Subscribers see events published
+    // after they subscribed.
+    int Subscribe(const Filter& filter, OverflowPolicy policy = OverflowPolicy::DropOldest);
+    void Unsubscribe(int subscription_id);
+
+    // Copy up to `max` pending events that pass the filter. Returns the
+    // number copied; 0 also once the subscription has been disconnected.
+    size_t Poll(int subscription_id, InputEvent* events, size_t max);
+    // Wait until there are unread events, which the filter may still turn
+    // away; false on timeout or disconnect
+    bool Wait(int subscription_id, std::chrono::milliseconds timeout);
+
+    SubscriberStats GetSubscriberStats(int subscription_id) const;
+    Stats GetStats() const;
+
+    // Called by the registry for every decoded report
+    void Publish(int slot, const WiimoteInputState& input, const ExtensionState& extension);
+
+private:
+    struct alignas(64) Entry
+    {
+        // 2 * sequence + 1 while the event is written, 2 * sequence + 2 after
+        std::atomic<uint64_t> state{ 0 };
+        InputEvent event;
+    };
+
+    struct Subscriber
+    {
+        int id = 0;
+        Filter filter;
+        // Only changed by the producer, under m_publish_mutex
+        OverflowPolicy policy = OverflowPolicy::DropOldest;
+        std::atomic<bool> demoted{ false };
+        std::atomic<uint64_t> cursor{ 0 };
+        std::atomic<bool> disconnected{ false };
+        std::atomic<uint64_t> delivered{ 0 };
+        std::atomic<uint64_t> filtered{ 0 };
+        std::atomic<uint64_t> dropped{ 0 };
+    };
+    using SubscriberList = std::vector<std::shared_ptr<Subscriber>>;
+
+    InputEventBus();
+    InputEventBus(const InputEventBus&) = delete;
+    InputEventBus& operator=(const InputEventBus&) = delete;
+
+    std::unique_ptr<Entry[]> m_ring;
+    std::atomic<uint64_t> m_head;
+
+    // Serializes producers; events from different remotes arrive on
+    // different reactor threads
+    mutable std::mutex m_publish_mutex;
+    std::condition_variable m_space_cv;
+    // Kept up to date without subscribers too, so the first event after
+    // one subscribes has the right button changes; each remote only
+    // touches its own entry
+    std::atomic<uint16_t> m_last_buttons[MAX_SLOTS];
+    Stats m_stats;
+
+    // Replaced as a whole on change so the producer can iterate without a lock
+    mutable std::mutex m_subscription_mutex;
+    std::shared_ptr<const SubscriberList> m_subscribers;
+    // Lets the producer skip the ring while nobody listens
+    std::atomic<size_t> m_subscriber_count;
+    int m_next_subscription_id;
+
+    std::mutex m_wait_mutex;
+    std::condition_variable m_data_cv;
+    std::atomic<int> m_waiters;
+    std::atomic<bool> m_producer_waiting;
+
+    std::shared_ptr<Subscriber> Find(int subscription_id) const;
+    std::shared_ptr<const SubscriberList> GetSubscribers() const;
+    static bool Matches(const Filter& filter, const InputEvent& event);
+};
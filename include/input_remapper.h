@@ -0,0 +1,224 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include "wiimote_input.h"
+#include "wiimote_extension.h"
+#include "motion_predictor.h"
+
+// Buttons of the gamepad remapped input is expressed in, laid out like XInput
+enum GamepadButton : uint32_t
+{
+    GAMEPAD_BUTTON_A = 1 << 0,
+    GAMEPAD_BUTTON_B = 1 << 1,
+    GAMEPAD_BUTTON_X = 1 << 2,
+    GAMEPAD_BUTTON_Y = 1 << 3,
+    GAMEPAD_BUTTON_BACK = 1 << 4,
+    GAMEPAD_BUTTON_START = 1 << 5,
+    GAMEPAD_BUTTON_GUIDE = 1 << 6,
+    GAMEPAD_BUTTON_DPAD_UP = 1 << 7,
+    GAMEPAD_BUTTON_DPAD_DOWN = 1 << 8,
+    GAMEPAD_BUTTON_DPAD_LEFT = 1 << 9,
+    GAMEPAD_BUTTON_DPAD_RIGHT = 1 << 10,
+    GAMEPAD_BUTTON_LEFT_SHOULDER = 1 << 11,
+    GAMEPAD_BUTTON_RIGHT_SHOULDER = 1 << 12,
+    GAMEPAD_BUTTON_LEFT_TRIGGER = 1 << 13,    // digital trigger, for pads without analog ones
+    GAMEPAD_BUTTON_RIGHT_TRIGGER = 1 << 14,
+    GAMEPAD_BUTTON_LEFT_THUMB = 1 << 15,
+    GAMEPAD_BUTTON_RIGHT_THUMB = 1 << 16
+};
+constexpr size_t GAMEPAD_BUTTON_COUNT = 17;
+
+enum GamepadAxis
+{
+    GAMEPAD_AXIS_LEFT_X,
+    GAMEPAD_AXIS_LEFT_Y,
+    GAMEPAD_AXIS_RIGHT_X,
+    GAMEPAD_AXIS_RIGHT_Y,
+    GAMEPAD_AXIS_LEFT_TRIGGER,
+    GAMEPAD_AXIS_RIGHT_TRIGGER,
+    GAMEPAD_AXIS_COUNT
+};
+
+struct GamepadState
+{
+    uint32_t buttons = 0;   // GamepadButton flags
+    // Sticks from -1 to 1, right and up positive; triggers from 0 to 1
+    float axes[GAMEPAD_AXIS_COUNT] = {};
+};
+
+// A mapping profile compiled for the report path. Buttons of the remote and
+// its extension are packed into one word and mapped a byte at a time through
+// flat tables; combos are masks tried before that. Analog outputs come from
+// a short program of instructions over the normalized analog inputs.
+//
+// The text form has one mapping per line:
+//   button remote.a -> a
+//   button tilt.roll > 0.5 -> right
+//   combo nunchuk.c + nunchuk.z -> guide
+//   axis left_x = nunchuk.x + classic.lx deadzone 0.1 curve 1.5
+//   axis left_y = remote.right - remote.left
+// Terms of an axis can be weighted (tilt.roll * 2); after them come
+// deadzone, curve, scale, offset and invert, applied in order.
+//   predict 12 max_error 0.02 smoothing 0.5
+// extrapolates the pointer and tilt inputs over the Bluetooth delay and
+// 12 ms past it, see MotionPredictor; max_error and smoothing are optional.
+class RemapProfile
+{
+public:
+    // Compile the mapping lines of one profile; false with `error` set
+    static std::shared_ptr<const RemapProfile> Compile(const std::string& name,
+                                                       const std::vector<std::pair<int, std::string>>& lines,
+                                                       std::string& error);
+
+    const std::string& GetName() const { return m_name; }
+    // Null when the profile does not predict
+    const MotionPredictor::Config* GetPrediction() const { return m_predict ? &m_prediction : nullptr; }
+    // InputFeature flags the remote has to report for the profile's inputs
+    uint32_t GetFeatures() const;
+
+    // With predictors, which keep the motion of one remote between its
+    // reports, pointer and tilt inputs are predicted as configured
+    void Apply(const WiimoteInputState& input, const ExtensionState& extension, GamepadState& output,
+               MotionPredictor* pointer = nullptr, MotionPredictor* tilt = nullptr) const;
+
+private:
+    // Remote buttons in bits 0 - 15, Classic Controller buttons in 16 - 31,
+    // Nunchuk C and Z in 32 and 33
+    static constexpr size_t SOURCE_BYTES = 5;
+    static constexpr size_t CURVE_POINTS = 33;
+
+    enum class Op : uint8_t
+    {
+        Load,           // value = input[index] * weight
+        LoadButton,     // value = button bit `index` * weight
+        Add,
+        AddButton,
+        Scale,
+        Offset,
+        Deadzone,
+        Curve,          // through the table at `table`
+        Store,          // clamped to the range of axis `index`
+        PressAbove,     // set button `index` if value > threshold
+        PressBelow
+    };
+
+    struct Instruction
+    {
+        Op op;
+        uint8_t index;
+        uint16_t table;
+        float value;
+    };
+
+    struct Combo
+    {
+        uint64_t sources;
+        uint32_t buttons;
+    };
+
+    std::string m_name;
+    uint32_t m_button_table[SOURCE_BYTES][256] = {};
+    std::vector<Combo> m_combos;
+    std::vector<Instruction> m_program;
+    std::vector<float> m_curves;
+    uint32_t m_analog_inputs = 0;   // inputs the program reads
+    bool m_predict = false;
+    MotionPredictor::Config m_prediction;
+
+    bool CompileLine(const std::vector<std::string>& tokens, std::string& error);
+};
+
+// Picks the mapping profile of each remote by Bluetooth address and remaps
+// its reports. Profiles are read from remap_profiles.txt next to the
+// executable, with blocks like
+//   profile sideways
+//   device 00:17:AB:12:34:56
+//   button remote.2 -> a
+//   ...
+// A profile containing the line "default" is used for remotes no profile
+// names; otherwise a built-in profile that mirrors the remote's own layout.
+class InputRemapper
+{
+public:
+    static constexpr int MAX_SLOTS = 16;
+
+    using ChangedCallback = std::function<void()>;
+
+    struct Stats
+    {
+        size_t profiles = 0;
+        size_t devices = 0;
+        uint64_t reports = 0;
+        // Pointer and tilt samples of profiles that predict, over all
+        // remotes; see MotionPredictor
+        uint64_t predicted_samples = 0;
+        double prediction_rms_error = 0.0;
+        double unpredicted_rms_error = 0.0;
+    };
+
+    static InputRemapper& Instance()
+    {
+        static InputRemapper instance;
+        return instance;
+    }
+
+    // Replace the loaded profiles; on an error the previous ones stay
+    bool LoadProfiles(const std::string& path);
+    bool LoadProfilesFromText(const std::string& text, std::string& error);
+
+    std::shared_ptr<const RemapProfile> GetProfile(uint64_t bt_address) const;
+    // What the remotes have to report for any loaded profile
+    uint32_t GetFeatures() const;
+    // Called after profiles are loaded, outside the remapper's lock
+    void SetChangedCallback(ChangedCallback callback);
+
+    // Remap a report of the remote in `slot`. The profile is resolved once
+    // per remote and profile load, not per report.
+    void Remap(int slot, uint64_t bt_address, const WiimoteInputState& input,
+               const ExtensionState& extension, GamepadState& output);
+
+    Stats GetStats() const;
+
+private:
+    struct SlotProfile
+    {
+        uint64_t bt_address = 0;
+        uint64_t generation = 0;
+        std::shared_ptr<const RemapProfile> profile;
+    };
+
+    // Motion kept for the prediction of one remote; used by its own reports
+    // and read for the stats
+    struct SlotPrediction
+    {
+        mutable std::mutex mutex;
+        std::shared_ptr<const RemapProfile> profile;
+        MotionPredictor pointer;
+        MotionPredictor tilt;
+    };
+
+    InputRemapper();
+    InputRemapper(const InputRemapper&) = delete;
+    InputRemapper& operator=(const InputRemapper&) = delete;
+
+    mutable std::mutex m_mutex;
+    std::shared_ptr<const RemapProfile> m_builtin;
+    std::shared_ptr<const RemapProfile> m_default;
+    std::vector<std::shared_ptr<const RemapProfile>> m_profiles;
+    std::map<uint64_t, std::shared_ptr<const RemapProfile>> m_devices;
+    uint64_t m_generation;
+    ChangedCallback m_changed_callback;
+    SlotProfile m_slots[MAX_SLOTS];
+    SlotPrediction m_predictions[MAX_SLOTS];
+    std::atomic<uint64_t> m_reports;
+
+    std::shared_ptr<const RemapProfile> GetProfileLocked(uint64_t bt_address) const;
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include "wiimote_input.h"
+#include "precise_timer.h"
+
+// A button change of one remote, at the time the remote sampled it
+struct TimelineEvent
+{
+    int slot = -1;
+    std::chrono::steady_clock::time_point time;
+    uint16_t buttons_pressed = 0;
+    uint16_t buttons_released = 0;
+    uint16_t buttons = 0;
+    // Released after events of other remotes that were sampled later, as its
+    // report came in after the timeline had moved past it
+    bool late = false;
+};
+
+struct TimelineRemote
+{
+    uint16_t buttons = 0;
+    bool accel_calibrated = false;
+    float accel_g[3] = {};   // interpolated between the reports around the snapshot time
+};
+
+// Every remote as it was at one instant of the timeline
+struct TimelineSnapshot
+{
+    static constexpr int MAX_SLOTS = 16;
+
+    std::chrono::steady_clock::time_point time;
+    uint32_t slots = 0;   // remotes present at `time`, one bit per slot
+    TimelineRemote remotes[MAX_SLOTS];
+};
+
+// Puts the reports of all remotes on one timeline so that inputs of
+// different players can be compared, as in rhythm and party games where
+// who pressed first decides. Each remote samples on its own clock; its
+// ReportClock maps that onto the host clock, and the timeline orders
+// reports by those sample times instead of by arrival, which Bluetooth
+// batching shuffles by 5 - 20 ms between remotes.
+//
+// A report can still be on its way when a later sampled one of another
+// remote is in, so the timeline only moves up to the oldest latest sample
+// of the remotes reporting, and never further back than MAX_DELAY:
+// everything before it is final. Button events are released in sample time
+// order up to there, and snapshots of all remotes are taken at fixed steps
+// of it, the motion interpolated between reports. A report later than
+// MAX_DELAY is still released, marked late.
+class InputTimeline
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using EventCallback = std::function<void(const TimelineEvent& event)>;
+    using SnapshotCallback = std::function<void(const TimelineSnapshot& snapshot)>;
+
+    static constexpr int MAX_SLOTS = TimelineSnapshot::MAX_SLOTS;
+    // Most the timeline runs behind the present waiting for reports
+    static constexpr auto MAX_DELAY = std::chrono::milliseconds(30);
+    // How often events are released and snapshots taken
+    static constexpr float TICK_RATE = 250.0f;
+
+    struct Stats
+    {
+        uint64_t samples = 0;       // reports taken in
+        uint64_t events = 0;
+        uint64_t late_events = 0;
+        uint64_t snapshots = 0;
+        uint64_t ticks = 0;
+        // From the sample time to the release of an event
+        double average_event_delay_us = 0.0;
+        double max_event_delay_us = 0.0;
+        // Present minus the timeline at the last tick
+        double timeline_delay_us = 0.0;
+        int remotes = 0;
+        size_t subscriptions = 0;
+    };
+
+    static InputTimeline& Instance()
+    {
+        static InputTimeline instance;
+        return instance;
+    }
+
+    // Button events in timeline order go to `on_event`, and snapshots every
+    // 1 / `snapshot_rate` seconds of the timeline to `on_snapshot`; either
+    // may be empty, and a rate of 0 takes no snapshots. Callbacks run on the
+    // timeline thread and must not subscribe or unsubscribe. Returns -1 when
+    // the thread cannot run.
+    int Subscribe(EventCallback on_event, float snapshot_rate, SnapshotCallback on_snapshot);
+    void Unsubscribe(int subscription_id);
+
+    // Take in one report of the remote in `slot`
+    void HandleInput(int slot, const WiimoteInputState& input);
+
+    Stats GetStats() const;
+
+private:
+    // A remote whose last report is older than this does not hold the
+    // timeline back
+    static constexpr auto STALE_TIMEOUT = std::chrono::milliseconds(100);
+    // Reports kept per remote for snapshots, 320 ms at 100 Hz
+    static constexpr size_t HISTORY = 32;
+
+    struct Sample
+    {
+        Clock::time_point time;
+        uint16_t buttons = 0;
+        bool accel_calibrated = false;
+        float accel_g[3] = {};
+    };
+
+    struct Remote
+    {
+        Sample history[HISTORY];
+        size_t count = 0;    // samples in the history
+        size_t next = 0;     // where the next one goes
+        Clock::time_point received;
+    };
+
+    struct Subscription
+    {
+        int id;
+        EventCallback on_event;
+        Clock::duration snapshot_period;
+        SnapshotCallback on_snapshot;
+        // Timeline time of the next snapshot; set at the first tick
+        Clock::time_point next_snapshot;
+        bool started;
+    };
+
+    InputTimeline();
+    ~InputTimeline();
+    InputTimeline(const InputTimeline&) = delete;
+    InputTimeline& operator=(const InputTimeline&) = delete;
+
+    // Reports and the events not yet released
+    mutable std::mutex m_input_mutex;
+    Remote m_remotes[MAX_SLOTS];
+    std::vector<TimelineEvent> m_pending;
+    // Everything sampled up to here has been released
+    Clock::time_point m_timeline;
+    uint64_t m_samples;
+
+    // Held while callbacks run
+    std::mutex m_subscription_mutex;
+    std::vector<Subscription> m_subscriptions;
+    int m_next_subscription_id;
+    int m_registry_subscription;
+
+    // Serializes starting and stopping the thread; never held by it
+    std::mutex m_thread_mutex;
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+    PreciseTimer m_timer;
+
+    mutable std::mutex m_stats_mutex;
+    Stats m_stats;
+    double m_total_event_delay_us;
+
+    void ThreadProc();
+    void Tick(Clock::time_point now);
+    // Move the timeline as far as the reports allow and take the events up
+    // to it; call with m_input_mutex held
+    Clock::time_point AdvanceLocked(Clock::time_point now, std::vector<TimelineEvent>& events, int& remotes);
+    void TakeSnapshotLocked(Clock::time_point time, TimelineSnapshot& snapshot) const;
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Shared I/O loop for every open HID handle. On Windows the handles are
+// attached to one I/O completion port, on Linux to one epoll instance. Each
+// registered handle always has a read outstanding; completed reads, writes
+// and timers are dispatched to their handlers on a small pool of reactor
+// threads, so the number of threads does not grow with the number of remotes.
+//
+// Handlers of one handle never run concurrently with Unregister: once it
+// returns, no handler of that handle is running or will run again.
+class IoReactor
+{
+public:
+    using Clock = std::chrono::steady_clock;
+#ifdef _WIN32
+    using NativeHandle = HANDLE;
+#else
+    using NativeHandle = int;
+#endif
+    using ReadHandler = std::function<void(const uint8_t* data, size_t size)>;
+    // Called once when reading fails, typically because the remote went away
+    using CloseHandler = std::function<void(unsigned long error)>;
+    using WriteCallback = std::function<void(bool success, double latency_ms)>;
+    using TimerCallback = std::function<void(Clock::time_point now)>;
+
+    static constexpr size_t DEFAULT_THREADS = 2;
+
+    struct Stats
+    {
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        uint64_t write_failures = 0;
+        uint64_t timer_runs = 0;
+        uint64_t wakeups = 0;
+        size_t handles = 0;
+        size_t timers = 0;
+        size_t threads = 0;
+    };
+
+    static IoReactor& Instance()
+    {
+        static IoReactor instance;
+        return instance;
+    }
+
+    // Started on first use; Start is only needed to pick the thread count
+    bool Start(size_t threads = DEFAULT_THREADS);
+    void Stop();
+    bool IsRunning() const { return m_running; }
+
+    // Take ownership of an open handle and start reading reports of up to
+    // read_size bytes. On Windows the handle must be opened for overlapped
+    // I/O. Returns an id for Write and Unregister, or -1 on failure.
+    int Register(NativeHandle handle, size_t read_size, ReadHandler on_read, CloseHandler on_close);
+    // Cancel outstanding I/O, wait for running handlers and close the handle.
+    // Writes not yet done complete with a failure before it returns, except
+    // when called on a reactor thread on Windows, where they complete once
+    // their cancellation comes through the port.
+    void Unregister(int id);
+
+    // Queue an asynchronous write. The callback runs on a reactor thread, or
+    // in Unregister when the write is dropped.
+    bool Write(int id, const uint8_t* data, size_t size, WriteCallback callback = nullptr);
+
+    // Run `callback` every `period` on a reactor thread. Returns an id for
+    // RemoveTimer, which like Unregister waits for a running callback. A
+    // timer with a zero period only runs when armed.
+    int AddTimer(Clock::duration period, TimerCallback callback);
+    // Run the timer once at `deadline`, unless it is due earlier anyway
+    void ArmTimer(int id, Clock::time_point deadline);
+    void RemoveTimer(int id);
+
+    Stats GetStats() const;
+
+private:
+    struct Entry;
+    struct Operation;
+
+    struct Timer
+    {
+        Clock::duration period;
+        Clock::time_point deadline;
+        TimerCallback callback;
+        bool running = false;
+        bool removed = false;
+        std::thread::id thread;
+    };
+
+    IoReactor() = default;
+    ~IoReactor();
+    IoReactor(const IoReactor&) = delete;
+    IoReactor& operator=(const IoReactor&) = delete;
+
+    std::atomic<bool> m_running{ false };
+    std::vector<std::thread> m_threads;
+    std::mutex m_start_mutex;
+
+    mutable std::mutex m_mutex;
+    std::map<int, std::shared_ptr<Entry>> m_entries;
+    int m_next_id = 1;
+
+    mutable std::mutex m_timer_mutex;
+    std::condition_variable m_timer_cv;
+    std::map<int, Timer> m_timers;
+    int m_next_timer_id = 1;
+
+    std::atomic<uint64_t> m_reads{ 0 };
+    std::atomic<uint64_t> m_writes{ 0 };
+    std::atomic<uint64_t> m_write_failures{ 0 };
+    std::atomic<uint64_t> m_timer_runs{ 0 };
+    std::atomic<uint64_t> m_wakeups{ 0 };
+
+#ifdef _WIN32
+    HANDLE m_port = nullptr;
+    bool StartRead(const std::shared_ptr<Entry>& entry, Operation* op);
+    void CompleteOperation(Operation* op);
+#else
+    int m_epoll = -1;
+    int m_wake_fd = -1;
+    void HandleEvents(const std::shared_ptr<Entry>& entry, uint32_t events);
+    // One round of events; false once the handle has failed
+    bool HandleEventsOnce(Entry& entry, uint32_t events);
+    void Rearm(Entry& entry);
+#endif
+
+    void ThreadProc();
+    void Wake();
+    std::shared_ptr<Entry> FindEntry(int id) const;
+    bool Dispatch(Entry& entry, const std::function<void()>& handler);
+    void NotifyClosed(Entry& entry, unsigned long error);
+    void RunTimers(Clock::time_point now);
+    int GetWaitTimeoutMs(Clock::time_point now);
+};
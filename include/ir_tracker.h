@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <chrono>
+#include "wiimote_input.h"
+
+// Turns the raw IR dots of one remote into a steady pointer. The camera
+// reports up to four dots per frame, but dots flicker out, come back in a
+// different slot and jitter by a pixel or two. Each dot is therefore
+// matched to a persistent track, and every track runs a constant-velocity
+// Kalman filter per axis; a track that misses a few frames coasts on its
+// prediction instead of disappearing. The two ends of the sensor bar are
+// followed by track, so the bar keeps its orientation past 90 degrees of
+// roll and survives one end going out of view.
+class IrTracker
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr int MAX_TRACKS = 4;
+
+    struct Track
+    {
+        uint32_t id = 0;
+        bool active = false;
+        float x = 0.0f;    // filtered position in camera pixels
+        float y = 0.0f;
+        float vx = 0.0f;   // pixels per second
+        float vy = 0.0f;
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+    };
+
+    struct Config
+    {
+        // Farthest a dot may be from a track's prediction and still belong to it
+        float gate_px = 96.0f;
+        // Frames a track coasts on its prediction before it is dropped
+        uint32_t max_misses = 4;
+        // Standard deviation of the dot position noise, and of the hand's
+        // acceleration the filter expects
+        float measurement_noise_px = 1.5f;
+        float acceleration_noise_px = 4000.0f;
+        // Distance between the sensor bar's emitter groups
+        float bar_width_m = 0.2f;
+    };
+
+    struct Stats
+    {
+        uint64_t frames = 0;
+        uint64_t tracks_started = 0;
+        uint64_t tracks_dropped = 0;
+        // Frames in which a bar end was out of view and was extrapolated
+        uint64_t extrapolated = 0;
+        double average_update_us = 0.0;
+        double max_update_us = 0.0;
+    };
+
+    IrTracker();
+    explicit IrTracker(const Config& config);
+
+    // Feed one frame of dots; fills in the pointer
+    void Update(const IrDot dots[4], Clock::time_point time, IrPointer& pointer);
+    // Forget all tracks, e.g. when the camera is switched off
+    void Reset();
+
+    int GetTracks(Track tracks[MAX_TRACKS]) const;
+    Stats GetStats() const;
+
+private:
+    // Kalman state for one axis: position, velocity and their covariance
+    struct Axis
+    {
+        float position;
+        float velocity;
+        float p00, p01, p11;
+    };
+
+    struct TrackState
+    {
+        Track track;
+        Axis axis[2];
+    };
+
+    Config m_config;
+
+    mutable std::mutex m_mutex;
+    TrackState m_tracks[MAX_TRACKS];
+    uint32_t m_next_id;
+    bool m_has_time;
+    Clock::time_point m_last_time;
+
+    // Track ids of the left and right end of the bar, and the bar as last
+    // seen in full, for when one end goes out of view
+    uint32_t m_bar_ids[2];
+    float m_bar_dx;
+    float m_bar_dy;
+    bool m_has_bar;
+
+    Stats m_stats;
+    double m_total_update_us;
+
+    void Predict(float dt);
+    void Associate(const IrDot dots[4]);
+    bool FindBar(float bar[2][2]);
+    void ComputePointer(const float bar[2][2], IrPointer& pointer) const;
+    TrackState* FindTrack(uint32_t id);
+};
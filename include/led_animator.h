@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include "precise_timer.h"
+
+// One step of an LED timeline. Brightness below 255 is produced by toggling
+// the LEDs on and off from frame to frame, so it only looks smooth at high
+// frame rates; it ramps linearly from brightness_start to brightness_end
+// over the step.
+struct LedKeyframe
+{
+    uint8_t mask;
+    uint32_t duration_ms;
+    uint8_t brightness_start = 255;
+    uint8_t brightness_end = 255;
+};
+
+struct LedTimeline
+{
+    std::vector<LedKeyframe> frames;
+    // A timeline that does not loop holds its last frame
+    bool loop = true;
+};
+
+// Plays LED timelines on the tracked remotes from a single thread. Frames are
+// computed at a fixed rate against absolute deadlines of a monotonic clock,
+// so timing errors do not add up, and only frames that change a remote's
+// LEDs are handed to the output function. Remotes without a timeline of their
+// own follow the default one, all in step.
+class LedAnimator
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    // Receives the remotes whose LEDs changed this frame and their new masks
+    using OutputFunction = std::function<void(const std::vector<std::pair<std::wstring, uint8_t>>& changes)>;
+
+    static constexpr uint32_t DEFAULT_FRAME_RATE = 50;
+
+    struct Stats
+    {
+        uint64_t frames = 0;
+        uint64_t changes = 0;
+        // Frames started more than a whole period late and skipped ahead
+        uint64_t overruns = 0;
+        double average_jitter_ms = 0.0;
+        double max_jitter_ms = 0.0;
+        size_t devices = 0;
+    };
+
+    static LedAnimator& Instance()
+    {
+        static LedAnimator instance;
+        return instance;
+    }
+
+    // Steady player LED; players past 4 wrap around
+    static LedTimeline PlayerNumber(int player);
+    // One LED running back and forth while a remote waits to be paired
+    static LedTimeline PairingChase(uint32_t step_ms = 150);
+    // Each pattern held for step_ms in turn
+    static LedTimeline Rotation(const std::vector<uint8_t>& patterns, uint32_t step_ms);
+    // Two short flashes of all LEDs every two seconds
+    static LedTimeline LowBatteryBlink();
+    // `mask` fading in and out over period_ms
+    static LedTimeline Breathe(uint8_t mask, uint32_t period_ms = 2000);
+
+    bool Start(uint32_t frame_rate = DEFAULT_FRAME_RATE);
+    void Stop();
+    bool IsRunning() const { return m_running; }
+
+    void SetOutput(OutputFunction output);
+    void SetDefault(const LedTimeline& timeline);
+
+    // Remotes the default timeline is played on
+    void AddDevice(const std::wstring& device_path);
+    void RemoveDevice(const std::wstring& device_path);
+
+    // Play `timeline` on one remote from its first frame, in place of the
+    // default. StopAnimation returns the remote to the default timeline.
+    void Play(const std::wstring& device_path, const LedTimeline& timeline);
+    void StopAnimation(const std::wstring& device_path);
+
+    Stats GetStats() const;
+
+private:
+    struct Animation
+    {
+        bool tracked = false;
+        std::shared_ptr<const LedTimeline> timeline;
+        Clock::time_point start;
+        int last_mask = -1;
+        uint32_t brightness_error = 0;
+    };
+
+    LedAnimator();
+    ~LedAnimator();
+    LedAnimator(const LedAnimator&) = delete;
+    LedAnimator& operator=(const LedAnimator&) = delete;
+
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+    Clock::duration m_period;
+    Clock::time_point m_epoch;
+
+    PreciseTimer m_timer;
+
+    mutable std::mutex m_mutex;
+    std::map<std::wstring, Animation> m_animations;
+    std::shared_ptr<const LedTimeline> m_default;
+    OutputFunction m_output;
+
+    Stats m_stats;
+    double m_total_jitter_ms;
+
+    void ThreadProc();
+    void RenderFrame(Clock::time_point now);
+    static uint8_t Evaluate(const LedTimeline& timeline, Clock::duration elapsed, uint32_t& brightness_error);
+};
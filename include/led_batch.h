@@ -0,0 +1,53 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <chrono>
+
+// Sets the player LEDs of many remotes in one pass. Remotes with an open
+// WiimoteDevice get the change through their output scheduler and count as
+// done once the remote has acknowledged that LED report; the others are opened for
+// overlapped I/O and all written at once. Run returns when every write has
+// finished or the timeout has passed, so the remotes change together instead
+// of one write latency after another. If waiting fails, the writes still
+// pending are cancelled and counted as failed. Run blocks for up to the
+// timeout, so it belongs on a thread that can wait.
+class LedBatch
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr DWORD DEFAULT_TIMEOUT_MS = 250;
+
+    struct Result
+    {
+        size_t requested = 0;
+        size_t completed = 0;
+        size_t failed = 0;
+        size_t timed_out = 0;
+        // Paths that could not be opened; the remote has most likely gone
+        std::vector<std::wstring> unreachable;
+        // First to last remote changing
+        double spread_ms = 0.0;
+        double max_latency_ms = 0.0;
+        double total_ms = 0.0;
+    };
+
+    // Set the 4-bit LED mask of one remote; a later call for the same path
+    // replaces the earlier one
+    void Add(const std::wstring& device_path, uint8_t mask);
+    bool IsEmpty() const { return m_writes.empty(); }
+
+    Result Run(DWORD timeout_ms = DEFAULT_TIMEOUT_MS);
+
+private:
+    struct Write
+    {
+        std::wstring device_path;
+        uint8_t mask;
+    };
+
+    std::vector<Write> m_writes;
+};
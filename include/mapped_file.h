@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// A file mapped read/write into memory. The file is created, and grown to
+// the requested size, if needed. OpenShared maps a named region backed by
+// the paging file instead, for sharing memory with other processes; on
+// POSIX systems a shm_open object named after the part of the name past
+// its last backslash.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const std::string& path, size_t size);
+    // With `create` the region is created (or joined, if another process
+    // created it first) read/write; without, an existing one is opened
+    // read-only.
+    bool OpenShared(const std::wstring& name, size_t size, bool create);
+    void Close();
+    void Flush();
+
+    bool IsOpen() const { return m_view != nullptr; }
+    void* GetData() const { return m_view; }
+    size_t GetSize() const { return m_size; }
+
+    // True if the file or region did not exist, or was too small, before Open
+    bool WasCreated() const { return m_created; }
+
+private:
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#else
+    int m_file;
+#endif
+    void* m_view;
+    size_t m_size;
+    bool m_created;
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include "wiimote_input.h"
+#include "wiimote_extension.h"
+#include "precise_timer.h"
+
+enum MotionChannel
+{
+    MOTION_ACCEL_X,         // g, gravity included
+    MOTION_ACCEL_Y,
+    MOTION_ACCEL_Z,
+    MOTION_GYRO_PITCH,      // degrees per second, from the MotionPlus; 0 without one
+    MOTION_GYRO_ROLL,
+    MOTION_GYRO_YAW,
+    MOTION_CHANNEL_COUNT
+};
+
+// One sample of every remote, channel-major so that a stage runs over all
+// remotes of a channel in one loop: values[channel][lane], the lane being
+// the remote's slot
+struct MotionBlock
+{
+    static constexpr size_t MAX_LANES = 32;
+
+    alignas(64) float values[MOTION_CHANNEL_COUNT][MAX_LANES] = {};
+    uint32_t lanes = 0;         // remotes with motion data
+    uint32_t gyro_lanes = 0;    // of those, remotes with a MotionPlus
+    float rate = 0.0f;          // samples per second of the stream
+    std::chrono::steady_clock::time_point time;
+};
+
+enum class MotionStageType : uint8_t
+{
+    RemoveBias,     // gyro zero-rate offset, learned while the remote is still
+    LowPass,        // first order, parameters[0] = cutoff in Hz
+    OneEuro,        // parameters[0] = minimum cutoff in Hz, parameters[1] = beta
+    Decimate,       // mean of every parameters[0] samples
+    Resample        // linear interpolation down to parameters[0] samples per second
+};
+
+struct MotionStage
+{
+    MotionStageType type = MotionStageType::LowPass;
+    float parameters[2] = {};
+
+    static MotionStage RemoveBias();
+    static MotionStage LowPass(float cutoff_hz);
+    static MotionStage OneEuro(float min_cutoff_hz, float beta);
+    static MotionStage Decimate(int factor);
+    // Does not filter; put a low pass with a cutoff below half the new rate
+    // in front of it
+    static MotionStage Resample(float rate_hz);
+
+    bool operator==(const MotionStage& other) const
+    {
+        return type == other.type && parameters[0] == other.parameters[0] &&
+               parameters[1] == other.parameters[1];
+    }
+};
+
+// Runs the motion of all remotes through chains of DSP stages. A consumer
+// subscribes with the chain it wants, say bias removal, a 20 Hz low pass and
+// decimation by 2; chains are merged into a tree on their common prefixes,
+// so a stage several consumers ask for is computed once per sample.
+//
+// Reports of a remote arrive on its own reactor thread, at its own pace and
+// in bursts, so each remote keeps a short history of its reports by the
+// time the remote sampled them. One pacing thread runs the tree over all
+// remotes at BASE_RATE, above the 100 Hz the remotes report at, on a stream
+// time RESAMPLE_DELAY behind the clock: every lane is interpolated at that
+// time between the two reports around it, so a report late by less than
+// the delay is still used where it belongs, and no report is repeated.
+// Every stage then works on whole MotionBlocks with fixed-length loops over
+// the lanes that the compiler turns into vector instructions; state of a
+// lane is set from its first sample when a remote appears.
+class MotionPipeline
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using MotionCallback = std::function<void(const MotionBlock& block)>;
+
+    static constexpr size_t MAX_LANES = MotionBlock::MAX_LANES;
+    static constexpr float BASE_RATE = 200.0f;
+    // How far the stream runs behind the clock; a report sampled longer ago
+    // than this when it arrives is late
+    static constexpr auto RESAMPLE_DELAY = std::chrono::milliseconds(20);
+
+    struct Stats
+    {
+        uint64_t samples = 0;       // reports taken in
+        uint64_t late_samples = 0;  // of those, sampled behind the stream already
+        uint64_t ticks = 0;
+        uint64_t stage_runs = 0;    // stages run over a block
+        uint64_t overruns = 0;
+        double average_tick_us = 0.0;
+        double max_tick_us = 0.0;
+        size_t stages = 0;          // nodes of the tree
+        size_t subscriptions = 0;
+    };
+
+    static MotionPipeline& Instance()
+    {
+        static MotionPipeline instance;
+        return instance;
+    }
+
+    // Blocks at the end of `stages` go to `callback` on the pacing thread,
+    // which holds the tree meanwhile: callbacks must not subscribe or
+    // unsubscribe. Returns -1 for a chain that cannot run, such as a
+    // resample to a higher rate.
+    int Subscribe(const std::vector<MotionStage>& stages, MotionCallback callback);
+    void Unsubscribe(int subscription_id);
+
+    // Take in one report of the remote in `slot`
+    void HandleInput(int slot, const WiimoteInputState& input, const ExtensionState& extension);
+
+    Stats GetStats() const;
+
+private:
+    // A remote whose last report is older than this has left the stream
+    static constexpr auto STALE_TIMEOUT = std::chrono::milliseconds(100);
+    // Reports kept per remote; a tenth of a second and more at 100 Hz
+    static constexpr size_t HISTORY = 16;
+
+    // The latest reports of one remote, in the order it sampled them
+    struct LaneHistory
+    {
+        Clock::time_point times[HISTORY];
+        float values[HISTORY][MOTION_CHANNEL_COUNT];
+        bool gyro[HISTORY];
+        uint64_t count = 0;     // reports taken in; the newest is at (count - 1) % HISTORY
+    };
+
+    struct Subscription
+    {
+        int id;
+        MotionCallback callback;
+    };
+
+    struct Node
+    {
+        MotionStage stage;
+        std::vector<std::unique_ptr<Node>> children;
+        std::vector<Subscription> subscriptions;
+        // Lanes whose state has been set from a sample
+        uint32_t initialized = 0;
+        // Samples into the current output, for Decimate; position between
+        // outputs, for Resample
+        uint32_t count = 0;
+        float phase = 0.0f;
+        // Per stage: bias; output, previous input and
+        // its derivative; sum; previous input
+        alignas(64) float state[3][MOTION_CHANNEL_COUNT][MAX_LANES] = {};
+        MotionBlock output;
+    };
+
+    MotionPipeline();
+    ~MotionPipeline();
+    MotionPipeline(const MotionPipeline&) = delete;
+    MotionPipeline& operator=(const MotionPipeline&) = delete;
+
+    // Recent reports of every remote
+    mutable std::mutex m_input_mutex;
+    LaneHistory m_history[MAX_LANES];
+    Clock::time_point m_stream_time;    // of the last tick
+    uint64_t m_samples;
+    uint64_t m_late_samples;
+
+    // The tree; held while it runs
+    mutable std::mutex m_graph_mutex;
+    Node m_root;
+    int m_next_subscription_id;
+    int m_registry_subscription;
+    size_t m_node_count;
+    size_t m_subscription_count;
+
+    // Serializes starting and stopping the thread; never held by it
+    std::mutex m_thread_mutex;
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+    PreciseTimer m_timer;
+
+    mutable std::mutex m_stats_mutex;
+    Stats m_stats;
+    double m_total_tick_us;
+
+    void ThreadProc();
+    // Run the tree once on every remote's motion at stream time `time`
+    void Tick(Clock::time_point time);
+    uint64_t Run(Node& node, const MotionBlock& input);
+    // False when the stage has no output for this input, as a Decimate
+    // between outputs
+    static bool Process(Node& node, const MotionBlock& input);
+    static void InitializeLane(Node& node, const MotionBlock& input, size_t lane);
+    static bool RemoveSubscription(Node& node, int subscription_id, size_t& removed_nodes);
+};
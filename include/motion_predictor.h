@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+
+// Extrapolates a few channels of motion, such as the pointer position or
+// the tilt of one remote, from the latest report to the present and on by a
+// horizon. Reports are taken at the time the remote sampled them, so the
+// 8 - 15 ms a report is old by the time it is decoded is always made up;
+// the horizon covers what follows, until the output takes effect.
+//
+// Each channel runs an alpha-beta-gamma filter (position, velocity and
+// acceleration) over the reports as they come, whatever their spacing.
+// Every prediction returned is also checked against the reports that later
+// arrive around the time it stood for, which gives the error actually
+// achieved; the horizon can be shortened automatically when that error
+// grows too large, as it does for jerky motion.
+class MotionPredictor
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t MAX_CHANNELS = 4;
+
+    struct Config
+    {
+        // How far past the present to extrapolate
+        float horizon_ms = 12.0f;
+        // RMS error, in the units of the channels, above which the horizon
+        // is shortened in proportion; 0 for no limit
+        float max_error = 0.0f;
+        // 0 follows every report; towards 1 velocity and acceleration are
+        // averaged over more reports, steadier but slower to turn
+        float smoothing = 0.5f;
+    };
+
+    struct Stats
+    {
+        uint64_t samples = 0;
+        // Predictions compared with the reports for the time they stood for
+        uint64_t checked = 0;
+        double rms_error = 0.0;
+        // Of using the latest report as is, for comparison
+        double rms_error_unpredicted = 0.0;
+        // Current horizon over the configured one
+        float horizon_scale = 1.0f;
+    };
+
+    MotionPredictor();
+    MotionPredictor(size_t channels, const Config& config);
+
+    void Configure(size_t channels, const Config& config);
+    // Forget the motion so far, e.g. when the pointer leaves the screen
+    void Reset();
+
+    void Update(Clock::time_point time, const float* values);
+    // Values extrapolated to `now` plus the horizon; the latest report as is
+    // until there are two. The prediction is kept to be checked.
+    void Predict(Clock::time_point now, float* values);
+
+    Stats GetStats() const;
+
+private:
+    // Reports further apart than this are not one motion
+    static constexpr double MAX_GAP_S = 0.1;
+    // Extrapolation never reaches further ahead than this, however late
+    // the next report is
+    static constexpr double MAX_EXTRAPOLATION_S = 0.05;
+    static constexpr size_t MAX_PENDING = 8;
+
+    // A prediction waiting for the report at its time
+    struct Pending
+    {
+        Clock::time_point time;
+        float predicted[MAX_CHANNELS];
+        float latest[MAX_CHANNELS];
+    };
+
+    size_t m_channels;
+    Config m_config;
+    float m_alpha;
+    float m_beta;
+    float m_gamma;
+
+    uint64_t m_count;   // reports since the last reset
+    Clock::time_point m_time;
+    float m_latest[MAX_CHANNELS];
+    float m_position[MAX_CHANNELS];
+    float m_velocity[MAX_CHANNELS];
+    float m_acceleration[MAX_CHANNELS];
+
+    Pending m_pending[MAX_PENDING];
+    size_t m_pending_start;
+    size_t m_pending_count;
+    double m_squared_error;
+    double m_squared_error_unpredicted;
+    // Recent mean squared error, for the horizon limit
+    float m_recent_error;
+    float m_horizon_scale;
+    Stats m_stats;
+
+    void Extrapolate(double seconds, float* values) const;
+    void CheckPending(Clock::time_point time, const float* values);
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include "wiimote_protocol.h"
+
+// Output report queue for a single Wii Remote.
+//
+// LED, rumble, reporting mode and status requests are kept as pending state
+// rather than as reports, so repeated changes collapse into the latest value
+// and several changes can share one report: the rumble bit lives in byte 1 of
+// every output report, so a rumble change rides along with whatever report
+// goes out next. Other reports (register traffic, IR setup) are queued as
+// they are and get the current rumble bit ORed in. Reports are released no
+// faster than one per min_report_interval.
+//
+// Send order: a pending rumble change first, then reporting mode, queued
+// reports, LEDs and finally status requests. A rumble change given some slack
+// waits up to that long for another report to ride on before it is sent on
+// its own.
+//
+// State reports and reports submitted as acknowledged carry the acknowledge
+// flag and are matched to the 0x22 reports the remote answers with. A 0x22
+// only names the report id, and after a lost report a FIFO of several per
+// id would pair every later ack with the report before it; so only one
+// report per id waits for its ack at a time. A state change made meanwhile
+// goes out once that one is settled, as the latest value, and a queued
+// report waits with the reports behind it. One that is not acknowledged in
+// time is sent again; for state this re-sends the current value rather
+// than the lost one.
+//
+// Speaker data is paced by the speaker streamer and goes out through
+// SendNow, past the queue and the rate cap; reports from the queue keep
+// their spacing behind it.
+//
+// When Drain has to stop short of work, because of the rate cap, a deferred
+// rumble change or an acknowledgement still out, the wake function is told
+// when to call it again, so pacing does not depend on a periodic tick.
+class OutputScheduler
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using SendFunction = std::function<bool(const uint8_t* report, size_t size)>;
+    // Asks for Drain to be called at `when`
+    using WakeFunction = std::function<void(Clock::time_point when)>;
+    // Told once whether a state change reached the remote
+    using DeliveryCallback = std::function<void(bool delivered)>;
+
+    struct Config
+    {
+        std::chrono::microseconds min_report_interval{ 5000 };
+        size_t max_queued_reports = 64;
+        bool acknowledge_state = true;
+        std::chrono::milliseconds ack_timeout{ 100 };
+        int max_retransmits = 3;
+    };
+
+    struct Stats
+    {
+        uint64_t reports_sent = 0;
+        uint64_t send_failures = 0;
+        uint64_t coalesced = 0;
+        uint64_t rate_limited = 0;
+        uint64_t dropped = 0;
+        // Reports sent past the queue by SendNow
+        uint64_t sent_now = 0;
+        double average_latency_ms = 0.0;
+        double max_latency_ms = 0.0;
+
+        // Acknowledged delivery
+        uint64_t delivered = 0;
+        uint64_t retransmits = 0;
+        // Reports not acknowledged in time, and those given up on after
+        // the last retransmission
+        uint64_t timeouts = 0;
+        uint64_t lost = 0;
+        uint64_t device_errors = 0;
+        uint64_t unmatched_acks = 0;
+        double average_delivery_ms = 0.0;
+        double max_delivery_ms = 0.0;
+        double loss_rate = 0.0;   // of the reports sent, how many timed out
+
+        // Rumble changes that rode on another report or needed one of their own
+        uint64_t rumble_carried = 0;
+        uint64_t rumble_reports = 0;
+        double average_rumble_latency_ms = 0.0;
+        double max_rumble_latency_ms = 0.0;
+    };
+
+    explicit OutputScheduler(SendFunction send);
+    OutputScheduler(SendFunction send, const Config& config);
+
+    OutputScheduler(const OutputScheduler&) = delete;
+    OutputScheduler& operator=(const OutputScheduler&) = delete;
+
+    // Set before the first report; without one Drain relies on being called
+    // periodically
+    void SetWakeFunction(WakeFunction wake);
+
+    // Queue a complete output report. With `acknowledged` the report is sent
+    // with the acknowledge flag and retransmitted until the remote confirms
+    // it. Returns false when the queue is full.
+    bool Submit(const uint8_t* report, size_t size, bool acknowledged = false);
+    // Send a report at once with the current rumble bit, for streams that
+    // keep their own time. It is never acknowledged or retransmitted.
+    bool SendNow(const uint8_t* report, size_t size);
+
+    // `on_delivered` is called with true once a report carrying this mask,
+    // or a later one that replaced it, has been acknowledged (sent, without
+    // acknowledgements), and with false when it is given up on or cleared.
+    // It runs on the thread that settles it, without the scheduler locked.
+    void SetLeds(uint8_t mask, DeliveryCallback on_delivered = nullptr);
+    // With `slack` the change may be held back that long in the hope that
+    // another report goes out and carries it
+    void SetRumble(bool on, Clock::duration slack = Clock::duration::zero());
+    // Re-sending the same mode is not a no-op: the remote needs the mode
+    // again after every status report.
+    void SetReportingMode(bool continuous, uint8_t mode);
+    void RequestStatus();
+
+    // Consume a 0x22 acknowledgement for a report sent with the acknowledge
+    // flag. Acknowledgements of memory writes are left to the register engine.
+    bool HandleAck(const uint8_t* report, size_t size);
+
+    // Retransmit what timed out and send whatever the rate cap allows.
+    // Called after every change and when the wake function asks for it.
+    void Drain();
+
+    // Drop everything pending, e.g. when the device closes
+    void Clear();
+
+    bool IsIdle() const;
+    uint8_t GetLeds() const;
+    bool GetRumble() const;
+    Stats GetStats() const;
+
+private:
+    // What a report on the wire was generated from
+    enum Source
+    {
+        SOURCE_RUMBLE,
+        SOURCE_MODE,
+        SOURCE_LEDS,
+        SOURCE_STATUS,
+        SOURCE_STATE_COUNT,
+        SOURCE_QUEUE = SOURCE_STATE_COUNT
+    };
+
+    struct QueuedReport
+    {
+        uint8_t data[WiimoteProtocol::MAX_REPORT_SIZE];
+        size_t size = 0;
+        Clock::time_point queued;
+        bool acknowledged = false;
+        int attempts = 0;
+    };
+
+    struct PendingState
+    {
+        bool dirty = false;
+        Clock::time_point queued;
+        // Latest time the change may go out; only rumble is ever deferred
+        Clock::time_point due;
+        int attempts = 0;
+    };
+
+    struct AwaitingAck
+    {
+        Source source;
+        QueuedReport report;
+        Clock::time_point sent;
+        std::vector<DeliveryCallback> callbacks;
+    };
+
+    SendFunction m_send;
+    WakeFunction m_wake;
+    Config m_config;
+
+    mutable std::mutex m_mutex;
+    std::deque<QueuedReport> m_queue;
+    // Reports sent with the acknowledge flag, by report id
+    std::map<uint8_t, AwaitingAck> m_awaiting_ack;
+
+    uint8_t m_leds;
+    bool m_rumble;
+    bool m_continuous;
+    uint8_t m_mode;
+    PendingState m_state[SOURCE_STATE_COUNT];
+    // Waiting for the pending value of each state to be settled
+    std::vector<DeliveryCallback> m_callbacks[SOURCE_STATE_COUNT];
+
+    Clock::time_point m_next_send;
+    bool m_was_rate_limited;
+    bool m_draining;
+    // Earliest wake asked for that has not come yet
+    Clock::time_point m_wake_at;
+
+    Stats m_stats;
+    double m_total_latency_ms;
+    double m_total_delivery_ms;
+    double m_total_rumble_latency_ms;
+
+    void MarkDirtyLocked(Source source, Clock::duration slack = Clock::duration::zero());
+    static uint8_t GetReportId(Source source);
+    // Whether `source` has a report to send that is not held back by an ack
+    bool IsReadyLocked(Source source, Clock::time_point now) const;
+    bool HasWorkLocked(Clock::time_point now) const;
+    bool TakeNextLocked(Clock::time_point now, QueuedReport& report, Source& source);
+    void BuildStateReportLocked(Source source, QueuedReport& report) const;
+    // Callbacks of reports given up on are added to `failed`
+    void CheckAckTimeoutsLocked(Clock::time_point now, std::vector<DeliveryCallback>& failed);
+    // When Drain next has something to do; max when nothing is waiting
+    Clock::time_point GetNextWakeLocked(Clock::time_point now) const;
+    // Ask for a wake at the next time Drain has work, unless one is due by then
+    void ScheduleWake();
+    void UpdateLossRateLocked();
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Sleeps until absolute deadlines of the steady clock for threads that pace
+// output, such as LED frames and speaker data. On Windows this waits on a
+// high-resolution waitable timer where the system has one, since a plain
+// Sleep or wait is only as fine as the 15.6 ms system tick.
+class PreciseTimer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    PreciseTimer();
+    ~PreciseTimer();
+
+    PreciseTimer(const PreciseTimer&) = delete;
+    PreciseTimer& operator=(const PreciseTimer&) = delete;
+
+    bool Open();
+    void Close();
+
+    // Returns false without waiting out the deadline once Cancel is called
+    bool WaitUntil(Clock::time_point deadline);
+    void Cancel();
+    // Make the timer usable again after Cancel
+    void Reset();
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cancel_cv;
+    bool m_cancelled;
+#ifdef _WIN32
+    HANDLE m_timer;
+    HANDLE m_cancel_event;
+#endif
+};
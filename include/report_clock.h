@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <chrono>
+
+// Estimates when a remote took each of its reports from when they arrived.
+// The remote samples on its own clock, one report per period, but the
+// Bluetooth stack hands reports over in bursts, so arrival times are the
+// sample times plus a delay that varies from report to report.
+//
+// The model is a grid of sample times, a phase and a period, followed
+// through the arrivals like a phase-locked loop. Batching only ever delays
+// a report, so the grid follows arrivals that come earlier than it quickly
+// and later ones only slowly: it settles on the least delayed reports,
+// and the time of a report is the grid point it belongs to. That needs
+// continuous reporting: otherwise the remote skips the periods in which
+// nothing changed and reports keep their arrival time.
+class ReportClock
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats
+    {
+        uint64_t reports = 0;
+        double period_us = 0.0;
+        // Remote's clock against the host's, from the period
+        double drift_ppm = 0.0;
+        // Arrival behind the estimated sample time
+        double average_jitter_us = 0.0;
+        double max_jitter_us = 0.0;
+        // Grid points whose report was lost, and silences the model restarted after
+        uint64_t skipped_periods = 0;
+        uint64_t gaps = 0;
+    };
+
+    ReportClock();
+
+    // Take the arrival of one data report; returns its estimated sample
+    // time, or the arrival unless the remote reports `continuous`ly.
+    Clock::time_point Update(Clock::time_point arrival, bool continuous);
+    void Reset();
+
+    Stats GetStats() const;
+
+private:
+    // Reports in continuous mode come at 100 Hz by the remote's clock
+    static constexpr double NOMINAL_PERIOD_S = 0.01;
+    static constexpr double MIN_PERIOD_S = 0.002;
+    static constexpr double MAX_PERIOD_S = 0.05;
+    // After this long without a report the phase is taken afresh
+    static constexpr double MAX_GAP_S = 0.5;
+
+    mutable std::mutex m_mutex;
+    bool m_has_time;
+    Clock::time_point m_sample_time;
+    double m_period_s;
+    // Longest recent delay of an arrival behind the grid
+    double m_max_delay_s;
+    Stats m_stats;
+    // Reports placed on the grid, which the jitter is over
+    uint64_t m_timed_reports;
+    double m_total_jitter_us;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <chrono>
+
+// What a consumer needs from a remote's data reports
+enum InputFeature : uint32_t
+{
+    INPUT_FEATURE_BUTTONS    = 0x01,
+    INPUT_FEATURE_ACCEL      = 0x02,
+    INPUT_FEATURE_IR         = 0x04,
+    INPUT_FEATURE_EXTENSION  = 0x08,
+    // Report at the full rate even when nothing changed
+    INPUT_FEATURE_CONTINUOUS = 0x100,
+};
+
+// IR camera data formats written to register 0xB00033
+enum class IrMode : uint8_t
+{
+    Off = 0,
+    Basic = 1,
+    Extended = 3
+};
+
+// Picks the smallest data reporting mode that covers what the consumers of
+// one remote subscribed to, and tracks how much air time the remote uses.
+// Every remote on an adapter shares the same radio, so a remote that only
+// needs buttons should not stream 21-byte reports.
+class ReportingModeManager
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Selection
+    {
+        uint8_t mode = 0;
+        bool continuous = false;
+        IrMode ir_mode = IrMode::Off;
+
+        bool operator==(const Selection& other) const
+        {
+            return mode == other.mode && continuous == other.continuous && ir_mode == other.ir_mode;
+        }
+        bool operator!=(const Selection& other) const { return !(*this == other); }
+    };
+
+    struct Traffic
+    {
+        double input_bytes_per_second = 0.0;
+        double output_bytes_per_second = 0.0;
+        double input_reports_per_second = 0.0;
+    };
+
+    ReportingModeManager();
+
+    static Selection Select(uint32_t features, size_t extension_bytes);
+
+    void SetFeatures(uint32_t features);
+    void SetExtensionBytes(size_t extension_bytes);
+    uint32_t GetFeatures() const;
+
+    // Recompute the selection. Returns true if it differs from the one last
+    // returned, in which case the caller must reconfigure the remote.
+    bool Update(Selection& selection);
+    Selection GetSelection() const;
+
+    void RecordInput(size_t bytes, Clock::time_point now);
+    void RecordOutput(size_t bytes, Clock::time_point now);
+    Traffic GetTraffic(Clock::time_point now) const;
+
+private:
+    // Traffic is summed over a sliding window of short buckets
+    static constexpr int BUCKET_COUNT = 10;
+    static constexpr std::chrono::milliseconds BUCKET_LENGTH{ 100 };
+
+    struct Bucket
+    {
+        int64_t index = -1;
+        uint64_t input_bytes = 0;
+        uint64_t output_bytes = 0;
+        uint32_t input_reports = 0;
+    };
+
+    mutable std::mutex m_mutex;
+    uint32_t m_features;
+    size_t m_extension_bytes;
+    Selection m_selection;
+    bool m_has_selection;
+    Bucket m_buckets[BUCKET_COUNT];
+
+    Bucket& BucketForLocked(Clock::time_point now);
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <functional>
+
+// One step of a rumble waveform; intensity ramps linearly from
+// intensity_start to intensity_end over the step
+struct RumbleStep
+{
+    float intensity_start;
+    float intensity_end;
+    uint32_t duration_ms;
+};
+
+struct RumbleWaveform
+{
+    std::vector<RumbleStep> steps;
+    bool loop = false;
+};
+
+// Turns rumble intensity for one remote into on/off changes of the rumble
+// bit. The Wii Remote's motor can only be switched on and off, so a partial
+// intensity is approximated by switching it on for the matching share of the
+// time, decided slot by slot so the on-time accumulated so far tracks the
+// requested intensity. Changes are handed on with some slack so they can
+// ride on output reports that are going out anyway.
+class RumblePlayer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using SetRumbleFunction = std::function<void(bool on, Clock::duration slack)>;
+
+    struct Config
+    {
+        // Shortest time the motor stays on or off while modulating
+        std::chrono::milliseconds slot{ 10 };
+        // How long a modulation change may wait for a report to ride on.
+        // Kept below the device tick so a change is due by the next drain.
+        std::chrono::milliseconds slack{ 5 };
+    };
+
+    struct Stats
+    {
+        uint64_t commands = 0;
+        uint64_t toggles = 0;
+        // On-time delivered minus on-time requested, over the current command
+        double error_ms = 0.0;
+        double max_error_ms = 0.0;
+    };
+
+    explicit RumblePlayer(SetRumbleFunction set_rumble);
+    RumblePlayer(SetRumbleFunction set_rumble, const Config& config);
+
+    RumblePlayer(const RumblePlayer&) = delete;
+    RumblePlayer& operator=(const RumblePlayer&) = delete;
+
+    // Constant intensity from 0 to 1 until the next command
+    void SetIntensity(float intensity);
+    void Play(const RumbleWaveform& waveform);
+    void Stop();
+
+    // Advance the modulation; called from the device's I/O tick
+    void Update(Clock::time_point now);
+
+    bool IsActive() const;
+    Stats GetStats() const;
+
+private:
+    SetRumbleFunction m_set_rumble;
+    Config m_config;
+
+    mutable std::mutex m_mutex;
+    RumbleWaveform m_waveform;
+    bool m_active;
+    Clock::time_point m_start;
+    Clock::time_point m_last_update;
+    bool m_on;
+    float m_intensity;
+    // Requested minus delivered on-time, in ms
+    double m_error_ms;
+    Stats m_stats;
+
+    void StartLocked(RumbleWaveform waveform, Clock::time_point now);
+    float IntensityAtLocked(Clock::time_point now, bool& finished) const;
+    // Returns true when the motor has to be switched
+    bool StepLocked(Clock::time_point now);
+};
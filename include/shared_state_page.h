@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include "mapped_file.h"
+#include "wiimote_input.h"
+#include "wiimote_extension.h"
+
+// Latest decoded state of one remote, as laid out in shared memory. Plain
+// fixed-size fields only, so other processes can map the same layout.
+struct SharedRemoteState
+{
+    uint64_t bt_address;
+    // steady_clock time of the report in microseconds; the same clock as
+    // QueryPerformanceCounter on Windows
+    uint64_t timestamp_us;
+    uint32_t report_count;
+    uint16_t buttons;
+    uint8_t connected;
+    uint8_t battery_percent;
+    uint8_t battery_low;
+    uint8_t extension_type;    // ExtensionType
+    uint8_t extension_size;
+    uint8_t ir_valid;          // bit n set when ir_x/ir_y[n] hold a dot
+
+    uint16_t accel_raw[3];
+    uint8_t accel_calibrated;
+    uint8_t pointer_visible;
+    float accel_g[3];
+    // From gravity, so only meaningful while the remote is held still
+    float pitch;
+    float roll;
+
+    uint16_t ir_x[4];
+    uint16_t ir_y[4];
+    uint8_t ir_size[4];
+    float pointer_x;
+    float pointer_y;
+    float pointer_roll;
+    float pointer_distance_m;
+
+    uint8_t extension[21];
+    uint8_t nunchuk_stick[2];
+    uint8_t reserved;
+    float nunchuk_accel_g[3];
+    uint16_t classic_buttons;
+    uint16_t reserved2;
+    float balance_kg[BALANCE_SENSOR_COUNT];
+    float balance_weight_kg;
+    float balance_center[2];
+};
+
+// Publishes every remote's latest state into a named shared-memory region,
+// so programs on the same machine can read the remotes without opening the
+// HID devices and racing with the bridge.
+//
+// Each slot is guarded by a sequence counter (a seqlock): the writer makes
+// it odd, writes the state and makes it even again. Readers never block the
+// writer and make no system calls; they read the state in place and retry
+// if the counter was odd or changed while they were reading.
+class SharedStatePage
+{
+public:
+    static constexpr int MAX_SLOTS = 16;
+    static constexpr uint32_t MAGIC = 0x53535757;  // "WWSS"
+    static constexpr uint32_t VERSION = 1;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slot_count;
+        uint32_t slot_size;
+    };
+
+    struct alignas(64) Slot
+    {
+        std::atomic<uint32_t> sequence;
+        uint32_t reserved;
+        SharedRemoteState state;
+    };
+
+    struct Layout
+    {
+        Header header;
+        alignas(64) Slot slots[MAX_SLOTS];
+    };
+
+    struct Stats
+    {
+        uint64_t published = 0;
+        bool open = false;
+    };
+
+    static SharedStatePage& Instance()
+    {
+        static SharedStatePage instance;
+        return instance;
+    }
+
+    static const wchar_t* GetName() { return L"Local\\WiimoteBridgeState"; }
+
+    // Called with each decoded report of the remote in `slot`. Reports of one
+    // remote arrive one at a time, so every slot has a single writer.
+    void Publish(int slot, uint64_t bt_address, const WiimoteInputState& input,
+                 const ExtensionState& extension);
+    // Mark the slot's remote as gone
+    void Clear(int slot);
+
+    Stats GetStats() const;
+
+    // Reader side, for a mapping opened with MappedFile::OpenShared. Read in
+    // place between BeginRead and EndRead and use what was read only when
+    // EndRead returns true; Read copies a consistent snapshot.
+    static uint32_t BeginRead(const Slot& slot)
+    {
+        uint32_t sequence;
+        while ((sequence = slot.sequence.load(std::memory_order_acquire)) & 1)
+        {
+        }
+        return sequence;
+    }
+
+    static bool EndRead(const Slot& slot, uint32_t sequence)
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.sequence.load(std::memory_order_relaxed) == sequence;
+    }
+
+    static void Read(const Slot& slot, SharedRemoteState& state)
+    {
+        uint32_t sequence;
+        do
+        {
+            sequence = BeginRead(slot);
+            state = slot.state;
+        } while (!EndRead(slot, sequence));
+    }
+
+private:
+    SharedStatePage();
+    SharedStatePage(const SharedStatePage&) = delete;
+    SharedStatePage& operator=(const SharedStatePage&) = delete;
+
+    mutable std::mutex m_mutex;
+    MappedFile m_region;
+    std::atomic<Layout*> m_layout;
+    bool m_open_attempted;
+    std::atomic<uint64_t> m_published;
+
+    Layout* EnsureOpen();
+    static void Write(Slot& slot, const SharedRemoteState& state);
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "wiimote_speaker.h"
+#include "adpcm_encoder.h"
+#include "precise_timer.h"
+
+// Feeds every enabled Wii Remote speaker from one pacing thread. Each period
+// (40 samples at 3000 Hz ADPCM, 13.3 ms) it takes the next block of queued
+// audio from every speaker, encodes all of them in one pass of the
+// multi-lane ADPCM encoder and sends one 0x18 report per remote. Periods are
+// timed against absolute deadlines so spacing errors do not accumulate;
+// uneven spacing is audible as crackle.
+class SpeakerStreamer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t MAX_SPEAKERS = AdpcmEncoder::MAX_LANES;
+
+    struct Stats
+    {
+        uint64_t periods = 0;
+        uint64_t reports = 0;
+        // Periods started more than a whole period late and skipped ahead
+        uint64_t overruns = 0;
+        double average_jitter_ms = 0.0;
+        double max_jitter_ms = 0.0;
+        size_t speakers = 0;
+    };
+
+    static SpeakerStreamer& Instance()
+    {
+        static SpeakerStreamer instance;
+        return instance;
+    }
+
+    // Format and rate of all speakers; only changes while none is enabled
+    bool Configure(const SpeakerConfig& config);
+    SpeakerConfig GetConfig() const;
+
+    // Called by WiimoteSpeaker. Add starts the pacing thread with the first
+    // speaker; Remove waits for a period in progress and stops the thread
+    // with the last one.
+    bool Add(WiimoteSpeaker* speaker);
+    void Remove(WiimoteSpeaker* speaker);
+
+    Stats GetStats() const;
+
+private:
+    SpeakerStreamer();
+    ~SpeakerStreamer();
+    SpeakerStreamer(const SpeakerStreamer&) = delete;
+    SpeakerStreamer& operator=(const SpeakerStreamer&) = delete;
+
+    mutable std::mutex m_mutex;
+    SpeakerConfig m_config;
+    // Indexed by encoder lane; null where the lane is free
+    WiimoteSpeaker* m_speakers[MAX_SPEAKERS];
+    size_t m_count;
+    AdpcmEncoder m_encoder;
+    // One period of every lane, interleaved by sample for the encoder as
+    // input[i * lanes + lane], and one speaker's block
+    int16_t m_input[MAX_SPEAKERS * SpeakerConfig::MAX_SAMPLES_PER_REPORT];
+    int16_t m_block[SpeakerConfig::MAX_SAMPLES_PER_REPORT];
+
+    // Serializes starting and stopping the thread; never held by it
+    std::mutex m_thread_mutex;
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+    PreciseTimer m_timer;
+
+    Stats m_stats;
+    double m_total_jitter_ms;
+
+    void ThreadProc();
+    void RunPeriod();
+    Clock::duration GetPeriod() const;
+};
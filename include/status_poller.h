@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <random>
+
+// Decides when each remote should be sent a 0x15 status request. Requests
+// are spread across remotes with a minimum spacing and random jitter, the
+// interval backs off while the battery level is steady, and any 0x20 report
+// the remote sends on its own (extension plugged, reply to another request)
+// counts as a fresh reading and pushes the next poll out.
+class StatusPoller
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats
+    {
+        uint64_t requests = 0;
+        uint64_t replies = 0;
+        uint64_t unsolicited = 0;
+        uint64_t deferred = 0;
+        uint64_t timeouts = 0;
+    };
+
+    static StatusPoller& Instance()
+    {
+        static StatusPoller instance;
+        return instance;
+    }
+
+    void AddDevice(int slot, Clock::time_point now);
+    void RemoveDevice(int slot);
+
+    // Called from the device's I/O tick. Returns true when a status request
+    // should be sent now; the request is then considered in flight.
+    bool ShouldPoll(int slot, Clock::time_point now);
+
+    // Called for every 0x20 status report, requested or not
+    void HandleStatus(int slot, uint8_t battery, bool battery_low, Clock::time_point now);
+
+    Stats GetStats() const;
+
+private:
+    struct Entry
+    {
+        Clock::time_point next_poll;
+        Clock::time_point request_time;
+        bool request_pending = false;
+        Clock::duration interval{};
+        int last_battery = -1;
+        bool battery_low = false;
+        int steady_readings = 0;
+    };
+
+    StatusPoller();
+
+    Clock::duration Jitter(Clock::duration interval);
+
+    mutable std::mutex m_mutex;
+    std::map<int, Entry> m_entries;
+    Clock::time_point m_last_request;
+    std::minstd_rand m_random;
+    Stats m_stats;
+};
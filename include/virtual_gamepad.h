@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include "wiimote_input.h"
+#include "wiimote_extension.h"
+#include "input_remapper.h"
+
+// One remote as a standard gamepad. On Linux this is a uinput device that
+// gets every remapped report as evdev events: only the keys and axes that
+// changed, followed by a SYN_REPORT, in a single write. Without a uinput
+// device the same events go to a null sink, which only counts, so the
+// mapping path can be measured anywhere.
+class VirtualGamepad
+{
+public:
+    // One key per GamepadButton, one axis per GamepadAxis
+    static constexpr size_t KEY_COUNT = GAMEPAD_BUTTON_COUNT;
+    static constexpr size_t AXIS_COUNT = GAMEPAD_AXIS_COUNT;
+
+    explicit VirtualGamepad(int slot);
+    ~VirtualGamepad();
+
+    VirtualGamepad(const VirtualGamepad&) = delete;
+    VirtualGamepad& operator=(const VirtualGamepad&) = delete;
+
+    // Create the uinput device; false means the null sink is used
+    bool Open();
+    bool IsUinput() const { return m_fd >= 0; }
+
+    // Emit the changes since the last report. Returns the number of events
+    // written, not counting the SYN_REPORT; -1 if the write failed.
+    int Emit(const GamepadState& state);
+
+private:
+    int m_slot;
+    int m_fd;
+
+    std::mutex m_mutex;
+    bool m_first;
+    bool m_keys[KEY_COUNT];
+    int32_t m_axes[AXIS_COUNT];
+};
+
+// Creates a VirtualGamepad for every remote that reports input and feeds it
+// from the registry through the InputRemapper, measuring the time from
+// report to emitted events. Only runs where uinput is available: elsewhere
+// there is nothing to emit to.
+class VirtualGamepadBackend
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr int MAX_SLOTS = 16;
+
+    struct Stats
+    {
+        uint64_t reports = 0;
+        uint64_t events = 0;
+        uint64_t writes = 0;
+        uint64_t write_errors = 0;
+        // Report received to events written
+        double average_latency_us = 0.0;
+        double max_latency_us = 0.0;
+        // Remote sampled the report to events written
+        double average_sample_age_us = 0.0;
+        double max_sample_age_us = 0.0;
+        int uinput_devices = 0;
+        int null_devices = 0;
+    };
+
+    static VirtualGamepadBackend& Instance()
+    {
+        static VirtualGamepadBackend instance;
+        return instance;
+    }
+
+    // False, and nothing subscribed, without a writable /dev/uinput
+    bool Start();
+    void Stop();
+
+    void HandleInput(int slot, uint64_t bt_address, const WiimoteInputState& input,
+                     const ExtensionState& extension);
+    // Called when the remote in `slot` goes away
+    void Remove(int slot);
+
+    Stats GetStats() const;
+
+private:
+    VirtualGamepadBackend();
+    VirtualGamepadBackend(const VirtualGamepadBackend&) = delete;
+    VirtualGamepadBackend& operator=(const VirtualGamepadBackend&) = delete;
+
+    mutable std::mutex m_mutex;
+    std::shared_ptr<VirtualGamepad> m_gamepads[MAX_SLOTS];
+    std::atomic<bool> m_running;
+    // Held while the subscription is made, changed or withdrawn
+    std::mutex m_subscription_mutex;
+    int m_subscription;
+
+    Stats m_stats;
+    double m_total_latency_us;
+    double m_total_sample_age_us;
+};
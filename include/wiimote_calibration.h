@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include "wiimote_register_engine.h"
+#include "wiimote_extension.h"
+
+// Zero and 1 g points of a 10-bit accelerometer, in the packed layout used
+// by both the remote's EEPROM block at 0x16 and the Nunchuk's block at 0xA40020.
+struct AccelCalibration
+{
+    uint16_t zero[3] = {};
+    uint16_t one_g[3] = {};
+    bool valid = false;
+
+    static AccelCalibration Parse(const uint8_t* block);
+    void Apply(const uint16_t raw[3], float out_g[3]) const;
+};
+
+// Raw readings of the Balance Board's four load cells at 0, 17 and 34 kg,
+// from the board's block at 0xA40024.
+struct BalanceBoardCalibration
+{
+    static constexpr int POINT_COUNT = 3;
+    static constexpr float POINT_SPACING_KG = 17.0f;
+
+    uint16_t points[POINT_COUNT][BALANCE_SENSOR_COUNT] = {};
+    // Kilograms per raw count below and above the 17 kg point, worked out
+    // once so a report needs no division
+    float kg_per_count[POINT_COUNT - 1][BALANCE_SENSOR_COUNT] = {};
+    bool valid = false;
+
+    static BalanceBoardCalibration Parse(const uint8_t* block);
+    // Fills sensor_kg, weight_kg and the center of balance from the raw sensors
+    void Apply(BalanceBoardState& state) const;
+};
+
+// Loads the calibration blocks of one remote and its extension. Blocks come
+// from CalibrationCache under `cache_key`, from CalibrationCache::KeyFor,
+// unless it is 0; the cached copy is used immediately and confirmed
+// afterwards by reading only the block's checksum bytes. A mismatch falls
+// back to a full read.
+class WiimoteCalibration
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    WiimoteCalibration(WiimoteRegisterEngine& registers, uint64_t cache_key, int slot);
+
+    // Start loading the remote's accelerometer calibration
+    void Load(Clock::time_point connect_time);
+    void LoadExtension(ExtensionType type, uint64_t extension_id);
+
+    bool GetAccel(AccelCalibration& calibration) const;
+    bool GetNunchukAccel(AccelCalibration& calibration) const;
+    bool GetBalanceBoard(BalanceBoardCalibration& calibration) const;
+    bool GetExtensionBlock(std::vector<uint8_t>& block) const;
+
+    // Call for each calibrated sample; the first one after connecting records
+    // the connect-to-calibrated-sample latency.
+    void NoteCalibratedSample(Clock::time_point now);
+
+private:
+    using ApplyFunction = std::function<void(const std::vector<uint8_t>& block)>;
+
+    WiimoteRegisterEngine& m_registers;
+    uint64_t m_cache_key;
+    int m_slot;
+
+    mutable std::mutex m_mutex;
+    AccelCalibration m_accel;
+    AccelCalibration m_nunchuk_accel;
+    BalanceBoardCalibration m_balance_board;
+    std::vector<uint8_t> m_extension_block;
+    uint32_t m_extension_generation;
+    Clock::time_point m_connect_time;
+    bool m_from_cache;
+    bool m_latency_recorded;
+
+    void LoadBlock(uint64_t extension_id, uint8_t address_space, uint32_t address, uint8_t size,
+                   uint8_t check_bytes, ApplyFunction apply);
+    void ReadFullBlock(uint64_t extension_id, uint8_t address_space, uint32_t address, uint8_t size,
+                       ApplyFunction apply);
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <functional>
+#include "wiimote_register_engine.h"
+#include "wiimote_extension.h"
+#include "wiimote_calibration.h"
+#include "wiimote_speaker.h"
+#include "ir_tracker.h"
+#include "report_clock.h"
+#include "wiimote_input.h"
+#include "reporting_mode_manager.h"
+#include "output_scheduler.h"
+#include "rumble_player.h"
+#include "hid_writer.h"
+
+// An open HID connection to a single Wii Remote. The handle is served by the
+// shared IoReactor, which delivers input reports and runs the device's timer
+// tick. Owns the output scheduler every report goes through, the per-device
+// register engine and the extension handler.
+class WiimoteDevice
+{
+public:
+    WiimoteDevice(const std::wstring& device_path, const std::wstring& device_name,
+                  uint64_t bt_address, int slot);
+    ~WiimoteDevice();
+
+    WiimoteDevice(const WiimoteDevice&) = delete;
+    WiimoteDevice& operator=(const WiimoteDevice&) = delete;
+
+    bool Open();
+    void Close();
+    bool IsConnected() const { return m_connected; }
+
+    // Queue an output report on the output scheduler. The current rumble bit
+    // is applied to it; with `acknowledged` it is retransmitted until the
+    // remote confirms it. Returns false when the device is closed or the
+    // queue is full.
+    bool WriteReport(const uint8_t* report, size_t size, bool acknowledged = false);
+
+    // Ask the remote for a 0x20 status report
+    void RequestStatus();
+    // See OutputScheduler::SetLeds for `on_delivered`
+    void SetLeds(uint8_t mask, OutputScheduler::DeliveryCallback on_delivered = nullptr);
+    // Rumble goes through the rumble player; SetRumble is full intensity or off
+    void SetRumble(bool on);
+    void SetRumbleIntensity(float intensity);
+    void PlayRumble(const RumbleWaveform& waveform);
+    RumblePlayer::Stats GetRumbleStats() const { return m_rumble.GetStats(); }
+    // True once everything queued on the output scheduler has been sent and,
+    // where asked for, acknowledged
+    bool IsOutputIdle() const { return m_output.IsIdle(); }
+    OutputScheduler::Stats GetOutputStats() const { return m_output.GetStats(); }
+    HidWriter::Stats GetWriterStats() const { return m_writer.GetStats(); }
+    ReportClock::Stats GetClockStats() const { return m_report_clock.GetStats(); }
+
+    using InputCallback = std::function<void(WiimoteDevice& device, const WiimoteInputState& input,
+                                             const ExtensionState& extension)>;
+
+    // Called on a reactor thread for every decoded data report
+    void SetInputCallback(InputCallback callback);
+
+    // Union of InputFeature flags the consumers of this remote need. The
+    // reporting mode is switched at runtime when it changes.
+    void SetRequestedFeatures(uint32_t features);
+    uint8_t GetReportingMode() const { return m_reporting_mode; }
+    ReportingModeManager::Traffic GetTraffic() const;
+
+    WiimoteRegisterEngine& GetRegisterEngine() { return m_registers; }
+    WiimoteExtension& GetExtension() { return m_extension; }
+    WiimoteCalibration& GetCalibration() { return m_calibration; }
+    WiimoteSpeaker& GetSpeaker() { return m_speaker; }
+    IrTracker& GetIrTracker() { return m_ir_tracker; }
+
+    WiimoteInputState GetInputState();
+    ExtensionState GetExtensionState();
+
+    const std::wstring& GetPath() const { return m_device_path; }
+    const std::wstring& GetName() const { return m_device_name; }
+    uint64_t GetBluetoothAddress() const { return m_bt_address; }
+    int GetSlot() const { return m_slot; }
+
+private:
+    std::wstring m_device_path;
+    std::wstring m_device_name;
+    uint64_t m_bt_address;
+    int m_slot;
+
+    HidWriter::NativeHandle m_handle;
+    int m_reactor_id;
+    int m_tick_timer_id;
+    // Runs Drain when the output scheduler asks to be woken
+    std::atomic<int> m_drain_timer_id;
+    size_t m_input_report_size;
+    size_t m_output_report_size;
+
+    std::atomic<bool> m_connected;
+    // Low battery flag of the last status report; the LEDs blink while set
+    bool m_battery_low;
+    HidWriter m_writer;
+    OutputScheduler m_output;
+    RumblePlayer m_rumble;
+
+    std::atomic<uint8_t> m_reporting_mode;
+    std::atomic<bool> m_continuous_reporting;
+    IrMode m_ir_mode;
+    std::mutex m_mode_mutex;
+    ReportingModeManager m_mode_manager;
+    InputCallback m_input_callback;
+
+    WiimoteRegisterEngine m_registers;
+    WiimoteExtension m_extension;
+    WiimoteCalibration m_calibration;
+    WiimoteSpeaker m_speaker;
+    IrTracker m_ir_tracker;
+    ReportClock m_report_clock;
+
+    std::mutex m_state_mutex;
+    WiimoteInputState m_input_state;
+    ExtensionState m_extension_state;
+
+    bool WriteToDevice(const uint8_t* report, size_t size);
+    void Tick();
+    void HandleInputReport(const uint8_t* report, size_t size);
+    void HandleStatusReport(const uint8_t* report, size_t size);
+    void HandleExtensionChanged(ExtensionType type);
+    void UpdateReportingMode();
+    void ApplyIrMode(IrMode ir_mode);
+    void SendReportingMode();
+};
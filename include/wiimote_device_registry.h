@@ -0,0 +1,82 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include "wiimote_device.h"
+
+// Owns the open WiimoteDevice connections, hands out player slots and fans
+// decoded input out to subscribers. The features subscribers ask for decide
+// each remote's reporting mode.
+class WiimoteDeviceRegistry
+{
+public:
+    using InputCallback = WiimoteDevice::InputCallback;
+
+    // Features every remote reports even without subscribers
+    static constexpr uint32_t DEFAULT_FEATURES = INPUT_FEATURE_BUTTONS | INPUT_FEATURE_EXTENSION;
+
+    static WiimoteDeviceRegistry& Instance()
+    {
+        static WiimoteDeviceRegistry instance;
+        return instance;
+    }
+
+    // Open a connection to the device if it is not open yet. The device is
+    // opened without holding the registry lock.
+    std::shared_ptr<WiimoteDevice> Open(const std::wstring& device_path,
+                                        const std::wstring& device_name,
+                                        uint64_t bt_address);
+    void Close(const std::wstring& device_path);
+    void CloseAll();
+
+    // Drop devices whose connection the reactor has seen go away
+    int RemoveDisconnected();
+
+    std::shared_ptr<WiimoteDevice> Find(const std::wstring& device_path);
+    std::vector<std::shared_ptr<WiimoteDevice>> GetDevices();
+
+    // Receive decoded input from the remote in `slot`, or from every remote
+    // when slot is -1. Returns an id for Unsubscribe.
+    int Subscribe(uint32_t features, InputCallback callback, int slot = -1);
+    // Change what a subscription asks of the remotes
+    void SetFeatures(int subscription_id, uint32_t features);
+    void Unsubscribe(int subscription_id);
+
+private:
+    struct Subscription
+    {
+        int id;
+        uint32_t features;
+        int slot;
+        InputCallback callback;
+    };
+    using SubscriptionList = std::vector<Subscription>;
+
+    WiimoteDeviceRegistry() = default;
+    WiimoteDeviceRegistry(const WiimoteDeviceRegistry&) = delete;
+    WiimoteDeviceRegistry& operator=(const WiimoteDeviceRegistry&) = delete;
+
+    std::map<std::wstring, std::shared_ptr<WiimoteDevice>> m_devices;
+    // Paths being opened outside the lock, with the slot reserved for them
+    std::map<std::wstring, int> m_opening;
+    std::mutex m_mutex;
+    std::condition_variable m_opened;
+
+    // Replaced as a whole on change so dispatch can iterate without a lock
+    std::shared_ptr<const SubscriptionList> m_subscriptions = std::make_shared<SubscriptionList>();
+    std::mutex m_subscription_mutex;
+    int m_next_subscription_id = 1;
+
+    int AllocateSlotLocked() const;
+    uint32_t GetFeaturesForSlot(int slot);
+    void UpdateRequestedFeatures();
+    // Withdraw what was published for a remote that has been closed
+    void ReleaseSlot(int slot);
+    void DispatchInput(WiimoteDevice& device, const WiimoteInputState& input,
+                       const ExtensionState& extension);
+};
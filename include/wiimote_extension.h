@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include "wiimote_register_engine.h"
+
+enum class ExtensionType
+{
+    None,
+    Unknown,
+    Nunchuk,
+    ClassicController,
+    ClassicControllerPro,
+    Guitar,
+    Drums,
+    BalanceBoard,
+    MotionPlus
+};
+
+// What to do with a MotionPlus found on the remote: leave it inactive, so
+// that it is only a port for another extension, or activate it alone or
+// passing a Nunchuk or Classic Controller plugged into it through
+enum class MotionPlusMode
+{
+    Off,
+    Alone,
+    NunchukPassthrough,
+    ClassicPassthrough
+};
+
+struct NunchukState
+{
+    uint8_t stick_x = 0;
+    uint8_t stick_y = 0;
+    uint16_t accel[3] = {};   // raw 10-bit X, Y, Z
+    bool accel_calibrated = false;
+    float accel_g[3] = {};
+    bool button_c = false;
+    bool button_z = false;
+};
+
+struct ClassicControllerState
+{
+    uint8_t left_x = 0;          // 6-bit
+    uint8_t left_y = 0;          // 6-bit
+    uint8_t right_x = 0;         // 5-bit
+    uint8_t right_y = 0;         // 5-bit
+    uint8_t left_trigger = 0;    // 5-bit
+    uint8_t right_trigger = 0;   // 5-bit
+    uint16_t buttons = 0;        // 1 = pressed
+};
+
+struct MotionPlusState
+{
+    uint16_t yaw = 0;     // raw 14-bit rates
+    uint16_t roll = 0;
+    uint16_t pitch = 0;
+    bool yaw_slow = false;
+    bool roll_slow = false;
+    bool pitch_slow = false;
+};
+
+// Sensor order of both the data report and the calibration block
+enum BalanceBoardSensor
+{
+    BALANCE_TOP_RIGHT,
+    BALANCE_BOTTOM_RIGHT,
+    BALANCE_TOP_LEFT,
+    BALANCE_BOTTOM_LEFT,
+    BALANCE_SENSOR_COUNT
+};
+
+struct BalanceBoardState
+{
+    uint16_t sensors[BALANCE_SENSOR_COUNT] = {};   // raw 16-bit load cells
+    uint8_t temperature = 0;
+    uint8_t battery = 0;
+    bool calibrated = false;
+    float sensor_kg[BALANCE_SENSOR_COUNT] = {};
+    float weight_kg = 0.0f;
+    // Center of balance, -1 (left/back) to 1 (right/front); 0 with nobody on the board
+    float center_x = 0.0f;
+    float center_y = 0.0f;
+};
+
+struct ExtensionState
+{
+    ExtensionType type = ExtensionType::None;
+    // The extension plugged into a MotionPlus in passthrough mode, whose
+    // state is kept next to the MotionPlus's; None when there is none
+    ExtensionType passthrough = ExtensionType::None;
+    NunchukState nunchuk;
+    ClassicControllerState classic;
+    MotionPlusState motion_plus;
+    BalanceBoardState balance_board;
+};
+
+const char* GetExtensionName(ExtensionType type);
+
+// The extension whose Nunchuk or Classic Controller state is valid: the
+// extension itself, or the one passed through by a MotionPlus
+ExtensionType GetControllerType(const ExtensionState& state);
+
+// MotionPlus rates in degrees per second about the remote's X (pitch),
+// Y (roll) and Z (yaw) axes
+void GetMotionPlusRates(const MotionPlusState& state, float rates_dps[3]);
+
+// Number of extension bytes a reporting mode must carry for this extension
+size_t GetExtensionDataSize(ExtensionType type);
+
+// Extension hotplug handling for one Wii Remote. Reacts to the extension
+// flag of 0x20 status reports, initialises the extension without encryption,
+// identifies it and decodes its data. The init writes and the ID read are
+// queued back-to-back on the register engine rather than one per round trip.
+//
+// An inactive MotionPlus raises no status report of its own, so unless the
+// MotionPlus mode is Off it is looked for at every plug-in and every
+// MOTION_PLUS_PROBE_PERIOD while nothing is plugged in, and activated in
+// that mode when found. Passthrough frames are told apart by bit 1 of their
+// last byte and merged into one state.
+class WiimoteExtension
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using ChangedCallback = std::function<void(ExtensionType type)>;
+
+    static constexpr std::chrono::milliseconds MOTION_PLUS_PROBE_PERIOD{ 40 };
+
+    struct Stats
+    {
+        uint64_t hotplugs = 0;
+        uint64_t init_failures = 0;
+        uint64_t motion_plus_activations = 0;
+        double last_identify_ms = 0.0;
+        double last_first_sample_ms = 0.0;
+        double max_first_sample_ms = 0.0;
+    };
+
+    WiimoteExtension(WiimoteRegisterEngine& registers, int slot);
+
+    // Called from the device once the extension has been identified or removed
+    void SetChangedCallback(ChangedCallback callback);
+    // NunchukPassthrough by default; applies to the next MotionPlus found
+    void SetMotionPlusMode(MotionPlusMode mode);
+
+    void HandleStatus(bool extension_connected, Clock::time_point now);
+    void Tick(Clock::time_point now);
+
+    // Decode the extension bytes of a data report
+    bool Decode(const uint8_t* data, size_t size, ExtensionState& state, Clock::time_point now);
+
+    ExtensionType GetType() const;
+    uint64_t GetId() const;
+    Stats GetStats() const;
+
+private:
+    WiimoteRegisterEngine& m_registers;
+    int m_slot;
+    ChangedCallback m_changed_callback;
+
+    mutable std::mutex m_mutex;
+    bool m_connected;
+    ExtensionType m_type;
+    uint64_t m_id;
+    uint32_t m_generation;
+    int m_init_attempts;
+    bool m_retry_pending;
+    bool m_awaiting_first_sample;
+    Clock::time_point m_plug_time;
+    Clock::time_point m_retry_time;
+    Stats m_stats;
+
+    MotionPlusMode m_motion_plus_mode;
+    // A MotionPlus was activated and answers at 0xA400xx, where the init
+    // writes of other extensions would deactivate it
+    bool m_motion_plus_active;
+    bool m_probe_pending;
+    Clock::time_point m_next_probe;
+    // Both halves of passthrough data, each kept until its next frame
+    ExtensionState m_passthrough_state;
+
+    void BeginInit(uint32_t generation);
+    void BeginProbe(uint32_t generation, Clock::time_point now);
+    void HandleProbe(uint32_t generation, Clock::time_point sent, const RegisterReadResult& result);
+    void HandleIdRead(uint32_t generation, const RegisterReadResult& result);
+    void DecodeMotionPlusLocked(const uint8_t* data, ExtensionState& state);
+    void NotifyChanged(ExtensionType type);
+};
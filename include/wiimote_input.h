@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include "wiimote_protocol.h"
+
+// Decoded contents of one data report (0x30 - 0x3D).
+
+struct IrDot
+{
+    uint16_t x = 0;     // 0 - 1023
+    uint16_t y = 0;     // 0 - 767
+    uint8_t size = 0;   // only reported in extended mode
+    bool valid = false;
+};
+
+// Pointing derived from the tracked IR dots by IrTracker
+struct IrPointer
+{
+    bool visible = false;
+    float x = 0.0f;            // screen space, 0 at the left edge, 1 at the right
+    float y = 0.0f;            // screen space, 0 at the top edge, 1 at the bottom
+    float roll = 0.0f;         // radians, from the line through the sensor bar
+    float distance_m = 0.0f;   // remote to sensor bar
+    float bar[2][2] = {};      // left and right end of the bar in camera pixels
+};
+
+struct WiimoteInputState
+{
+    uint8_t report_id = 0;
+    std::chrono::steady_clock::time_point received;
+    // When the remote took the report, estimated by its ReportClock; the
+    // arrival time unless reporting is continuous
+    std::chrono::steady_clock::time_point sampled;
+
+    uint16_t buttons = 0;
+
+    bool has_accel = false;
+    uint16_t accel[3] = {};   // raw 10-bit X, Y, Z
+    bool accel_calibrated = false;
+    float accel_g[3] = {};
+
+    bool has_ir = false;
+    IrDot ir[4];
+    IrPointer pointer;
+
+    uint8_t extension_size = 0;
+    uint8_t extension[21] = {};
+};
+
+// Decode a data report. Returns false for report ids that carry no input data.
+bool DecodeInputReport(const uint8_t* report, size_t size, WiimoteInputState& state);
@@ -10,7 +10,11 @@
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include "debug_log.h"
+#include "led_batch.h"
+#include "led_animator.h"
+#include "wiimote_device_registry.h"
 
 #pragma comment(lib, "Hid.lib")
 #pragma comment(lib, "Bthprops.lib")
@@ -24,28 +28,59 @@ public:
         return instance;
     }
 
-    ~WiimoteLedSetter()
-    {
-        StopBlinking();
-    }
-
     void StartBlinking()
     {
-        if (m_blink_thread_running)
+        LedAnimator& animator = LedAnimator::Instance();
+        if (animator.IsRunning())
             return;
 
-        m_blink_thread_running = true;
-        m_blink_thread = std::thread([this]() { BlinkThreadProc(); });
+        animator.SetOutput([this](const std::vector<std::pair<std::wstring, uint8_t>>& changes) {
+            WriteLedFrame(changes);
+        });
+        animator.SetDefault(LedAnimator::Rotation({ 0x08, 0x04, 0x02, 0x01 }, BLINK_STEP_MS));
+        {
+            std::lock_guard<std::mutex> lock(m_devices_mutex);
+            for (const auto& pair : m_tracked_devices)
+                animator.AddDevice(pair.first);
+        }
+        animator.Start();
     }
 
     void StopBlinking()
     {
-        if (!m_blink_thread_running)
-            return;
+        LedAnimator::Instance().Stop();
+        StopWriter();
+    }
+
+    // Hold `mask` on every tracked remote, all of them changing in the same
+    // frame and so in one batch. They keep it until ClearMaskOnAllWiimotes
+    // returns them to the running animation.
+    void SetMaskOnAllWiimotes(uint8_t mask)
+    {
+        LedTimeline timeline;
+        timeline.frames.push_back({ static_cast<uint8_t>(mask & 0x0F), 1000 });
+        timeline.loop = false;
 
-        m_blink_thread_running = false;
-        if (m_blink_thread.joinable())
-            m_blink_thread.join();
+        LedAnimator& animator = LedAnimator::Instance();
+        std::vector<std::pair<std::wstring, uint8_t>> changes;
+        {
+            std::lock_guard<std::mutex> lock(m_devices_mutex);
+            for (const auto& pair : m_tracked_devices)
+            {
+                animator.Play(pair.first, timeline);
+                changes.emplace_back(pair.first, timeline.frames.front().mask);
+            }
+        }
+        // Nothing renders the timelines while the animator is stopped
+        if (!animator.IsRunning())
+            WriteLedFrame(changes);
+    }
+
+    void ClearMaskOnAllWiimotes()
+    {
+        std::lock_guard<std::mutex> lock(m_devices_mutex);
+        for (const auto& pair : m_tracked_devices)
+            LedAnimator::Instance().StopAnimation(pair.first);
     }
 
     struct WiimoteDeviceInfo
@@ -73,12 +108,14 @@ public:
             }
             
             m_tracked_devices[device_path] = info;
+            LedAnimator::Instance().AddDevice(device_path);
             LOG_INFO("Registered Wiimote for LED blinking");
         }
     }
 
     int SetLedsOnAllWiimotes()
     {
+        // Registered remotes pick up the running animation on its next frame
         return EnumerateAndSetLeds(false);
     }
 
@@ -155,6 +192,7 @@ public:
                 return false;
             device_info = it->second;
             m_tracked_devices.erase(it);
+            LedAnimator::Instance().RemoveDevice(device_path);
         }
         
         // Actually disconnect by disabling HID service via Bluetooth API
@@ -231,6 +269,7 @@ public:
                 if (it->second.has_bt_address && 
                     memcmp(&it->second.bt_address, &bt_addr, sizeof(BLUETOOTH_ADDRESS)) == 0)
                 {
+                    LedAnimator::Instance().RemoveDevice(it->first);
                     m_tracked_devices.erase(it);
                     break;
                 }
@@ -299,15 +338,23 @@ public:
     }
 
 private:
-    WiimoteLedSetter() : m_blink_thread_running(false), m_current_led_pattern(0) {}
+    // How long each step of the idle LED rotation is shown
+    static constexpr uint32_t BLINK_STEP_MS = 3000;
+
+    WiimoteLedSetter() = default;
+    ~WiimoteLedSetter() { StopWriter(); }
     WiimoteLedSetter(const WiimoteLedSetter&) = delete;
     WiimoteLedSetter& operator=(const WiimoteLedSetter&) = delete;
 
-    std::thread m_blink_thread;
-    std::atomic<bool> m_blink_thread_running;
     std::map<std::wstring, WiimoteDeviceInfo> m_tracked_devices;
     std::mutex m_devices_mutex;
-    int m_current_led_pattern;
+
+    // Masks waiting for the writer thread, the latest of each remote
+    std::thread m_writer;
+    std::mutex m_writer_mutex;
+    std::condition_variable m_writer_wake;
+    std::map<std::wstring, uint8_t> m_pending_leds;
+    bool m_writer_stopping = false;
 
     // Get actual Bluetooth device name for a Wiimote
     std::wstring GetBluetoothDeviceName(const std::wstring& device_path, USHORT productId)
@@ -403,99 +450,81 @@ private:
         return found;
     }
 
-    void BlinkThreadProc()
+    // Output of the LED animator: open remotes take the change through
+    // their output scheduler, the rest are handed to the writer thread, as a
+    // batch can wait on its writes for up to 250 ms and the animator has to
+    // keep its 50 Hz frames
+    void WriteLedFrame(const std::vector<std::pair<std::wstring, uint8_t>>& changes)
     {
-        const int patterns[] = { 0x08, 0x04, 0x02, 0x01 };
-        int pattern_index = 0;
-
-        while (m_blink_thread_running)
+        std::vector<std::pair<std::wstring, uint8_t>> unopened;
+        for (const auto& change : changes)
         {
-            m_current_led_pattern = patterns[pattern_index];
-            SetLedPattern(m_current_led_pattern);
-            
-            pattern_index = (pattern_index + 1) % 4;
+            auto device = WiimoteDeviceRegistry::Instance().Find(change.first);
+            if (device && device->IsConnected())
+                device->SetLeds(change.second);
+            else
+                unopened.push_back(change);
+        }
+        if (unopened.empty())
+            return;
 
-            for (int i = 0; i < 30 && m_blink_thread_running; ++i)
-            {
-                Sleep(100);
-            }
+        {
+            std::lock_guard<std::mutex> lock(m_writer_mutex);
+            for (const auto& change : unopened)
+                m_pending_leds[change.first] = change.second;
+            if (!m_writer.joinable() && !m_writer_stopping)
+                m_writer = std::thread([this]() { WriterProc(); });
         }
+        m_writer_wake.notify_one();
     }
 
-    void SetLedPattern(int ledMask)
+    // Writes the pending masks a batch at a time. Frames that come in while
+    // a batch runs are merged, so a slow batch skips frames instead of
+    // falling behind.
+    void WriterProc()
     {
-        std::lock_guard<std::mutex> lock(m_devices_mutex);
-        
-        GUID hidGuid;
-        HidD_GetHidGuid(&hidGuid);
-
-        HDEVINFO deviceInfoSet = SetupDiGetClassDevs(
-            &hidGuid, nullptr, nullptr, 
-            DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
-
-        if (deviceInfoSet == INVALID_HANDLE_VALUE)
-            return;
-
-        SP_DEVICE_INTERFACE_DATA deviceInterfaceData;
-        deviceInterfaceData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
-
-        for (DWORD i = 0; SetupDiEnumDeviceInterfaces(
-            deviceInfoSet, nullptr, &hidGuid, i, &deviceInterfaceData); ++i)
+        std::unique_lock<std::mutex> lock(m_writer_mutex);
+        for (;;)
         {
-            DWORD requiredSize = 0;
-            SetupDiGetDeviceInterfaceDetailW(
-                deviceInfoSet, &deviceInterfaceData, 
-                nullptr, 0, &requiredSize, nullptr);
-
-            if (requiredSize == 0)
-                continue;
+            m_writer_wake.wait(lock, [this]() { return m_writer_stopping || !m_pending_leds.empty(); });
+            if (m_writer_stopping)
+                return;
 
-            std::vector<BYTE> detailBuffer(requiredSize);
-            PSP_DEVICE_INTERFACE_DETAIL_DATA_W detailData = 
-                reinterpret_cast<PSP_DEVICE_INTERFACE_DETAIL_DATA_W>(detailBuffer.data());
-            detailData->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W);
+            LedBatch batch;
+            for (const auto& pair : m_pending_leds)
+                batch.Add(pair.first, pair.second);
+            m_pending_leds.clear();
+            lock.unlock();
 
-            if (!SetupDiGetDeviceInterfaceDetailW(
-                deviceInfoSet, &deviceInterfaceData,
-                detailData, requiredSize, nullptr, nullptr))
+            LedBatch::Result result = batch.Run();
             {
-                continue;
-            }
-
-            std::wstring devicePath(detailData->DevicePath);
-            
-            if (m_tracked_devices.find(devicePath) == m_tracked_devices.end())
-                continue;
-
-            HANDLE deviceHandle = CreateFileW(
-                detailData->DevicePath,
-                GENERIC_READ | GENERIC_WRITE,
-                FILE_SHARE_READ | FILE_SHARE_WRITE,
-                nullptr, OPEN_EXISTING, 0, nullptr);
-
-            if (deviceHandle == INVALID_HANDLE_VALUE)
-            {
-                m_tracked_devices.erase(devicePath);
-                continue;
-            }
-
-            HIDD_ATTRIBUTES attributes;
-            attributes.Size = sizeof(HIDD_ATTRIBUTES);
-            if (HidD_GetAttributes(deviceHandle, &attributes))
-            {
-                if (attributes.VendorID == 0x057e && 
-                    (attributes.ProductID == 0x0306 || attributes.ProductID == 0x0330))
+                std::lock_guard<std::mutex> devices_lock(m_devices_mutex);
+                for (const std::wstring& path : result.unreachable)
                 {
-                    BYTE ledReport[2] = { 0x11, static_cast<BYTE>((ledMask & 0x0F) << 4) };
-                    DWORD bytesWritten = 0;
-                    WriteFile(deviceHandle, ledReport, sizeof(ledReport), &bytesWritten, nullptr);
+                    m_tracked_devices.erase(path);
+                    LedAnimator::Instance().RemoveDevice(path);
                 }
             }
+            lock.lock();
+        }
+    }
 
-            CloseHandle(deviceHandle);
+    // Masks still pending are written by the next writer
+    void StopWriter()
+    {
+        std::thread writer;
+        {
+            std::lock_guard<std::mutex> lock(m_writer_mutex);
+            if (!m_writer.joinable())
+                return;
+            m_writer_stopping = true;
+            writer = std::move(m_writer);
         }
+        m_writer_wake.notify_one();
+        writer.join();
 
-        SetupDiDestroyDeviceInfoList(deviceInfoSet);
+        std::lock_guard<std::mutex> lock(m_writer_mutex);
+        m_writer_stopping = false;
     }
 
     int EnumerateAndSetLeds(bool detect_new)
@@ -584,6 +613,7 @@ private:
                             }
                             
                             m_tracked_devices[devicePath] = info;
+                            LedAnimator::Instance().AddDevice(devicePath);
                             LOG_NOTICE("Detected pre-paired Wiimote, starting LED animation");
                             count++;
                         }
@@ -28,4 +28,5 @@ private:
 
     bool EndPairing();
     void CheckForPrePairedDevices();
+    void SyncDevices();
 };
\ No newline at end of file
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Wii Remote HID protocol constants shared by the device, register and
+// reporting code. Report layouts follow the community documentation on WiiBrew.
+
+namespace WiimoteProtocol
+{
+    // Every report is at most 22 bytes including the report id.
+    constexpr size_t MAX_REPORT_SIZE = 22;
+
+    // Output reports (host -> remote). Byte 1 of every output report carries
+    // the rumble bit in bit 0.
+    enum OutputReportId : uint8_t
+    {
+        OUTPUT_RUMBLE          = 0x10,
+        OUTPUT_LEDS            = 0x11,
+        OUTPUT_REPORT_MODE     = 0x12,
+        OUTPUT_IR_PIXEL_CLOCK  = 0x13,
+        OUTPUT_SPEAKER_ENABLE  = 0x14,
+        OUTPUT_STATUS_REQUEST  = 0x15,
+        OUTPUT_WRITE_MEMORY    = 0x16,
+        OUTPUT_READ_MEMORY     = 0x17,
+        OUTPUT_SPEAKER_DATA    = 0x18,
+        OUTPUT_SPEAKER_MUTE    = 0x19,
+        OUTPUT_IR_LOGIC        = 0x1A,
+    };
+
+    // Input reports (remote -> host).
+    enum InputReportId : uint8_t
+    {
+        INPUT_STATUS           = 0x20,
+        INPUT_READ_DATA        = 0x21,
+        INPUT_ACK              = 0x22,
+        INPUT_CORE             = 0x30,
+        INPUT_CORE_ACCEL       = 0x31,
+        INPUT_CORE_EXT8        = 0x32,
+        INPUT_CORE_ACCEL_IR12  = 0x33,
+        INPUT_CORE_EXT19       = 0x34,
+        INPUT_CORE_ACCEL_EXT16 = 0x35,
+        INPUT_CORE_IR10_EXT9   = 0x36,
+        INPUT_CORE_ACCEL_IR10_EXT6 = 0x37,
+        INPUT_EXT21            = 0x3D,
+    };
+
+    // Byte layout of the data reporting modes. Offsets count from the report
+    // id byte; an offset of 0 means the mode does not carry that field.
+    struct ReportLayout
+    {
+        uint8_t id;
+        uint8_t size;
+        uint8_t accel_offset;
+        uint8_t ir_offset;
+        uint8_t ir_size;
+        uint8_t ext_offset;
+        uint8_t ext_size;
+    };
+
+    constexpr ReportLayout REPORT_LAYOUTS[] = {
+        { INPUT_CORE,                  3, 0, 0,  0, 0,  0 },
+        { INPUT_CORE_ACCEL,            6, 3, 0,  0, 0,  0 },
+        { INPUT_CORE_EXT8,            11, 0, 0,  0, 3,  8 },
+        { INPUT_CORE_ACCEL_IR12,      18, 3, 6, 12, 0,  0 },
+        { INPUT_CORE_EXT19,           22, 0, 0,  0, 3, 19 },
+        { INPUT_CORE_ACCEL_EXT16,     22, 3, 0,  0, 6, 16 },
+        { INPUT_CORE_IR10_EXT9,       22, 0, 3, 10, 13, 9 },
+        { INPUT_CORE_ACCEL_IR10_EXT6, 22, 3, 6, 10, 16, 6 },
+        { INPUT_EXT21,                22, 0, 0,  0, 1, 21 },
+    };
+
+    inline const ReportLayout* FindReportLayout(uint8_t report_id)
+    {
+        for (const auto& layout : REPORT_LAYOUTS)
+        {
+            if (layout.id == report_id)
+                return &layout;
+        }
+        return nullptr;
+    }
+
+    // Size of an input report on the wire, including the report id
+    inline size_t GetInputReportSize(uint8_t report_id)
+    {
+        if (const ReportLayout* layout = FindReportLayout(report_id))
+            return layout->size;
+        switch (report_id)
+        {
+        case INPUT_STATUS:    return 7;
+        case INPUT_READ_DATA: return 22;
+        case INPUT_ACK:       return 5;
+        default:              return MAX_REPORT_SIZE;
+        }
+    }
+
+    // Flags in byte 1 of output reports
+    constexpr uint8_t OUTPUT_FLAG_RUMBLE = 0x01;
+    constexpr uint8_t OUTPUT_FLAG_ACKNOWLEDGE = 0x02;   // ask for a 0x22 report
+    constexpr uint8_t OUTPUT_FLAG_ENABLE = 0x04;
+    constexpr uint8_t REPORT_MODE_CONTINUOUS = 0x04;
+
+    // Core button bits, (byte 1 << 8) | byte 2 of every data report
+    constexpr uint16_t BUTTON_LEFT  = 0x0100;
+    constexpr uint16_t BUTTON_RIGHT = 0x0200;
+    constexpr uint16_t BUTTON_DOWN  = 0x0400;
+    constexpr uint16_t BUTTON_UP    = 0x0800;
+    constexpr uint16_t BUTTON_PLUS  = 0x1000;
+    constexpr uint16_t BUTTON_TWO   = 0x0001;
+    constexpr uint16_t BUTTON_ONE   = 0x0002;
+    constexpr uint16_t BUTTON_B     = 0x0004;
+    constexpr uint16_t BUTTON_A     = 0x0008;
+    constexpr uint16_t BUTTON_MINUS = 0x0010;
+    constexpr uint16_t BUTTON_HOME  = 0x0080;
+    constexpr uint16_t BUTTON_MASK  = 0x1F9F;
+
+    // Classic Controller button bits, as in ClassicControllerState::buttons
+    constexpr uint16_t CLASSIC_BUTTON_UP    = 0x0001;
+    constexpr uint16_t CLASSIC_BUTTON_LEFT  = 0x0002;
+    constexpr uint16_t CLASSIC_BUTTON_ZR    = 0x0004;
+    constexpr uint16_t CLASSIC_BUTTON_X     = 0x0008;
+    constexpr uint16_t CLASSIC_BUTTON_A     = 0x0010;
+    constexpr uint16_t CLASSIC_BUTTON_Y     = 0x0020;
+    constexpr uint16_t CLASSIC_BUTTON_B     = 0x0040;
+    constexpr uint16_t CLASSIC_BUTTON_ZL    = 0x0080;
+    constexpr uint16_t CLASSIC_BUTTON_R     = 0x0200;
+    constexpr uint16_t CLASSIC_BUTTON_PLUS  = 0x0400;
+    constexpr uint16_t CLASSIC_BUTTON_HOME  = 0x0800;
+    constexpr uint16_t CLASSIC_BUTTON_MINUS = 0x1000;
+    constexpr uint16_t CLASSIC_BUTTON_L     = 0x2000;
+    constexpr uint16_t CLASSIC_BUTTON_DOWN  = 0x4000;
+    constexpr uint16_t CLASSIC_BUTTON_RIGHT = 0x8000;
+
+    // Status report (0x20) flags in byte 3, battery level in byte 6
+    constexpr uint8_t STATUS_BATTERY_LOW   = 0x01;
+    constexpr uint8_t STATUS_EXTENSION     = 0x02;
+    constexpr uint8_t STATUS_SPEAKER       = 0x04;
+    constexpr uint8_t STATUS_IR            = 0x08;
+    constexpr uint8_t STATUS_LED_MASK      = 0xF0;
+
+    // Memory write / read request layout (0x16 / 0x17)
+    constexpr uint8_t ADDRESS_SPACE_EEPROM   = 0x00;
+    constexpr uint8_t ADDRESS_SPACE_REGISTER = 0x04;
+    constexpr size_t  MEMORY_WRITE_MAX_BYTES = 16;
+    constexpr size_t  MEMORY_READ_CHUNK_BYTES = 16;
+
+    // Extension registers. Writing 0x55 to 0xF0 and 0x00 to 0xFB initialises
+    // an extension without encryption.
+    constexpr uint32_t EXTENSION_INIT1       = 0xA400F0;
+    constexpr uint32_t EXTENSION_INIT2       = 0xA400FB;
+    constexpr uint32_t EXTENSION_ID          = 0xA400FA;
+    constexpr uint32_t EXTENSION_CALIBRATION = 0xA40020;
+    constexpr uint8_t  EXTENSION_INIT1_VALUE = 0x55;
+    constexpr uint8_t  EXTENSION_INIT2_VALUE = 0x00;
+    constexpr size_t   EXTENSION_ID_SIZE     = 6;
+
+    // MotionPlus registers. An inactive MotionPlus answers at 0xA600xx;
+    // writing 0x55 to 0xF0 and a mode to 0xFE activates it, after which it
+    // answers at 0xA400xx like any extension until 0x55 is written to
+    // 0xA400F0. The modes pass a Nunchuk or Classic Controller plugged into
+    // it through, with their data interleaved with the MotionPlus's own.
+    constexpr uint32_t MOTION_PLUS_INIT      = 0xA600F0;
+    constexpr uint32_t MOTION_PLUS_ID        = 0xA600FA;
+    constexpr uint32_t MOTION_PLUS_MODE      = 0xA600FE;
+    constexpr uint8_t  MOTION_PLUS_INIT_VALUE = 0x55;
+    constexpr uint8_t  MOTION_PLUS_MODE_ALONE   = 0x04;
+    constexpr uint8_t  MOTION_PLUS_MODE_NUNCHUK = 0x05;
+    constexpr uint8_t  MOTION_PLUS_MODE_CLASSIC = 0x07;
+
+    // IR camera registers
+    constexpr uint32_t IR_CONTROL            = 0xB00030;
+    constexpr uint32_t IR_SENSITIVITY_BLOCK1 = 0xB00000;
+    constexpr uint32_t IR_SENSITIVITY_BLOCK2 = 0xB0001A;
+    constexpr uint32_t IR_MODE               = 0xB00033;
+    constexpr uint8_t  IR_CONTROL_ENABLE     = 0x08;
+
+    // Speaker registers. The speaker is set up by writing 0x01 to ENABLE,
+    // 0x08 and then the 7-byte configuration to CONFIG, and 0x01 to PLAY,
+    // with 0x14 enabling it before and 0x19 keeping it muted until done.
+    constexpr uint32_t SPEAKER_ENABLE        = 0xA20009;
+    constexpr uint32_t SPEAKER_CONFIG        = 0xA20001;
+    constexpr uint32_t SPEAKER_PLAY          = 0xA20008;
+    constexpr uint8_t  SPEAKER_FORMAT_ADPCM  = 0x00;
+    constexpr uint8_t  SPEAKER_FORMAT_PCM8   = 0x40;
+    constexpr size_t   SPEAKER_DATA_BYTES    = 20;
+    // Sample rate register value = clock / sample rate
+    constexpr uint32_t SPEAKER_ADPCM_CLOCK   = 6000000;
+    constexpr uint32_t SPEAKER_PCM8_CLOCK    = 12000000;
+
+    // Error codes returned in the low nibble of 0x21 byte 3 and in 0x22 byte 4
+    constexpr uint8_t ERROR_NONE          = 0x00;
+    constexpr uint8_t ERROR_WRITE_ONLY    = 0x07;
+    constexpr uint8_t ERROR_NO_SUCH_ADDR  = 0x08;
+}
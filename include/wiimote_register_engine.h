@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <functional>
+#include "wiimote_protocol.h"
+
+// Pipelined register / EEPROM access for a single Wii Remote.
+//
+// Reads are split into segments, each sent as its own 0x17 request, and
+// several segments are kept in flight so a bulk read streams 0x21 chunks
+// back-to-back instead of paying one round trip per chunk. Replies are
+// matched to segments by the address carried in each 0x21 chunk. Writes are
+// sent as 0x16 reports of up to 16 bytes, one at a time: a 0x22
+// acknowledgement names only the report id, so with more in flight a lost
+// write would take the acknowledgement of the next. Requests leave the
+// engine in the order they were submitted, so a write followed by a read of
+// the same register is safe.
+
+enum class RegisterStatus
+{
+    Ok,
+    Timeout,
+    DeviceError,
+    SendFailed,
+    Cancelled
+};
+
+struct RegisterReadResult
+{
+    RegisterStatus status = RegisterStatus::Ok;
+    uint8_t address_space = 0;
+    uint32_t address = 0;
+    uint8_t device_error = 0;
+    std::vector<uint8_t> data;
+};
+
+class WiimoteRegisterEngine
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using SendFunction = std::function<bool(const uint8_t* report, size_t size)>;
+    using ReadCallback = std::function<void(const RegisterReadResult& result)>;
+    using WriteCallback = std::function<void(RegisterStatus status)>;
+
+    struct Config
+    {
+        size_t max_reads_in_flight = 4;
+        uint16_t read_segment_size = 64;
+        std::chrono::milliseconds timeout{ 250 };
+        int max_retries = 3;
+    };
+
+    struct Stats
+    {
+        uint64_t reads_completed = 0;
+        uint64_t reads_failed = 0;
+        uint64_t writes_completed = 0;
+        uint64_t writes_failed = 0;
+        uint64_t retries = 0;
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        uint64_t unmatched_replies = 0;
+        double last_read_ms = 0.0;
+        double last_read_bytes_per_second = 0.0;
+    };
+
+    explicit WiimoteRegisterEngine(SendFunction send);
+    WiimoteRegisterEngine(SendFunction send, const Config& config);
+    ~WiimoteRegisterEngine();
+
+    WiimoteRegisterEngine(const WiimoteRegisterEngine&) = delete;
+    WiimoteRegisterEngine& operator=(const WiimoteRegisterEngine&) = delete;
+
+    void Read(uint8_t address_space, uint32_t address, uint16_t size, ReadCallback callback);
+    void Write(uint8_t address_space, uint32_t address, const uint8_t* data, size_t size,
+               WriteCallback callback = nullptr);
+
+    std::future<RegisterReadResult> ReadAsync(uint8_t address_space, uint32_t address, uint16_t size);
+    std::future<RegisterStatus> WriteAsync(uint8_t address_space, uint32_t address,
+                                           const uint8_t* data, size_t size);
+
+    // Feed every input report from the device. Returns true if the report was
+    // a 0x21 / 0x22 reply consumed by the engine.
+    bool HandleInputReport(const uint8_t* report, size_t size);
+
+    // Expire timed-out requests and retransmit. Call periodically.
+    void Tick(Clock::time_point now);
+
+    // Fail every queued and in-flight request with RegisterStatus::Cancelled.
+    void CancelAll();
+
+    bool IsIdle() const;
+    Stats GetStats() const;
+
+private:
+    struct Transaction;
+
+    // One 0x17 request covering [address, address + size) of a read transaction
+    struct ReadSegment
+    {
+        Transaction* owner = nullptr;
+        uint32_t address = 0;
+        uint16_t size = 0;
+        uint16_t received = 0;
+        int retries = 0;
+        Clock::time_point deadline;
+    };
+
+    // One 0x16 request of up to 16 bytes
+    struct WriteChunk
+    {
+        Transaction* owner = nullptr;
+        uint32_t address = 0;
+        uint8_t size = 0;
+        uint8_t data[WiimoteProtocol::MEMORY_WRITE_MAX_BYTES] = {};
+        int retries = 0;
+        Clock::time_point deadline;
+    };
+
+    struct Transaction
+    {
+        bool is_read = false;
+        uint8_t address_space = 0;
+        uint32_t address = 0;
+        size_t size = 0;
+        size_t pending_parts = 0;
+        bool failed = false;
+        RegisterStatus status = RegisterStatus::Ok;
+        uint8_t device_error = 0;
+        std::vector<uint8_t> data;
+        ReadCallback read_callback;
+        WriteCallback write_callback;
+        Clock::time_point submitted;
+    };
+
+    // Either a read segment or a write chunk, queued in submission order
+    struct PendingRequest
+    {
+        bool is_read = false;
+        ReadSegment segment;
+        WriteChunk chunk;
+    };
+
+    using Completion = std::function<void()>;
+
+    SendFunction m_send;
+    Config m_config;
+
+    mutable std::mutex m_mutex;
+    std::list<Transaction> m_transactions;
+    std::deque<PendingRequest> m_pending;
+    std::list<ReadSegment> m_reads_in_flight;
+    // The write waiting for its acknowledgement, if any
+    std::deque<WriteChunk> m_writes_in_flight;
+    std::deque<std::vector<uint8_t>> m_outbox;
+    bool m_draining;
+    Stats m_stats;
+
+    void Submit(Transaction&& transaction, std::vector<PendingRequest>&& parts);
+    void IssuePendingLocked(Clock::time_point now);
+    void QueueReadRequestLocked(const ReadSegment& segment, uint32_t offset);
+    void QueueWriteRequestLocked(const WriteChunk& chunk);
+    bool SegmentOverlapsInFlightLocked(const ReadSegment& segment) const;
+
+    bool HandleReadDataLocked(const uint8_t* report, size_t size, std::vector<Completion>& done);
+    bool HandleAckLocked(const uint8_t* report, size_t size, std::vector<Completion>& done);
+
+    void PartFinishedLocked(Transaction* transaction, std::vector<Completion>& done);
+    void FailTransactionLocked(Transaction* transaction, RegisterStatus status, uint8_t device_error,
+                               std::vector<Completion>& done);
+    Completion MakeCompletionLocked(Transaction* transaction);
+
+    void DrainOutbox();
+    static void RunCompletions(std::vector<Completion>& done);
+};
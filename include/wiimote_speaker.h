@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <functional>
+#include "wiimote_register_engine.h"
+
+enum class SpeakerFormat
+{
+    Adpcm,   // 4-bit Yamaha ADPCM, 40 samples per report
+    Pcm8     // 8-bit signed PCM, 20 samples per report
+};
+
+struct SpeakerConfig
+{
+    SpeakerFormat format = SpeakerFormat::Adpcm;
+    uint32_t sample_rate = 3000;
+    uint8_t volume = 0x40;
+
+    // ADPCM packs two samples per byte of a 0x18 report
+    static constexpr size_t MAX_SAMPLES_PER_REPORT = WiimoteProtocol::SPEAKER_DATA_BYTES * 2;
+
+    size_t SamplesPerReport() const;
+};
+
+// The speaker of one Wii Remote. Enable runs the setup sequence through the
+// register engine and, once the remote has taken it, hands the speaker to
+// SpeakerStreamer, which encodes the queued PCM and paces the 0x18 reports.
+// Those go out through `send_data` as soon as they are made, since holding
+// them back behind other output is audible.
+class WiimoteSpeaker
+{
+public:
+    using SendFunction = std::function<bool(const uint8_t* report, size_t size)>;
+
+    // About one second of audio at the default rate
+    static constexpr size_t MAX_BUFFERED_SAMPLES = 3000;
+
+    struct Stats
+    {
+        uint64_t reports_sent = 0;
+        uint64_t samples_played = 0;
+        // Reports that had to be padded with silence because too little
+        // audio was queued
+        uint64_t underruns = 0;
+        uint64_t dropped_samples = 0;
+        size_t buffered_samples = 0;
+    };
+
+    WiimoteSpeaker(WiimoteRegisterEngine& registers, SendFunction send, SendFunction send_data);
+    ~WiimoteSpeaker();
+
+    WiimoteSpeaker(const WiimoteSpeaker&) = delete;
+    WiimoteSpeaker& operator=(const WiimoteSpeaker&) = delete;
+
+    // Set the speaker up in the streamer's format. Audio queued before the
+    // setup finishes is kept and played once it has.
+    void Enable(uint8_t volume);
+    void Disable();
+    bool IsEnabled() const;
+
+    // Queue signed 16-bit mono PCM at the streamer's sample rate. Returns how
+    // many samples fit into the buffer.
+    size_t Queue(const int16_t* samples, size_t count);
+    void ClearQueue();
+
+    Stats GetStats() const;
+
+private:
+    friend class SpeakerStreamer;
+
+    enum class State
+    {
+        Off,
+        Starting,
+        On
+    };
+
+    WiimoteRegisterEngine& m_registers;
+    SendFunction m_send;
+    SendFunction m_send_data;
+
+    mutable std::mutex m_mutex;
+    State m_state;
+    // Bumped on every Enable and Disable so a setup that finishes late can
+    // tell it has been superseded
+    uint32_t m_generation;
+    std::deque<int16_t> m_buffer;
+    bool m_playing;
+    Stats m_stats;
+
+    void HandleSetupDone(uint32_t generation, RegisterStatus status);
+
+    // Streamer side: take up to `count` samples, padding with silence.
+    // Returns false when there was nothing to play.
+    bool Pull(int16_t* samples, size_t count);
+    bool SendData(const uint8_t* data, size_t size, size_t samples);
+};
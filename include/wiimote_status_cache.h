@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+
+struct WiimoteStatus
+{
+    int slot = -1;
+    uint64_t bt_address = 0;
+    uint8_t battery_raw = 0;
+    int battery_percent = 0;
+    bool battery_low = false;
+    bool extension = false;
+    bool speaker = false;
+    bool ir = false;
+    uint8_t leds = 0;
+    uint32_t age_ms = 0;
+};
+
+// Latest status report of every remote, readable from any thread without
+// locks or device access. Each slot holds the remote's address and its
+// status packed into one word, guarded by a sequence counter (a seqlock):
+// a writer makes it odd while it updates the slot, and a reader retries
+// until it saw the same even value before and after, so the address and
+// status it returns always belong to the same update.
+class WiimoteStatusCache
+{
+public:
+    static constexpr int MAX_SLOTS = 16;
+
+    static WiimoteStatusCache& Instance()
+    {
+        static WiimoteStatusCache instance;
+        return instance;
+    }
+
+    void Publish(int slot, uint64_t bt_address, uint8_t flags, uint8_t battery)
+    {
+        if (slot < 0 || slot >= MAX_SLOTS)
+            return;
+        const uint64_t packed = VALID_BIT |
+                                (static_cast<uint64_t>(flags) << 40) |
+                                (static_cast<uint64_t>(battery) << 32) |
+                                NowMs();
+        Write(m_slots[slot], bt_address, packed);
+    }
+
+    void Clear(int slot)
+    {
+        if (slot < 0 || slot >= MAX_SLOTS)
+            return;
+        Write(m_slots[slot], 0, 0);
+    }
+
+    bool Get(int slot, WiimoteStatus& status) const
+    {
+        if (slot < 0 || slot >= MAX_SLOTS)
+            return false;
+
+        const Slot& entry = m_slots[slot];
+        uint32_t sequence;
+        uint64_t packed, address;
+        do
+        {
+            while ((sequence = entry.sequence.load(std::memory_order_acquire)) & 1)
+                ;
+            packed = entry.packed.load(std::memory_order_relaxed);
+            address = entry.bt_address.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while (entry.sequence.load(std::memory_order_relaxed) != sequence);
+
+        if (!(packed & VALID_BIT))
+            return false;
+
+        const uint8_t flags = static_cast<uint8_t>(packed >> 40);
+        status.slot = slot;
+        status.bt_address = address;
+        status.battery_raw = static_cast<uint8_t>(packed >> 32);
+        status.battery_percent = status.battery_raw >= BATTERY_FULL ? 100 : status.battery_raw * 100 / BATTERY_FULL;
+        status.battery_low = (flags & 0x01) != 0;
+        status.extension = (flags & 0x02) != 0;
+        status.speaker = (flags & 0x04) != 0;
+        status.ir = (flags & 0x08) != 0;
+        status.leds = flags >> 4;
+        status.age_ms = NowMs() - static_cast<uint32_t>(packed);
+        return true;
+    }
+
+    bool FindByAddress(uint64_t bt_address, WiimoteStatus& status) const
+    {
+        for (int slot = 0; slot < MAX_SLOTS; ++slot)
+        {
+            if (Get(slot, status) && status.bt_address == bt_address)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    static constexpr uint64_t VALID_BIT = 1ULL << 63;
+    // Battery byte of a remote with fresh batteries
+    static constexpr int BATTERY_FULL = 0xC8;
+
+    struct alignas(64) Slot
+    {
+        std::atomic<uint32_t> sequence{ 0 };
+        std::atomic<uint64_t> bt_address{ 0 };
+        std::atomic<uint64_t> packed{ 0 };
+    };
+
+    WiimoteStatusCache() : m_epoch(std::chrono::steady_clock::now()) {}
+
+    // A remote's reader thread publishes while Close may clear the slot from
+    // another thread, so a writer takes the slot by making its sequence odd
+    static void Write(Slot& slot, uint64_t bt_address, uint64_t packed)
+    {
+        uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+        while ((sequence & 1) ||
+               !slot.sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_relaxed))
+        {
+            sequence = slot.sequence.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.bt_address.store(bt_address, std::memory_order_relaxed);
+        slot.packed.store(packed, std::memory_order_relaxed);
+        slot.sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    uint32_t NowMs() const
+    {
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - m_epoch).count());
+    }
+
+    std::chrono::steady_clock::time_point m_epoch;
+    Slot m_slots[MAX_SLOTS];
+};
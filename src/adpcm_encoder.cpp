@@ -0,0 +1,101 @@
+#include "adpcm_encoder.h"
+#include <algorithm>
+
+// Encoder state at the start of a stream, as the remote's decoder assumes
+constexpr int32_t INITIAL_PREDICTOR = 0;
+constexpr int32_t INITIAL_STEP = 127;
+constexpr int32_t MIN_STEP = 127;
+constexpr int32_t MAX_STEP = 24576;
+
+AdpcmEncoder::AdpcmEncoder()
+{
+    ResetAll();
+}
+
+void AdpcmEncoder::Reset(size_t lane)
+{
+    if (lane >= MAX_LANES)
+        return;
+    m_predictor[lane] = INITIAL_PREDICTOR;
+    m_step[lane] = INITIAL_STEP;
+}
+
+void AdpcmEncoder::ResetAll()
+{
+    for (size_t lane = 0; lane < MAX_LANES; ++lane)
+        Reset(lane);
+}
+
+AdpcmEncoder::LaneState AdpcmEncoder::GetState(size_t lane) const
+{
+    if (lane >= MAX_LANES)
+        return { INITIAL_PREDICTOR, INITIAL_STEP };
+    return { m_predictor[lane], m_step[lane] };
+}
+
+void AdpcmEncoder::SetState(size_t lane, const LaneState& state)
+{
+    if (lane >= MAX_LANES)
+        return;
+    m_predictor[lane] = state.predictor;
+    m_step[lane] = state.step;
+}
+
+void AdpcmEncoder::Encode(const int16_t* input, size_t lanes, size_t count, uint8_t* const* output)
+{
+    lanes = std::min(lanes, MAX_LANES);
+
+    int32_t* const predictor = m_predictor;
+    int32_t* const step = m_step;
+    alignas(64) int32_t nibbles[MAX_LANES];
+    alignas(64) int32_t high[MAX_LANES] = {};
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int16_t* samples = input + i * lanes;
+
+        // Every lane does the same arithmetic with selects instead of
+        // branches and table lookups, so this loop vectorizes
+        for (size_t lane = 0; lane < lanes; ++lane)
+        {
+            const int32_t delta = samples[lane] - predictor[lane];
+            const int32_t negative = delta < 0 ? 1 : 0;
+            const int32_t scaled = (delta < 0 ? -delta : delta) * 4;
+            const int32_t s = step[lane];
+
+            // min(7, |delta| * 4 / step) without a division
+            int32_t q = 0;
+            for (int32_t k = 1; k <= 7; ++k)
+                q += scaled >= k * s ? 1 : 0;
+
+            // Yamaha difference table: (2q + 1) / 8 of a step, signed
+            const int32_t difference = (s * (2 * q + 1)) >> 3;
+            const int32_t predicted = predictor[lane] + (negative ? -difference : difference);
+            predictor[lane] = std::clamp(predicted, -32768, 32767);
+
+            // Yamaha step scale table {230, 230, 230, 230, 307, 409, 512, 614}
+            // is max(230, (q - 1) * 102.4) in fixed point
+            const int32_t scale = std::max(230, ((q - 1) * 6554) >> 6);
+            step[lane] = std::clamp((s * scale) >> 8, MIN_STEP, MAX_STEP);
+
+            nibbles[lane] = q | (negative << 3);
+        }
+
+        if ((i & 1) == 0)
+        {
+            for (size_t lane = 0; lane < lanes; ++lane)
+                high[lane] = nibbles[lane] << 4;
+        }
+        else
+        {
+            for (size_t lane = 0; lane < lanes; ++lane)
+                output[lane][i / 2] = static_cast<uint8_t>(high[lane] | nibbles[lane]);
+        }
+    }
+}
+
+void AdpcmEncoder::Encode(const int16_t* input, size_t count, uint8_t* output)
+{
+    uint8_t* outputs[1] = { output };
+    Encode(input, 1, count, outputs);
+}
@@ -0,0 +1,175 @@
+#include "calibration_cache.h"
+#include "debug_log.h"
+#include <cstring>
+#include <cwctype>
+
+constexpr uint64_t PATH_KEY = 1ull << 63;
+
+uint64_t CalibrationCache::KeyFor(uint64_t bt_address, const std::wstring& device_path)
+{
+    if (bt_address != 0)
+        return bt_address;
+    if (device_path.empty())
+        return 0;
+
+    // FNV-1a over the path, ignoring case as Windows does
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (wchar_t c : device_path)
+    {
+        hash ^= static_cast<uint64_t>(std::towlower(c));
+        hash *= 0x100000001B3ull;
+    }
+    return hash | PATH_KEY;
+}
+
+bool CalibrationCache::Lookup(uint64_t key, uint64_t extension_id, std::vector<uint8_t>& data)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (key == 0 || !EnsureOpenLocked())
+    {
+        m_stats.misses++;
+        return false;
+    }
+
+    Entry* entry = FindLocked(key, extension_id);
+    if (!entry || entry->checksum != ComputeChecksum(*entry))
+    {
+        m_stats.misses++;
+        return false;
+    }
+
+    entry->last_used = ++Header()->clock;
+    data.assign(entry->data, entry->data + entry->size);
+    m_stats.hits++;
+    return true;
+}
+
+void CalibrationCache::Store(uint64_t key, uint64_t extension_id, const uint8_t* data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (key == 0 || size > MAX_BLOCK_SIZE || !EnsureOpenLocked())
+        return;
+
+    Entry* entry = FindLocked(key, extension_id);
+    if (!entry)
+    {
+        // Reuse the least recently used slot
+        Entry* entries = Entries();
+        entry = &entries[0];
+        for (uint32_t i = 1; i < CAPACITY; ++i)
+        {
+            if (entries[i].last_used < entry->last_used)
+                entry = &entries[i];
+        }
+    }
+
+    memset(entry, 0, sizeof(Entry));
+    entry->bt_address = key;
+    entry->extension_id = extension_id;
+    entry->last_used = ++Header()->clock;
+    entry->size = static_cast<uint8_t>(size);
+    memcpy(entry->data, data, size);
+    entry->checksum = ComputeChecksum(*entry);
+    m_file.Flush();
+}
+
+void CalibrationCache::Invalidate(uint64_t key, uint64_t extension_id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!EnsureOpenLocked())
+        return;
+
+    if (Entry* entry = FindLocked(key, extension_id))
+        memset(entry, 0, sizeof(Entry));
+}
+
+void CalibrationCache::RecordLatency(bool cache_hit, double milliseconds)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    double& average = cache_hit ? m_stats.cached_latency_ms : m_stats.uncached_latency_ms;
+    uint64_t& count = cache_hit ? m_stats.cached_samples : m_stats.uncached_samples;
+    count++;
+    average += (milliseconds - average) / static_cast<double>(count);
+}
+
+void CalibrationCache::RecordStale()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.stale++;
+}
+
+CalibrationCache::Stats CalibrationCache::GetStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+bool CalibrationCache::EnsureOpenLocked()
+{
+    if (m_file.IsOpen())
+        return true;
+    if (m_open_attempted)
+        return false;
+    m_open_attempted = true;
+
+    const size_t size = sizeof(FileHeader) + sizeof(Entry) * CAPACITY;
+    const std::string path = GetExecutableDirectory() + "wiimote_calibration.cache";
+    if (!m_file.Open(path, size))
+        return false;
+
+    FileHeader* header = Header();
+    if (m_file.WasCreated() || header->magic != FILE_MAGIC || header->version != FILE_VERSION ||
+        header->capacity != CAPACITY)
+    {
+        memset(m_file.GetData(), 0, size);
+        header->magic = FILE_MAGIC;
+        header->version = FILE_VERSION;
+        header->capacity = CAPACITY;
+        m_file.Flush();
+        LOG_INFO("Created calibration cache");
+    }
+    return true;
+}
+
+CalibrationCache::FileHeader* CalibrationCache::Header() const
+{
+    return static_cast<FileHeader*>(m_file.GetData());
+}
+
+CalibrationCache::Entry* CalibrationCache::Entries() const
+{
+    return reinterpret_cast<Entry*>(static_cast<uint8_t*>(m_file.GetData()) + sizeof(FileHeader));
+}
+
+CalibrationCache::Entry* CalibrationCache::FindLocked(uint64_t bt_address, uint64_t extension_id) const
+{
+    Entry* entries = Entries();
+    for (uint32_t i = 0; i < CAPACITY; ++i)
+    {
+        if (entries[i].size != 0 && entries[i].bt_address == bt_address &&
+            entries[i].extension_id == extension_id)
+        {
+            return &entries[i];
+        }
+    }
+    return nullptr;
+}
+
+uint32_t CalibrationCache::ComputeChecksum(const Entry& entry)
+{
+    // FNV-1a over the key and the block, enough to catch a torn write
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const void* bytes, size_t count) {
+        const uint8_t* data = static_cast<const uint8_t*>(bytes);
+        for (size_t i = 0; i < count; ++i)
+        {
+            hash ^= data[i];
+            hash *= 16777619u;
+        }
+    };
+    mix(&entry.bt_address, sizeof(entry.bt_address));
+    mix(&entry.extension_id, sizeof(entry.extension_id));
+    mix(&entry.size, sizeof(entry.size));
+    mix(entry.data, entry.size);
+    return hash;
+}
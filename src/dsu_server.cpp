@@ -0,0 +1,613 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+#include "dsu_server.h"
+#include "wiimote_device_registry.h"
+#include "wiimote_status_cache.h"
+#include "debug_log.h"
+#include <cstring>
+
+using namespace WiimoteProtocol;
+
+constexpr uint16_t DSU_VERSION = 1001;
+constexpr size_t HEADER_SIZE = 16;
+constexpr uint32_t MESSAGE_VERSION = 0x100000;
+constexpr uint32_t MESSAGE_INFO = 0x100001;
+constexpr uint32_t MESSAGE_DATA = 0x100002;
+
+// Header, message type and the 11-byte pad description shared by info and
+// data packets
+constexpr size_t PAD_HEADER_SIZE = HEADER_SIZE + 4 + 11;
+constexpr size_t VERSION_PACKET_SIZE = HEADER_SIZE + 4 + 2;
+constexpr size_t INFO_PACKET_SIZE = PAD_HEADER_SIZE + 1;
+constexpr size_t DATA_PACKET_SIZE = 100;
+constexpr size_t MAX_REQUEST_SIZE = 64;
+
+constexpr uint8_t PAD_STATE_DISCONNECTED = 0;
+constexpr uint8_t PAD_STATE_CONNECTED = 2;
+constexpr uint8_t PAD_MODEL_PARTIAL_GYRO = 1;
+constexpr uint8_t PAD_MODEL_FULL_GYRO = 2;
+constexpr uint8_t CONNECTION_BLUETOOTH = 2;
+
+constexpr int RECEIVE_TIMEOUT_MS = 100;
+
+struct Crc32Table
+{
+    uint32_t entries[256];
+
+    constexpr Crc32Table() : entries()
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+            entries[i] = crc;
+        }
+    }
+};
+
+static constexpr Crc32Table CRC32_TABLE;
+
+static uint32_t Crc32(const uint8_t* data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; ++i)
+        crc = CRC32_TABLE.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void Put16(uint8_t* out, uint16_t value)
+{
+    out[0] = static_cast<uint8_t>(value);
+    out[1] = static_cast<uint8_t>(value >> 8);
+}
+
+static void Put32(uint8_t* out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out[i] = static_cast<uint8_t>(value >> (i * 8));
+}
+
+static void Put64(uint8_t* out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        out[i] = static_cast<uint8_t>(value >> (i * 8));
+}
+
+static void PutFloat(uint8_t* out, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    Put32(out, bits);
+}
+
+static uint32_t Get32(const uint8_t* in)
+{
+    return static_cast<uint32_t>(in[0]) | (static_cast<uint32_t>(in[1]) << 8) |
+           (static_cast<uint32_t>(in[2]) << 16) | (static_cast<uint32_t>(in[3]) << 24);
+}
+
+// Fill in the length and checksum once the packet is complete
+static void FinishPacket(uint8_t* packet, size_t size)
+{
+    Put16(packet + 6, static_cast<uint16_t>(size - HEADER_SIZE));
+    Put32(packet + 8, 0);
+    Put32(packet + 8, Crc32(packet, size));
+}
+
+static void GetMac(uint64_t bt_address, uint8_t* mac)
+{
+    for (int i = 0; i < 6; ++i)
+        mac[i] = static_cast<uint8_t>(bt_address >> ((5 - i) * 8));
+}
+
+static uint8_t GetBatteryLevel(const WiimoteStatus& status)
+{
+    // DSU battery levels: 1 dying, 2 low, 3 medium, 4 high, 5 full
+    if (status.battery_low)
+        return 0x01;
+    if (status.battery_percent >= 95)
+        return 0x05;
+    if (status.battery_percent >= 60)
+        return 0x04;
+    if (status.battery_percent >= 25)
+        return 0x03;
+    return 0x02;
+}
+
+static void CloseSocket(uintptr_t socket)
+{
+#ifdef _WIN32
+    closesocket(static_cast<SOCKET>(socket));
+#else
+    close(static_cast<int>(socket));
+#endif
+}
+
+DsuServer::DsuServer()
+    : m_socket(static_cast<SocketHandle>(-1)), m_running(false), m_subscriptions(), m_server_id(0),
+      m_clients(), m_pads(), m_packet_numbers()
+{
+}
+
+DsuServer::~DsuServer()
+{
+    Stop();
+}
+
+bool DsuServer::Start(uint16_t port)
+{
+    if (m_running)
+        return true;
+
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+    {
+        LOG_ERROR("Failed to initialize Winsock for the DSU server");
+        return false;
+    }
+    const SOCKET socket_handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (socket_handle == INVALID_SOCKET)
+    {
+        LOG_ERROR(LogFormat("Failed to create DSU server socket, error: %d", WSAGetLastError()));
+        WSACleanup();
+        return false;
+    }
+    const DWORD timeout = RECEIVE_TIMEOUT_MS;
+    setsockopt(socket_handle, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+#else
+    const int socket_handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (socket_handle < 0)
+    {
+        LOG_ERROR(LogFormat("Failed to create DSU server socket, error: %d", errno));
+        return false;
+    }
+    timeval timeout = { 0, RECEIVE_TIMEOUT_MS * 1000 };
+    setsockopt(socket_handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+
+    // Local clients only
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(socket_handle, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        LOG_ERROR(LogFormat("Failed to bind DSU server to port %u", static_cast<unsigned>(port)));
+        CloseSocket(static_cast<uintptr_t>(socket_handle));
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_socket = static_cast<SocketHandle>(socket_handle);
+        m_server_id = static_cast<uint32_t>(Clock::now().time_since_epoch().count());
+        for (Client& client : m_clients)
+            client.active = false;
+        m_stats = Stats();
+    }
+
+    m_running = true;
+    m_thread = std::thread([this]() { ThreadProc(); });
+
+    LOG_INFO(LogFormat("DSU server listening on 127.0.0.1:%u", static_cast<unsigned>(port)));
+    return true;
+}
+
+void DsuServer::Stop()
+{
+    if (!m_running)
+        return;
+
+    m_running = false;
+    if (m_thread.joinable())
+        m_thread.join();
+    for (int pad = 0; pad < MAX_PADS; ++pad)
+        Unsubscribe(pad);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    CloseSocket(static_cast<uintptr_t>(m_socket));
+    m_socket = static_cast<SocketHandle>(-1);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    LOG_INFO("DSU server stopped");
+}
+
+void DsuServer::HandleInput(int slot, uint64_t bt_address, const WiimoteInputState& input,
+                            const ExtensionState& extension)
+{
+    if (slot < 0 || slot >= MAX_PADS || !m_running)
+        return;
+
+    uint8_t packet[DATA_PACKET_SIZE] = {};
+    uint8_t addresses[MAX_CLIENTS][16];
+    const uint8_t* destinations[MAX_CLIENTS];
+    size_t count = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        PadInfo& pad = m_pads[slot];
+        pad.connected = true;
+        pad.model = extension.type == ExtensionType::MotionPlus ? PAD_MODEL_FULL_GYRO : PAD_MODEL_PARTIAL_GYRO;
+        GetMac(bt_address, pad.mac);
+        WiimoteStatus status;
+        pad.battery = WiimoteStatusCache::Instance().Get(slot, status) ? GetBatteryLevel(status) : 0;
+
+        const Clock::time_point now = Clock::now();
+        for (const Client& client : m_clients)
+        {
+            if (!client.active)
+                continue;
+            const bool wanted = client.all_until > now || client.pad_until[slot] > now ||
+                                (client.mac_until > now && memcmp(client.mac, pad.mac, 6) == 0);
+            if (!wanted)
+                continue;
+            memcpy(addresses[count], client.address, sizeof(client.address));
+            destinations[count] = addresses[count];
+            count++;
+        }
+        if (count == 0)
+            return;
+
+        BuildPadHeader(packet, MESSAGE_DATA, slot);
+        Put32(packet + 32, ++m_packet_numbers[slot]);
+    }
+
+    // Remote held sideways is the usual emulator layout, but the DSU pad is
+    // a plain gamepad: D-pad as is, A/B/1/2 on the face buttons
+    const uint16_t buttons = input.buttons;
+    uint8_t* data = packet + PAD_HEADER_SIZE;
+    data[0] = 1;   // connected
+    uint8_t dpad = 0;
+    dpad |= (buttons & BUTTON_LEFT) ? 0x80 : 0;
+    dpad |= (buttons & BUTTON_DOWN) ? 0x40 : 0;
+    dpad |= (buttons & BUTTON_RIGHT) ? 0x20 : 0;
+    dpad |= (buttons & BUTTON_UP) ? 0x10 : 0;
+    dpad |= (buttons & BUTTON_PLUS) ? 0x08 : 0;    // Options
+    dpad |= (buttons & BUTTON_MINUS) ? 0x01 : 0;   // Share
+    uint8_t face = 0;
+    face |= (buttons & BUTTON_TWO) ? 0x80 : 0;     // Y
+    face |= (buttons & BUTTON_B) ? 0x40 : 0;
+    face |= (buttons & BUTTON_A) ? 0x20 : 0;
+    face |= (buttons & BUTTON_ONE) ? 0x10 : 0;     // X
+
+    uint8_t stick_x = 128;
+    uint8_t stick_y = 128;
+    if (GetControllerType(extension) == ExtensionType::Nunchuk)
+    {
+        stick_x = extension.nunchuk.stick_x;
+        stick_y = extension.nunchuk.stick_y;
+        face |= extension.nunchuk.button_c ? 0x04 : 0;   // L1
+        face |= extension.nunchuk.button_z ? 0x01 : 0;   // L2
+    }
+
+    data[5] = dpad;
+    data[6] = face;
+    data[7] = (buttons & BUTTON_HOME) ? 1 : 0;
+    data[9] = stick_x;
+    data[10] = stick_y;
+    data[11] = 128;
+    data[12] = 128;
+    // Analog D-pad left/down/right/up, Y/B/A/X, R1/L1/R2/L2
+    const uint8_t analog_bits[12][2] = {
+        { 0, 0x80 }, { 0, 0x40 }, { 0, 0x20 }, { 0, 0x10 },
+        { 1, 0x80 }, { 1, 0x40 }, { 1, 0x20 }, { 1, 0x10 },
+        { 1, 0x08 }, { 1, 0x04 }, { 1, 0x02 }, { 1, 0x01 },
+    };
+    for (int i = 0; i < 12; ++i)
+        data[13 + i] = ((analog_bits[i][0] == 0 ? dpad : face) & analog_bits[i][1]) ? 0xFF : 0x00;
+
+    // Touch points at 25 - 36 stay empty
+    const uint64_t timestamp_us = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(input.sampled.time_since_epoch()).count());
+    Put64(data + 37, timestamp_us);
+
+    // Accelerometer in g, in the remote's own axes
+    for (int axis = 0; axis < 3; ++axis)
+        PutFloat(data + 45 + axis * 4, input.accel_calibrated ? input.accel_g[axis] : 0.0f);
+
+    if (extension.type == ExtensionType::MotionPlus)
+    {
+        float rates[3];
+        GetMotionPlusRates(extension.motion_plus, rates);
+        // DSU orders them pitch, yaw, roll
+        PutFloat(data + 57, rates[0]);
+        PutFloat(data + 61, rates[2]);
+        PutFloat(data + 65, rates[1]);
+    }
+
+    FinishPacket(packet, DATA_PACKET_SIZE);
+    Send(packet, DATA_PACKET_SIZE, destinations, count);
+}
+
+DsuServer::Stats DsuServer::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats = m_stats;
+    stats.clients = 0;
+    for (const Client& client : m_clients)
+        stats.clients += client.active ? 1 : 0;
+    return stats;
+}
+
+void DsuServer::ThreadProc()
+{
+    uint8_t packet[MAX_REQUEST_SIZE];
+    while (m_running)
+    {
+        sockaddr_in from = {};
+#ifdef _WIN32
+        int from_size = sizeof(from);
+        const int received = recvfrom(static_cast<SOCKET>(m_socket), reinterpret_cast<char*>(packet),
+                                      sizeof(packet), 0, reinterpret_cast<sockaddr*>(&from), &from_size);
+#else
+        socklen_t from_size = sizeof(from);
+        const ssize_t received = recvfrom(m_socket, packet, sizeof(packet), 0,
+                                          reinterpret_cast<sockaddr*>(&from), &from_size);
+#endif
+        // Timeouts bring us back round to check m_running and let
+        // registrations lapse
+        if (received > 0)
+        {
+            uint8_t address[16] = {};
+            memcpy(address, &from, sizeof(from) < sizeof(address) ? sizeof(from) : sizeof(address));
+            HandleRequest(packet, static_cast<size_t>(received), address);
+        }
+        UpdateSubscriptions();
+    }
+}
+
+void DsuServer::UpdateSubscriptions()
+{
+    uint32_t wanted;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        wanted = GetWantedPadsLocked(Clock::now());
+    }
+
+    // Outside the lock: the registry calls HandleInput, which takes it
+    for (int pad = 0; pad < MAX_PADS; ++pad)
+    {
+        if (!(wanted & (1u << pad)))
+        {
+            Unsubscribe(pad);
+            continue;
+        }
+        if (m_subscriptions[pad] != 0)
+            continue;
+        m_subscriptions[pad] = WiimoteDeviceRegistry::Instance().Subscribe(
+            INPUT_FEATURE_BUTTONS | INPUT_FEATURE_ACCEL | INPUT_FEATURE_EXTENSION,
+            [this](WiimoteDevice& device, const WiimoteInputState& input, const ExtensionState& extension) {
+                HandleInput(device.GetSlot(), device.GetBluetoothAddress(), input, extension);
+            }, pad);
+        LOG_INFO(LogFormat("DSU pad %d has a client, subscribed to its remote", pad));
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.subscribed_pads = wanted;
+}
+
+void DsuServer::Unsubscribe(int pad)
+{
+    if (m_subscriptions[pad] == 0)
+        return;
+    WiimoteDeviceRegistry::Instance().Unsubscribe(m_subscriptions[pad]);
+    m_subscriptions[pad] = 0;
+    LOG_INFO(LogFormat("DSU pad %d has no client left, unsubscribed from its remote", pad));
+}
+
+uint32_t DsuServer::GetWantedPadsLocked(Clock::time_point now) const
+{
+    uint32_t wanted = 0;
+    for (const Client& client : m_clients)
+    {
+        if (!client.active)
+            continue;
+        if (client.all_until > now)
+            return (1u << MAX_PADS) - 1;
+        for (int pad = 0; pad < MAX_PADS; ++pad)
+        {
+            if (client.pad_until[pad] > now)
+                wanted |= 1u << pad;
+        }
+        if (client.mac_until <= now)
+            continue;
+        // Whichever pad the remote with that address is in now
+        for (int pad = 0; pad < MAX_PADS; ++pad)
+        {
+            WiimoteStatus status;
+            uint8_t mac[6];
+            if (!WiimoteStatusCache::Instance().Get(pad, status))
+                continue;
+            GetMac(status.bt_address, mac);
+            if (memcmp(mac, client.mac, sizeof(mac)) == 0)
+                wanted |= 1u << pad;
+        }
+    }
+    return wanted;
+}
+
+void DsuServer::HandleRequest(const uint8_t* packet, size_t size, const uint8_t* address)
+{
+    uint8_t request[MAX_REQUEST_SIZE];
+    const bool valid_header = size >= HEADER_SIZE + 4 && size <= sizeof(request) &&
+                              memcmp(packet, "DSUC", 4) == 0 &&
+                              (packet[4] | (packet[5] << 8)) == DSU_VERSION &&
+                              static_cast<size_t>(packet[6] | (packet[7] << 8)) == size - HEADER_SIZE;
+    bool valid = valid_header;
+    if (valid)
+    {
+        memcpy(request, packet, size);
+        Put32(request + 8, 0);
+        valid = Crc32(request, size) == Get32(packet + 8);
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!valid)
+    {
+        m_stats.bad_requests++;
+        return;
+    }
+    m_stats.requests++;
+
+    const uint32_t type = Get32(packet + 16);
+    const Clock::time_point now = Clock::now();
+    const uint8_t* destinations[1] = { address };
+
+    if (type == MESSAGE_VERSION)
+    {
+        uint8_t reply[VERSION_PACKET_SIZE] = {};
+        memcpy(reply, "DSUS", 4);
+        Put16(reply + 4, DSU_VERSION);
+        Put32(reply + 12, m_server_id);
+        Put32(reply + 16, MESSAGE_VERSION);
+        Put16(reply + 20, DSU_VERSION);
+        lock.unlock();
+        FinishPacket(reply, sizeof(reply));
+        Send(reply, sizeof(reply), destinations, 1);
+    }
+    else if (type == MESSAGE_INFO && size >= HEADER_SIZE + 8)
+    {
+        // One reply per pad asked about
+        const uint32_t ports = Get32(packet + 20);
+        uint8_t replies[MAX_PADS][INFO_PACKET_SIZE] = {};
+        size_t count = 0;
+        for (uint32_t i = 0; i < ports && i < MAX_PADS && HEADER_SIZE + 8 + i < size; ++i)
+        {
+            const uint8_t pad = packet[24 + i];
+            if (pad >= MAX_PADS)
+                continue;
+            BuildPadHeader(replies[count], MESSAGE_INFO, pad);
+            count++;
+        }
+        lock.unlock();
+        for (size_t i = 0; i < count; ++i)
+        {
+            FinishPacket(replies[i], INFO_PACKET_SIZE);
+            Send(replies[i], INFO_PACKET_SIZE, destinations, 1);
+        }
+    }
+    else if (type == MESSAGE_DATA && size >= HEADER_SIZE + 12)
+    {
+        Client* client = FindClientLocked(address, now);
+        if (!client)
+            return;
+
+        // Flags: none for every pad, bit 0 for one pad, bit 1 for one MAC
+        const uint8_t flags = packet[20];
+        const uint8_t pad = packet[21];
+        const Clock::time_point until = now + CLIENT_TIMEOUT;
+        if (flags == 0)
+            client->all_until = until;
+        if ((flags & 0x01) && pad < MAX_PADS)
+            client->pad_until[pad] = until;
+        if (flags & 0x02)
+        {
+            memcpy(client->mac, packet + 22, 6);
+            client->mac_until = until;
+        }
+    }
+}
+
+size_t DsuServer::BuildPadHeader(uint8_t* packet, uint32_t type, int pad) const
+{
+    // A pad stays connected while its remote still has a status entry
+    WiimoteStatus status;
+    PadInfo info = m_pads[pad];
+    info.connected = info.connected && WiimoteStatusCache::Instance().Get(pad, status);
+    memcpy(packet, "DSUS", 4);
+    Put16(packet + 4, DSU_VERSION);
+    Put32(packet + 12, m_server_id);
+    Put32(packet + 16, type);
+
+    uint8_t* shared = packet + HEADER_SIZE + 4;
+    shared[0] = static_cast<uint8_t>(pad);
+    shared[1] = info.connected ? PAD_STATE_CONNECTED : PAD_STATE_DISCONNECTED;
+    shared[2] = info.connected ? info.model : 0;
+    shared[3] = info.connected ? CONNECTION_BLUETOOTH : 0;
+    memcpy(shared + 4, info.mac, 6);
+    shared[10] = info.battery;
+    return PAD_HEADER_SIZE;
+}
+
+void DsuServer::Send(const uint8_t* packet, size_t size, const uint8_t* const* addresses, size_t count)
+{
+    // Held across the sends so Stop cannot close the socket under them
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_socket == static_cast<SocketHandle>(-1))
+        return;
+
+    size_t sent = 0;
+    size_t calls = 0;
+#ifdef _WIN32
+    // Winsock has no batched send for UDP; one sendto per client
+    for (size_t i = 0; i < count; ++i)
+    {
+        calls++;
+        if (sendto(static_cast<SOCKET>(m_socket), reinterpret_cast<const char*>(packet), static_cast<int>(size), 0,
+                   reinterpret_cast<const sockaddr*>(addresses[i]), sizeof(sockaddr_in)) == static_cast<int>(size))
+            sent++;
+    }
+#else
+    // Every client gets the same bytes, so all messages share one iovec
+    iovec buffer = { const_cast<uint8_t*>(packet), size };
+    mmsghdr messages[MAX_CLIENTS] = {};
+    for (size_t i = 0; i < count; ++i)
+    {
+        messages[i].msg_hdr.msg_name = const_cast<uint8_t*>(addresses[i]);
+        messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        messages[i].msg_hdr.msg_iov = &buffer;
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (sent < count)
+    {
+        calls++;
+        const int result = sendmmsg(m_socket, messages + sent, static_cast<unsigned int>(count - sent), 0);
+        if (result <= 0)
+            break;
+        sent += static_cast<size_t>(result);
+    }
+#endif
+
+    m_stats.send_calls += calls;
+    m_stats.packets_sent += sent;
+    m_stats.send_errors += count - sent;
+}
+
+DsuServer::Client* DsuServer::FindClientLocked(const uint8_t* address, Clock::time_point now)
+{
+    Client* free_client = nullptr;
+    for (Client& client : m_clients)
+    {
+        if (client.active && memcmp(client.address, address, sizeof(client.address)) == 0)
+            return &client;
+
+        // Clients that have let every registration lapse give up their place
+        bool expired = client.all_until <= now && client.mac_until <= now;
+        for (const Clock::time_point& until : client.pad_until)
+            expired = expired && until <= now;
+        if (client.active && expired)
+            client.active = false;
+        if (!client.active && !free_client)
+            free_client = &client;
+    }
+    if (!free_client)
+        return nullptr;
+
+    *free_client = Client();
+    free_client->active = true;
+    memcpy(free_client->address, address, sizeof(free_client->address));
+    return free_client;
+}
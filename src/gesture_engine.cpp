@@ -0,0 +1,727 @@
+#include "gesture_engine.h"
+#include "wiimote_device_registry.h"
+#include "debug_log.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+static const char* TEMPLATE_FILE = "gestures.txt";
+
+constexpr float INFINITE_DISTANCE = std::numeric_limits<float>::infinity();
+constexpr float TWO_PI = 6.2831853f;
+
+// A remote whose push and rotation stay below this for REST_SAMPLES
+// reports is at rest, and its matchers are skipped until it moves
+constexpr float REST_ENERGY = 0.25f;
+constexpr int REST_SAMPLES = 10;
+
+// Below this the accelerometer gives no usable direction for rotation
+constexpr float MIN_DIRECTION_G = 0.3f;
+constexpr float DIRECTION_SMOOTHING = 0.3f;
+
+static std::vector<GestureTemplate> CreateBuiltinTemplates()
+{
+    std::vector<GestureTemplate> templates(3);
+
+    // One hard push in any direction, 0.2 s
+    GestureTemplate& swing = templates[0];
+    swing.name = "swing";
+    swing.threshold = 1.0f;
+    std::fill(std::begin(swing.weights), std::end(swing.weights), 0.0f);
+    swing.weights[GESTURE_ACCEL_DYNAMIC] = 1.0f;
+    for (int i = 0; i < 20; ++i)
+    {
+        GestureSample sample = {};
+        sample[GESTURE_ACCEL_DYNAMIC] = 2.5f * std::sin(3.1415927f * (i + 0.5f) / 20.0f);
+        swing.samples.push_back(sample);
+    }
+
+    // Back and forth at 4 Hz with 2 g either way, 0.5 s
+    GestureTemplate& shake = templates[1];
+    shake.name = "shake";
+    shake.threshold = 0.15f;
+    std::fill(std::begin(shake.weights), std::end(shake.weights), 0.0f);
+    shake.weights[GESTURE_ACCEL_DYNAMIC] = 1.0f;
+    for (int i = 0; i < 50; ++i)
+    {
+        const float push = 2.0f * std::sin(TWO_PI * 4.0f * i / 100.0f);
+        GestureSample sample = {};
+        sample[GESTURE_ACCEL_DYNAMIC] = std::sqrt(1.0f + push * push) - 1.0f;
+        shake.samples.push_back(sample);
+    }
+
+    // A quarter turn about the pointing axis in 0.3 s, without pushing
+    GestureTemplate& twist = templates[2];
+    twist.name = "twist";
+    twist.threshold = 0.15f;
+    std::fill(std::begin(twist.weights), std::end(twist.weights), 0.0f);
+    twist.weights[GESTURE_ACCEL_DYNAMIC] = 1.0f;
+    twist.weights[GESTURE_ROTATION] = 1.0f;
+    for (int i = 0; i < 30; ++i)
+    {
+        GestureSample sample = {};
+        sample[GESTURE_ROTATION] = 1.3f * std::sin(3.1415927f * (i + 0.5f) / 30.0f);
+        twist.samples.push_back(sample);
+    }
+
+    return templates;
+}
+
+GestureEngine::GestureEngine()
+    : m_templates(std::make_shared<TemplateList>()),
+      m_subscriptions(std::make_shared<SubscriptionList>()),
+      m_next_subscription_id(1), m_registry_subscription(0)
+{
+    for (const GestureTemplate& gesture : CreateBuiltinTemplates())
+        AddTemplate(gesture);
+    LoadTemplates(GetExecutableDirectory() + TEMPLATE_FILE);
+}
+
+std::shared_ptr<const GestureEngine::CompiledTemplate> GestureEngine::Compile(const GestureTemplate& gesture)
+{
+    const size_t length = gesture.samples.size();
+    if (gesture.name.empty() || length == 0 || length > GestureTemplate::MAX_LENGTH || !(gesture.threshold > 0.0f))
+        return nullptr;
+
+    auto compiled = std::make_shared<CompiledTemplate>();
+    compiled->name = gesture.name;
+    compiled->length = length;
+    compiled->epsilon = gesture.threshold * static_cast<float>(length);
+    std::copy(std::begin(gesture.weights), std::end(gesture.weights), compiled->weights);
+    compiled->used_count = 0;
+    compiled->used_mask = 0;
+    for (size_t feature = 0; feature < GESTURE_FEATURE_COUNT; ++feature)
+    {
+        if (gesture.weights[feature] != 0.0f)
+        {
+            compiled->used_features[compiled->used_count++] = static_cast<uint8_t>(feature);
+            compiled->used_mask |= 1u << feature;
+        }
+    }
+    compiled->stride = (length + CELL_BLOCK - 1) / CELL_BLOCK * CELL_BLOCK;
+    compiled->features.resize(GESTURE_FEATURE_COUNT * compiled->stride);
+    // Group g holds the sorted samples [bounds[g], bounds[g + 1]); a template
+    // shorter than the groups leaves some empty
+    size_t bounds[BOUND_GROUPS + 1];
+    for (size_t group = 0; group <= BOUND_GROUPS; ++group)
+        bounds[group] = length * group / BOUND_GROUPS;
+    for (size_t group = 0; group < BOUND_GROUPS; ++group)
+        compiled->group_sizes[group] = static_cast<float>(bounds[group + 1] - bounds[group]);
+    for (size_t feature = 0; feature < GESTURE_FEATURE_COUNT; ++feature)
+    {
+        float sorted[GestureTemplate::MAX_LENGTH];
+        for (size_t i = 0; i < length; ++i)
+        {
+            compiled->features[feature * compiled->stride + i] = gesture.samples[i][feature];
+            sorted[i] = gesture.samples[i][feature];
+        }
+        std::sort(sorted, sorted + length);
+        for (size_t group = 0; group < BOUND_GROUPS; ++group)
+        {
+            float sum = 0.0f;
+            for (size_t i = bounds[group]; i < bounds[group + 1]; ++i)
+                sum += sorted[i];
+            compiled->group_means[feature][group] =
+                compiled->group_sizes[group] > 0.0f ? sum / compiled->group_sizes[group] : 0.0f;
+        }
+    }
+    return compiled;
+}
+
+bool GestureEngine::AddTemplate(const GestureTemplate& gesture)
+{
+    auto compiled = Compile(gesture);
+    if (!compiled)
+    {
+        LOG_ERROR(LogFormat("Gesture template \"%s\" is not valid", gesture.name.c_str()));
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_template_mutex);
+    auto templates = std::make_shared<TemplateList>(*m_templates);
+    auto it = std::find_if(templates->begin(), templates->end(), [&](const auto& existing) {
+        return existing->name == gesture.name;
+    });
+    if (it != templates->end())
+    {
+        *it = compiled;
+    }
+    else if (templates->size() < MAX_TEMPLATES)
+    {
+        templates->push_back(compiled);
+    }
+    else
+    {
+        LOG_ERROR(LogFormat("No room for gesture template \"%s\"", gesture.name.c_str()));
+        return false;
+    }
+    m_templates = templates;
+    return true;
+}
+
+bool GestureEngine::RemoveTemplate(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(m_template_mutex);
+    auto templates = std::make_shared<TemplateList>(*m_templates);
+    auto it = std::find_if(templates->begin(), templates->end(), [&](const auto& existing) {
+        return existing->name == name;
+    });
+    if (it == templates->end())
+        return false;
+    templates->erase(it);
+    m_templates = templates;
+    return true;
+}
+
+std::vector<std::string> GestureEngine::GetTemplateNames() const
+{
+    std::lock_guard<std::mutex> lock(m_template_mutex);
+    std::vector<std::string> names;
+    for (const auto& gesture : *m_templates)
+        names.push_back(gesture->name);
+    return names;
+}
+
+bool GestureEngine::LoadTemplates(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        LOG_DEBUG(LogFormat("No gesture templates at %s", path.c_str()));
+        return false;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+
+    std::string error;
+    if (!LoadTemplatesFromText(text.str(), error))
+    {
+        LOG_ERROR(LogFormat("Gesture templates in %s not loaded: %s", path.c_str(), error.c_str()));
+        return false;
+    }
+    return true;
+}
+
+bool GestureEngine::LoadTemplatesFromText(const std::string& text, std::string& error)
+{
+    std::vector<GestureTemplate> gestures;
+    std::istringstream stream(text);
+    std::string line;
+    for (int number = 1; std::getline(stream, line); ++number)
+    {
+        std::istringstream tokens(line.substr(0, line.find('#')));
+        std::string first;
+        if (!(tokens >> first))
+            continue;
+
+        if (first == "gesture")
+        {
+            GestureTemplate gesture;
+            if (!(tokens >> gesture.name >> gesture.threshold))
+            {
+                error = LogFormat("line %d: expected: gesture <name> <threshold>", number);
+                return false;
+            }
+            gestures.push_back(gesture);
+            continue;
+        }
+        if (gestures.empty())
+        {
+            error = LogFormat("line %d: samples outside of a gesture", number);
+            return false;
+        }
+
+        // Either the weights or one sample, a value per feature
+        const bool weights = first == "weights";
+        float values[GESTURE_FEATURE_COUNT];
+        size_t count = 0;
+        if (!weights)
+        {
+            char* end = nullptr;
+            values[count++] = std::strtof(first.c_str(), &end);
+            if (*end != '\0')
+            {
+                error = LogFormat("line %d: bad value %s", number, first.c_str());
+                return false;
+            }
+        }
+        while (count < GESTURE_FEATURE_COUNT && tokens >> values[count])
+            ++count;
+        std::string rest;
+        if (count != GESTURE_FEATURE_COUNT || tokens >> rest)
+        {
+            error = LogFormat("line %d: expected %d values", number, static_cast<int>(GESTURE_FEATURE_COUNT));
+            return false;
+        }
+
+        GestureTemplate& gesture = gestures.back();
+        if (weights)
+            std::copy(values, values + GESTURE_FEATURE_COUNT, gesture.weights);
+        else
+            gesture.samples.push_back({ values[0], values[1], values[2], values[3],
+                                        values[4], values[5], values[6], values[7] });
+    }
+
+    for (const GestureTemplate& gesture : gestures)
+    {
+        if (!Compile(gesture))
+        {
+            error = LogFormat("gesture %s needs 1 to %d samples and a positive threshold",
+                              gesture.name.c_str(), static_cast<int>(GestureTemplate::MAX_LENGTH));
+            return false;
+        }
+    }
+    for (const GestureTemplate& gesture : gestures)
+    {
+        if (!AddTemplate(gesture))
+        {
+            error = LogFormat("gesture %s does not fit", gesture.name.c_str());
+            return false;
+        }
+    }
+    LOG_INFO(LogFormat("Loaded %zu gesture templates", gestures.size()));
+    return true;
+}
+
+int GestureEngine::Subscribe(GestureCallback callback, int slot, float min_confidence)
+{
+    std::lock_guard<std::mutex> lock(m_subscription_mutex);
+    auto subscriptions = std::make_shared<SubscriptionList>(*m_subscriptions);
+    const int id = m_next_subscription_id++;
+    subscriptions->push_back({ id, slot, min_confidence, std::move(callback) });
+
+    // Motion is only asked of the remotes while someone listens
+    if (m_subscriptions->empty())
+    {
+        m_registry_subscription = WiimoteDeviceRegistry::Instance().Subscribe(
+            INPUT_FEATURE_ACCEL | INPUT_FEATURE_EXTENSION | INPUT_FEATURE_CONTINUOUS,
+            [this](WiimoteDevice& device, const WiimoteInputState& input, const ExtensionState& extension) {
+                HandleInput(device.GetSlot(), input, extension);
+            });
+    }
+    m_subscriptions = subscriptions;
+    return id;
+}
+
+void GestureEngine::Unsubscribe(int subscription_id)
+{
+    std::lock_guard<std::mutex> lock(m_subscription_mutex);
+    auto subscriptions = std::make_shared<SubscriptionList>(*m_subscriptions);
+    subscriptions->erase(std::remove_if(subscriptions->begin(), subscriptions->end(),
+                                        [&](const Subscription& subscription) {
+                                            return subscription.id == subscription_id;
+                                        }),
+                         subscriptions->end());
+    if (subscriptions->empty() && !m_subscriptions->empty())
+        WiimoteDeviceRegistry::Instance().Unsubscribe(m_registry_subscription);
+    m_subscriptions = subscriptions;
+}
+
+void GestureEngine::HandleInput(int slot, const WiimoteInputState& input, const ExtensionState& extension)
+{
+    if (slot < 0 || slot >= MAX_SLOTS)
+        return;
+
+    std::shared_ptr<const TemplateList> templates;
+    {
+        std::lock_guard<std::mutex> lock(m_template_mutex);
+        templates = m_templates;
+    }
+
+    GestureEvent events[MAX_TEMPLATES];
+    size_t count = 0;
+    uint64_t cells = 0;
+    bool idle = false;
+    {
+        RemoteState& remote = m_remotes[slot];
+        std::lock_guard<std::mutex> lock(remote.mutex);
+
+        float features[GESTURE_FEATURE_COUNT];
+        if (!ExtractFeatures(remote, input, extension, features))
+            return;
+
+        if (remote.templates != templates)
+        {
+            remote.templates = templates;
+            remote.matchers.assign(templates->size(), Matcher());
+            ResetMatchers(remote);
+        }
+        remote.times[remote.sample % HISTORY] = input.sampled;
+        std::copy(features, features + GESTURE_FEATURE_COUNT, remote.history[remote.sample % HISTORY]);
+        float* low = remote.block_low[remote.sample / ENVELOPE_BLOCK % ENVELOPE_BLOCKS];
+        float* high = remote.block_high[remote.sample / ENVELOPE_BLOCK % ENVELOPE_BLOCKS];
+        for (size_t feature = 0; feature < GESTURE_FEATURE_COUNT; ++feature)
+        {
+            const bool first = remote.sample % ENVELOPE_BLOCK == 0;
+            low[feature] = first ? features[feature] : std::min(low[feature], features[feature]);
+            high[feature] = first ? features[feature] : std::max(high[feature], features[feature]);
+        }
+
+        const bool quiet = features[GESTURE_ACCEL_DYNAMIC] + features[GESTURE_ROTATION] < REST_ENERGY;
+        remote.quiet_samples = quiet ? remote.quiet_samples + 1 : 0;
+        if (remote.idle && quiet)
+        {
+            idle = true;
+        }
+        else
+        {
+            if (remote.idle)
+                remote.moving_since = remote.sample;
+            remote.idle = false;
+            count = Match(remote, features, events, MAX_TEMPLATES, cells);
+            if (remote.quiet_samples >= REST_SAMPLES)
+            {
+                // Nothing is moving any more; what is pending is final
+                for (size_t i = 0; i < templates->size() && count < MAX_TEMPLATES; ++i)
+                {
+                    if (remote.matchers[i].best <= (*templates)[i]->epsilon)
+                        Report(remote, *(*templates)[i], remote.matchers[i], events[count++]);
+                }
+                ResetMatchers(remote);
+                remote.idle = true;
+            }
+        }
+        for (size_t i = 0; i < count; ++i)
+            events[i].slot = slot;
+        remote.sample++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        m_stats.samples++;
+        m_stats.idle_samples += idle ? 1 : 0;
+        m_stats.cells += cells;
+        m_stats.gestures += count;
+    }
+    if (count == 0)
+        return;
+
+    std::shared_ptr<const SubscriptionList> subscriptions;
+    {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        subscriptions = m_subscriptions;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        LOG_DEBUG(LogFormat("Gesture %s on slot %d, confidence %.2f", events[i].name, slot, events[i].confidence));
+        for (const Subscription& subscription : *subscriptions)
+        {
+            if ((subscription.slot == -1 || subscription.slot == slot) &&
+                events[i].confidence >= subscription.min_confidence)
+                subscription.callback(events[i]);
+        }
+    }
+}
+
+bool GestureEngine::ExtractFeatures(RemoteState& remote, const WiimoteInputState& input,
+                                    const ExtensionState& extension, float* features) const
+{
+    if (!input.accel_calibrated)
+        return false;
+
+    const float* g = input.accel_g;
+    const float magnitude = std::sqrt(g[0] * g[0] + g[1] * g[1] + g[2] * g[2]);
+    features[GESTURE_ACCEL_X] = g[0];
+    features[GESTURE_ACCEL_Y] = g[1];
+    features[GESTURE_ACCEL_Z] = g[2];
+    features[GESTURE_ACCEL_DYNAMIC] = std::fabs(magnitude - 1.0f);
+
+    if (extension.type == ExtensionType::MotionPlus)
+    {
+        float rates[3];
+        GetMotionPlusRates(extension.motion_plus, rates);
+        features[GESTURE_RATE_PITCH] = rates[0] / 360.0f;
+        features[GESTURE_RATE_ROLL] = rates[1] / 360.0f;
+        features[GESTURE_RATE_YAW] = rates[2] / 360.0f;
+        features[GESTURE_ROTATION] = std::sqrt(features[GESTURE_RATE_PITCH] * features[GESTURE_RATE_PITCH] +
+                                               features[GESTURE_RATE_ROLL] * features[GESTURE_RATE_ROLL] +
+                                               features[GESTURE_RATE_YAW] * features[GESTURE_RATE_YAW]);
+        return true;
+    }
+
+    // Without a gyro, rotation is how fast gravity turns in the remote's axes
+    features[GESTURE_RATE_PITCH] = 0.0f;
+    features[GESTURE_RATE_ROLL] = 0.0f;
+    features[GESTURE_RATE_YAW] = 0.0f;
+    features[GESTURE_ROTATION] = 0.0f;
+    if (magnitude < MIN_DIRECTION_G)
+        return true;
+
+    float direction[3] = { g[0] / magnitude, g[1] / magnitude, g[2] / magnitude };
+    const uint64_t count = remote.direction_count;
+    if (count > 0)
+    {
+        const float* last = remote.directions[(count - 1) % ROTATION_BASELINE];
+        float length = 0.0f;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            direction[axis] = last[axis] + DIRECTION_SMOOTHING * (direction[axis] - last[axis]);
+            length += direction[axis] * direction[axis];
+        }
+        length = std::sqrt(length);
+        for (int axis = 0; axis < 3; ++axis)
+            direction[axis] /= length;
+    }
+
+    // The oldest entry, about to be replaced
+    float* oldest = remote.directions[count % ROTATION_BASELINE];
+    Clock::time_point& oldest_time = remote.direction_times[count % ROTATION_BASELINE];
+    if (count >= ROTATION_BASELINE)
+    {
+        const float dot = std::clamp(direction[0] * oldest[0] + direction[1] * oldest[1] + direction[2] * oldest[2],
+                                     -1.0f, 1.0f);
+        const float seconds = std::max(std::chrono::duration<float>(input.sampled - oldest_time).count(), 0.001f);
+        features[GESTURE_ROTATION] = std::acos(dot) / (TWO_PI * seconds);
+    }
+    std::copy(direction, direction + 3, oldest);
+    oldest_time = input.sampled;
+    remote.direction_count++;
+    return true;
+}
+
+size_t GestureEngine::Match(RemoteState& remote, const float* features, GestureEvent* events, size_t max_events,
+                            uint64_t& cells)
+{
+    const uint64_t now = remote.sample;
+    const TemplateList& templates = *remote.templates;
+    size_t count = 0;
+
+    // Range of each feature over the reports a path may hold: the last
+    // ENVELOPE_SPAN at least, none from before the remote started moving
+    const uint64_t oldest =
+        std::max<uint64_t>(remote.moving_since, now >= ENVELOPE_SPAN ? now - ENVELOPE_SPAN + 1 : 0);
+    float low[GESTURE_FEATURE_COUNT];
+    float high[GESTURE_FEATURE_COUNT];
+    std::fill(low, low + GESTURE_FEATURE_COUNT, INFINITE_DISTANCE);
+    std::fill(high, high + GESTURE_FEATURE_COUNT, -INFINITE_DISTANCE);
+    for (uint64_t block = oldest / ENVELOPE_BLOCK; block <= now / ENVELOPE_BLOCK; ++block)
+    {
+        const float* block_low = remote.block_low[block % ENVELOPE_BLOCKS];
+        const float* block_high = remote.block_high[block % ENVELOPE_BLOCKS];
+        for (size_t feature = 0; feature < GESTURE_FEATURE_COUNT; ++feature)
+        {
+            low[feature] = std::min(low[feature], block_low[feature]);
+            high[feature] = std::max(high[feature], block_high[feature]);
+        }
+    }
+    uint32_t changed = 0;
+    for (size_t feature = 0; feature < GESTURE_FEATURE_COUNT; ++feature)
+    {
+        if (low[feature] != remote.low[feature] || high[feature] != remote.high[feature])
+            changed |= 1u << feature;
+    }
+    std::copy(low, low + GESTURE_FEATURE_COUNT, remote.low);
+    std::copy(high, high + GESTURE_FEATURE_COUNT, remote.high);
+
+    // Sleeping templates none of whose features' range changed stay asleep
+    uint32_t touched = 0;
+    for (size_t feature = 0; feature < GESTURE_FEATURE_COUNT; ++feature)
+    {
+        if (changed & (1u << feature))
+            touched |= remote.feature_templates[feature];
+    }
+    const uint32_t loaded = templates.size() < MAX_TEMPLATES ? (1u << templates.size()) - 1 : ~0u;
+    for (uint32_t pending = loaded & ~(remote.asleep & ~touched); pending != 0; pending &= pending - 1)
+    {
+        const size_t k = static_cast<size_t>(std::countr_zero(pending));
+        const uint32_t bit = 1u << k;
+        const CompiledTemplate& gesture = *templates[k];
+        Matcher& matcher = remote.matchers[k];
+        const size_t length = gesture.length;
+
+        // Every sample of the template is matched to a report in the range,
+        // at least as far from it as the range is; summed over a group of
+        // samples that is at least the group's size times the distance of
+        // its mean
+        float bound = 0.0f;
+        for (size_t f = 0; f < gesture.used_count; ++f)
+        {
+            const size_t feature = gesture.used_features[f];
+            float sum = 0.0f;
+            for (size_t group = 0; group < BOUND_GROUPS; ++group)
+            {
+                const float mean = gesture.group_means[feature][group];
+                const float gap = std::max(std::max(mean - high[feature], low[feature] - mean), 0.0f);
+                sum += gesture.group_sizes[group] * gap * gap;
+            }
+            bound += gesture.weights[feature] * sum;
+        }
+        if (bound > gesture.epsilon && matcher.best > gesture.epsilon)
+        {
+            remote.asleep |= bit;
+            continue;
+        }
+        if (remote.asleep & bit)
+        {
+            // Rebuild the column from the reports a path may have started at
+            std::fill(matcher.distances.begin(), matcher.distances.end(), INFINITE_DISTANCE);
+            matcher.active = 0;
+            remote.asleep &= ~bit;
+            for (uint64_t sample = std::max(oldest, matcher.floor); sample < now; ++sample)
+                cells += AdvanceColumn(gesture, matcher, remote.history[sample % HISTORY], sample);
+        }
+        cells += AdvanceColumn(gesture, matcher, features, now);
+        // No path through a column without a cell under the threshold ends
+        // under it, so none rebuilt later needs to start before this one
+        if (matcher.active == 0)
+            matcher.floor = now + 1;
+
+        // Report the best match once no path overlapping it can still beat it
+        float* distances = matcher.distances.data();
+        const uint64_t* starts = matcher.starts.data();
+        if (matcher.best <= gesture.epsilon)
+        {
+            bool final = true;
+            for (size_t row = 0; row < matcher.active && final; ++row)
+                final = distances[row] >= matcher.best || starts[row] > matcher.best_end;
+            if (final && count < max_events)
+            {
+                Report(remote, gesture, matcher, events[count++]);
+                for (size_t row = 0; row < matcher.active; ++row)
+                {
+                    if (starts[row] <= matcher.best_end)
+                        distances[row] = INFINITE_DISTANCE;
+                }
+                matcher.floor = matcher.best_end + 1;
+            }
+        }
+        if (distances[length - 1] <= gesture.epsilon && distances[length - 1] < matcher.best)
+        {
+            matcher.best = distances[length - 1];
+            matcher.best_start = starts[length - 1];
+            matcher.best_end = now;
+        }
+    }
+    return count;
+}
+
+size_t GestureEngine::AdvanceColumn(const CompiledTemplate& gesture, Matcher& matcher, const float* features,
+                                    uint64_t now)
+{
+    const size_t length = gesture.length;
+
+    // Distance of this sample to the template's samples, computed a block at
+    // a time as the column reaches it, one feature at a time so the inner
+    // loop vectorizes
+    float cost[GestureTemplate::MAX_LENGTH];
+    size_t costed = 0;
+
+    // Next column of the warping matrix, in place. Row 0 is 0 for every
+    // sample, so a path can start anywhere in the stream.
+    float* distances = matcher.distances.data();
+    uint64_t* starts = matcher.starts.data();
+    const size_t active = matcher.active;
+    float left = 0.0f;
+    uint64_t left_start = now;
+    float diagonal = 0.0f;
+    uint64_t diagonal_start = now;
+    size_t reached = 0;
+    size_t i = 0;
+    for (; i < length; ++i)
+    {
+        // Past the last finite cell of the column before, a cell can only be
+        // reached from the one below it in this column
+        if (i > active && left > gesture.epsilon)
+            break;
+        if (i == costed)
+        {
+            std::fill(cost + costed, cost + costed + CELL_BLOCK, 0.0f);
+            for (size_t f = 0; f < gesture.used_count; ++f)
+            {
+                const size_t feature = gesture.used_features[f];
+                const float weight = gesture.weights[feature];
+                const float value = features[feature];
+                const float* column = &gesture.features[feature * gesture.stride];
+                for (size_t j = costed; j < costed + CELL_BLOCK; ++j)
+                {
+                    const float difference = value - column[j];
+                    cost[j] += weight * difference * difference;
+                }
+            }
+            costed += CELL_BLOCK;
+        }
+
+        // Mins and masks rather than branches, as which way wins is data
+        // dependent; only the last min and the add wait for the cell before.
+        // A cell past the threshold is stored as infinite but passed on as it
+        // is, which ends no sooner under it.
+        const float previous = distances[i];
+        const float upper = std::min(diagonal, previous);
+        const uint64_t from_diagonal = 0 - static_cast<uint64_t>(diagonal <= previous);
+        const uint64_t upper_start = (diagonal_start & from_diagonal) | (starts[i] & ~from_diagonal);
+        const uint64_t from_left = 0 - static_cast<uint64_t>(left < upper);
+        const uint64_t start = (left_start & from_left) | (upper_start & ~from_left);
+        const float distance = cost[i] + std::min(left, upper);
+        const bool alive = distance <= gesture.epsilon;
+
+        diagonal = previous;
+        diagonal_start = starts[i];
+        distances[i] = alive ? distance : INFINITE_DISTANCE;
+        starts[i] = start;
+        reached = alive ? i + 1 : reached;
+        left = distance;
+        left_start = start;
+    }
+    // Cells from `i` on were infinite before and stay so
+    matcher.active = reached;
+    return i;
+}
+
+void GestureEngine::ResetMatchers(RemoteState& remote) const
+{
+    for (size_t k = 0; k < remote.matchers.size(); ++k)
+    {
+        Matcher& matcher = remote.matchers[k];
+        const size_t length = (*remote.templates)[k]->length;
+        matcher.distances.assign(length, INFINITE_DISTANCE);
+        matcher.starts.assign(length, 0);
+        matcher.active = 0;
+        matcher.best = INFINITE_DISTANCE;
+        matcher.best_start = 0;
+        matcher.best_end = 0;
+        matcher.floor = 0;
+    }
+    remote.asleep = 0;
+    std::fill(std::begin(remote.feature_templates), std::end(remote.feature_templates), 0u);
+    for (size_t k = 0; k < remote.matchers.size(); ++k)
+    {
+        for (size_t feature = 0; feature < GESTURE_FEATURE_COUNT; ++feature)
+        {
+            if ((*remote.templates)[k]->used_mask & (1u << feature))
+                remote.feature_templates[feature] |= 1u << k;
+        }
+    }
+    remote.moving_since = remote.sample;
+}
+
+void GestureEngine::Report(const RemoteState& remote, const CompiledTemplate& gesture, Matcher& matcher,
+                           GestureEvent& event) const
+{
+    snprintf(event.name, sizeof(event.name), "%s", gesture.name.c_str());
+    event.confidence = std::clamp(1.0f - matcher.best / gesture.epsilon, 0.0f, 1.0f);
+    event.distance = matcher.best / static_cast<float>(gesture.length);
+
+    // Paths can be longer than the time ring; those start at its oldest entry
+    const uint64_t oldest = remote.sample >= HISTORY - 1 ? remote.sample - (HISTORY - 1) : 0;
+    event.start = remote.times[std::max(matcher.best_start, oldest) % HISTORY];
+    event.end = remote.times[matcher.best_end % HISTORY];
+
+    matcher.best = INFINITE_DISTANCE;
+}
+
+GestureEngine::Stats GestureEngine::GetStats() const
+{
+    Stats stats;
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        stats = m_stats;
+    }
+    std::lock_guard<std::mutex> lock(m_template_mutex);
+    stats.templates = m_templates->size();
+    return stats;
+}
@@ -0,0 +1,387 @@
+#include "hid_writer.h"
+#include "debug_log.h"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#ifdef _WIN32
+#include <hidsdi.h>
+#pragma comment(lib, "Hid.lib")
+#else
+#include <unistd.h>
+#include <cerrno>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#endif
+
+#ifdef _WIN32
+static const HidWriter::NativeHandle NO_HANDLE = INVALID_HANDLE_VALUE;
+// How long a single interrupt write may take before it is abandoned
+constexpr DWORD WRITE_TIMEOUT_MS = 100;
+#else
+constexpr HidWriter::NativeHandle NO_HANDLE = -1;
+#endif
+
+// Writes per method during the connect probe
+constexpr int PROBE_WRITES = 3;
+// Failures in a row of the preferred method, each rescued by the other
+// method, before the other one becomes preferred
+constexpr int FAILURES_BEFORE_SWITCH = 3;
+
+static int MethodIndex(HidWriteMethod method)
+{
+    return method == HidWriteMethod::Interrupt ? 0 : 1;
+}
+
+static HidWriteMethod OtherMethod(HidWriteMethod method)
+{
+    return method == HidWriteMethod::Interrupt ? HidWriteMethod::Control : HidWriteMethod::Interrupt;
+}
+
+const char* GetHidWriteMethodName(HidWriteMethod method)
+{
+#ifdef _WIN32
+    return method == HidWriteMethod::Interrupt ? "WriteFile" : "HidD_SetOutputReport";
+#else
+    return method == HidWriteMethod::Interrupt ? "write" : "HIDIOCSOUTPUT";
+#endif
+}
+
+HidWriter::HidWriter()
+    : m_handle(NO_HANDLE), m_report_size(0),
+#ifdef _WIN32
+      m_write_event(nullptr),
+#endif
+      m_final(false), m_method(HidWriteMethod::Interrupt), m_consecutive_failures(0), m_accepting(false)
+{
+}
+
+HidWriter::~HidWriter()
+{
+    Detach();
+}
+
+bool HidWriter::Attach(NativeHandle handle, size_t report_size)
+{
+    Detach();
+
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+#ifdef _WIN32
+    m_write_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!m_write_event)
+        return false;
+#endif
+    m_handle = handle;
+    m_report_size = report_size;
+    m_consecutive_failures = 0;
+    m_final = false;
+
+    std::lock_guard<std::mutex> queue_lock(m_queue_mutex);
+    m_accepting = true;
+    return true;
+}
+
+void HidWriter::Detach()
+{
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    // The writer thread uses the handle, so it stops before the handle goes
+    {
+        std::lock_guard<std::mutex> queue_lock(m_queue_mutex);
+        m_accepting = false;
+        m_queue.clear();
+    }
+    m_queue_ready.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+
+#ifdef _WIN32
+    if (m_write_event)
+    {
+        CloseHandle(m_write_event);
+        m_write_event = nullptr;
+    }
+#endif
+    m_handle = NO_HANDLE;
+    m_async_write = nullptr;
+}
+
+bool HidWriter::WriteWith(HidWriteMethod method, uint8_t* buffer, size_t size)
+{
+#ifdef _WIN32
+    if (method == HidWriteMethod::Control)
+        return HidD_SetOutputReport(m_handle, buffer, static_cast<ULONG>(size)) != FALSE;
+
+    // The low bit of hEvent keeps the completion off a completion port the
+    // handle may be attached to
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(m_write_event) | 1);
+    ResetEvent(m_write_event);
+
+    DWORD bytes_written = 0;
+    if (!WriteFile(m_handle, buffer, static_cast<DWORD>(size), &bytes_written, &overlapped))
+    {
+        if (GetLastError() != ERROR_IO_PENDING)
+            return false;
+
+        if (WaitForSingleObject(m_write_event, WRITE_TIMEOUT_MS) != WAIT_OBJECT_0)
+        {
+            CancelIoEx(m_handle, &overlapped);
+            GetOverlappedResult(m_handle, &overlapped, &bytes_written, TRUE);
+            LOG_DEBUG("Wiimote output report timed out");
+            return false;
+        }
+
+        if (!GetOverlappedResult(m_handle, &overlapped, &bytes_written, FALSE))
+            return false;
+    }
+    return bytes_written > 0;
+#else
+    if (method == HidWriteMethod::Control)
+    {
+#ifdef HIDIOCSOUTPUT
+        return ioctl(m_handle, HIDIOCSOUTPUT(size), buffer) >= 0;
+#else
+        errno = ENOTSUP;
+        return false;
+#endif
+    }
+    return write(m_handle, buffer, size) == static_cast<ssize_t>(size);
+#endif
+}
+
+bool HidWriter::TimedWrite(HidWriteMethod method, uint8_t* buffer, size_t size)
+{
+    const auto start = Clock::now();
+    const bool ok = WriteWith(method, buffer, size);
+    return RecordResult(method, ok, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+}
+
+bool HidWriter::RecordResult(HidWriteMethod method, bool success, double ms)
+{
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    MethodStats& stats = m_stats.methods[MethodIndex(method)];
+    stats.attempts++;
+    if (!success)
+    {
+        stats.failures++;
+        return false;
+    }
+    stats.successes++;
+    stats.average_ms += (ms - stats.average_ms) / stats.successes;
+    stats.max_ms = std::max(stats.max_ms, ms);
+    return true;
+}
+
+void HidWriter::SetAsyncWrite(AsyncWriteFunction write)
+{
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    m_async_write = std::move(write);
+}
+
+bool HidWriter::Probe(const uint8_t* report, size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    if (m_handle == NO_HANDLE)
+        return false;
+
+    std::vector<uint8_t> buffer(report, report + size);
+#ifdef _WIN32
+    if (buffer.size() < m_report_size)
+        buffer.resize(m_report_size, 0);
+#endif
+
+    int successes[2] = {};
+    double total_ms[2] = {};
+    for (HidWriteMethod method : { HidWriteMethod::Interrupt, HidWriteMethod::Control })
+    {
+        const int index = MethodIndex(method);
+        for (int i = 0; i < PROBE_WRITES; ++i)
+        {
+            const auto start = Clock::now();
+            if (TimedWrite(method, buffer.data(), buffer.size()))
+            {
+                successes[index]++;
+                total_ms[index] += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            }
+        }
+    }
+
+    HidWriteMethod chosen;
+    if (successes[0] != successes[1])
+        chosen = successes[0] > successes[1] ? HidWriteMethod::Interrupt : HidWriteMethod::Control;
+    else
+        chosen = total_ms[0] / std::max(successes[0], 1) <= total_ms[1] / std::max(successes[1], 1)
+            ? HidWriteMethod::Interrupt : HidWriteMethod::Control;
+
+    {
+        std::lock_guard<std::mutex> stats_lock(m_stats_mutex);
+        m_method = chosen;
+        m_stats.method = chosen;
+        m_stats.probed = true;
+    }
+
+    LOG_INFO(LogFormat("HID output probe: %s %d/%d, %s %d/%d, using %s",
+                       GetHidWriteMethodName(HidWriteMethod::Interrupt), successes[0], PROBE_WRITES,
+                       GetHidWriteMethodName(HidWriteMethod::Control), successes[1], PROBE_WRITES,
+                       GetHidWriteMethodName(chosen)));
+    return successes[0] > 0 || successes[1] > 0;
+}
+
+bool HidWriter::Write(const uint8_t* report, size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    return !m_final && SubmitLocked(report, size, nullptr);
+}
+
+bool HidWriter::WriteFinal(const uint8_t* report, size_t size, std::chrono::milliseconds timeout)
+{
+    struct Outcome
+    {
+        std::mutex mutex;
+        std::condition_variable settled;
+        bool done = false;
+        bool success = false;
+    };
+    auto outcome = std::make_shared<Outcome>();
+
+    {
+        std::lock_guard<std::mutex> lock(m_write_mutex);
+        if (m_final)
+            return false;
+        m_final = true;
+        const bool submitted = SubmitLocked(report, size, [outcome](bool success) {
+            std::lock_guard<std::mutex> outcome_lock(outcome->mutex);
+            outcome->done = true;
+            outcome->success = success;
+            outcome->settled.notify_all();
+        });
+        if (!submitted)
+            return false;
+    }
+
+    std::unique_lock<std::mutex> lock(outcome->mutex);
+    outcome->settled.wait_for(lock, timeout, [&outcome]() { return outcome->done; });
+    return outcome->success;
+}
+
+bool HidWriter::SubmitLocked(const uint8_t* report, size_t size, DoneFunction on_done)
+{
+    if (m_handle == NO_HANDLE || size == 0)
+        return false;
+
+    PendingWrite write;
+    write.size = std::min(size, sizeof(write.data));
+    memcpy(write.data, report, write.size);
+#ifdef _WIN32
+    write.size = std::max(write.size, std::min(m_report_size, sizeof(write.data)));
+#endif
+    write.method = GetMethod();
+    write.on_done = std::move(on_done);
+
+    if (write.method == HidWriteMethod::Interrupt && m_async_write)
+    {
+        const bool submitted = m_async_write(write.data, write.size,
+            [this, write](bool success, double ms) {
+                if (RecordResult(HidWriteMethod::Interrupt, success, ms))
+                {
+                    m_consecutive_failures = 0;
+                    if (write.on_done)
+                        write.on_done(true);
+                    return;
+                }
+                // Completions run on a reactor thread, which must not wait
+                // for the other method
+                PendingWrite retry = write;
+                retry.failed = true;
+                if (!Enqueue(retry) && retry.on_done)
+                    retry.on_done(false);
+            });
+        if (submitted)
+            return true;
+        RecordResult(HidWriteMethod::Interrupt, false, 0.0);
+        write.failed = true;
+    }
+    return Enqueue(write);
+}
+
+bool HidWriter::Enqueue(const PendingWrite& write)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_queue_mutex);
+        if (!m_accepting)
+            return false;
+        if (m_queue.size() >= MAX_QUEUED_WRITES)
+        {
+            std::lock_guard<std::mutex> stats_lock(m_stats_mutex);
+            m_stats.queue_full++;
+            return false;
+        }
+        m_queue.push_back(write);
+        if (!m_thread.joinable())
+            m_thread = std::thread([this]() { ThreadProc(); });
+    }
+    {
+        std::lock_guard<std::mutex> stats_lock(m_stats_mutex);
+        m_stats.queued++;
+    }
+    m_queue_ready.notify_one();
+    return true;
+}
+
+void HidWriter::ThreadProc()
+{
+    std::unique_lock<std::mutex> lock(m_queue_mutex);
+    for (;;)
+    {
+        m_queue_ready.wait(lock, [this]() { return !m_accepting || !m_queue.empty(); });
+        if (!m_accepting)
+            return;
+
+        PendingWrite write = m_queue.front();
+        m_queue.pop_front();
+        lock.unlock();
+
+        // Detach waits for this thread before the handle goes away
+        bool success = !write.failed && TimedWrite(write.method, write.data, write.size);
+        if (success)
+            m_consecutive_failures = 0;
+        else
+            success = WriteWithFallback(write.method, write.data, write.size);
+        if (write.on_done)
+            write.on_done(success);
+
+        lock.lock();
+    }
+}
+
+bool HidWriter::WriteWithFallback(HidWriteMethod failed, uint8_t* buffer, size_t size)
+{
+    const HidWriteMethod other = OtherMethod(failed);
+    if (!TimedWrite(other, buffer, size))
+        return false;
+
+    std::lock_guard<std::mutex> stats_lock(m_stats_mutex);
+    m_stats.fallbacks++;
+    if (m_method == failed && ++m_consecutive_failures >= FAILURES_BEFORE_SWITCH)
+    {
+        m_consecutive_failures = 0;
+        m_method = other;
+        m_stats.method = other;
+        m_stats.switches++;
+        LOG_INFO(LogFormat("HID output switched to %s", GetHidWriteMethodName(other)));
+    }
+    return true;
+}
+
+HidWriteMethod HidWriter::GetMethod() const
+{
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    return m_method;
+}
+
+HidWriter::Stats HidWriter::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    return m_stats;
+}
@@ -0,0 +1,288 @@
+#include "input_event_bus.h"
+#include "debug_log.h"
+#include <algorithm>
+
+InputEventBus::InputEventBus()
+    : m_ring(new Entry[CAPACITY]), m_head(0), m_subscribers(std::make_shared<SubscriberList>()),
+      m_subscriber_count(0), m_next_subscription_id(1), m_waiters(0), m_producer_waiting(false)
+{
+    for (std::atomic<uint16_t>& buttons : m_last_buttons)
+        buttons.store(0, std::memory_order_relaxed);
+}
+
+int InputEventBus::Subscribe(const Filter& filter, OverflowPolicy policy)
+{
+    auto subscriber = std::make_shared<Subscriber>();
+    subscriber->filter = filter;
+    subscriber->policy = policy;
+    subscriber->cursor.store(m_head.load(std::memory_order_acquire), std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(m_subscription_mutex);
+    subscriber->id = m_next_subscription_id++;
+    auto subscribers = std::make_shared<SubscriberList>(*m_subscribers);
+    subscribers->push_back(subscriber);
+    m_subscribers = subscribers;
+    m_subscriber_count.store(subscribers->size(), std::memory_order_relaxed);
+    return subscriber->id;
+}
+
+void InputEventBus::Unsubscribe(int subscription_id)
+{
+    std::shared_ptr<Subscriber> removed;
+    {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        auto subscribers = std::make_shared<SubscriberList>(*m_subscribers);
+        auto it = std::find_if(subscribers->begin(), subscribers->end(),
+            [subscription_id](const std::shared_ptr<Subscriber>& subscriber) {
+                return subscriber->id == subscription_id;
+            });
+        if (it == subscribers->end())
+            return;
+        removed = *it;
+        subscribers->erase(it);
+        m_subscribers = subscribers;
+        m_subscriber_count.store(subscribers->size(), std::memory_order_relaxed);
+    }
+
+    // Release a producer waiting for it and a consumer waiting on it
+    removed->disconnected = true;
+    {
+        std::lock_guard<std::mutex> lock(m_publish_mutex);
+    }
+    m_space_cv.notify_all();
+    {
+        std::lock_guard<std::mutex> lock(m_wait_mutex);
+    }
+    m_data_cv.notify_all();
+}
+
+size_t InputEventBus::Poll(int subscription_id, InputEvent* events, size_t max)
+{
+    std::shared_ptr<Subscriber> subscriber = Find(subscription_id);
+    if (!subscriber || subscriber->disconnected)
+        return 0;
+
+    const uint64_t head = m_head.load(std::memory_order_acquire);
+    uint64_t cursor = subscriber->cursor.load(std::memory_order_relaxed);
+    if (head - cursor > CAPACITY)
+    {
+        subscriber->dropped += head - CAPACITY - cursor;
+        cursor = head - CAPACITY;
+    }
+
+    size_t count = 0;
+    uint64_t delivered = 0;
+    uint64_t filtered = 0;
+    uint64_t dropped = 0;
+    while (cursor < head && count < max)
+    {
+        // Read in place and check afterwards that the producer has not
+        // lapped us and reused the entry in the meantime
+        const Entry& entry = m_ring[cursor % CAPACITY];
+        const uint64_t expected = 2 * cursor + 2;
+        cursor++;
+        if (entry.state.load(std::memory_order_acquire) != expected)
+        {
+            dropped++;
+            continue;
+        }
+
+        const bool match = Matches(subscriber->filter, entry.event);
+        if (match)
+            events[count] = entry.event;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry.state.load(std::memory_order_relaxed) != expected)
+        {
+            dropped++;
+            continue;
+        }
+
+        if (match)
+        {
+            count++;
+            delivered++;
+        }
+        else
+        {
+            filtered++;
+        }
+    }
+
+    // Sequentially consistent with the producer's waiting flag, so a waiting
+    // producer is either woken or sees the new cursor
+    subscriber->cursor.store(cursor);
+    subscriber->delivered += delivered;
+    subscriber->filtered += filtered;
+    subscriber->dropped += dropped;
+
+    if (m_producer_waiting.load())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_publish_mutex);
+        }
+        m_space_cv.notify_all();
+    }
+    return count;
+}
+
+bool InputEventBus::Wait(int subscription_id, std::chrono::milliseconds timeout)
+{
+    std::shared_ptr<Subscriber> subscriber = Find(subscription_id);
+    if (!subscriber)
+        return false;
+
+    m_waiters++;
+    bool ready;
+    {
+        std::unique_lock<std::mutex> lock(m_wait_mutex);
+        ready = m_data_cv.wait_for(lock, timeout, [this, &subscriber]() {
+            return subscriber->disconnected ||
+                   subscriber->cursor.load(std::memory_order_relaxed) < m_head.load(std::memory_order_acquire);
+        });
+    }
+    m_waiters--;
+    return ready && !subscriber->disconnected;
+}
+
+InputEventBus::SubscriberStats InputEventBus::GetSubscriberStats(int subscription_id) const
+{
+    SubscriberStats stats;
+    std::shared_ptr<Subscriber> subscriber = Find(subscription_id);
+    if (!subscriber)
+    {
+        stats.disconnected = true;
+        return stats;
+    }
+    stats.delivered = subscriber->delivered;
+    stats.filtered = subscriber->filtered;
+    stats.dropped = subscriber->dropped;
+    stats.disconnected = subscriber->disconnected;
+    stats.demoted = subscriber->demoted;
+    return stats;
+}
+
+InputEventBus::Stats InputEventBus::GetStats() const
+{
+    Stats stats;
+    {
+        std::lock_guard<std::mutex> lock(m_publish_mutex);
+        stats = m_stats;
+    }
+    stats.subscribers = GetSubscribers()->size();
+    return stats;
+}
+
+void InputEventBus::Publish(int slot, const WiimoteInputState& input, const ExtensionState& extension)
+{
+    uint16_t previous = 0;
+    if (slot >= 0 && slot < MAX_SLOTS)
+        previous = m_last_buttons[slot].exchange(input.buttons, std::memory_order_relaxed);
+    if (m_subscriber_count.load(std::memory_order_relaxed) == 0)
+        return;
+
+    std::unique_lock<std::mutex> lock(m_publish_mutex);
+    const uint64_t sequence = m_head.load(std::memory_order_relaxed);
+
+    // The entry about to be reused still holds this event; deal with every
+    // subscriber that has not read it yet
+    if (sequence >= CAPACITY)
+    {
+        const uint64_t overwritten = sequence - CAPACITY;
+        const auto deadline = std::chrono::steady_clock::now() + BLOCK_TIMEOUT;
+        auto subscribers = GetSubscribers();
+        for (const auto& subscriber : *subscribers)
+        {
+            if (subscriber->disconnected || subscriber->cursor.load(std::memory_order_acquire) > overwritten)
+                continue;
+
+            if (subscriber->policy == OverflowPolicy::Disconnect)
+            {
+                subscriber->disconnected = true;
+                LOG_INFO(LogFormat("Input event subscriber %d fell behind and was disconnected", subscriber->id));
+            }
+            else if (subscriber->policy == OverflowPolicy::Block)
+            {
+                m_stats.producer_waits++;
+                m_producer_waiting = true;
+                const bool freed = m_space_cv.wait_until(lock, deadline, [&subscriber, overwritten]() {
+                    return subscriber->disconnected ||
+                           subscriber->cursor.load(std::memory_order_acquire) > overwritten;
+                });
+                m_producer_waiting = false;
+                if (!freed)
+                {
+                    m_stats.producer_timeouts++;
+                    subscriber->policy = OverflowPolicy::DropOldest;
+                    subscriber->demoted = true;
+                    LOG_INFO(LogFormat("Input event subscriber %d kept the producer waiting and now drops "
+                                       "events instead", subscriber->id));
+                }
+            }
+        }
+    }
+
+    uint32_t kinds = 0;
+    if (input.buttons != previous)
+        kinds |= INPUT_EVENT_BUTTONS;
+    if (input.has_accel)
+        kinds |= INPUT_EVENT_MOTION;
+    if (input.has_ir)
+        kinds |= INPUT_EVENT_IR;
+    if (input.extension_size > 0 && extension.type != ExtensionType::None &&
+        extension.type != ExtensionType::Unknown)
+        kinds |= INPUT_EVENT_EXTENSION;
+
+    Entry& entry = m_ring[sequence % CAPACITY];
+    entry.state.store(2 * sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    InputEvent& event = entry.event;
+    event.sequence = sequence;
+    event.slot = slot;
+    event.kinds = kinds;
+    event.buttons_pressed = static_cast<uint16_t>(input.buttons & ~previous);
+    event.buttons_released = static_cast<uint16_t>(previous & ~input.buttons);
+    event.input = input;
+    event.extension = extension;
+    entry.state.store(2 * sequence + 2, std::memory_order_release);
+
+    // Sequentially consistent with the waiter count, so a consumer that has
+    // just started waiting either sees the event or gets woken
+    m_head.store(sequence + 1);
+    m_stats.published++;
+    lock.unlock();
+
+    if (m_waiters.load() > 0)
+    {
+        {
+            std::lock_guard<std::mutex> wait_lock(m_wait_mutex);
+        }
+        m_data_cv.notify_all();
+    }
+}
+
+std::shared_ptr<InputEventBus::Subscriber> InputEventBus::Find(int subscription_id) const
+{
+    for (const auto& subscriber : *GetSubscribers())
+    {
+        if (subscriber->id == subscription_id)
+            return subscriber;
+    }
+    return nullptr;
+}
+
+std::shared_ptr<const InputEventBus::SubscriberList> InputEventBus::GetSubscribers() const
+{
+    std::lock_guard<std::mutex> lock(m_subscription_mutex);
+    return m_subscribers;
+}
+
+bool InputEventBus::Matches(const Filter& filter, const InputEvent& event)
+{
+    if (filter.slot >= 0 && filter.slot != event.slot)
+        return false;
+
+    uint32_t kinds = event.kinds & filter.kinds;
+    if ((kinds & INPUT_EVENT_BUTTONS) && !((event.buttons_pressed | event.buttons_released) & filter.buttons))
+        kinds &= ~static_cast<uint32_t>(INPUT_EVENT_BUTTONS);
+    return kinds != 0;
+}
@@ -0,0 +1,832 @@
+#include "input_remapper.h"
+#include "wiimote_protocol.h"
+#include "reporting_mode_manager.h"
+#include "debug_log.h"
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using namespace WiimoteProtocol;
+
+static const char* PROFILE_FILE = "remap_profiles.txt";
+
+// Mirrors the remote's own layout: face buttons by position, Nunchuk and
+// Classic Controller on the sticks, shoulders and triggers
+static const char* BUILTIN_PROFILE =
+    "button remote.a -> a\n"
+    "button remote.b -> b\n"
+    "button remote.1 -> x\n"
+    "button remote.2 -> y\n"
+    "button remote.minus -> back\n"
+    "button remote.plus -> start\n"
+    "button remote.home -> guide\n"
+    "button remote.up -> up\n"
+    "button remote.down -> down\n"
+    "button remote.left -> left\n"
+    "button remote.right -> right\n"
+    "button nunchuk.c -> lb\n"
+    "button nunchuk.z -> lt\n"
+    "button classic.b -> a\n"
+    "button classic.a -> b\n"
+    "button classic.y -> x\n"
+    "button classic.x -> y\n"
+    "button classic.minus -> back\n"
+    "button classic.plus -> start\n"
+    "button classic.home -> guide\n"
+    "button classic.up -> up\n"
+    "button classic.down -> down\n"
+    "button classic.left -> left\n"
+    "button classic.right -> right\n"
+    "button classic.zl -> lb\n"
+    "button classic.zr -> rb\n"
+    "button classic.l -> lt\n"
+    "button classic.r -> rt\n"
+    "axis left_x = nunchuk.x + classic.lx\n"
+    "axis left_y = nunchuk.y + classic.ly\n"
+    "axis right_x = classic.rx\n"
+    "axis right_y = classic.ry\n"
+    "axis left_trigger = classic.lt\n"
+    "axis right_trigger = classic.rt\n";
+
+enum AnalogInput
+{
+    INPUT_NUNCHUK_X,
+    INPUT_NUNCHUK_Y,
+    INPUT_CLASSIC_LX,
+    INPUT_CLASSIC_LY,
+    INPUT_CLASSIC_RX,
+    INPUT_CLASSIC_RY,
+    INPUT_CLASSIC_LT,
+    INPUT_CLASSIC_RT,
+    INPUT_ACCEL_X,
+    INPUT_ACCEL_Y,
+    INPUT_ACCEL_Z,
+    INPUT_TILT_PITCH,
+    INPUT_TILT_ROLL,
+    INPUT_POINTER_X,
+    INPUT_POINTER_Y,
+    ANALOG_INPUT_COUNT
+};
+
+constexpr uint32_t NUNCHUK_INPUTS = (1u << INPUT_NUNCHUK_X) | (1u << INPUT_NUNCHUK_Y);
+constexpr uint32_t CLASSIC_INPUTS = 0x3Fu << INPUT_CLASSIC_LX;
+constexpr uint32_t ACCEL_INPUTS = 0x1Fu << INPUT_ACCEL_X;
+constexpr uint32_t POINTER_INPUTS = (1u << INPUT_POINTER_X) | (1u << INPUT_POINTER_Y);
+constexpr uint32_t TILT_INPUTS = (1u << INPUT_TILT_PITCH) | (1u << INPUT_TILT_ROLL);
+
+constexpr uint8_t NUNCHUK_C_BIT = 32;
+constexpr uint8_t NUNCHUK_Z_BIT = 33;
+
+constexpr float HALF_PI = 1.5707963f;
+
+struct NamedIndex
+{
+    const char* name;
+    uint8_t index;
+};
+
+static const NamedIndex BUTTON_SOURCES[] = {
+    { "remote.a", std::countr_zero(BUTTON_A) },
+    { "remote.b", std::countr_zero(BUTTON_B) },
+    { "remote.1", std::countr_zero(BUTTON_ONE) },
+    { "remote.2", std::countr_zero(BUTTON_TWO) },
+    { "remote.minus", std::countr_zero(BUTTON_MINUS) },
+    { "remote.plus", std::countr_zero(BUTTON_PLUS) },
+    { "remote.home", std::countr_zero(BUTTON_HOME) },
+    { "remote.up", std::countr_zero(BUTTON_UP) },
+    { "remote.down", std::countr_zero(BUTTON_DOWN) },
+    { "remote.left", std::countr_zero(BUTTON_LEFT) },
+    { "remote.right", std::countr_zero(BUTTON_RIGHT) },
+    { "nunchuk.c", NUNCHUK_C_BIT },
+    { "nunchuk.z", NUNCHUK_Z_BIT },
+    { "classic.a", 16 + std::countr_zero(CLASSIC_BUTTON_A) },
+    { "classic.b", 16 + std::countr_zero(CLASSIC_BUTTON_B) },
+    { "classic.x", 16 + std::countr_zero(CLASSIC_BUTTON_X) },
+    { "classic.y", 16 + std::countr_zero(CLASSIC_BUTTON_Y) },
+    { "classic.l", 16 + std::countr_zero(CLASSIC_BUTTON_L) },
+    { "classic.r", 16 + std::countr_zero(CLASSIC_BUTTON_R) },
+    { "classic.zl", 16 + std::countr_zero(CLASSIC_BUTTON_ZL) },
+    { "classic.zr", 16 + std::countr_zero(CLASSIC_BUTTON_ZR) },
+    { "classic.minus", 16 + std::countr_zero(CLASSIC_BUTTON_MINUS) },
+    { "classic.plus", 16 + std::countr_zero(CLASSIC_BUTTON_PLUS) },
+    { "classic.home", 16 + std::countr_zero(CLASSIC_BUTTON_HOME) },
+    { "classic.up", 16 + std::countr_zero(CLASSIC_BUTTON_UP) },
+    { "classic.down", 16 + std::countr_zero(CLASSIC_BUTTON_DOWN) },
+    { "classic.left", 16 + std::countr_zero(CLASSIC_BUTTON_LEFT) },
+    { "classic.right", 16 + std::countr_zero(CLASSIC_BUTTON_RIGHT) },
+};
+
+static const NamedIndex ANALOG_SOURCES[] = {
+    { "nunchuk.x", INPUT_NUNCHUK_X },
+    { "nunchuk.y", INPUT_NUNCHUK_Y },
+    { "classic.lx", INPUT_CLASSIC_LX },
+    { "classic.ly", INPUT_CLASSIC_LY },
+    { "classic.rx", INPUT_CLASSIC_RX },
+    { "classic.ry", INPUT_CLASSIC_RY },
+    { "classic.lt", INPUT_CLASSIC_LT },
+    { "classic.rt", INPUT_CLASSIC_RT },
+    { "accel.x", INPUT_ACCEL_X },
+    { "accel.y", INPUT_ACCEL_Y },
+    { "accel.z", INPUT_ACCEL_Z },
+    { "tilt.pitch", INPUT_TILT_PITCH },
+    { "tilt.roll", INPUT_TILT_ROLL },
+    { "pointer.x", INPUT_POINTER_X },
+    { "pointer.y", INPUT_POINTER_Y },
+};
+
+static const NamedIndex BUTTON_TARGETS[] = {
+    { "a", 0 }, { "b", 1 }, { "x", 2 }, { "y", 3 },
+    { "back", 4 }, { "start", 5 }, { "guide", 6 },
+    { "up", 7 }, { "down", 8 }, { "left", 9 }, { "right", 10 },
+    { "lb", 11 }, { "rb", 12 }, { "lt", 13 }, { "rt", 14 }, { "ls", 15 }, { "rs", 16 },
+};
+
+static const NamedIndex AXIS_TARGETS[] = {
+    { "left_x", GAMEPAD_AXIS_LEFT_X },
+    { "left_y", GAMEPAD_AXIS_LEFT_Y },
+    { "right_x", GAMEPAD_AXIS_RIGHT_X },
+    { "right_y", GAMEPAD_AXIS_RIGHT_Y },
+    { "left_trigger", GAMEPAD_AXIS_LEFT_TRIGGER },
+    { "right_trigger", GAMEPAD_AXIS_RIGHT_TRIGGER },
+};
+
+template <size_t N>
+static bool FindName(const NamedIndex (&table)[N], const std::string& name, uint8_t& index)
+{
+    for (const NamedIndex& entry : table)
+    {
+        if (name == entry.name)
+        {
+            index = entry.index;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ParseNumber(const std::string& token, float& value)
+{
+    char* end = nullptr;
+    value = std::strtof(token.c_str(), &end);
+    return !token.empty() && *end == '\0' && std::isfinite(value);
+}
+
+// "00:17:AB:12:34:56", most significant byte first
+static bool ParseAddress(const std::string& token, uint64_t& address)
+{
+    if (token.size() != 17)
+        return false;
+    address = 0;
+    for (size_t i = 0; i < 6; ++i)
+    {
+        if (i > 0 && token[i * 3 - 1] != ':' && token[i * 3 - 1] != '-')
+            return false;
+        char* end = nullptr;
+        const std::string byte = token.substr(i * 3, 2);
+        const unsigned long value = std::strtoul(byte.c_str(), &end, 16);
+        if (*end != '\0' || !std::isxdigit(static_cast<unsigned char>(byte[0])))
+            return false;
+        address = (address << 8) | value;
+    }
+    return true;
+}
+
+static std::vector<std::string> Tokenize(const std::string& line)
+{
+    std::vector<std::string> tokens;
+    std::istringstream stream(line.substr(0, line.find('#')));
+    std::string token;
+    while (stream >> token)
+        tokens.push_back(token);
+    return tokens;
+}
+
+static bool IsClassic(ExtensionType type)
+{
+    return type == ExtensionType::ClassicController || type == ExtensionType::ClassicControllerPro;
+}
+
+static float Normalize(int raw, int center, int range)
+{
+    return std::clamp(static_cast<float>(raw - center) / static_cast<float>(range), -1.0f, 1.0f);
+}
+
+// Fill the analog inputs in `mask`, each from -1 to 1 (triggers 0 to 1);
+// inputs of an extension that is not connected read 0
+static void ReadAnalogInputs(uint32_t mask, const WiimoteInputState& input, const ExtensionState& extension,
+                             float* values)
+{
+    const ExtensionType controller = GetControllerType(extension);
+    if (mask & NUNCHUK_INPUTS && controller == ExtensionType::Nunchuk)
+    {
+        values[INPUT_NUNCHUK_X] = Normalize(extension.nunchuk.stick_x, 128, 100);
+        values[INPUT_NUNCHUK_Y] = Normalize(extension.nunchuk.stick_y, 128, 100);
+    }
+    if (mask & CLASSIC_INPUTS && IsClassic(controller))
+    {
+        const ClassicControllerState& classic = extension.classic;
+        values[INPUT_CLASSIC_LX] = Normalize(classic.left_x, 32, 31);
+        values[INPUT_CLASSIC_LY] = Normalize(classic.left_y, 32, 31);
+        values[INPUT_CLASSIC_RX] = Normalize(classic.right_x, 16, 15);
+        values[INPUT_CLASSIC_RY] = Normalize(classic.right_y, 16, 15);
+        values[INPUT_CLASSIC_LT] = classic.left_trigger / 31.0f;
+        values[INPUT_CLASSIC_RT] = classic.right_trigger / 31.0f;
+    }
+    if (mask & ACCEL_INPUTS && input.accel_calibrated)
+    {
+        const float* g = input.accel_g;
+        values[INPUT_ACCEL_X] = std::clamp(g[0], -1.0f, 1.0f);
+        values[INPUT_ACCEL_Y] = std::clamp(g[1], -1.0f, 1.0f);
+        values[INPUT_ACCEL_Z] = std::clamp(g[2], -1.0f, 1.0f);
+        // 1 at a quarter turn
+        values[INPUT_TILT_PITCH] = std::atan2(g[1], std::sqrt(g[0] * g[0] + g[2] * g[2])) / HALF_PI;
+        values[INPUT_TILT_ROLL] = std::clamp(std::atan2(g[0], g[2]) / HALF_PI, -1.0f, 1.0f);
+    }
+    if (mask & POINTER_INPUTS && input.pointer.visible)
+    {
+        values[INPUT_POINTER_X] = std::clamp(input.pointer.x * 2.0f - 1.0f, -1.0f, 1.0f);
+        values[INPUT_POINTER_Y] = std::clamp(1.0f - input.pointer.y * 2.0f, -1.0f, 1.0f);
+    }
+}
+
+// Replace the two inputs at `values` by where they are predicted to be at `now`
+static void PredictInputs(MotionPredictor& predictor, bool valid, MotionPredictor::Clock::time_point sampled,
+                          MotionPredictor::Clock::time_point now, float* values)
+{
+    if (!valid)
+    {
+        predictor.Reset();
+        return;
+    }
+    predictor.Update(sampled, values);
+    predictor.Predict(now, values);
+    values[0] = std::clamp(values[0], -1.0f, 1.0f);
+    values[1] = std::clamp(values[1], -1.0f, 1.0f);
+}
+
+std::shared_ptr<const RemapProfile> RemapProfile::Compile(const std::string& name,
+                                                          const std::vector<std::pair<int, std::string>>& lines,
+                                                          std::string& error)
+{
+    auto profile = std::make_shared<RemapProfile>();
+    profile->m_name = name;
+    for (const auto& line : lines)
+    {
+        const std::vector<std::string> tokens = Tokenize(line.second);
+        if (tokens.empty())
+            continue;
+        if (!profile->CompileLine(tokens, error))
+        {
+            error = LogFormat("profile %s, line %d: %s", name.c_str(), line.first, error.c_str());
+            return nullptr;
+        }
+    }
+
+    // Larger combos first, so C + Z wins over a combo of C alone
+    std::stable_sort(profile->m_combos.begin(), profile->m_combos.end(), [](const Combo& a, const Combo& b) {
+        return std::popcount(a.sources) > std::popcount(b.sources);
+    });
+    return profile;
+}
+
+bool RemapProfile::CompileLine(const std::vector<std::string>& tokens, std::string& error)
+{
+    const std::string& kind = tokens[0];
+    uint8_t target = 0;
+    uint8_t source = 0;
+
+    if (kind == "button")
+    {
+        const bool threshold = tokens.size() == 6;
+        if ((tokens.size() != 4 && !threshold) || tokens[tokens.size() - 2] != "->")
+        {
+            error = "expected: button <source> [> or < <threshold>] -> <button>";
+            return false;
+        }
+        if (!FindName(BUTTON_TARGETS, tokens.back(), target))
+        {
+            error = "unknown button " + tokens.back();
+            return false;
+        }
+
+        if (!threshold && FindName(BUTTON_SOURCES, tokens[1], source))
+        {
+            // Every byte value with the source's bit set gets the button
+            const uint32_t button = 1u << target;
+            const uint8_t bit = static_cast<uint8_t>(1u << (source % 8));
+            for (uint32_t value = 0; value < 256; ++value)
+            {
+                if (value & bit)
+                    m_button_table[source / 8][value] |= button;
+            }
+            return true;
+        }
+
+        float value = 0.0f;
+        if (!threshold || !FindName(ANALOG_SOURCES, tokens[1], source) ||
+            (tokens[2] != ">" && tokens[2] != "<") || !ParseNumber(tokens[3], value))
+        {
+            error = threshold ? "expected an analog source and a threshold" : "unknown button source " + tokens[1];
+            return false;
+        }
+        m_analog_inputs |= 1u << source;
+        m_program.push_back({ Op::Load, source, 0, 1.0f });
+        m_program.push_back({ tokens[2] == ">" ? Op::PressAbove : Op::PressBelow, target, 0, value });
+        return true;
+    }
+
+    if (kind == "combo")
+    {
+        // combo <button> + <button> ... -> <button>
+        const size_t arrow = static_cast<size_t>(std::find(tokens.begin(), tokens.end(), "->") - tokens.begin());
+        bool valid = arrow >= 4 && arrow % 2 == 0 && arrow + 2 == tokens.size() &&
+                     FindName(BUTTON_TARGETS, tokens.back(), target);
+        Combo combo = { 0, 1u << target };
+        for (size_t i = 1; valid && i < arrow; i += 2)
+        {
+            valid = FindName(BUTTON_SOURCES, tokens[i], source) && (i + 1 == arrow || tokens[i + 1] == "+");
+            combo.sources |= 1ull << source;
+        }
+        if (!valid)
+        {
+            error = "expected: combo <button> + <button> ... -> <button>";
+            return false;
+        }
+        m_combos.push_back(combo);
+        return true;
+    }
+
+    if (kind == "axis")
+    {
+        if (tokens.size() < 4 || tokens[2] != "=" || !FindName(AXIS_TARGETS, tokens[1], target))
+        {
+            error = "expected: axis <axis> = <source> ...";
+            return false;
+        }
+
+        // Terms: source [* weight], joined by + or -
+        size_t i = 3;
+        float sign = 1.0f;
+        for (bool first = true;; first = false)
+        {
+            float weight = sign;
+            const std::string& name = tokens[i++];
+            if (i + 1 < tokens.size() && tokens[i] == "*")
+            {
+                float factor = 0.0f;
+                if (!ParseNumber(tokens[i + 1], factor))
+                {
+                    error = "bad weight " + tokens[i + 1];
+                    return false;
+                }
+                weight *= factor;
+                i += 2;
+            }
+
+            if (FindName(ANALOG_SOURCES, name, source))
+            {
+                m_analog_inputs |= 1u << source;
+                m_program.push_back({ first ? Op::Load : Op::Add, source, 0, weight });
+            }
+            else if (FindName(BUTTON_SOURCES, name, source))
+            {
+                m_program.push_back({ first ? Op::LoadButton : Op::AddButton, source, 0, weight });
+            }
+            else
+            {
+                error = "unknown source " + name;
+                return false;
+            }
+
+            if (i + 1 >= tokens.size() || (tokens[i] != "+" && tokens[i] != "-"))
+                break;
+            sign = tokens[i] == "+" ? 1.0f : -1.0f;
+            ++i;
+        }
+
+        // Transforms, in order
+        while (i < tokens.size())
+        {
+            const std::string& transform = tokens[i++];
+            if (transform == "invert")
+            {
+                m_program.push_back({ Op::Scale, 0, 0, -1.0f });
+                continue;
+            }
+
+            float value = 0.0f;
+            if (i >= tokens.size() || !ParseNumber(tokens[i++], value))
+            {
+                error = "expected a number after " + transform;
+                return false;
+            }
+            if (transform == "scale")
+            {
+                m_program.push_back({ Op::Scale, 0, 0, value });
+            }
+            else if (transform == "offset")
+            {
+                m_program.push_back({ Op::Offset, 0, 0, value });
+            }
+            else if (transform == "deadzone" && value >= 0.0f && value < 1.0f)
+            {
+                m_program.push_back({ Op::Deadzone, 0, 0, value });
+            }
+            else if (transform == "curve" && value > 0.0f)
+            {
+                // Sampled once here; the report path interpolates
+                const uint16_t table = static_cast<uint16_t>(m_curves.size());
+                for (size_t point = 0; point < CURVE_POINTS; ++point)
+                    m_curves.push_back(std::pow(static_cast<float>(point) / (CURVE_POINTS - 1), value));
+                m_program.push_back({ Op::Curve, 0, table, value });
+            }
+            else
+            {
+                error = "bad transform " + transform;
+                return false;
+            }
+        }
+
+        m_program.push_back({ Op::Store, target, 0, 0.0f });
+        return true;
+    }
+
+    if (kind == "predict")
+    {
+        // predict <horizon ms> [max_error <value>] [smoothing <value>]
+        MotionPredictor::Config config;
+        bool valid = tokens.size() % 2 == 0 && ParseNumber(tokens[1], config.horizon_ms) &&
+                     config.horizon_ms >= 0.0f && config.horizon_ms <= 50.0f;
+        for (size_t i = 2; valid && i < tokens.size(); i += 2)
+        {
+            if (tokens[i] == "max_error")
+                valid = ParseNumber(tokens[i + 1], config.max_error) && config.max_error >= 0.0f;
+            else if (tokens[i] == "smoothing")
+                valid = ParseNumber(tokens[i + 1], config.smoothing) && config.smoothing >= 0.0f &&
+                        config.smoothing < 1.0f;
+            else
+                valid = false;
+        }
+        if (!valid)
+        {
+            error = "expected: predict <0 - 50 ms> [max_error <error>] [smoothing <0 - 1>]";
+            return false;
+        }
+        m_predict = true;
+        m_prediction = config;
+        return true;
+    }
+
+    error = "unknown mapping " + kind;
+    return false;
+}
+
+uint32_t RemapProfile::GetFeatures() const
+{
+    uint32_t features = INPUT_FEATURE_BUTTONS | INPUT_FEATURE_EXTENSION;
+    // The pointer comes from the IR camera, which is only switched on for it
+    if (m_analog_inputs & POINTER_INPUTS)
+        features |= INPUT_FEATURE_IR;
+    // Tilt is worked out from the accelerometer
+    if (m_analog_inputs & (ACCEL_INPUTS | TILT_INPUTS))
+        features |= INPUT_FEATURE_ACCEL;
+    // A remote held still stops reporting, and the predictor would take the
+    // gap for the motion having stopped long ago
+    if (m_predict && m_analog_inputs & (POINTER_INPUTS | TILT_INPUTS))
+        features |= INPUT_FEATURE_CONTINUOUS;
+    return features;
+}
+
+void RemapProfile::Apply(const WiimoteInputState& input, const ExtensionState& extension, GamepadState& output,
+                         MotionPredictor* pointer, MotionPredictor* tilt) const
+{
+    uint64_t sources = input.buttons;
+    const ExtensionType controller = GetControllerType(extension);
+    if (IsClassic(controller))
+    {
+        sources |= static_cast<uint64_t>(extension.classic.buttons) << 16;
+    }
+    else if (controller == ExtensionType::Nunchuk)
+    {
+        sources |= static_cast<uint64_t>(extension.nunchuk.button_c) << NUNCHUK_C_BIT;
+        sources |= static_cast<uint64_t>(extension.nunchuk.button_z) << NUNCHUK_Z_BIT;
+    }
+
+    // A combo takes its buttons away from the single mappings
+    uint32_t buttons = 0;
+    for (const Combo& combo : m_combos)
+    {
+        if ((sources & combo.sources) == combo.sources)
+        {
+            buttons |= combo.buttons;
+            sources &= ~combo.sources;
+        }
+    }
+    for (size_t i = 0; i < SOURCE_BYTES; ++i)
+        buttons |= m_button_table[i][(sources >> (i * 8)) & 0xFF];
+
+    float inputs[ANALOG_INPUT_COUNT] = {};
+    if (m_analog_inputs)
+        ReadAnalogInputs(m_analog_inputs, input, extension, inputs);
+    if (m_predict && (pointer || tilt))
+    {
+        const MotionPredictor::Clock::time_point now = MotionPredictor::Clock::now();
+        if (pointer && m_analog_inputs & POINTER_INPUTS)
+            PredictInputs(*pointer, input.pointer.visible, input.sampled, now, &inputs[INPUT_POINTER_X]);
+        if (tilt && m_analog_inputs & TILT_INPUTS)
+            PredictInputs(*tilt, input.accel_calibrated, input.sampled, now, &inputs[INPUT_TILT_PITCH]);
+    }
+
+    std::fill(std::begin(output.axes), std::end(output.axes), 0.0f);
+    float value = 0.0f;
+    for (const Instruction& instruction : m_program)
+    {
+        switch (instruction.op)
+        {
+        case Op::Load:
+            value = inputs[instruction.index] * instruction.value;
+            break;
+        case Op::LoadButton:
+            value = (sources >> instruction.index) & 1 ? instruction.value : 0.0f;
+            break;
+        case Op::Add:
+            value += inputs[instruction.index] * instruction.value;
+            break;
+        case Op::AddButton:
+            value += (sources >> instruction.index) & 1 ? instruction.value : 0.0f;
+            break;
+        case Op::Scale:
+            value *= instruction.value;
+            break;
+        case Op::Offset:
+            value += instruction.value;
+            break;
+        case Op::Deadzone:
+        {
+            const float magnitude = std::fabs(value);
+            value = magnitude <= instruction.value
+                ? 0.0f : std::copysign((magnitude - instruction.value) / (1.0f - instruction.value), value);
+            break;
+        }
+        case Op::Curve:
+        {
+            const float position = std::min(std::fabs(value), 1.0f) * (CURVE_POINTS - 1);
+            const size_t point = std::min(static_cast<size_t>(position), CURVE_POINTS - 2);
+            const float* curve = &m_curves[instruction.table];
+            const float fraction = position - static_cast<float>(point);
+            value = std::copysign(curve[point] + (curve[point + 1] - curve[point]) * fraction, value);
+            break;
+        }
+        case Op::Store:
+            output.axes[instruction.index] = std::clamp(value, instruction.index >= GAMEPAD_AXIS_LEFT_TRIGGER ? 0.0f : -1.0f, 1.0f);
+            break;
+        case Op::PressAbove:
+            if (value > instruction.value)
+                buttons |= 1u << instruction.index;
+            break;
+        case Op::PressBelow:
+            if (value < instruction.value)
+                buttons |= 1u << instruction.index;
+            break;
+        }
+    }
+    output.buttons = buttons;
+}
+
+InputRemapper::InputRemapper()
+    : m_generation(1), m_reports(0)
+{
+    std::vector<std::pair<int, std::string>> lines;
+    std::istringstream stream(BUILTIN_PROFILE);
+    std::string line;
+    while (std::getline(stream, line))
+        lines.emplace_back(static_cast<int>(lines.size()) + 1, line);
+    std::string error;
+    m_builtin = RemapProfile::Compile("builtin", lines, error);
+
+    LoadProfiles(GetExecutableDirectory() + PROFILE_FILE);
+}
+
+bool InputRemapper::LoadProfiles(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        LOG_DEBUG(LogFormat("No remap profiles at %s", path.c_str()));
+        return false;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+
+    std::string error;
+    if (!LoadProfilesFromText(text.str(), error))
+    {
+        LOG_ERROR(LogFormat("Remap profiles in %s not loaded: %s", path.c_str(), error.c_str()));
+        return false;
+    }
+    return true;
+}
+
+bool InputRemapper::LoadProfilesFromText(const std::string& text, std::string& error)
+{
+    struct Block
+    {
+        std::string name;
+        bool is_default = false;
+        std::vector<uint64_t> devices;
+        std::vector<std::pair<int, std::string>> lines;
+    };
+    std::vector<Block> blocks;
+
+    std::istringstream stream(text);
+    std::string line;
+    for (int number = 1; std::getline(stream, line); ++number)
+    {
+        const std::vector<std::string> tokens = Tokenize(line);
+        if (tokens.empty())
+            continue;
+
+        if (tokens[0] == "profile")
+        {
+            if (tokens.size() != 2)
+            {
+                error = LogFormat("line %d: expected: profile <name>", number);
+                return false;
+            }
+            blocks.emplace_back();
+            blocks.back().name = tokens[1];
+            continue;
+        }
+        if (blocks.empty())
+        {
+            error = LogFormat("line %d: mapping outside of a profile", number);
+            return false;
+        }
+
+        Block& block = blocks.back();
+        if (tokens[0] == "device")
+        {
+            uint64_t address = 0;
+            if (tokens.size() != 2 || !ParseAddress(tokens[1], address))
+            {
+                error = LogFormat("line %d: expected: device <bluetooth address>", number);
+                return false;
+            }
+            block.devices.push_back(address);
+        }
+        else if (tokens[0] == "default" && tokens.size() == 1)
+        {
+            block.is_default = true;
+        }
+        else
+        {
+            block.lines.emplace_back(number, line);
+        }
+    }
+
+    std::vector<std::shared_ptr<const RemapProfile>> profiles;
+    std::map<uint64_t, std::shared_ptr<const RemapProfile>> devices;
+    std::shared_ptr<const RemapProfile> default_profile;
+    for (const Block& block : blocks)
+    {
+        auto profile = RemapProfile::Compile(block.name, block.lines, error);
+        if (!profile)
+            return false;
+        for (uint64_t address : block.devices)
+        {
+            if (!devices.emplace(address, profile).second)
+            {
+                error = LogFormat("profile %s: device %012llX is already in another profile",
+                                  block.name.c_str(), static_cast<unsigned long long>(address));
+                return false;
+            }
+        }
+        if (block.is_default)
+            default_profile = profile;
+        profiles.push_back(profile);
+    }
+
+    ChangedCallback callback;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_profiles.swap(profiles);
+        m_devices.swap(devices);
+        m_default = default_profile;
+        m_generation++;
+        callback = m_changed_callback;
+    }
+    LOG_INFO(LogFormat("Loaded %zu remap profiles", blocks.size()));
+    if (callback)
+        callback();
+    return true;
+}
+
+uint32_t InputRemapper::GetFeatures() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint32_t features = (m_default ? m_default : m_builtin)->GetFeatures();
+    for (const auto& profile : m_profiles)
+        features |= profile->GetFeatures();
+    return features;
+}
+
+void InputRemapper::SetChangedCallback(ChangedCallback callback)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_changed_callback = std::move(callback);
+}
+
+std::shared_ptr<const RemapProfile> InputRemapper::GetProfile(uint64_t bt_address) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return GetProfileLocked(bt_address);
+}
+
+std::shared_ptr<const RemapProfile> InputRemapper::GetProfileLocked(uint64_t bt_address) const
+{
+    auto it = m_devices.find(bt_address);
+    if (it != m_devices.end())
+        return it->second;
+    return m_default ? m_default : m_builtin;
+}
+
+void InputRemapper::Remap(int slot, uint64_t bt_address, const WiimoteInputState& input,
+                          const ExtensionState& extension, GamepadState& output)
+{
+    std::shared_ptr<const RemapProfile> profile;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (slot >= 0 && slot < MAX_SLOTS)
+        {
+            SlotProfile& cached = m_slots[slot];
+            if (!cached.profile || cached.bt_address != bt_address || cached.generation != m_generation)
+            {
+                cached.bt_address = bt_address;
+                cached.generation = m_generation;
+                cached.profile = GetProfileLocked(bt_address);
+            }
+            profile = cached.profile;
+        }
+        else
+        {
+            profile = GetProfileLocked(bt_address);
+        }
+    }
+
+    const MotionPredictor::Config* prediction = profile->GetPrediction();
+    if (prediction && slot >= 0 && slot < MAX_SLOTS)
+    {
+        SlotPrediction& predictors = m_predictions[slot];
+        std::lock_guard<std::mutex> lock(predictors.mutex);
+        // Motion of another remote, or predicted differently, is no use
+        if (predictors.profile != profile)
+        {
+            predictors.profile = profile;
+            predictors.pointer.Configure(2, *prediction);
+            predictors.tilt.Configure(2, *prediction);
+        }
+        profile->Apply(input, extension, output, &predictors.pointer, &predictors.tilt);
+    }
+    else
+    {
+        profile->Apply(input, extension, output);
+    }
+    m_reports.fetch_add(1, std::memory_order_relaxed);
+}
+
+InputRemapper::Stats InputRemapper::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats;
+    stats.profiles = m_profiles.size();
+    stats.devices = m_devices.size();
+    stats.reports = m_reports.load(std::memory_order_relaxed);
+
+    uint64_t checked = 0;
+    for (const SlotPrediction& predictors : m_predictions)
+    {
+        std::lock_guard<std::mutex> slot_lock(predictors.mutex);
+        if (!predictors.profile)
+            continue;
+        for (const MotionPredictor* predictor : { &predictors.pointer, &predictors.tilt })
+        {
+            const MotionPredictor::Stats predictor_stats = predictor->GetStats();
+            stats.predicted_samples += predictor_stats.samples;
+            checked += predictor_stats.checked;
+            stats.prediction_rms_error += predictor_stats.rms_error * predictor_stats.rms_error * predictor_stats.checked;
+            stats.unpredicted_rms_error += predictor_stats.rms_error_unpredicted *
+                                           predictor_stats.rms_error_unpredicted * predictor_stats.checked;
+        }
+    }
+    if (checked > 0)
+    {
+        stats.prediction_rms_error = std::sqrt(stats.prediction_rms_error / checked);
+        stats.unpredicted_rms_error = std::sqrt(stats.unpredicted_rms_error / checked);
+    }
+    return stats;
+}
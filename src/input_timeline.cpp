@@ -0,0 +1,295 @@
+#include "input_timeline.h"
+#include "wiimote_device_registry.h"
+#include "wiimote_device.h"
+#include "debug_log.h"
+#include <algorithm>
+
+// A stalled thread skips the snapshots it missed beyond this rather than
+// catching up on all of them
+constexpr auto MAX_SNAPSHOT_BACKLOG = std::chrono::milliseconds(250);
+
+InputTimeline::InputTimeline()
+    : m_samples(0), m_next_subscription_id(1), m_registry_subscription(0), m_running(false),
+      m_total_event_delay_us(0.0)
+{
+}
+
+InputTimeline::~InputTimeline()
+{
+    m_running = false;
+    m_timer.Cancel();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+int InputTimeline::Subscribe(EventCallback on_event, float snapshot_rate, SnapshotCallback on_snapshot)
+{
+    if (snapshot_rate < 0.0f || (snapshot_rate > 0.0f && !on_snapshot))
+    {
+        LOG_ERROR(LogFormat("Invalid timeline snapshot rate %.1f", snapshot_rate));
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> thread_lock(m_thread_mutex);
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        Subscription subscription;
+        subscription.id = id = m_next_subscription_id++;
+        subscription.on_event = std::move(on_event);
+        subscription.snapshot_period = snapshot_rate > 0.0f
+            ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / snapshot_rate))
+            : Clock::duration::zero();
+        subscription.on_snapshot = std::move(on_snapshot);
+        subscription.started = false;
+        m_subscriptions.push_back(std::move(subscription));
+        if (m_subscriptions.size() > 1)
+            return id;
+    }
+
+    // Reports are only asked of the remotes, and the timeline only run,
+    // while someone listens. Continuous reporting lets the report clocks
+    // place every report, and keeps each remote moving the timeline on.
+    if (!m_timer.Open())
+    {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        m_subscriptions.clear();
+        return -1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_input_mutex);
+        for (Remote& remote : m_remotes)
+            remote = Remote();
+        m_pending.clear();
+        m_timeline = Clock::now();
+    }
+    m_registry_subscription = WiimoteDeviceRegistry::Instance().Subscribe(
+        INPUT_FEATURE_BUTTONS | INPUT_FEATURE_ACCEL | INPUT_FEATURE_CONTINUOUS,
+        [this](WiimoteDevice& device, const WiimoteInputState& input, const ExtensionState&) {
+            HandleInput(device.GetSlot(), input);
+        });
+    m_running = true;
+    m_thread = std::thread([this]() { ThreadProc(); });
+    return id;
+}
+
+void InputTimeline::Unsubscribe(int subscription_id)
+{
+    std::lock_guard<std::mutex> thread_lock(m_thread_mutex);
+    {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        auto subscription = std::find_if(m_subscriptions.begin(), m_subscriptions.end(),
+                                         [&](const Subscription& candidate) {
+                                             return candidate.id == subscription_id;
+                                         });
+        if (subscription == m_subscriptions.end())
+            return;
+        m_subscriptions.erase(subscription);
+        if (!m_subscriptions.empty())
+            return;
+    }
+
+    WiimoteDeviceRegistry::Instance().Unsubscribe(m_registry_subscription);
+    m_running = false;
+    m_timer.Cancel();
+    if (m_thread.joinable())
+        m_thread.join();
+    m_timer.Close();
+}
+
+void InputTimeline::HandleInput(int slot, const WiimoteInputState& input)
+{
+    if (slot < 0 || slot >= MAX_SLOTS)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_input_mutex);
+    Remote& remote = m_remotes[slot];
+    const uint16_t previous = remote.count > 0 ? remote.history[(remote.next + HISTORY - 1) % HISTORY].buttons : 0;
+    const uint16_t changed = previous ^ input.buttons;
+    if (changed != 0)
+    {
+        TimelineEvent event;
+        event.slot = slot;
+        event.time = input.sampled;
+        event.buttons_pressed = changed & input.buttons;
+        event.buttons_released = changed & previous;
+        event.buttons = input.buttons;
+        event.late = input.sampled < m_timeline;
+        m_pending.push_back(event);
+    }
+
+    Sample& sample = remote.history[remote.next];
+    sample.time = input.sampled;
+    sample.buttons = input.buttons;
+    sample.accel_calibrated = input.accel_calibrated;
+    std::copy(input.accel_g, input.accel_g + 3, sample.accel_g);
+    remote.next = (remote.next + 1) % HISTORY;
+    remote.count = std::min(remote.count + 1, HISTORY);
+    remote.received = input.received;
+    m_samples++;
+}
+
+void InputTimeline::ThreadProc()
+{
+    const Clock::duration period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1.0 / TICK_RATE));
+    Clock::time_point deadline = Clock::now();
+
+    while (m_running)
+    {
+        deadline += period;
+        if (!m_timer.WaitUntil(deadline))
+            break;
+
+        const Clock::time_point now = Clock::now();
+        Tick(now);
+        // Events and snapshots are placed by the timeline, not by the tick
+        // that releases them, so missed ticks need no catching up
+        if (now - deadline >= period)
+            deadline = now;
+    }
+}
+
+void InputTimeline::Tick(Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(m_subscription_mutex);
+
+    std::vector<TimelineEvent> events;
+    Clock::time_point timeline;
+    int remotes = 0;
+    {
+        std::lock_guard<std::mutex> input_lock(m_input_mutex);
+        timeline = AdvanceLocked(now, events, remotes);
+    }
+
+    for (const TimelineEvent& event : events)
+    {
+        for (const Subscription& subscription : m_subscriptions)
+        {
+            if (subscription.on_event)
+                subscription.on_event(event);
+        }
+    }
+
+    uint64_t snapshots = 0;
+    TimelineSnapshot snapshot;
+    for (Subscription& subscription : m_subscriptions)
+    {
+        if (subscription.snapshot_period == Clock::duration::zero())
+            continue;
+        if (!subscription.started || timeline - subscription.next_snapshot > MAX_SNAPSHOT_BACKLOG)
+        {
+            subscription.next_snapshot = timeline;
+            subscription.started = true;
+        }
+        for (; subscription.next_snapshot <= timeline; subscription.next_snapshot += subscription.snapshot_period)
+        {
+            {
+                std::lock_guard<std::mutex> input_lock(m_input_mutex);
+                TakeSnapshotLocked(subscription.next_snapshot, snapshot);
+            }
+            subscription.on_snapshot(snapshot);
+            snapshots++;
+        }
+    }
+
+    std::lock_guard<std::mutex> stats_lock(m_stats_mutex);
+    m_stats.ticks++;
+    m_stats.snapshots += snapshots;
+    m_stats.remotes = remotes;
+    m_stats.subscriptions = m_subscriptions.size();
+    m_stats.timeline_delay_us = std::chrono::duration<double, std::micro>(now - timeline).count();
+    for (const TimelineEvent& event : events)
+    {
+        const double delay_us = std::chrono::duration<double, std::micro>(now - event.time).count();
+        m_stats.events++;
+        if (event.late)
+            m_stats.late_events++;
+        m_total_event_delay_us += delay_us;
+        m_stats.max_event_delay_us = std::max(m_stats.max_event_delay_us, delay_us);
+    }
+    if (m_stats.events > 0)
+        m_stats.average_event_delay_us = m_total_event_delay_us / m_stats.events;
+}
+
+InputTimeline::Clock::time_point InputTimeline::AdvanceLocked(Clock::time_point now,
+                                                             std::vector<TimelineEvent>& events, int& remotes)
+{
+    // A remote that reports can still have reports on the way sampled after
+    // its latest one, but none before it: the timeline can move up to the
+    // oldest latest sample among them
+    Clock::time_point reached = now;
+    remotes = 0;
+    for (const Remote& remote : m_remotes)
+    {
+        if (remote.count == 0 || now - remote.received > STALE_TIMEOUT)
+            continue;
+        remotes++;
+        reached = std::min(reached, remote.history[(remote.next + HISTORY - 1) % HISTORY].time);
+    }
+    m_timeline = std::max(m_timeline, std::max(reached, now - MAX_DELAY));
+
+    // Sample time order; a remote's own events keep their order at equal times
+    auto released = std::stable_partition(m_pending.begin(), m_pending.end(), [&](const TimelineEvent& event) {
+        return event.time <= m_timeline;
+    });
+    events.assign(m_pending.begin(), released);
+    m_pending.erase(m_pending.begin(), released);
+    std::stable_sort(events.begin(), events.end(), [](const TimelineEvent& a, const TimelineEvent& b) {
+        return a.time < b.time;
+    });
+    return m_timeline;
+}
+
+void InputTimeline::TakeSnapshotLocked(Clock::time_point time, TimelineSnapshot& snapshot) const
+{
+    snapshot.time = time;
+    snapshot.slots = 0;
+    for (int slot = 0; slot < MAX_SLOTS; ++slot)
+    {
+        const Remote& remote = m_remotes[slot];
+        TimelineRemote& out = snapshot.remotes[slot];
+        out = TimelineRemote();
+
+        // The last report sampled at or before `time`, and the one after it
+        const Sample* before = nullptr;
+        const Sample* after = nullptr;
+        for (size_t i = 0; i < remote.count; ++i)
+        {
+            const Sample& sample = remote.history[(remote.next + HISTORY - remote.count + i) % HISTORY];
+            if (sample.time > time)
+            {
+                after = &sample;
+                break;
+            }
+            before = &sample;
+        }
+        if (!before || time - before->time > STALE_TIMEOUT)
+            continue;
+
+        snapshot.slots |= 1u << slot;
+        out.buttons = before->buttons;
+        out.accel_calibrated = before->accel_calibrated;
+        std::copy(before->accel_g, before->accel_g + 3, out.accel_g);
+        if (!after || !before->accel_calibrated || !after->accel_calibrated)
+            continue;
+        const float position = std::chrono::duration<float>(time - before->time).count() /
+                               std::chrono::duration<float>(after->time - before->time).count();
+        for (int axis = 0; axis < 3; ++axis)
+            out.accel_g[axis] += position * (after->accel_g[axis] - before->accel_g[axis]);
+    }
+}
+
+InputTimeline::Stats InputTimeline::GetStats() const
+{
+    Stats stats;
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        stats = m_stats;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_input_mutex);
+        stats.samples = m_samples;
+    }
+    return stats;
+}
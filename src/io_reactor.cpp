@@ -0,0 +1,707 @@
+#include "io_reactor.h"
+#include "debug_log.h"
+#include <algorithm>
+#include <cstring>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+// Completions taken from the kernel per wait
+constexpr int MAX_EVENTS_PER_WAIT = 64;
+// Longest wait without timers, so Stop is noticed even if a wakeup is lost
+constexpr int MAX_WAIT_MS = 100;
+
+// Set while a thread runs a handler of this entry, so Unregister from inside
+// one of its own handlers does not wait for itself
+static thread_local const void* t_current_entry = nullptr;
+#ifdef _WIN32
+// Set on the reactor's own threads, which complete cancelled operations and
+// so must not wait for them
+static thread_local bool t_reactor_thread = false;
+#endif
+
+struct IoReactor::Entry
+{
+    int id = 0;
+    NativeHandle handle;
+    size_t read_size = 0;
+    ReadHandler on_read;
+    CloseHandler on_close;
+
+    std::mutex mutex;
+    std::condition_variable idle;
+    bool closed = false;
+    bool close_notified = false;
+    int active_handlers = 0;
+
+#ifdef _WIN32
+    // Writes handed to the kernel whose completion has not been handled
+    int writes_outstanding = 0;
+#else
+    struct PendingWrite
+    {
+        std::vector<uint8_t> data;
+        WriteCallback callback;
+        Clock::time_point queued;
+    };
+    std::deque<PendingWrite> writes;
+    // A thread is handling events of the entry. Write re-arms the handle
+    // when none is, so an event taken by another thread just before can find
+    // one running; it leaves its events here for that thread instead.
+    bool in_progress = false;
+    uint32_t pending_events = 0;
+#endif
+};
+
+#ifdef _WIN32
+struct IoReactor::Operation
+{
+    OVERLAPPED overlapped = {};   // first member: the kernel hands back its address
+    enum Type { Read, Write } type = Read;
+    std::shared_ptr<Entry> entry;
+    std::vector<uint8_t> buffer;
+    WriteCallback callback;
+    Clock::time_point started;
+};
+
+// Completion key of the packets Wake posts
+constexpr ULONG_PTR WAKE_KEY = 1;
+#else
+// epoll data of the wakeup eventfd; handle ids start at 1
+constexpr uint64_t WAKE_ID = 0;
+#endif
+
+IoReactor::~IoReactor()
+{
+    Stop();
+}
+
+bool IoReactor::Start(size_t threads)
+{
+    std::lock_guard<std::mutex> lock(m_start_mutex);
+    if (m_running)
+        return true;
+
+    threads = std::max<size_t>(threads, 1);
+#ifdef _WIN32
+    m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, static_cast<DWORD>(threads));
+    if (!m_port)
+    {
+        LOG_ERROR(LogFormat("Failed to create I/O completion port, error: %lu", GetLastError()));
+        return false;
+    }
+#else
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epoll < 0 || m_wake_fd < 0)
+    {
+        LOG_ERROR(LogFormat("Failed to create epoll instance, error: %d", errno));
+        return false;
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = WAKE_ID;
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake_fd, &event);
+#endif
+
+    m_running = true;
+    for (size_t i = 0; i < threads; ++i)
+        m_threads.emplace_back([this]() { ThreadProc(); });
+
+    LOG_INFO(LogFormat("I/O reactor started with %zu threads", threads));
+    return true;
+}
+
+void IoReactor::Stop()
+{
+    std::lock_guard<std::mutex> lock(m_start_mutex);
+    if (!m_running)
+        return;
+
+    std::vector<int> ids;
+    {
+        std::lock_guard<std::mutex> entries_lock(m_mutex);
+        for (const auto& entry : m_entries)
+            ids.push_back(entry.first);
+    }
+    for (int id : ids)
+        Unregister(id);
+
+    m_running = false;
+    for (size_t i = 0; i < m_threads.size(); ++i)
+        Wake();
+    for (std::thread& thread : m_threads)
+        thread.join();
+    m_threads.clear();
+
+#ifdef _WIN32
+    CloseHandle(m_port);
+    m_port = nullptr;
+#else
+    close(m_wake_fd);
+    close(m_epoll);
+    m_wake_fd = -1;
+    m_epoll = -1;
+#endif
+}
+
+void IoReactor::Wake()
+{
+    m_wakeups++;
+#ifdef _WIN32
+    PostQueuedCompletionStatus(m_port, 0, WAKE_KEY, nullptr);
+#else
+    const uint64_t one = 1;
+    (void)!write(m_wake_fd, &one, sizeof(one));
+#endif
+}
+
+std::shared_ptr<IoReactor::Entry> IoReactor::FindEntry(int id) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_entries.find(id);
+    return it != m_entries.end() ? it->second : nullptr;
+}
+
+bool IoReactor::Dispatch(Entry& entry, const std::function<void()>& handler)
+{
+    {
+        std::lock_guard<std::mutex> lock(entry.mutex);
+        if (entry.closed)
+            return false;
+        entry.active_handlers++;
+    }
+
+    const void* previous = t_current_entry;
+    t_current_entry = &entry;
+    handler();
+    t_current_entry = previous;
+
+    std::lock_guard<std::mutex> lock(entry.mutex);
+    entry.active_handlers--;
+    entry.idle.notify_all();
+    return true;
+}
+
+void IoReactor::NotifyClosed(Entry& entry, unsigned long error)
+{
+    {
+        std::lock_guard<std::mutex> lock(entry.mutex);
+        if (entry.close_notified)
+            return;
+        entry.close_notified = true;
+    }
+    if (entry.on_close)
+        Dispatch(entry, [&entry, error]() { entry.on_close(error); });
+}
+
+int IoReactor::Register(NativeHandle handle, size_t read_size, ReadHandler on_read, CloseHandler on_close)
+{
+    if (!m_running && !Start())
+        return -1;
+
+    auto entry = std::make_shared<Entry>();
+    entry->handle = handle;
+    entry->read_size = read_size;
+    entry->on_read = std::move(on_read);
+    entry->on_close = std::move(on_close);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        entry->id = m_next_id++;
+        m_entries[entry->id] = entry;
+    }
+
+#ifdef _WIN32
+    if (!CreateIoCompletionPort(handle, m_port, 0, 0))
+    {
+        LOG_ERROR(LogFormat("Failed to attach HID handle to the completion port, error: %lu", GetLastError()));
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_entries.erase(entry->id);
+        return -1;
+    }
+    if (!StartRead(entry, nullptr))
+        NotifyClosed(*entry, GetLastError());
+#else
+    fcntl(handle, F_SETFL, fcntl(handle, F_GETFL) | O_NONBLOCK);
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = static_cast<uint64_t>(entry->id);
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, handle, &event) < 0)
+    {
+        LOG_ERROR(LogFormat("Failed to add HID handle to epoll, error: %d", errno));
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_entries.erase(entry->id);
+        return -1;
+    }
+#endif
+
+    return entry->id;
+}
+
+void IoReactor::Unregister(int id)
+{
+    std::shared_ptr<Entry> entry;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(id);
+        if (it == m_entries.end())
+            return;
+        entry = it->second;
+        m_entries.erase(it);
+    }
+
+    std::unique_lock<std::mutex> lock(entry->mutex);
+    entry->closed = true;
+#ifdef _WIN32
+    // Cancelled operations still complete through the port and are freed
+    // there, writes with a failure
+    CancelIoEx(entry->handle, nullptr);
+    CloseHandle(entry->handle);
+#else
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, entry->handle, nullptr);
+    close(entry->handle);
+    std::deque<Entry::PendingWrite> dropped;
+    dropped.swap(entry->writes);
+#endif
+
+    if (t_current_entry != entry.get())
+        entry->idle.wait(lock, [&entry]() { return entry->active_handlers == 0; });
+
+#ifdef _WIN32
+    if (!t_reactor_thread)
+        entry->idle.wait(lock, [&entry]() { return entry->writes_outstanding == 0; });
+#else
+    lock.unlock();
+    for (Entry::PendingWrite& pending : dropped)
+    {
+        m_writes++;
+        m_write_failures++;
+        if (pending.callback)
+            pending.callback(false, std::chrono::duration<double, std::milli>(Clock::now() - pending.queued).count());
+    }
+#endif
+}
+
+bool IoReactor::Write(int id, const uint8_t* data, size_t size, WriteCallback callback)
+{
+    std::shared_ptr<Entry> entry = FindEntry(id);
+    if (!entry)
+        return false;
+
+#ifdef _WIN32
+    auto op = new Operation();
+    op->type = Operation::Write;
+    op->entry = entry;
+    op->buffer.assign(data, data + size);
+    op->callback = std::move(callback);
+    op->started = Clock::now();
+
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if (entry->closed)
+    {
+        delete op;
+        return false;
+    }
+    if (!WriteFile(entry->handle, op->buffer.data(), static_cast<DWORD>(op->buffer.size()), nullptr, &op->overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        m_write_failures++;
+        delete op;
+        return false;
+    }
+    entry->writes_outstanding++;
+    return true;
+#else
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if (entry->closed)
+        return false;
+    entry->writes.push_back({ std::vector<uint8_t>(data, data + size), std::move(callback), Clock::now() });
+    // A thread handling this entry re-arms it when done
+    if (!entry->in_progress)
+        Rearm(*entry);
+    return true;
+#endif
+}
+
+int IoReactor::AddTimer(Clock::duration period, TimerCallback callback)
+{
+    if (!m_running && !Start())
+        return -1;
+
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(m_timer_mutex);
+        id = m_next_timer_id++;
+        Timer& timer = m_timers[id];
+        timer.period = period;
+        timer.deadline = period > Clock::duration::zero() ? Clock::now() + period : Clock::time_point::max();
+        timer.callback = std::move(callback);
+    }
+    // A waiting thread may be sleeping past the new deadline
+    Wake();
+    return id;
+}
+
+void IoReactor::ArmTimer(int id, Clock::time_point deadline)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_timer_mutex);
+        auto it = m_timers.find(id);
+        if (it == m_timers.end() || it->second.removed || it->second.deadline <= deadline)
+            return;
+        it->second.deadline = deadline;
+    }
+    Wake();
+}
+
+void IoReactor::RemoveTimer(int id)
+{
+    std::unique_lock<std::mutex> lock(m_timer_mutex);
+    auto it = m_timers.find(id);
+    if (it == m_timers.end())
+        return;
+
+    if (it->second.running)
+    {
+        it->second.removed = true;
+        if (it->second.thread != std::this_thread::get_id())
+            m_timer_cv.wait(lock, [this, id]() { return m_timers.find(id) == m_timers.end(); });
+        return;
+    }
+    m_timers.erase(it);
+}
+
+int IoReactor::GetWaitTimeoutMs(Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(m_timer_mutex);
+    auto next = Clock::time_point::max();
+    for (const auto& timer : m_timers)
+    {
+        if (!timer.second.running)
+            next = std::min(next, timer.second.deadline);
+    }
+    if (next == Clock::time_point::max())
+        return MAX_WAIT_MS;
+    if (next <= now)
+        return 0;
+    // Round up so a thread does not wake just before the deadline and spin
+    const auto wait = std::chrono::ceil<std::chrono::milliseconds>(next - now).count();
+    return static_cast<int>(std::min<long long>(wait, MAX_WAIT_MS));
+}
+
+void IoReactor::RunTimers(Clock::time_point now)
+{
+    for (;;)
+    {
+        int id = 0;
+        TimerCallback callback;
+        {
+            std::lock_guard<std::mutex> lock(m_timer_mutex);
+            for (auto& timer : m_timers)
+            {
+                if (!timer.second.running && timer.second.deadline <= now)
+                {
+                    id = timer.first;
+                    timer.second.running = true;
+                    timer.second.thread = std::this_thread::get_id();
+                    callback = timer.second.callback;
+                    // Keep the phase, but do not try to catch up on missed ticks
+                    if (timer.second.period == Clock::duration::zero())
+                        timer.second.deadline = Clock::time_point::max();
+                    else if ((timer.second.deadline += timer.second.period) <= now)
+                        timer.second.deadline = now + timer.second.period;
+                    break;
+                }
+            }
+        }
+        if (id == 0)
+            return;
+
+        callback(now);
+        m_timer_runs++;
+
+        std::lock_guard<std::mutex> lock(m_timer_mutex);
+        auto it = m_timers.find(id);
+        if (it != m_timers.end())
+        {
+            it->second.running = false;
+            if (it->second.removed)
+                m_timers.erase(it);
+        }
+        m_timer_cv.notify_all();
+    }
+}
+
+IoReactor::Stats IoReactor::GetStats() const
+{
+    Stats stats;
+    stats.reads = m_reads;
+    stats.writes = m_writes;
+    stats.write_failures = m_write_failures;
+    stats.timer_runs = m_timer_runs;
+    stats.wakeups = m_wakeups;
+    stats.threads = m_threads.size();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        stats.handles = m_entries.size();
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_timer_mutex);
+        stats.timers = m_timers.size();
+    }
+    return stats;
+}
+
+#ifdef _WIN32
+
+bool IoReactor::StartRead(const std::shared_ptr<Entry>& entry, Operation* op)
+{
+    if (!op)
+    {
+        op = new Operation();
+        op->type = Operation::Read;
+        op->entry = entry;
+        op->buffer.resize(entry->read_size);
+    }
+    op->overlapped = {};
+
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if (entry->closed ||
+        (!ReadFile(entry->handle, op->buffer.data(), static_cast<DWORD>(op->buffer.size()), nullptr, &op->overlapped) &&
+         GetLastError() != ERROR_IO_PENDING))
+    {
+        delete op;
+        return false;
+    }
+    return true;
+}
+
+void IoReactor::CompleteOperation(Operation* op)
+{
+    Entry& entry = *op->entry;
+    DWORD bytes = 0;
+    bool success;
+    {
+        std::lock_guard<std::mutex> lock(entry.mutex);
+        success = !entry.closed && GetOverlappedResult(entry.handle, &op->overlapped, &bytes, FALSE);
+    }
+    const DWORD error = success ? ERROR_SUCCESS : GetLastError();
+
+    if (op->type == Operation::Write)
+    {
+        m_writes++;
+        if (!success)
+            m_write_failures++;
+        if (op->callback)
+        {
+            const double latency = std::chrono::duration<double, std::milli>(Clock::now() - op->started).count();
+            // A write cancelled by Unregister still reports its failure
+            if (!Dispatch(entry, [op, success, bytes, latency]() { op->callback(success && bytes > 0, latency); }))
+                op->callback(false, latency);
+        }
+        std::shared_ptr<Entry> keep = op->entry;
+        delete op;
+        std::lock_guard<std::mutex> lock(keep->mutex);
+        keep->writes_outstanding--;
+        keep->idle.notify_all();
+        return;
+    }
+
+    if (!success)
+    {
+        if (error != ERROR_OPERATION_ABORTED)
+            NotifyClosed(entry, error);
+        delete op;
+        return;
+    }
+
+    m_reads++;
+    if (bytes > 0)
+        Dispatch(entry, [&entry, op, bytes]() { entry.on_read(op->buffer.data(), bytes); });
+
+    // Reuse the operation for the next read; it is freed if that fails
+    std::shared_ptr<Entry> keep = op->entry;
+    if (StartRead(keep, op))
+        return;
+
+    const DWORD read_error = GetLastError();
+    bool closed;
+    {
+        std::lock_guard<std::mutex> lock(keep->mutex);
+        closed = keep->closed;
+    }
+    if (!closed)
+        NotifyClosed(*keep, read_error);
+}
+
+void IoReactor::ThreadProc()
+{
+    OVERLAPPED_ENTRY events[MAX_EVENTS_PER_WAIT];
+    t_reactor_thread = true;
+
+    while (m_running)
+    {
+        const DWORD timeout = static_cast<DWORD>(GetWaitTimeoutMs(Clock::now()));
+        ULONG count = 0;
+        if (!GetQueuedCompletionStatusEx(m_port, events, MAX_EVENTS_PER_WAIT, &count, timeout, FALSE))
+            count = 0;
+
+        for (ULONG i = 0; i < count; ++i)
+        {
+            if (events[i].lpCompletionKey == WAKE_KEY || !events[i].lpOverlapped)
+                continue;
+            CompleteOperation(reinterpret_cast<Operation*>(events[i].lpOverlapped));
+        }
+
+        RunTimers(Clock::now());
+    }
+}
+
+#else
+
+void IoReactor::Rearm(Entry& entry)
+{
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLONESHOT | (entry.writes.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+    event.data.u64 = static_cast<uint64_t>(entry.id);
+    epoll_ctl(m_epoll, EPOLL_CTL_MOD, entry.handle, &event);
+}
+
+void IoReactor::HandleEvents(const std::shared_ptr<Entry>& entry, uint32_t events)
+{
+    {
+        std::lock_guard<std::mutex> lock(entry->mutex);
+        if (entry->closed)
+            return;
+        if (entry->in_progress)
+        {
+            entry->pending_events |= events;
+            return;
+        }
+        entry->in_progress = true;
+    }
+
+    for (;;)
+    {
+        if (!HandleEventsOnce(*entry, events))
+            return;
+
+        std::lock_guard<std::mutex> lock(entry->mutex);
+        events = entry->pending_events;
+        entry->pending_events = 0;
+        if (events != 0 && !entry->closed)
+            continue;
+        entry->in_progress = false;
+        if (!entry->closed)
+            Rearm(*entry);
+        return;
+    }
+}
+
+bool IoReactor::HandleEventsOnce(Entry& entry, uint32_t events)
+{
+    bool failed = false;
+    int error = 0;
+
+    if (events & EPOLLOUT)
+    {
+        for (;;)
+        {
+            Entry::PendingWrite pending;
+            ssize_t written;
+            {
+                std::lock_guard<std::mutex> lock(entry.mutex);
+                if (entry.closed || entry.writes.empty())
+                    break;
+                written = write(entry.handle, entry.writes.front().data.data(), entry.writes.front().data.size());
+                if (written < 0 && errno == EAGAIN)
+                    break;
+                pending = std::move(entry.writes.front());
+                entry.writes.pop_front();
+            }
+
+            const bool success = written == static_cast<ssize_t>(pending.data.size());
+            m_writes++;
+            if (!success)
+                m_write_failures++;
+            if (pending.callback)
+            {
+                const double latency = std::chrono::duration<double, std::milli>(Clock::now() - pending.queued).count();
+                Dispatch(entry, [&pending, success, latency]() { pending.callback(success, latency); });
+            }
+        }
+    }
+
+    if (events & EPOLLIN)
+    {
+        std::vector<uint8_t> buffer(entry.read_size);
+        for (;;)
+        {
+            ssize_t bytes;
+            {
+                // Unregister closes the descriptor under the same lock
+                std::lock_guard<std::mutex> lock(entry.mutex);
+                if (entry.closed)
+                    break;
+                bytes = read(entry.handle, buffer.data(), buffer.size());
+            }
+            if (bytes > 0)
+            {
+                m_reads++;
+                Dispatch(entry, [&entry, &buffer, bytes]() { entry.on_read(buffer.data(), static_cast<size_t>(bytes)); });
+                continue;
+            }
+            if (bytes < 0 && (errno == EAGAIN || errno == EINTR))
+                break;
+            failed = true;
+            error = bytes == 0 ? ENODEV : errno;
+            break;
+        }
+    }
+
+    if (events & (EPOLLHUP | EPOLLERR))
+    {
+        failed = true;
+        error = error ? error : ENODEV;
+    }
+
+    if (failed)
+    {
+        NotifyClosed(entry, static_cast<unsigned long>(error));
+        return false;
+    }
+    return true;
+}
+
+void IoReactor::ThreadProc()
+{
+    epoll_event events[MAX_EVENTS_PER_WAIT];
+
+    while (m_running)
+    {
+        const int timeout = GetWaitTimeoutMs(Clock::now());
+        const int count = epoll_wait(m_epoll, events, MAX_EVENTS_PER_WAIT, timeout);
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (events[i].data.u64 == WAKE_ID)
+            {
+                uint64_t value;
+                (void)!read(m_wake_fd, &value, sizeof(value));
+                continue;
+            }
+            if (auto entry = FindEntry(static_cast<int>(events[i].data.u64)))
+                HandleEvents(entry, events[i].events);
+        }
+
+        RunTimers(Clock::now());
+    }
+}
+
+#endif
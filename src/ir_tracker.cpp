@@ -0,0 +1,349 @@
+#include "ir_tracker.h"
+#include <algorithm>
+#include <cmath>
+
+// Camera resolution and approximate horizontal field of view
+constexpr float IR_WIDTH = 1024.0f;
+constexpr float IR_HEIGHT = 768.0f;
+constexpr float IR_FOV_X = 33.0f * 3.14159265f / 180.0f;
+
+// Frame interval assumed for the first frame and the limits put on it, so a
+// stalled connection does not fling the tracks along their velocity
+constexpr float DEFAULT_DT = 0.01f;
+constexpr float MIN_DT = 0.001f;
+constexpr float MAX_DT = 0.1f;
+
+// Velocity uncertainty of a new track, in pixels per second
+constexpr float INITIAL_VELOCITY_SIGMA = 1000.0f;
+
+IrTracker::IrTracker()
+    : IrTracker(Config())
+{
+}
+
+IrTracker::IrTracker(const Config& config)
+    : m_config(config), m_tracks(), m_next_id(1), m_has_time(false), m_bar_ids(), m_bar_dx(0.0f),
+      m_bar_dy(0.0f), m_has_bar(false), m_total_update_us(0.0)
+{
+}
+
+void IrTracker::Update(const IrDot dots[4], Clock::time_point time, IrPointer& pointer)
+{
+    const Clock::time_point start = Clock::now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    float dt = DEFAULT_DT;
+    if (m_has_time)
+        dt = std::clamp(std::chrono::duration<float>(time - m_last_time).count(), MIN_DT, MAX_DT);
+    m_has_time = true;
+    m_last_time = time;
+
+    Predict(dt);
+    Associate(dots);
+
+    float bar[2][2];
+    pointer = IrPointer();
+    if (FindBar(bar))
+        ComputePointer(bar, pointer);
+
+    const double update_us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    m_stats.frames++;
+    m_total_update_us += update_us;
+    m_stats.average_update_us = m_total_update_us / m_stats.frames;
+    m_stats.max_update_us = std::max(m_stats.max_update_us, update_us);
+}
+
+void IrTracker::Reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (TrackState& state : m_tracks)
+        state.track.active = false;
+    m_has_time = false;
+    m_has_bar = false;
+    m_bar_ids[0] = m_bar_ids[1] = 0;
+}
+
+int IrTracker::GetTracks(Track tracks[MAX_TRACKS]) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int count = 0;
+    for (const TrackState& state : m_tracks)
+    {
+        if (state.track.active)
+            tracks[count++] = state.track;
+    }
+    return count;
+}
+
+IrTracker::Stats IrTracker::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void IrTracker::Predict(float dt)
+{
+    // Constant velocity with white-noise acceleration
+    const float q = m_config.acceleration_noise_px * m_config.acceleration_noise_px;
+    const float q00 = q * dt * dt * dt * dt / 4.0f;
+    const float q01 = q * dt * dt * dt / 2.0f;
+    const float q11 = q * dt * dt;
+
+    for (TrackState& state : m_tracks)
+    {
+        if (!state.track.active)
+            continue;
+        for (Axis& axis : state.axis)
+        {
+            axis.position += axis.velocity * dt;
+            axis.p00 += 2.0f * dt * axis.p01 + dt * dt * axis.p11 + q00;
+            axis.p01 += dt * axis.p11 + q01;
+            axis.p11 += q11;
+        }
+    }
+}
+
+void IrTracker::Associate(const IrDot dots[4])
+{
+    const float r = m_config.measurement_noise_px * m_config.measurement_noise_px;
+    const float gate = m_config.gate_px * m_config.gate_px;
+
+    // Squared distance from every track's prediction to every dot
+    float distance[MAX_TRACKS][4];
+    for (int t = 0; t < MAX_TRACKS; ++t)
+    {
+        const TrackState& state = m_tracks[t];
+        for (int d = 0; d < 4; ++d)
+        {
+            const float dx = dots[d].x - state.axis[0].position;
+            const float dy = dots[d].y - state.axis[1].position;
+            distance[t][d] = state.track.active && dots[d].valid ? dx * dx + dy * dy : INFINITY;
+        }
+    }
+
+    // Closest pairs first. With at most four of each this is as good as a
+    // full assignment in practice, because real dots are far apart compared
+    // to how far they move between frames.
+    bool track_matched[MAX_TRACKS] = {};
+    bool dot_matched[4] = {};
+    for (;;)
+    {
+        int best_track = -1;
+        int best_dot = -1;
+        float best = gate;
+        for (int t = 0; t < MAX_TRACKS; ++t)
+        {
+            for (int d = 0; d < 4; ++d)
+            {
+                if (!track_matched[t] && !dot_matched[d] && distance[t][d] < best)
+                {
+                    best = distance[t][d];
+                    best_track = t;
+                    best_dot = d;
+                }
+            }
+        }
+        if (best_track < 0)
+            break;
+
+        track_matched[best_track] = true;
+        dot_matched[best_dot] = true;
+
+        TrackState& state = m_tracks[best_track];
+        const float measurement[2] = { static_cast<float>(dots[best_dot].x), static_cast<float>(dots[best_dot].y) };
+        for (int i = 0; i < 2; ++i)
+        {
+            Axis& axis = state.axis[i];
+            const float s = axis.p00 + r;
+            const float k0 = axis.p00 / s;
+            const float k1 = axis.p01 / s;
+            const float innovation = measurement[i] - axis.position;
+            axis.position += k0 * innovation;
+            axis.velocity += k1 * innovation;
+            axis.p11 -= k1 * axis.p01;
+            axis.p00 *= 1.0f - k0;
+            axis.p01 *= 1.0f - k0;
+        }
+        state.track.hits++;
+        state.track.misses = 0;
+    }
+
+    for (int t = 0; t < MAX_TRACKS; ++t)
+    {
+        Track& track = m_tracks[t].track;
+        if (!track.active || track_matched[t])
+            continue;
+        if (++track.misses > m_config.max_misses)
+        {
+            track.active = false;
+            m_stats.tracks_dropped++;
+        }
+    }
+
+    for (int d = 0; d < 4; ++d)
+    {
+        if (!dots[d].valid || dot_matched[d])
+            continue;
+        auto free_slot = std::find_if(std::begin(m_tracks), std::end(m_tracks),
+                                      [](const TrackState& state) { return !state.track.active; });
+        if (free_slot == std::end(m_tracks))
+            break;
+
+        TrackState& state = *free_slot;
+        state.track = Track();
+        state.track.id = m_next_id++;
+        state.track.active = true;
+        state.track.hits = 1;
+        const float measurement[2] = { static_cast<float>(dots[d].x), static_cast<float>(dots[d].y) };
+        for (int i = 0; i < 2; ++i)
+        {
+            state.axis[i] = { measurement[i], 0.0f, r, 0.0f,
+                              INITIAL_VELOCITY_SIGMA * INITIAL_VELOCITY_SIGMA };
+        }
+        m_stats.tracks_started++;
+    }
+
+    for (TrackState& state : m_tracks)
+    {
+        state.track.x = state.axis[0].position;
+        state.track.y = state.axis[1].position;
+        state.track.vx = state.axis[0].velocity;
+        state.track.vy = state.axis[1].velocity;
+    }
+}
+
+bool IrTracker::FindBar(float bar[2][2])
+{
+    TrackState* ends[2] = { FindTrack(m_bar_ids[0]), FindTrack(m_bar_ids[1]) };
+
+    // One end out of view: place it from the other end and the bar as last
+    // seen, and hand it to a fresh track that turns up where it should be
+    if (m_has_bar && (ends[0] != nullptr) != (ends[1] != nullptr))
+    {
+        const int seen = ends[0] ? 0 : 1;
+        const float sign = seen == 0 ? 1.0f : -1.0f;
+        const float x = ends[seen]->track.x + sign * m_bar_dx;
+        const float y = ends[seen]->track.y + sign * m_bar_dy;
+
+        const float gate = m_config.gate_px * m_config.gate_px;
+        for (TrackState& state : m_tracks)
+        {
+            if (!state.track.active || state.track.misses > 0 || &state == ends[seen])
+                continue;
+            const float dx = state.track.x - x;
+            const float dy = state.track.y - y;
+            if (dx * dx + dy * dy < gate)
+            {
+                ends[1 - seen] = &state;
+                m_bar_ids[1 - seen] = state.track.id;
+                break;
+            }
+        }
+
+        if (!ends[1 - seen])
+        {
+            bar[seen][0] = ends[seen]->track.x;
+            bar[seen][1] = ends[seen]->track.y;
+            bar[1 - seen][0] = x;
+            bar[1 - seen][1] = y;
+            m_stats.extrapolated++;
+            return true;
+        }
+    }
+
+    if (!ends[0] || !ends[1])
+    {
+        // Pick a new bar from the dots in view: the pair farthest apart,
+        // ordered the way the last bar was so roll carries on past 90 degrees
+        TrackState* best[2] = {};
+        float best_distance = 0.0f;
+        for (int a = 0; a < MAX_TRACKS; ++a)
+        {
+            for (int b = a + 1; b < MAX_TRACKS; ++b)
+            {
+                const Track& first = m_tracks[a].track;
+                const Track& second = m_tracks[b].track;
+                if (!first.active || !second.active || first.misses > 0 || second.misses > 0)
+                    continue;
+                const float dx = second.x - first.x;
+                const float dy = second.y - first.y;
+                if (dx * dx + dy * dy > best_distance)
+                {
+                    best_distance = dx * dx + dy * dy;
+                    best[0] = &m_tracks[a];
+                    best[1] = &m_tracks[b];
+                }
+            }
+        }
+        if (!best[0])
+        {
+            m_has_bar = false;
+            m_bar_ids[0] = m_bar_ids[1] = 0;
+            return false;
+        }
+
+        const float dx = best[1]->track.x - best[0]->track.x;
+        const float dy = best[1]->track.y - best[0]->track.y;
+        const bool reversed = m_has_bar ? dx * m_bar_dx + dy * m_bar_dy < 0.0f : dx < 0.0f;
+        ends[0] = best[reversed ? 1 : 0];
+        ends[1] = best[reversed ? 0 : 1];
+        m_bar_ids[0] = ends[0]->track.id;
+        m_bar_ids[1] = ends[1]->track.id;
+    }
+
+    for (int end = 0; end < 2; ++end)
+    {
+        bar[end][0] = ends[end]->track.x;
+        bar[end][1] = ends[end]->track.y;
+    }
+    // Only a bar seen in full this frame is trusted for extrapolating later
+    if (ends[0]->track.misses == 0 && ends[1]->track.misses == 0)
+    {
+        m_bar_dx = bar[1][0] - bar[0][0];
+        m_bar_dy = bar[1][1] - bar[0][1];
+        m_has_bar = true;
+    }
+    return true;
+}
+
+void IrTracker::ComputePointer(const float bar[2][2], IrPointer& pointer) const
+{
+    const float dx = bar[1][0] - bar[0][0];
+    const float dy = bar[1][1] - bar[0][1];
+    const float separation = std::sqrt(dx * dx + dy * dy);
+    const float roll = std::atan2(dy, dx);
+
+    // Undo the roll around the image center, so twisting the remote does
+    // not move the pointer
+    const float mx = (bar[0][0] + bar[1][0]) / 2.0f - IR_WIDTH / 2.0f;
+    const float my = (bar[0][1] + bar[1][1]) / 2.0f - IR_HEIGHT / 2.0f;
+    const float c = std::cos(roll);
+    const float s = std::sin(roll);
+    const float rx = mx * c + my * s;
+    const float ry = -mx * s + my * c;
+
+    // The camera sees the bar move the opposite way to where the remote points
+    pointer.visible = true;
+    pointer.x = 0.5f - rx / IR_WIDTH;
+    pointer.y = 0.5f - ry / IR_HEIGHT;
+    pointer.roll = roll;
+    const float angle = separation * IR_FOV_X / IR_WIDTH;
+    pointer.distance_m = angle > 0.0f ? m_config.bar_width_m / (2.0f * std::tan(angle / 2.0f)) : 0.0f;
+    for (int end = 0; end < 2; ++end)
+    {
+        pointer.bar[end][0] = bar[end][0];
+        pointer.bar[end][1] = bar[end][1];
+    }
+}
+
+IrTracker::TrackState* IrTracker::FindTrack(uint32_t id)
+{
+    if (id == 0)
+        return nullptr;
+    for (TrackState& state : m_tracks)
+    {
+        if (state.track.active && state.track.id == id)
+            return &state;
+    }
+    return nullptr;
+}
@@ -0,0 +1,261 @@
+#include "led_animator.h"
+#include "debug_log.h"
+#include <algorithm>
+#include <cmath>
+
+constexpr uint8_t FULL_BRIGHTNESS = 255;
+
+LedAnimator::LedAnimator()
+    : m_running(false), m_period(std::chrono::milliseconds(1000 / DEFAULT_FRAME_RATE)),
+      m_total_jitter_ms(0.0)
+{
+}
+
+LedAnimator::~LedAnimator()
+{
+    Stop();
+}
+
+LedTimeline LedAnimator::PlayerNumber(int player)
+{
+    LedTimeline timeline;
+    timeline.frames.push_back({ static_cast<uint8_t>(1 << ((std::max(player, 1) - 1) % 4)), 1000 });
+    timeline.loop = false;
+    return timeline;
+}
+
+LedTimeline LedAnimator::PairingChase(uint32_t step_ms)
+{
+    return Rotation({ 0x01, 0x02, 0x04, 0x08, 0x04, 0x02 }, step_ms);
+}
+
+LedTimeline LedAnimator::Rotation(const std::vector<uint8_t>& patterns, uint32_t step_ms)
+{
+    LedTimeline timeline;
+    for (uint8_t pattern : patterns)
+        timeline.frames.push_back({ static_cast<uint8_t>(pattern & 0x0F), step_ms });
+    return timeline;
+}
+
+LedTimeline LedAnimator::LowBatteryBlink()
+{
+    LedTimeline timeline;
+    timeline.frames = {
+        { 0x0F, 150 }, { 0x00, 150 },
+        { 0x0F, 150 }, { 0x00, 1550 },
+    };
+    return timeline;
+}
+
+LedTimeline LedAnimator::Breathe(uint8_t mask, uint32_t period_ms)
+{
+    LedTimeline timeline;
+    timeline.frames = {
+        { static_cast<uint8_t>(mask & 0x0F), period_ms / 2, 0, FULL_BRIGHTNESS },
+        { static_cast<uint8_t>(mask & 0x0F), period_ms - period_ms / 2, FULL_BRIGHTNESS, 0 },
+    };
+    return timeline;
+}
+
+bool LedAnimator::Start(uint32_t frame_rate)
+{
+    if (m_running)
+        return true;
+    if (frame_rate == 0)
+        return false;
+
+    if (!m_timer.Open())
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_period = std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)) / frame_rate;
+        m_epoch = Clock::now();
+        // Everything is sent again after a restart
+        for (auto& pair : m_animations)
+            pair.second.last_mask = -1;
+    }
+
+    m_running = true;
+    m_thread = std::thread([this]() { ThreadProc(); });
+    return true;
+}
+
+void LedAnimator::Stop()
+{
+    if (!m_running)
+        return;
+
+    m_running = false;
+    m_timer.Cancel();
+    if (m_thread.joinable())
+        m_thread.join();
+    m_timer.Close();
+}
+
+void LedAnimator::SetOutput(OutputFunction output)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_output = std::move(output);
+}
+
+void LedAnimator::SetDefault(const LedTimeline& timeline)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_default = std::make_shared<const LedTimeline>(timeline);
+}
+
+void LedAnimator::AddDevice(const std::wstring& device_path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_animations[device_path].tracked = true;
+}
+
+void LedAnimator::RemoveDevice(const std::wstring& device_path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_animations.find(device_path);
+    if (it == m_animations.end())
+        return;
+    it->second.tracked = false;
+    if (!it->second.timeline)
+        m_animations.erase(it);
+}
+
+void LedAnimator::Play(const std::wstring& device_path, const LedTimeline& timeline)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Animation& animation = m_animations[device_path];
+    animation.timeline = std::make_shared<const LedTimeline>(timeline);
+    animation.start = Clock::now();
+    animation.brightness_error = 0;
+}
+
+void LedAnimator::StopAnimation(const std::wstring& device_path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_animations.find(device_path);
+    if (it == m_animations.end())
+        return;
+    if (!it->second.tracked)
+    {
+        m_animations.erase(it);
+        return;
+    }
+    it->second.timeline.reset();
+}
+
+LedAnimator::Stats LedAnimator::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats = m_stats;
+    stats.devices = m_animations.size();
+    return stats;
+}
+
+uint8_t LedAnimator::Evaluate(const LedTimeline& timeline, Clock::duration elapsed, uint32_t& brightness_error)
+{
+    if (timeline.frames.empty())
+        return 0;
+
+    uint64_t total_ms = 0;
+    for (const LedKeyframe& frame : timeline.frames)
+        total_ms += frame.duration_ms;
+
+    double t = std::chrono::duration<double, std::milli>(elapsed).count();
+    if (total_ms == 0 || t < 0.0)
+        t = 0.0;
+    else if (timeline.loop)
+        t = std::fmod(t, static_cast<double>(total_ms));
+    else
+        t = std::min(t, static_cast<double>(total_ms));
+
+    const LedKeyframe* current = &timeline.frames.back();
+    double progress = 1.0;
+    for (const LedKeyframe& frame : timeline.frames)
+    {
+        if (t < frame.duration_ms)
+        {
+            current = &frame;
+            progress = t / frame.duration_ms;
+            break;
+        }
+        t -= frame.duration_ms;
+    }
+
+    const double brightness = current->brightness_start +
+        (static_cast<double>(current->brightness_end) - current->brightness_start) * progress;
+    if (brightness >= FULL_BRIGHTNESS)
+        return current->mask;
+    if (brightness <= 0.0)
+        return 0;
+
+    // Spread the on frames evenly: the LEDs are on in the frames where the
+    // accumulated brightness crosses another full step
+    brightness_error += static_cast<uint32_t>(brightness + 0.5);
+    if (brightness_error >= FULL_BRIGHTNESS)
+    {
+        brightness_error -= FULL_BRIGHTNESS;
+        return current->mask;
+    }
+    return 0;
+}
+
+void LedAnimator::RenderFrame(Clock::time_point now)
+{
+    std::vector<std::pair<std::wstring, uint8_t>> changes;
+    OutputFunction output;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& pair : m_animations)
+        {
+            Animation& animation = pair.second;
+            const LedTimeline* timeline = animation.timeline ? animation.timeline.get() : m_default.get();
+            if (!timeline)
+                continue;
+
+            const Clock::time_point start = animation.timeline ? animation.start : m_epoch;
+            const uint8_t mask = Evaluate(*timeline, now - start, animation.brightness_error);
+            if (mask == animation.last_mask)
+                continue;
+            animation.last_mask = mask;
+            changes.emplace_back(pair.first, mask);
+        }
+        m_stats.changes += changes.size();
+        output = m_output;
+    }
+
+    if (!changes.empty() && output)
+        output(changes);
+}
+
+void LedAnimator::ThreadProc()
+{
+    Clock::time_point deadline = Clock::now();
+
+    while (m_running)
+    {
+        // Deadlines advance by whole periods from the start, so a late frame
+        // does not push back the ones after it
+        deadline += m_period;
+        if (!m_timer.WaitUntil(deadline))
+            break;
+
+        const Clock::time_point now = Clock::now();
+        const double jitter_ms = std::chrono::duration<double, std::milli>(now - deadline).count();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.frames++;
+            m_total_jitter_ms += jitter_ms;
+            m_stats.average_jitter_ms = m_total_jitter_ms / m_stats.frames;
+            m_stats.max_jitter_ms = std::max(m_stats.max_jitter_ms, jitter_ms);
+            if (now - deadline >= m_period)
+            {
+                m_stats.overruns++;
+                deadline = now;
+            }
+        }
+
+        RenderFrame(now);
+    }
+}
@@ -0,0 +1,266 @@
+#include "led_batch.h"
+#include "wiimote_device_registry.h"
+#include "wiimote_protocol.h"
+#include "debug_log.h"
+#include <hidsdi.h>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#pragma comment(lib, "Hid.lib")
+
+namespace
+{
+    // Outcome of a change handed to an output scheduler. The scheduler may
+    // settle it after Run has given up, so it is shared with the callback.
+    struct Delivery
+    {
+        HANDLE event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        std::atomic<bool> success{ false };
+        LedBatch::Clock::time_point finished;
+
+        ~Delivery()
+        {
+            if (event)
+                CloseHandle(event);
+        }
+    };
+
+    struct PendingWrite
+    {
+        // Set for a remote with an open WiimoteDevice, instead of a handle
+        std::shared_ptr<Delivery> delivery;
+
+        HANDLE handle = INVALID_HANDLE_VALUE;
+        OVERLAPPED overlapped = {};
+        std::vector<BYTE> report;
+
+        LedBatch::Clock::time_point started;
+        LedBatch::Clock::time_point finished;
+        bool done = false;
+        bool success = false;
+
+        ~PendingWrite()
+        {
+            if (overlapped.hEvent)
+                CloseHandle(overlapped.hEvent);
+            if (handle != INVALID_HANDLE_VALUE)
+                CloseHandle(handle);
+        }
+    };
+
+    bool IsWiimote(HANDLE handle)
+    {
+        HIDD_ATTRIBUTES attributes;
+        attributes.Size = sizeof(HIDD_ATTRIBUTES);
+        return HidD_GetAttributes(handle, &attributes) && attributes.VendorID == 0x057e &&
+               (attributes.ProductID == 0x0306 || attributes.ProductID == 0x0330);
+    }
+
+    size_t GetOutputReportSize(HANDLE handle)
+    {
+        size_t size = WiimoteProtocol::MAX_REPORT_SIZE;
+        PHIDP_PREPARSED_DATA preparsed = nullptr;
+        if (HidD_GetPreparsedData(handle, &preparsed))
+        {
+            HIDP_CAPS caps;
+            if (HidP_GetCaps(preparsed, &caps) == HIDP_STATUS_SUCCESS && caps.OutputReportByteLength > 0)
+                size = caps.OutputReportByteLength;
+            HidD_FreePreparsedData(preparsed);
+        }
+        return size;
+    }
+
+    void Finish(PendingWrite& write, bool success)
+    {
+        write.done = true;
+        write.success = success;
+        write.finished = LedBatch::Clock::now();
+    }
+}
+
+void LedBatch::Add(const std::wstring& device_path, uint8_t mask)
+{
+    for (Write& write : m_writes)
+    {
+        if (write.device_path == device_path)
+        {
+            write.mask = mask;
+            return;
+        }
+    }
+    m_writes.push_back({ device_path, mask });
+}
+
+LedBatch::Result LedBatch::Run(DWORD timeout_ms)
+{
+    Result result;
+    result.requested = m_writes.size();
+
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point deadline = start + std::chrono::milliseconds(timeout_ms);
+    std::vector<std::unique_ptr<PendingWrite>> pending;
+    bool wait_failed = false;
+
+    // Issue everything before waiting on anything
+    for (const Write& write : m_writes)
+    {
+        auto entry = std::make_unique<PendingWrite>();
+        entry->started = Clock::now();
+
+        if (auto device = WiimoteDeviceRegistry::Instance().Find(write.device_path))
+        {
+            auto delivery = std::make_shared<Delivery>();
+            if (device->IsConnected() && delivery->event)
+            {
+                // Done when the remote acknowledges this LED report, not
+                // when the whole output queue has drained. Closing the
+                // device settles it as failed.
+                device->SetLeds(write.mask, [delivery](bool delivered) {
+                    delivery->finished = Clock::now();
+                    delivery->success = delivered;
+                    SetEvent(delivery->event);
+                });
+                entry->delivery = delivery;
+                pending.push_back(std::move(entry));
+                continue;
+            }
+        }
+
+        entry->handle = CreateFileW(
+            write.device_path.c_str(),
+            GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+
+        if (entry->handle == INVALID_HANDLE_VALUE)
+        {
+            result.unreachable.push_back(write.device_path);
+            continue;
+        }
+
+        entry->overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!entry->overlapped.hEvent || !IsWiimote(entry->handle))
+        {
+            result.failed++;
+            continue;
+        }
+
+        entry->report.assign(GetOutputReportSize(entry->handle), 0);
+        entry->report[0] = WiimoteProtocol::OUTPUT_LEDS;
+        entry->report[1] = static_cast<BYTE>((write.mask & 0x0F) << 4);
+
+        if (WriteFile(entry->handle, entry->report.data(), static_cast<DWORD>(entry->report.size()),
+                      nullptr, &entry->overlapped))
+        {
+            Finish(*entry, true);
+        }
+        else if (GetLastError() != ERROR_IO_PENDING)
+        {
+            // Some Bluetooth stacks only take output reports over the control channel
+            Finish(*entry, HidD_SetOutputReport(entry->handle, entry->report.data(),
+                                                static_cast<ULONG>(entry->report.size())) != FALSE);
+        }
+        pending.push_back(std::move(entry));
+    }
+
+    for (;;)
+    {
+        std::vector<HANDLE> events;
+        std::vector<PendingWrite*> waiting;
+
+        for (auto& entry : pending)
+        {
+            if (!entry->done && events.size() < MAXIMUM_WAIT_OBJECTS)
+            {
+                events.push_back(entry->delivery ? entry->delivery->event : entry->overlapped.hEvent);
+                waiting.push_back(entry.get());
+            }
+        }
+
+        const Clock::time_point now = Clock::now();
+        if (events.empty() || now >= deadline)
+            break;
+
+        // Rounded up, so the last wait does not end just short of the deadline
+        const DWORD wait_ms = static_cast<DWORD>(
+            std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count());
+        const DWORD signalled = WaitForMultipleObjects(static_cast<DWORD>(events.size()), events.data(),
+                                                       FALSE, wait_ms);
+        if (signalled == WAIT_FAILED)
+        {
+            // Waiting again would fail the same way until the deadline; give
+            // up on what is still pending and cancel it below
+            LOG_ERROR(LogFormat("LED batch: waiting for the writes failed, error %lu", GetLastError()));
+            wait_failed = true;
+            break;
+        }
+        if (signalled >= WAIT_OBJECT_0 + events.size())
+            continue;
+
+        // Collect everything that has completed, not just the first one
+        for (PendingWrite* entry : waiting)
+        {
+            if (entry->delivery)
+            {
+                if (WaitForSingleObject(entry->delivery->event, 0) == WAIT_OBJECT_0)
+                {
+                    Finish(*entry, entry->delivery->success);
+                    entry->finished = entry->delivery->finished;
+                }
+                continue;
+            }
+
+            DWORD bytes_written = 0;
+            if (GetOverlappedResult(entry->handle, &entry->overlapped, &bytes_written, FALSE))
+            {
+                Finish(*entry, bytes_written > 0);
+            }
+            else if (GetLastError() != ERROR_IO_INCOMPLETE)
+            {
+                Finish(*entry, HidD_SetOutputReport(entry->handle, entry->report.data(),
+                                                    static_cast<ULONG>(entry->report.size())) != FALSE);
+            }
+        }
+    }
+
+    Clock::time_point first_change = Clock::time_point::max();
+    Clock::time_point last_change = Clock::time_point::min();
+    for (auto& entry : pending)
+    {
+        if (!entry->done)
+        {
+            if (wait_failed)
+                result.failed++;
+            else
+                result.timed_out++;
+            if (!entry->delivery)
+            {
+                DWORD bytes_written = 0;
+                CancelIoEx(entry->handle, &entry->overlapped);
+                GetOverlappedResult(entry->handle, &entry->overlapped, &bytes_written, TRUE);
+            }
+            continue;
+        }
+        if (!entry->success)
+        {
+            result.failed++;
+            continue;
+        }
+
+        result.completed++;
+        first_change = std::min(first_change, entry->finished);
+        last_change = std::max(last_change, entry->finished);
+        result.max_latency_ms = std::max(result.max_latency_ms,
+            std::chrono::duration<double, std::milli>(entry->finished - entry->started).count());
+    }
+
+    if (result.completed > 0)
+        result.spread_ms = std::chrono::duration<double, std::milli>(last_change - first_change).count();
+    result.total_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    LOG_DEBUG(LogFormat("LED batch: %zu/%zu set, %zu failed, %zu timed out, spread %.1f ms, slowest %.1f ms",
+                        result.completed, result.requested, result.failed + result.unreachable.size(),
+                        result.timed_out, result.spread_ms, result.max_latency_ms));
+    return result;
+}
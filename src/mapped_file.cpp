@@ -0,0 +1,218 @@
+#include "mapped_file.h"
+#include "debug_log.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile()
+    : m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr), m_view(nullptr), m_size(0), m_created(false)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(const std::string& path, size_t size)
+{
+    Close();
+
+    m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+                         nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        LOG_ERROR(LogFormat("Failed to open %s, error: %lu", path.c_str(), GetLastError()));
+        return false;
+    }
+
+    LARGE_INTEGER existing_size = {};
+    GetFileSizeEx(m_file, &existing_size);
+    m_created = existing_size.QuadPart < static_cast<LONGLONG>(size);
+
+    // Mapping a file with a larger size extends it with zeros
+    m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READWRITE,
+                                   static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                   static_cast<DWORD>(size & 0xFFFFFFFF), nullptr);
+    if (!m_mapping)
+    {
+        LOG_ERROR(LogFormat("Failed to map %s, error: %lu", path.c_str(), GetLastError()));
+        Close();
+        return false;
+    }
+
+    m_view = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!m_view)
+    {
+        LOG_ERROR(LogFormat("Failed to map view of %s, error: %lu", path.c_str(), GetLastError()));
+        Close();
+        return false;
+    }
+
+    m_size = size;
+    return true;
+}
+
+bool MappedFile::OpenShared(const std::wstring& name, size_t size, bool create)
+{
+    Close();
+
+    if (create)
+    {
+        m_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                       static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                       static_cast<DWORD>(size & 0xFFFFFFFF), name.c_str());
+        m_created = m_mapping && GetLastError() != ERROR_ALREADY_EXISTS;
+    }
+    else
+    {
+        m_mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, name.c_str());
+        m_created = false;
+    }
+    if (!m_mapping)
+    {
+        LOG_ERROR(LogFormat("Failed to open shared memory, error: %lu", GetLastError()));
+        return false;
+    }
+
+    m_view = MapViewOfFile(m_mapping, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, size);
+    if (!m_view)
+    {
+        LOG_ERROR(LogFormat("Failed to map view of shared memory, error: %lu", GetLastError()));
+        Close();
+        return false;
+    }
+
+    m_size = size;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_view)
+    {
+        FlushViewOfFile(m_view, 0);
+        UnmapViewOfFile(m_view);
+        m_view = nullptr;
+    }
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+    }
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+    m_size = 0;
+}
+
+void MappedFile::Flush()
+{
+    if (m_view)
+        FlushViewOfFile(m_view, 0);
+}
+#else
+MappedFile::MappedFile()
+    : m_file(-1), m_view(nullptr), m_size(0), m_created(false)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+// Shared by Open and OpenShared once m_file is open
+static void* MapDescriptor(int file, size_t size, bool writable, bool& created)
+{
+    struct stat status = {};
+    fstat(file, &status);
+    created = status.st_size < static_cast<off_t>(size);
+    if (created && (!writable || ftruncate(file, static_cast<off_t>(size)) < 0))
+        return nullptr;
+
+    void* view = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+    return view == MAP_FAILED ? nullptr : view;
+}
+
+bool MappedFile::Open(const std::string& path, size_t size)
+{
+    Close();
+
+    m_file = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_file < 0)
+    {
+        LOG_ERROR(LogFormat("Failed to open %s, error: %d", path.c_str(), errno));
+        return false;
+    }
+
+    m_view = MapDescriptor(m_file, size, true, m_created);
+    if (!m_view)
+    {
+        LOG_ERROR(LogFormat("Failed to map %s, error: %d", path.c_str(), errno));
+        Close();
+        return false;
+    }
+
+    m_size = size;
+    return true;
+}
+
+bool MappedFile::OpenShared(const std::wstring& name, size_t size, bool create)
+{
+    Close();
+
+    const std::wstring leaf = name.substr(name.find_last_of(L'\\') + 1);
+    const std::string object = "/" + std::string(leaf.begin(), leaf.end());
+    m_file = shm_open(object.c_str(), create ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+    if (m_file < 0)
+    {
+        LOG_ERROR(LogFormat("Failed to open shared memory, error: %d", errno));
+        return false;
+    }
+
+    // The object lives on in /dev/shm, so only the file is closed here
+    bool grown = false;
+    m_view = MapDescriptor(m_file, size, create, grown);
+    m_created = create && grown;
+    if (!m_view)
+    {
+        LOG_ERROR(LogFormat("Failed to map shared memory, error: %d", errno));
+        Close();
+        return false;
+    }
+
+    m_size = size;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_view)
+    {
+        msync(m_view, m_size, MS_SYNC);
+        munmap(m_view, m_size);
+        m_view = nullptr;
+    }
+    if (m_file >= 0)
+    {
+        close(m_file);
+        m_file = -1;
+    }
+    m_size = 0;
+}
+
+void MappedFile::Flush()
+{
+    if (m_view)
+        msync(m_view, m_size, MS_ASYNC);
+}
+#endif
@@ -0,0 +1,565 @@
+#include "motion_pipeline.h"
+#include "wiimote_device_registry.h"
+#include "debug_log.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+constexpr float TWO_PI = 6.2831853f;
+
+// The remote counts as still for bias learning while it turns slower than
+// this, after the bias learned so far, and feels little but gravity
+constexpr float STILL_RATE_DPS = 20.0f;
+constexpr float STILL_ACCEL_G = 0.1f;
+// Time constant of the bias while still; long enough that slow turns mostly
+// ride through it
+constexpr float BIAS_TIME_CONSTANT_S = 2.0f;
+// Cutoff of the One Euro filter's speed estimate, as in the paper
+constexpr float ONE_EURO_DERIVATIVE_CUTOFF = 1.0f;
+
+MotionStage MotionStage::RemoveBias()
+{
+    MotionStage stage;
+    stage.type = MotionStageType::RemoveBias;
+    return stage;
+}
+
+MotionStage MotionStage::LowPass(float cutoff_hz)
+{
+    MotionStage stage;
+    stage.type = MotionStageType::LowPass;
+    stage.parameters[0] = cutoff_hz;
+    return stage;
+}
+
+MotionStage MotionStage::OneEuro(float min_cutoff_hz, float beta)
+{
+    MotionStage stage;
+    stage.type = MotionStageType::OneEuro;
+    stage.parameters[0] = min_cutoff_hz;
+    stage.parameters[1] = beta;
+    return stage;
+}
+
+MotionStage MotionStage::Decimate(int factor)
+{
+    MotionStage stage;
+    stage.type = MotionStageType::Decimate;
+    stage.parameters[0] = static_cast<float>(factor);
+    return stage;
+}
+
+MotionStage MotionStage::Resample(float rate_hz)
+{
+    MotionStage stage;
+    stage.type = MotionStageType::Resample;
+    stage.parameters[0] = rate_hz;
+    return stage;
+}
+
+static bool IsValidStage(const MotionStage& stage, float input_rate)
+{
+    switch (stage.type)
+    {
+    case MotionStageType::RemoveBias:
+        return true;
+    case MotionStageType::LowPass:
+        return stage.parameters[0] > 0.0f && stage.parameters[0] < input_rate / 2.0f;
+    case MotionStageType::OneEuro:
+        return stage.parameters[0] > 0.0f && stage.parameters[1] >= 0.0f;
+    case MotionStageType::Decimate:
+        return stage.parameters[0] >= 1.0f && stage.parameters[0] == std::floor(stage.parameters[0]);
+    case MotionStageType::Resample:
+        return stage.parameters[0] > 0.0f && stage.parameters[0] <= input_rate;
+    }
+    return false;
+}
+
+static float GetOutputRate(const MotionStage& stage, float input_rate)
+{
+    switch (stage.type)
+    {
+    case MotionStageType::Decimate:
+        return input_rate / stage.parameters[0];
+    case MotionStageType::Resample:
+        return stage.parameters[0];
+    default:
+        return input_rate;
+    }
+}
+
+MotionPipeline::MotionPipeline()
+    : m_samples(0), m_late_samples(0), m_next_subscription_id(1), m_registry_subscription(0),
+      m_node_count(0), m_subscription_count(0), m_running(false), m_total_tick_us(0.0)
+{
+    m_root.output.rate = BASE_RATE;
+}
+
+MotionPipeline::~MotionPipeline()
+{
+    m_running = false;
+    m_timer.Cancel();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+int MotionPipeline::Subscribe(const std::vector<MotionStage>& stages, MotionCallback callback)
+{
+    std::lock_guard<std::mutex> thread_lock(m_thread_mutex);
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(m_graph_mutex);
+        float rate = BASE_RATE;
+        for (size_t i = 0; i < stages.size(); ++i)
+        {
+            if (!IsValidStage(stages[i], rate))
+            {
+                LOG_ERROR(LogFormat("Motion stage %zu cannot run on a %.1f Hz stream", i + 1, rate));
+                return -1;
+            }
+            rate = GetOutputRate(stages[i], rate);
+        }
+
+        // Share every stage of the chain that another chain already starts with
+        Node* node = &m_root;
+        for (const MotionStage& stage : stages)
+        {
+            auto child = std::find_if(node->children.begin(), node->children.end(),
+                                      [&](const std::unique_ptr<Node>& candidate) {
+                                          return candidate->stage == stage;
+                                      });
+            if (child == node->children.end())
+            {
+                auto created = std::make_unique<Node>();
+                created->stage = stage;
+                created->output.rate = GetOutputRate(stage, node->output.rate);
+                node->children.push_back(std::move(created));
+                m_node_count++;
+                node = node->children.back().get();
+            }
+            else
+            {
+                node = child->get();
+            }
+        }
+
+        id = m_next_subscription_id++;
+        node->subscriptions.push_back({ id, std::move(callback) });
+        if (m_subscription_count++ > 0)
+            return id;
+    }
+
+    // Motion is only asked of the remotes, and the tree only run, while
+    // someone listens
+    if (!m_timer.Open())
+    {
+        std::lock_guard<std::mutex> lock(m_graph_mutex);
+        size_t removed_nodes = 0;
+        RemoveSubscription(m_root, id, removed_nodes);
+        m_node_count -= removed_nodes;
+        m_subscription_count--;
+        return -1;
+    }
+    m_registry_subscription = WiimoteDeviceRegistry::Instance().Subscribe(
+        INPUT_FEATURE_ACCEL | INPUT_FEATURE_EXTENSION | INPUT_FEATURE_CONTINUOUS,
+        [this](WiimoteDevice& device, const WiimoteInputState& input, const ExtensionState& extension) {
+            HandleInput(device.GetSlot(), input, extension);
+        });
+    m_running = true;
+    m_thread = std::thread([this]() { ThreadProc(); });
+    return id;
+}
+
+void MotionPipeline::Unsubscribe(int subscription_id)
+{
+    std::lock_guard<std::mutex> thread_lock(m_thread_mutex);
+    {
+        std::lock_guard<std::mutex> lock(m_graph_mutex);
+        size_t removed_nodes = 0;
+        if (!RemoveSubscription(m_root, subscription_id, removed_nodes))
+            return;
+        m_node_count -= removed_nodes;
+        if (--m_subscription_count > 0)
+            return;
+    }
+
+    WiimoteDeviceRegistry::Instance().Unsubscribe(m_registry_subscription);
+    m_running = false;
+    m_timer.Cancel();
+    if (m_thread.joinable())
+        m_thread.join();
+    m_timer.Close();
+}
+
+bool MotionPipeline::RemoveSubscription(Node& node, int subscription_id, size_t& removed_nodes)
+{
+    auto subscription = std::find_if(node.subscriptions.begin(), node.subscriptions.end(),
+                                     [&](const Subscription& candidate) {
+                                         return candidate.id == subscription_id;
+                                     });
+    if (subscription != node.subscriptions.end())
+    {
+        node.subscriptions.erase(subscription);
+        return true;
+    }
+
+    for (auto child = node.children.begin(); child != node.children.end(); ++child)
+    {
+        if (!RemoveSubscription(**child, subscription_id, removed_nodes))
+            continue;
+        // Stages nobody reads any more stop running
+        if ((*child)->subscriptions.empty() && (*child)->children.empty())
+        {
+            node.children.erase(child);
+            removed_nodes++;
+        }
+        return true;
+    }
+    return false;
+}
+
+void MotionPipeline::HandleInput(int slot, const WiimoteInputState& input, const ExtensionState& extension)
+{
+    if (slot < 0 || slot >= static_cast<int>(MAX_LANES) || !input.accel_calibrated)
+        return;
+
+    float rates[3] = {};
+    const bool has_gyro = extension.type == ExtensionType::MotionPlus;
+    if (has_gyro)
+        GetMotionPlusRates(extension.motion_plus, rates);
+
+    std::lock_guard<std::mutex> lock(m_input_mutex);
+    m_samples++;
+    if (input.sampled <= m_stream_time)
+        m_late_samples++;
+    // Reports of a remote come in the order it took them; one that does not
+    // would only confuse the interpolation
+    LaneHistory& history = m_history[slot];
+    if (history.count > 0 && input.sampled <= history.times[(history.count - 1) % HISTORY])
+        return;
+
+    const size_t index = history.count++ % HISTORY;
+    history.times[index] = input.sampled;
+    float* values = history.values[index];
+    values[MOTION_ACCEL_X] = input.accel_g[0];
+    values[MOTION_ACCEL_Y] = input.accel_g[1];
+    values[MOTION_ACCEL_Z] = input.accel_g[2];
+    values[MOTION_GYRO_PITCH] = rates[0];
+    values[MOTION_GYRO_ROLL] = rates[1];
+    values[MOTION_GYRO_YAW] = rates[2];
+    history.gyro[index] = has_gyro;
+}
+
+void MotionPipeline::ThreadProc()
+{
+    const Clock::duration period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1.0 / BASE_RATE));
+    Clock::time_point deadline = Clock::now();
+
+    while (m_running)
+    {
+        deadline += period;
+        if (!m_timer.WaitUntil(deadline))
+            break;
+
+        // A late tick is caught up with at once, as the samples it is due
+        // for are still in the histories; one later than a remote would
+        // take to go stale skips ahead instead
+        const Clock::time_point now = Clock::now();
+        const bool overrun = now - deadline >= period;
+        if (now - deadline >= STALE_TIMEOUT)
+            deadline = now;
+        Tick(deadline - RESAMPLE_DELAY);
+        const double tick_us = std::chrono::duration<double, std::micro>(Clock::now() - now).count();
+
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        m_total_tick_us += tick_us;
+        m_stats.average_tick_us = m_total_tick_us / m_stats.ticks;
+        m_stats.max_tick_us = std::max(m_stats.max_tick_us, tick_us);
+        if (overrun)
+            m_stats.overruns++;
+    }
+}
+
+void MotionPipeline::Tick(Clock::time_point time)
+{
+    std::lock_guard<std::mutex> lock(m_graph_mutex);
+
+    MotionBlock& root = m_root.output;
+    {
+        std::lock_guard<std::mutex> input_lock(m_input_mutex);
+        m_stream_time = time;
+        uint32_t lanes = 0;
+        uint32_t gyro_lanes = 0;
+        for (size_t lane = 0; lane < MAX_LANES; ++lane)
+        {
+            const LaneHistory& history = m_history[lane];
+            if (history.count == 0 || history.times[(history.count - 1) % HISTORY] < time - STALE_TIMEOUT)
+                continue;
+
+            // The last report sampled at or before `time`, and the one after
+            // it when it has arrived; a remote whose first report is still
+            // ahead of the stream is not in it yet
+            const uint64_t oldest = history.count > HISTORY ? history.count - HISTORY : 0;
+            uint64_t before = history.count;
+            while (before > oldest && history.times[(before - 1) % HISTORY] > time)
+                before--;
+            if (before == oldest)
+                continue;
+            const size_t from = (before - 1) % HISTORY;
+
+            if (before == history.count)
+            {
+                for (size_t channel = 0; channel < MOTION_CHANNEL_COUNT; ++channel)
+                    root.values[channel][lane] = history.values[from][channel];
+            }
+            else
+            {
+                const size_t to = before % HISTORY;
+                const float position = std::chrono::duration<float>(time - history.times[from]).count() /
+                                       std::chrono::duration<float>(history.times[to] - history.times[from]).count();
+                for (size_t channel = 0; channel < MOTION_CHANNEL_COUNT; ++channel)
+                {
+                    const float a = history.values[from][channel];
+                    root.values[channel][lane] = a + position * (history.values[to][channel] - a);
+                }
+            }
+            lanes |= 1u << lane;
+            if (history.gyro[from])
+                gyro_lanes |= 1u << lane;
+        }
+        root.lanes = lanes;
+        root.gyro_lanes = gyro_lanes;
+    }
+    root.time = time;
+
+    for (const Subscription& subscription : m_root.subscriptions)
+        subscription.callback(root);
+    uint64_t runs = 0;
+    for (const auto& child : m_root.children)
+        runs += Run(*child, root);
+
+    std::lock_guard<std::mutex> stats_lock(m_stats_mutex);
+    m_stats.ticks++;
+    m_stats.stage_runs += runs;
+}
+
+uint64_t MotionPipeline::Run(Node& node, const MotionBlock& input)
+{
+    if (!Process(node, input))
+        return 1;
+
+    for (const Subscription& subscription : node.subscriptions)
+        subscription.callback(node.output);
+    uint64_t runs = 1;
+    for (const auto& child : node.children)
+        runs += Run(*child, node.output);
+    return runs;
+}
+
+void MotionPipeline::InitializeLane(Node& node, const MotionBlock& input, size_t lane)
+{
+    for (size_t channel = 0; channel < MOTION_CHANNEL_COUNT; ++channel)
+    {
+        const float x = input.values[channel][lane];
+        switch (node.stage.type)
+        {
+        case MotionStageType::RemoveBias:
+            node.state[0][channel][lane] = 0.0f;
+            break;
+        case MotionStageType::LowPass:
+            node.state[0][channel][lane] = x;
+            break;
+        case MotionStageType::OneEuro:
+            node.state[0][channel][lane] = x;
+            node.state[1][channel][lane] = x;
+            node.state[2][channel][lane] = 0.0f;
+            break;
+        case MotionStageType::Decimate:
+            // As if the remote had held still through the samples so far
+            node.state[0][channel][lane] = x * static_cast<float>(node.count);
+            break;
+        case MotionStageType::Resample:
+            node.state[0][channel][lane] = x;
+            break;
+        }
+    }
+}
+
+// Every loop below runs over all MAX_LANES lanes, whether a remote is there
+// or not, without branches on the values, so that it compiles to vector
+// code. Input rows are copied to the stack first: the compiler cannot tell
+// the input block from the node's own arrays otherwise, and would only
+// vectorize behind a runtime overlap check, or not at all.
+bool MotionPipeline::Process(Node& node, const MotionBlock& input)
+{
+    const uint32_t appeared = input.lanes & ~node.initialized;
+    for (size_t lane = 0; appeared != 0 && lane < MAX_LANES; ++lane)
+    {
+        if (appeared & (1u << lane))
+            InitializeLane(node, input, lane);
+    }
+    node.initialized = input.lanes;
+
+    MotionBlock& output = node.output;
+    output.lanes = input.lanes;
+    output.gyro_lanes = input.gyro_lanes;
+    output.time = input.time;
+
+    auto& y = output.values;
+    const float rate = input.rate;
+    alignas(64) float x[MAX_LANES];
+    switch (node.stage.type)
+    {
+    case MotionStageType::RemoveBias:
+    {
+        auto& bias = node.state[0];
+        const float adapt = 1.0f - std::exp(-1.0f / (BIAS_TIME_CONSTANT_S * rate));
+
+        const auto& v = input.values;
+        alignas(64) float gain[MAX_LANES];
+        for (size_t lane = 0; lane < MAX_LANES; ++lane)
+        {
+            const float pitch = v[MOTION_GYRO_PITCH][lane] - bias[MOTION_GYRO_PITCH][lane];
+            const float roll = v[MOTION_GYRO_ROLL][lane] - bias[MOTION_GYRO_ROLL][lane];
+            const float yaw = v[MOTION_GYRO_YAW][lane] - bias[MOTION_GYRO_YAW][lane];
+            const float turn = pitch * pitch + roll * roll + yaw * yaw;
+            const float magnitude = v[MOTION_ACCEL_X][lane] * v[MOTION_ACCEL_X][lane] +
+                                    v[MOTION_ACCEL_Y][lane] * v[MOTION_ACCEL_Y][lane] +
+                                    v[MOTION_ACCEL_Z][lane] * v[MOTION_ACCEL_Z][lane];
+            const bool still = (turn < STILL_RATE_DPS * STILL_RATE_DPS) &
+                               (std::fabs(magnitude - 1.0f) < 2.0f * STILL_ACCEL_G);
+            gain[lane] = still ? adapt : 0.0f;
+        }
+
+        std::memcpy(y[MOTION_ACCEL_X], input.values[MOTION_ACCEL_X], 3 * sizeof(y[0]));
+        for (size_t channel = MOTION_GYRO_PITCH; channel <= MOTION_GYRO_YAW; ++channel)
+        {
+            std::memcpy(x, input.values[channel], sizeof(x));
+            for (size_t lane = 0; lane < MAX_LANES; ++lane)
+            {
+                bias[channel][lane] += gain[lane] * (x[lane] - bias[channel][lane]);
+                y[channel][lane] = x[lane] - bias[channel][lane];
+            }
+        }
+        return true;
+    }
+
+    case MotionStageType::LowPass:
+    {
+        auto& filtered = node.state[0];
+        const float alpha = 1.0f - std::exp(-TWO_PI * node.stage.parameters[0] / rate);
+        for (size_t channel = 0; channel < MOTION_CHANNEL_COUNT; ++channel)
+        {
+            std::memcpy(x, input.values[channel], sizeof(x));
+            for (size_t lane = 0; lane < MAX_LANES; ++lane)
+            {
+                filtered[channel][lane] += alpha * (x[lane] - filtered[channel][lane]);
+                y[channel][lane] = filtered[channel][lane];
+            }
+        }
+        return true;
+    }
+
+    case MotionStageType::OneEuro:
+    {
+        // Casiez et al., "1 Euro Filter": a low pass whose cutoff rises with
+        // the speed of the signal, smooth at rest and quick when moving
+        auto& filtered = node.state[0];
+        auto& previous = node.state[1];
+        auto& speed = node.state[2];
+        const float min_cutoff = node.stage.parameters[0];
+        const float beta = node.stage.parameters[1];
+        const float speed_alpha = TWO_PI * ONE_EURO_DERIVATIVE_CUTOFF / (TWO_PI * ONE_EURO_DERIVATIVE_CUTOFF + rate);
+        for (size_t channel = 0; channel < MOTION_CHANNEL_COUNT; ++channel)
+        {
+            std::memcpy(x, input.values[channel], sizeof(x));
+            for (size_t lane = 0; lane < MAX_LANES; ++lane)
+            {
+                speed[channel][lane] += speed_alpha * ((x[lane] - previous[channel][lane]) * rate - speed[channel][lane]);
+                previous[channel][lane] = x[lane];
+                const float cutoff = TWO_PI * (min_cutoff + beta * std::fabs(speed[channel][lane]));
+                const float alpha = cutoff / (cutoff + rate);
+                filtered[channel][lane] += alpha * (x[lane] - filtered[channel][lane]);
+                y[channel][lane] = filtered[channel][lane];
+            }
+        }
+        return true;
+    }
+
+    case MotionStageType::Decimate:
+    {
+        auto& sum = node.state[0];
+        for (size_t channel = 0; channel < MOTION_CHANNEL_COUNT; ++channel)
+        {
+            std::memcpy(x, input.values[channel], sizeof(x));
+            for (size_t lane = 0; lane < MAX_LANES; ++lane)
+                sum[channel][lane] += x[lane];
+        }
+        const uint32_t factor = static_cast<uint32_t>(node.stage.parameters[0]);
+        if (++node.count < factor)
+            return false;
+
+        const float scale = 1.0f / static_cast<float>(factor);
+        for (size_t channel = 0; channel < MOTION_CHANNEL_COUNT; ++channel)
+        {
+            for (size_t lane = 0; lane < MAX_LANES; ++lane)
+            {
+                y[channel][lane] = sum[channel][lane] * scale;
+                sum[channel][lane] = 0.0f;
+            }
+        }
+        node.count = 0;
+        return true;
+    }
+
+    case MotionStageType::Resample:
+    {
+        // An output is due each time the phase passes 1; it lies `position`
+        // of the way from the previous input to this one
+        auto& previous = node.state[0];
+        const float step = node.stage.parameters[0] / rate;
+        const float phase = node.phase + step;
+        if (phase < 1.0f)
+        {
+            std::memcpy(previous, input.values, sizeof(input.values));
+            node.phase = phase;
+            return false;
+        }
+
+        const float position = (1.0f - node.phase) / step;
+        for (size_t channel = 0; channel < MOTION_CHANNEL_COUNT; ++channel)
+        {
+            std::memcpy(x, input.values[channel], sizeof(x));
+            for (size_t lane = 0; lane < MAX_LANES; ++lane)
+            {
+                y[channel][lane] = previous[channel][lane] + position * (x[lane] - previous[channel][lane]);
+                previous[channel][lane] = x[lane];
+            }
+        }
+        node.phase = phase - 1.0f;
+        output.time = input.time - std::chrono::duration_cast<Clock::duration>(
+                                       std::chrono::duration<double>((1.0f - position) / rate));
+        return true;
+    }
+    }
+    return false;
+}
+
+MotionPipeline::Stats MotionPipeline::GetStats() const
+{
+    Stats stats;
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        stats = m_stats;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_input_mutex);
+        stats.samples = m_samples;
+        stats.late_samples = m_late_samples;
+    }
+    std::lock_guard<std::mutex> lock(m_graph_mutex);
+    stats.stages = m_node_count;
+    stats.subscriptions = m_subscription_count;
+    return stats;
+}
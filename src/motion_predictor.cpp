@@ -0,0 +1,165 @@
+#include "motion_predictor.h"
+#include <algorithm>
+#include <cmath>
+
+// Weight of one checked prediction in the recent error, about half a
+// second of reports
+constexpr float RECENT_ERROR_WEIGHT = 0.05f;
+
+MotionPredictor::MotionPredictor()
+    : MotionPredictor(1, Config())
+{
+}
+
+MotionPredictor::MotionPredictor(size_t channels, const Config& config)
+{
+    Configure(channels, config);
+}
+
+void MotionPredictor::Configure(size_t channels, const Config& config)
+{
+    m_channels = std::clamp<size_t>(channels, 1, MAX_CHANNELS);
+    m_config = config;
+
+    // Fading-memory gains: one parameter from following every report to
+    // averaging over many, always stable
+    const float theta = std::clamp(config.smoothing, 0.0f, 0.95f);
+    const float forget = 1.0f - theta;
+    m_alpha = 1.0f - theta * theta * theta;
+    m_beta = 1.5f * forget * forget * (1.0f + theta);
+    m_gamma = 0.5f * forget * forget * forget;
+
+    m_stats = Stats();
+    m_squared_error = 0.0;
+    m_squared_error_unpredicted = 0.0;
+    Reset();
+}
+
+void MotionPredictor::Reset()
+{
+    m_count = 0;
+    m_pending_start = 0;
+    m_pending_count = 0;
+    m_recent_error = 0.0f;
+    m_horizon_scale = 1.0f;
+}
+
+void MotionPredictor::Update(Clock::time_point time, const float* values)
+{
+    const double dt = std::chrono::duration<double>(time - m_time).count();
+    if (m_count > 0 && (dt <= 0.0 || dt > MAX_GAP_S))
+        Reset();
+
+    if (m_count > 0)
+        CheckPending(time, values);
+
+    const float step = static_cast<float>(dt);
+    for (size_t i = 0; i < m_channels; ++i)
+    {
+        if (m_count == 0)
+        {
+            m_position[i] = values[i];
+            m_velocity[i] = 0.0f;
+            m_acceleration[i] = 0.0f;
+        }
+        else if (m_count == 1)
+        {
+            m_velocity[i] = (values[i] - m_position[i]) / step;
+            m_position[i] = values[i];
+        }
+        else
+        {
+            const float position = m_position[i] + (m_velocity[i] + 0.5f * m_acceleration[i] * step) * step;
+            const float velocity = m_velocity[i] + m_acceleration[i] * step;
+            const float residual = values[i] - position;
+            m_position[i] = position + m_alpha * residual;
+            m_velocity[i] = velocity + m_beta * residual / step;
+            m_acceleration[i] += 2.0f * m_gamma * residual / (step * step);
+        }
+        m_latest[i] = values[i];
+    }
+    m_time = time;
+    m_count++;
+    m_stats.samples++;
+}
+
+void MotionPredictor::CheckPending(Clock::time_point time, const float* values)
+{
+    const double span = std::chrono::duration<double>(time - m_time).count();
+    while (m_pending_count > 0)
+    {
+        const Pending& pending = m_pending[m_pending_start];
+        if (pending.time > time)
+            break;
+
+        // The motion at the predicted time, between the last two reports
+        const float position = static_cast<float>(
+            std::max(0.0, std::chrono::duration<double>(pending.time - m_time).count()) / span);
+        float error = 0.0f;
+        float error_unpredicted = 0.0f;
+        for (size_t i = 0; i < m_channels; ++i)
+        {
+            const float actual = m_latest[i] + position * (values[i] - m_latest[i]);
+            error += (pending.predicted[i] - actual) * (pending.predicted[i] - actual);
+            error_unpredicted += (pending.latest[i] - actual) * (pending.latest[i] - actual);
+        }
+        error /= static_cast<float>(m_channels);
+        error_unpredicted /= static_cast<float>(m_channels);
+
+        m_squared_error += error;
+        m_squared_error_unpredicted += error_unpredicted;
+        m_stats.checked++;
+        m_recent_error += RECENT_ERROR_WEIGHT * (error - m_recent_error);
+        m_pending_start = (m_pending_start + 1) % MAX_PENDING;
+        m_pending_count--;
+    }
+
+    const float limit = m_config.max_error * m_config.max_error;
+    m_horizon_scale = limit > 0.0f && m_recent_error > limit ? std::sqrt(limit / m_recent_error) : 1.0f;
+}
+
+void MotionPredictor::Predict(Clock::time_point now, float* values)
+{
+    if (m_count == 0)
+        return;
+    if (m_count == 1)
+    {
+        std::copy(m_latest, m_latest + m_channels, values);
+        return;
+    }
+    const double ahead = std::clamp(std::chrono::duration<double>(now - m_time).count() +
+                                        m_config.horizon_ms * m_horizon_scale / 1000.0,
+                                    0.0, MAX_EXTRAPOLATION_S);
+    Extrapolate(ahead, values);
+
+    // What is returned is checked against the reports for the time it
+    // stands for
+    if (m_pending_count == MAX_PENDING)
+    {
+        m_pending_start = (m_pending_start + 1) % MAX_PENDING;
+        m_pending_count--;
+    }
+    Pending& pending = m_pending[(m_pending_start + m_pending_count++) % MAX_PENDING];
+    pending.time = m_time + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(ahead));
+    std::copy(values, values + m_channels, pending.predicted);
+    std::copy(m_latest, m_latest + m_channels, pending.latest);
+}
+
+void MotionPredictor::Extrapolate(double seconds, float* values) const
+{
+    const float dt = static_cast<float>(std::clamp(seconds, 0.0, MAX_EXTRAPOLATION_S));
+    for (size_t i = 0; i < m_channels; ++i)
+        values[i] = m_position[i] + (m_velocity[i] + 0.5f * m_acceleration[i] * dt) * dt;
+}
+
+MotionPredictor::Stats MotionPredictor::GetStats() const
+{
+    Stats stats = m_stats;
+    if (stats.checked > 0)
+    {
+        stats.rms_error = std::sqrt(m_squared_error / stats.checked);
+        stats.rms_error_unpredicted = std::sqrt(m_squared_error_unpredicted / stats.checked);
+    }
+    stats.horizon_scale = m_horizon_scale;
+    return stats;
+}
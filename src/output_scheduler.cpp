@@ -0,0 +1,557 @@
+#include "output_scheduler.h"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+using namespace WiimoteProtocol;
+
+static void Settle(std::vector<OutputScheduler::DeliveryCallback>& callbacks, bool delivered)
+{
+    for (auto& callback : callbacks)
+        callback(delivered);
+    callbacks.clear();
+}
+
+OutputScheduler::OutputScheduler(SendFunction send)
+    : OutputScheduler(std::move(send), Config())
+{
+}
+
+OutputScheduler::OutputScheduler(SendFunction send, const Config& config)
+    : m_send(std::move(send)), m_config(config), m_leds(0), m_rumble(false),
+      m_continuous(false), m_mode(INPUT_CORE), m_was_rate_limited(false),
+      m_draining(false), m_wake_at(Clock::time_point::max()), m_total_latency_ms(0.0),
+      m_total_delivery_ms(0.0), m_total_rumble_latency_ms(0.0)
+{
+}
+
+void OutputScheduler::SetWakeFunction(WakeFunction wake)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_wake = std::move(wake);
+}
+
+bool OutputScheduler::Submit(const uint8_t* report, size_t size, bool acknowledged)
+{
+    if (size < 2 || size > MAX_REPORT_SIZE)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_queue.size() >= m_config.max_queued_reports)
+        {
+            ++m_stats.dropped;
+            return false;
+        }
+
+        QueuedReport queued;
+        memcpy(queued.data, report, size);
+        queued.size = size;
+        queued.queued = Clock::now();
+        queued.acknowledged = acknowledged;
+        m_queue.push_back(queued);
+    }
+
+    Drain();
+    return true;
+}
+
+bool OutputScheduler::SendNow(const uint8_t* report, size_t size)
+{
+    if (size < 2 || size > MAX_REPORT_SIZE)
+        return false;
+
+    uint8_t data[MAX_REPORT_SIZE];
+    memcpy(data, report, size);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        data[1] &= static_cast<uint8_t>(~(OUTPUT_FLAG_RUMBLE | OUTPUT_FLAG_ACKNOWLEDGE));
+        if (m_rumble)
+            data[1] |= OUTPUT_FLAG_RUMBLE;
+        m_next_send = std::max(m_next_send, Clock::now() + m_config.min_report_interval);
+    }
+
+    const bool sent = m_send(data, size);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!sent)
+    {
+        ++m_stats.send_failures;
+        return false;
+    }
+    ++m_stats.reports_sent;
+    ++m_stats.sent_now;
+    return true;
+}
+
+void OutputScheduler::MarkDirtyLocked(Source source, Clock::duration slack)
+{
+    PendingState& state = m_state[source];
+    const Clock::time_point now = Clock::now();
+    if (state.dirty)
+    {
+        ++m_stats.coalesced;
+        state.due = std::min(state.due, now + slack);
+        return;
+    }
+    state.dirty = true;
+    state.queued = now;
+    state.due = now + slack;
+    state.attempts = 0;
+}
+
+void OutputScheduler::SetLeds(uint8_t mask, DeliveryCallback on_delivered)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        mask &= 0x0F;
+        if (mask != m_leds || m_state[SOURCE_LEDS].dirty)
+        {
+            m_leds = mask;
+            MarkDirtyLocked(SOURCE_LEDS);
+            if (on_delivered)
+                m_callbacks[SOURCE_LEDS].push_back(std::move(on_delivered));
+            on_delivered = nullptr;
+        }
+        else if (on_delivered)
+        {
+            // Already sent: settled with the report carrying it, if that
+            // is still unconfirmed
+            auto awaiting = m_awaiting_ack.find(OUTPUT_LEDS);
+            if (awaiting != m_awaiting_ack.end() && awaiting->second.source == SOURCE_LEDS)
+            {
+                awaiting->second.callbacks.push_back(std::move(on_delivered));
+                on_delivered = nullptr;
+            }
+        }
+    }
+    if (on_delivered)
+    {
+        on_delivered(true);
+        return;
+    }
+    Drain();
+}
+
+void OutputScheduler::SetRumble(bool on, Clock::duration slack)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (on == m_rumble && !m_state[SOURCE_RUMBLE].dirty)
+            return;
+        m_rumble = on;
+        MarkDirtyLocked(SOURCE_RUMBLE, slack);
+    }
+    Drain();
+}
+
+void OutputScheduler::SetReportingMode(bool continuous, uint8_t mode)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_continuous = continuous;
+        m_mode = mode;
+        MarkDirtyLocked(SOURCE_MODE);
+    }
+    Drain();
+}
+
+void OutputScheduler::RequestStatus()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        MarkDirtyLocked(SOURCE_STATUS);
+    }
+    Drain();
+}
+
+uint8_t OutputScheduler::GetReportId(Source source)
+{
+    switch (source)
+    {
+    case SOURCE_RUMBLE: return OUTPUT_RUMBLE;
+    case SOURCE_MODE:   return OUTPUT_REPORT_MODE;
+    case SOURCE_LEDS:   return OUTPUT_LEDS;
+    default:            return OUTPUT_STATUS_REQUEST;
+    }
+}
+
+bool OutputScheduler::IsReadyLocked(Source source, Clock::time_point now) const
+{
+    if (source == SOURCE_QUEUE)
+    {
+        // Queued reports keep their order, so one waiting for its id holds
+        // back the rest
+        return !m_queue.empty() &&
+               !(m_queue.front().acknowledged && m_awaiting_ack.count(m_queue.front().data[0]));
+    }
+
+    // A deferred rumble change alone is not worth a report yet
+    const PendingState& state = m_state[source];
+    if (!state.dirty || (source == SOURCE_RUMBLE && state.due > now))
+        return false;
+    // A change made while the previous value waits for its ack goes out
+    // once that is settled, as the latest value
+    return source == SOURCE_STATUS || !m_config.acknowledge_state || !m_awaiting_ack.count(GetReportId(source));
+}
+
+bool OutputScheduler::HasWorkLocked(Clock::time_point now) const
+{
+    for (int source = 0; source < SOURCE_STATE_COUNT; ++source)
+    {
+        if (IsReadyLocked(static_cast<Source>(source), now))
+            return true;
+    }
+    return IsReadyLocked(SOURCE_QUEUE, now);
+}
+
+void OutputScheduler::BuildStateReportLocked(Source source, QueuedReport& report) const
+{
+    switch (source)
+    {
+    case SOURCE_RUMBLE:
+        report.data[0] = OUTPUT_RUMBLE;
+        report.data[1] = 0x00;
+        report.size = 2;
+        break;
+    case SOURCE_MODE:
+        report.data[0] = OUTPUT_REPORT_MODE;
+        report.data[1] = m_continuous ? REPORT_MODE_CONTINUOUS : 0x00;
+        report.data[2] = m_mode;
+        report.size = 3;
+        break;
+    case SOURCE_LEDS:
+        report.data[0] = OUTPUT_LEDS;
+        report.data[1] = static_cast<uint8_t>(m_leds << 4);
+        report.size = 2;
+        break;
+    default:
+        report.data[0] = OUTPUT_STATUS_REQUEST;
+        report.data[1] = 0x00;
+        report.size = 2;
+        break;
+    }
+
+    // A status request is answered by 0x20, which is confirmation enough
+    report.acknowledged = m_config.acknowledge_state && source != SOURCE_STATUS;
+    report.queued = m_state[source].queued;
+    report.attempts = m_state[source].attempts;
+}
+
+bool OutputScheduler::TakeNextLocked(Clock::time_point now, QueuedReport& report, Source& source)
+{
+    // The rumble bit is shared, so a rumble change does not need a report of
+    // its own if anything else is waiting
+    const bool carry_rumble = m_state[SOURCE_RUMBLE].dirty;
+    const Clock::time_point rumble_queued = m_state[SOURCE_RUMBLE].queued;
+    const bool mode = IsReadyLocked(SOURCE_MODE, now);
+    const bool queue = IsReadyLocked(SOURCE_QUEUE, now);
+    const bool leds = IsReadyLocked(SOURCE_LEDS, now);
+
+    if (mode && (!carry_rumble || !leds))
+        source = SOURCE_MODE;
+    else if (queue && !carry_rumble)
+        source = SOURCE_QUEUE;
+    else if (leds)
+        source = SOURCE_LEDS;
+    else if (IsReadyLocked(SOURCE_STATUS, now))
+        source = SOURCE_STATUS;
+    else if (queue)
+        source = SOURCE_QUEUE;
+    else if (carry_rumble && IsReadyLocked(SOURCE_RUMBLE, Clock::time_point::max()))
+        source = SOURCE_RUMBLE;
+    else
+        return false;
+
+    if (source == SOURCE_QUEUE)
+    {
+        report = m_queue.front();
+        m_queue.pop_front();
+    }
+    else
+    {
+        BuildStateReportLocked(source, report);
+        m_state[source].dirty = false;
+    }
+
+    const uint8_t id = report.data[0];
+    if (carry_rumble)
+    {
+        const double latency = std::chrono::duration<double, std::milli>(Clock::now() - rumble_queued).count();
+        if (source == SOURCE_RUMBLE)
+            ++m_stats.rumble_reports;
+        else
+            ++m_stats.rumble_carried;
+        m_total_rumble_latency_ms += latency;
+        m_stats.average_rumble_latency_ms = m_total_rumble_latency_ms / (m_stats.rumble_reports + m_stats.rumble_carried);
+        m_stats.max_rumble_latency_ms = std::max(m_stats.max_rumble_latency_ms, latency);
+    }
+
+    if (carry_rumble && source != SOURCE_RUMBLE)
+    {
+        report.queued = std::min(report.queued, rumble_queued);
+        // The carrying report stands in for the rumble change; make sure it
+        // is confirmed like one, unless a report of its id still waits for
+        // an ack and a second could not be told apart from it
+        report.acknowledged = report.acknowledged || (m_config.acknowledge_state && !m_awaiting_ack.count(id));
+    }
+    m_state[SOURCE_RUMBLE].dirty = false;
+
+    if (m_rumble)
+        report.data[1] |= OUTPUT_FLAG_RUMBLE;
+    else
+        report.data[1] &= static_cast<uint8_t>(~OUTPUT_FLAG_RUMBLE);
+
+    // Memory access and status requests have replies of their own, and
+    // speaker data is streamed too fast to confirm report by report
+    if (id == OUTPUT_WRITE_MEMORY || id == OUTPUT_READ_MEMORY || id == OUTPUT_STATUS_REQUEST ||
+        id == OUTPUT_SPEAKER_DATA)
+        report.acknowledged = false;
+    if (report.acknowledged)
+        report.data[1] |= OUTPUT_FLAG_ACKNOWLEDGE;
+    return true;
+}
+
+bool OutputScheduler::HandleAck(const uint8_t* report, size_t size)
+{
+    // 22 BB BB RR EE
+    if (size < 5 || report[0] != INPUT_ACK || report[3] == OUTPUT_WRITE_MEMORY)
+        return false;
+
+    AwaitingAck acked;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // At most one report per id waits for its ack, so the ack is for it
+        auto awaiting = m_awaiting_ack.find(report[3]);
+        if (awaiting == m_awaiting_ack.end())
+        {
+            ++m_stats.unmatched_acks;
+            return true;
+        }
+
+        acked = std::move(awaiting->second);
+        m_awaiting_ack.erase(awaiting);
+
+        if (report[4] != ERROR_NONE)
+        {
+            ++m_stats.device_errors;
+        }
+        else
+        {
+            const double delivery = std::chrono::duration<double, std::milli>(Clock::now() - acked.report.queued).count();
+            ++m_stats.delivered;
+            m_total_delivery_ms += delivery;
+            m_stats.average_delivery_ms = m_total_delivery_ms / m_stats.delivered;
+            m_stats.max_delivery_ms = std::max(m_stats.max_delivery_ms, delivery);
+        }
+        UpdateLossRateLocked();
+    }
+    Settle(acked.callbacks, report[4] == ERROR_NONE);
+
+    // A change held back for this ack can go now
+    Drain();
+    return true;
+}
+
+void OutputScheduler::CheckAckTimeoutsLocked(Clock::time_point now, std::vector<DeliveryCallback>& failed)
+{
+    std::vector<QueuedReport> resend;
+
+    // Oldest first, so retransmissions keep their send order
+    std::vector<AwaitingAck> expired_reports;
+    for (auto it = m_awaiting_ack.begin(); it != m_awaiting_ack.end();)
+    {
+        if (now - it->second.sent < m_config.ack_timeout)
+        {
+            ++it;
+            continue;
+        }
+        expired_reports.push_back(std::move(it->second));
+        it = m_awaiting_ack.erase(it);
+    }
+    std::sort(expired_reports.begin(), expired_reports.end(),
+        [](const AwaitingAck& a, const AwaitingAck& b) { return a.sent < b.sent; });
+
+    for (AwaitingAck& expired : expired_reports)
+    {
+        ++m_stats.timeouts;
+        if (expired.report.attempts >= m_config.max_retransmits)
+        {
+            ++m_stats.lost;
+            std::move(expired.callbacks.begin(), expired.callbacks.end(), std::back_inserter(failed));
+            continue;
+        }
+
+        if (expired.source == SOURCE_QUEUE)
+        {
+            QueuedReport report = expired.report;
+            report.attempts++;
+            resend.push_back(report);
+            ++m_stats.retransmits;
+            continue;
+        }
+
+        // A newer value already waiting replaces the lost one, and settles
+        // its callbacks too
+        PendingState& state = m_state[expired.source];
+        std::move(expired.callbacks.begin(), expired.callbacks.end(),
+                  std::back_inserter(m_callbacks[expired.source]));
+        if (state.dirty)
+            continue;
+        state.dirty = true;
+        state.queued = expired.report.queued;
+        state.due = now;
+        state.attempts = expired.report.attempts + 1;
+        ++m_stats.retransmits;
+    }
+
+    // Retransmissions go ahead of reports queued after them
+    m_queue.insert(m_queue.begin(), resend.begin(), resend.end());
+    UpdateLossRateLocked();
+}
+
+void OutputScheduler::UpdateLossRateLocked()
+{
+    const uint64_t total = m_stats.delivered + m_stats.timeouts;
+    m_stats.loss_rate = total > 0 ? static_cast<double>(m_stats.timeouts) / total : 0.0;
+}
+
+OutputScheduler::Clock::time_point OutputScheduler::GetNextWakeLocked(Clock::time_point now) const
+{
+    Clock::time_point next = Clock::time_point::max();
+    if (HasWorkLocked(now))
+        next = std::max(now, m_next_send);
+    else if (m_state[SOURCE_RUMBLE].dirty)
+        next = std::max(m_state[SOURCE_RUMBLE].due, m_next_send);
+    for (const auto& awaiting : m_awaiting_ack)
+        next = std::min(next, awaiting.second.sent + m_config.ack_timeout);
+    return next;
+}
+
+void OutputScheduler::ScheduleWake()
+{
+    WakeFunction wake;
+    Clock::time_point when;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const Clock::time_point now = Clock::now();
+        when = GetNextWakeLocked(now);
+        if (!m_wake || when == Clock::time_point::max() || (m_wake_at > now && m_wake_at <= when))
+            return;
+        m_wake_at = when;
+        wake = m_wake;
+    }
+    wake(when);
+}
+
+void OutputScheduler::Drain()
+{
+    std::vector<DeliveryCallback> failed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_draining)
+            return;
+        m_draining = true;
+        const Clock::time_point now = Clock::now();
+        if (m_wake_at <= now)
+            m_wake_at = Clock::time_point::max();
+        CheckAckTimeoutsLocked(now, failed);
+    }
+    Settle(failed, false);
+
+    for (;;)
+    {
+        QueuedReport report;
+        Source source;
+        std::vector<DeliveryCallback> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const auto now = Clock::now();
+            const bool rate_limited = HasWorkLocked(now) && now < m_next_send;
+            if (rate_limited || !TakeNextLocked(now, report, source))
+            {
+                m_was_rate_limited = m_was_rate_limited || rate_limited;
+                m_draining = false;
+                break;
+            }
+            m_next_send = now + m_config.min_report_interval;
+            if (m_was_rate_limited)
+            {
+                ++m_stats.rate_limited;
+                m_was_rate_limited = false;
+            }
+
+            if (source != SOURCE_QUEUE)
+                callbacks.swap(m_callbacks[source]);
+
+            // Registered before sending so a fast acknowledgement finds it.
+            // A failed send is left to time out and be retransmitted.
+            if (report.acknowledged)
+            {
+                AwaitingAck& awaiting = m_awaiting_ack[report.data[0]];
+                awaiting = { source, report, now, {} };
+                awaiting.callbacks.swap(callbacks);
+            }
+        }
+
+        const bool sent = m_send(report.data, report.size);
+        const double latency = std::chrono::duration<double, std::milli>(Clock::now() - report.queued).count();
+        // Without an ack to wait for, sending is all there is to know
+        Settle(callbacks, sent);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!sent)
+        {
+            ++m_stats.send_failures;
+            continue;
+        }
+        ++m_stats.reports_sent;
+        m_total_latency_ms += latency;
+        m_stats.average_latency_ms = m_total_latency_ms / m_stats.reports_sent;
+        m_stats.max_latency_ms = std::max(m_stats.max_latency_ms, latency);
+    }
+    ScheduleWake();
+}
+
+void OutputScheduler::Clear()
+{
+    std::vector<DeliveryCallback> cleared;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.clear();
+        for (auto& awaiting : m_awaiting_ack)
+            std::move(awaiting.second.callbacks.begin(), awaiting.second.callbacks.end(), std::back_inserter(cleared));
+        m_awaiting_ack.clear();
+        for (int source = 0; source < SOURCE_STATE_COUNT; ++source)
+        {
+            m_state[source].dirty = false;
+            std::move(m_callbacks[source].begin(), m_callbacks[source].end(), std::back_inserter(cleared));
+            m_callbacks[source].clear();
+        }
+    }
+    Settle(cleared, false);
+}
+
+bool OutputScheduler::IsIdle() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return !HasWorkLocked(Clock::time_point::max()) && m_awaiting_ack.empty();
+}
+
+uint8_t OutputScheduler::GetLeds() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_leds;
+}
+
+bool OutputScheduler::GetRumble() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_rumble;
+}
+
+OutputScheduler::Stats OutputScheduler::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
@@ -0,0 +1,107 @@
+#include "precise_timer.h"
+#include "debug_log.h"
+
+#ifdef _WIN32
+// Missing from SDKs older than Windows 10 1803
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+#endif
+
+PreciseTimer::PreciseTimer()
+    : m_cancelled(false)
+#ifdef _WIN32
+      , m_timer(nullptr), m_cancel_event(nullptr)
+#endif
+{
+}
+
+PreciseTimer::~PreciseTimer()
+{
+    Close();
+}
+
+bool PreciseTimer::Open()
+{
+    Reset();
+#ifdef _WIN32
+    if (m_timer)
+        return true;
+
+    m_timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (!m_timer)
+    {
+        // Older systems: the wait is then only as fine as the system timer
+        LOG_DEBUG("High resolution waitable timer unavailable, using the default timer");
+        m_timer = CreateWaitableTimerW(nullptr, TRUE, nullptr);
+    }
+    m_cancel_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!m_timer || !m_cancel_event)
+    {
+        LOG_ERROR(LogFormat("Failed to create waitable timer, error: %lu", GetLastError()));
+        Close();
+        return false;
+    }
+#endif
+    return true;
+}
+
+void PreciseTimer::Close()
+{
+#ifdef _WIN32
+    if (m_timer)
+        CloseHandle(m_timer);
+    if (m_cancel_event)
+        CloseHandle(m_cancel_event);
+    m_timer = nullptr;
+    m_cancel_event = nullptr;
+#endif
+}
+
+void PreciseTimer::Cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancelled = true;
+    }
+#ifdef _WIN32
+    if (m_cancel_event)
+        SetEvent(m_cancel_event);
+#else
+    m_cancel_cv.notify_all();
+#endif
+}
+
+void PreciseTimer::Reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cancelled = false;
+#ifdef _WIN32
+    if (m_cancel_event)
+        ResetEvent(m_cancel_event);
+#endif
+}
+
+bool PreciseTimer::WaitUntil(Clock::time_point deadline)
+{
+#ifdef _WIN32
+    const auto remaining = deadline - Clock::now();
+    if (remaining <= Clock::duration::zero())
+        return WaitForSingleObject(m_cancel_event, 0) != WAIT_OBJECT_0;
+
+    // Negative due times are relative, in 100 ns units
+    LARGE_INTEGER due;
+    due.QuadPart = -static_cast<LONGLONG>(std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count() / 100);
+    if (!SetWaitableTimer(m_timer, &due, 0, nullptr, nullptr, FALSE))
+    {
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count();
+        return WaitForSingleObject(m_cancel_event, static_cast<DWORD>(ms)) != WAIT_OBJECT_0;
+    }
+
+    HANDLE handles[2] = { m_cancel_event, m_timer };
+    return WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0;
+#else
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return !m_cancel_cv.wait_until(lock, deadline, [this]() { return m_cancelled; });
+#endif
+}
@@ -0,0 +1,89 @@
+#include "report_clock.h"
+#include <algorithm>
+#include <cmath>
+
+// Share of a late arrival's offset from the grid the phase moves by; it
+// mostly shows a batching delay. A report earlier than the grid shows the
+// grid is late, as a sample cannot arrive before it is taken, and moves
+// the phase all the way.
+constexpr double LATE_GAIN = 0.01;
+// Share of each phase correction, per period, taken into the period
+constexpr double PERIOD_GAIN = 0.002;
+// Per report, how fast the longest delay expected forgets an outlier
+constexpr double MAX_DELAY_DECAY = 0.999;
+
+ReportClock::ReportClock()
+    : m_has_time(false), m_period_s(NOMINAL_PERIOD_S), m_max_delay_s(0.0),
+      m_timed_reports(0), m_total_jitter_us(0.0)
+{
+}
+
+void ReportClock::Reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_has_time = false;
+    m_period_s = NOMINAL_PERIOD_S;
+    m_max_delay_s = 0.0;
+    m_stats = Stats();
+    m_timed_reports = 0;
+    m_total_jitter_us = 0.0;
+}
+
+ReportClock::Clock::time_point ReportClock::Update(Clock::time_point arrival, bool continuous)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.reports++;
+
+    const double elapsed = std::chrono::duration<double>(arrival - m_sample_time).count();
+    if (!m_has_time || elapsed > MAX_GAP_S || elapsed < 0.0)
+    {
+        if (m_has_time)
+            m_stats.gaps++;
+        m_has_time = true;
+        m_sample_time = arrival;
+        return arrival;
+    }
+
+    // Without continuous reporting the remote skips the periods in which
+    // nothing changed, and as batching delays can be longer than a period
+    // the arrivals cannot tell a late report from skipped periods: the
+    // arrival is the best time there is, and the phase follows it.
+    if (!continuous)
+    {
+        m_sample_time = arrival;
+        return arrival;
+    }
+
+    // Each report is the next one on the grid unless it is later than any
+    // delay seen lately, which means reports were lost
+    const double periods = 1.0 + std::floor(std::max(0.0, elapsed - m_period_s - m_max_delay_s) / m_period_s);
+    const double offset = elapsed - periods * m_period_s;
+    const double correction = offset < 0.0 ? offset : offset * LATE_GAIN;
+
+    // Never later than the report arrived, rounding included
+    const Clock::time_point sample_time = m_sample_time + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(periods * m_period_s + correction));
+    m_sample_time = std::min(sample_time, arrival);
+    m_period_s = std::clamp(m_period_s + PERIOD_GAIN * correction / periods, MIN_PERIOD_S, MAX_PERIOD_S);
+
+    const double delay = std::chrono::duration<double>(arrival - m_sample_time).count();
+    m_max_delay_s = std::max(delay, std::max(m_max_delay_s * MAX_DELAY_DECAY, m_period_s / 2.0));
+
+    const double jitter_us = delay * 1e6;
+    m_total_jitter_us += jitter_us;
+    m_stats.average_jitter_us = m_total_jitter_us / ++m_timed_reports;
+    m_stats.max_jitter_us = std::max(m_stats.max_jitter_us, jitter_us);
+    m_stats.skipped_periods += static_cast<uint64_t>(periods) - 1;
+    return m_sample_time;
+}
+
+ReportClock::Stats ReportClock::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats = m_stats;
+    stats.period_us = m_period_s * 1e6;
+    // Against the nominal rate or the multiple of it the remote reports at
+    const double nominal = NOMINAL_PERIOD_S / std::max(1.0, std::round(NOMINAL_PERIOD_S / m_period_s));
+    stats.drift_ppm = (nominal / m_period_s - 1.0) * 1e6;
+    return stats;
+}
@@ -0,0 +1,135 @@
+#include "reporting_mode_manager.h"
+#include "wiimote_protocol.h"
+
+using namespace WiimoteProtocol;
+
+ReportingModeManager::ReportingModeManager()
+    : m_features(INPUT_FEATURE_BUTTONS), m_extension_bytes(0), m_has_selection(false)
+{
+}
+
+ReportingModeManager::Selection ReportingModeManager::Select(uint32_t features, size_t extension_bytes)
+{
+    const bool want_accel = (features & INPUT_FEATURE_ACCEL) != 0;
+    const bool want_ir = (features & INPUT_FEATURE_IR) != 0;
+    const size_t want_ext = (features & INPUT_FEATURE_EXTENSION) ? extension_bytes : 0;
+
+    Selection selection;
+    selection.continuous = (features & INPUT_FEATURE_CONTINUOUS) != 0;
+
+    // Layouts are ordered by size, so the first match is the cheapest one.
+    // Mode 0x3D drops the buttons and is never picked. Among equally sized
+    // modes the first one that covers the request wins; partial extension
+    // coverage is accepted as a last resort so that buttons, accel and IR
+    // keep flowing.
+    const ReportLayout* best = nullptr;
+    const ReportLayout* partial = nullptr;
+    for (const auto& layout : REPORT_LAYOUTS)
+    {
+        if (layout.id == INPUT_EXT21)
+            continue;
+        if (want_accel && layout.accel_offset == 0)
+            continue;
+        if (want_ir && layout.ir_offset == 0)
+            continue;
+        if (layout.ext_size < want_ext)
+        {
+            if (!partial || layout.ext_size > partial->ext_size)
+                partial = &layout;
+            continue;
+        }
+        if (!best || layout.size < best->size)
+            best = &layout;
+    }
+    if (!best)
+        best = partial ? partial : &REPORT_LAYOUTS[0];
+
+    selection.mode = best->id;
+    if (best->ir_offset != 0)
+        selection.ir_mode = best->ir_size == 12 ? IrMode::Extended : IrMode::Basic;
+    return selection;
+}
+
+void ReportingModeManager::SetFeatures(uint32_t features)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_features = features | INPUT_FEATURE_BUTTONS;
+}
+
+void ReportingModeManager::SetExtensionBytes(size_t extension_bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_extension_bytes = extension_bytes;
+}
+
+uint32_t ReportingModeManager::GetFeatures() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_features;
+}
+
+bool ReportingModeManager::Update(Selection& selection)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    selection = Select(m_features, m_extension_bytes);
+    if (m_has_selection && selection == m_selection)
+        return false;
+
+    m_selection = selection;
+    m_has_selection = true;
+    return true;
+}
+
+ReportingModeManager::Selection ReportingModeManager::GetSelection() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_selection;
+}
+
+ReportingModeManager::Bucket& ReportingModeManager::BucketForLocked(Clock::time_point now)
+{
+    const int64_t index = now.time_since_epoch() / BUCKET_LENGTH;
+    Bucket& bucket = m_buckets[index % BUCKET_COUNT];
+    if (bucket.index != index)
+    {
+        bucket = Bucket();
+        bucket.index = index;
+    }
+    return bucket;
+}
+
+void ReportingModeManager::RecordInput(size_t bytes, Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Bucket& bucket = BucketForLocked(now);
+    bucket.input_bytes += bytes;
+    bucket.input_reports++;
+}
+
+void ReportingModeManager::RecordOutput(size_t bytes, Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    BucketForLocked(now).output_bytes += bytes;
+}
+
+ReportingModeManager::Traffic ReportingModeManager::GetTraffic(Clock::time_point now) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const int64_t current = now.time_since_epoch() / BUCKET_LENGTH;
+
+    Traffic traffic;
+    for (const auto& bucket : m_buckets)
+    {
+        if (bucket.index < 0 || current - bucket.index >= BUCKET_COUNT)
+            continue;
+        traffic.input_bytes_per_second += static_cast<double>(bucket.input_bytes);
+        traffic.output_bytes_per_second += static_cast<double>(bucket.output_bytes);
+        traffic.input_reports_per_second += bucket.input_reports;
+    }
+
+    const double window = std::chrono::duration<double>(BUCKET_LENGTH * BUCKET_COUNT).count();
+    traffic.input_bytes_per_second /= window;
+    traffic.output_bytes_per_second /= window;
+    traffic.input_reports_per_second /= window;
+    return traffic;
+}
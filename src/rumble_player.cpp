@@ -0,0 +1,159 @@
+#include "rumble_player.h"
+#include <algorithm>
+#include <cmath>
+
+// Length of the single looping step a constant intensity is played as
+constexpr uint32_t CONSTANT_STEP_MS = 1000;
+
+RumblePlayer::RumblePlayer(SetRumbleFunction set_rumble)
+    : RumblePlayer(std::move(set_rumble), Config())
+{
+}
+
+RumblePlayer::RumblePlayer(SetRumbleFunction set_rumble, const Config& config)
+    : m_set_rumble(std::move(set_rumble)), m_config(config), m_active(false),
+      m_on(false), m_intensity(0.0f), m_error_ms(0.0)
+{
+}
+
+void RumblePlayer::SetIntensity(float intensity)
+{
+    RumbleWaveform waveform;
+    intensity = std::clamp(intensity, 0.0f, 1.0f);
+    waveform.steps.push_back({ intensity, intensity, CONSTANT_STEP_MS });
+    waveform.loop = true;
+    Play(waveform);
+}
+
+void RumblePlayer::Play(const RumbleWaveform& waveform)
+{
+    bool on;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        StartLocked(waveform, Clock::now());
+        if (!StepLocked(m_start))
+            return;
+        on = m_on;
+    }
+    // A new command goes out straight away rather than waiting for a carrier
+    m_set_rumble(on, Clock::duration::zero());
+}
+
+void RumblePlayer::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_active = false;
+        m_waveform.steps.clear();
+        m_intensity = 0.0f;
+        if (!m_on)
+            return;
+        m_on = false;
+        m_stats.toggles++;
+    }
+    m_set_rumble(false, Clock::duration::zero());
+}
+
+void RumblePlayer::Update(Clock::time_point now)
+{
+    bool on;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_active || !StepLocked(now))
+            return;
+        on = m_on;
+    }
+    m_set_rumble(on, m_config.slack);
+}
+
+bool RumblePlayer::IsActive() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_active;
+}
+
+RumblePlayer::Stats RumblePlayer::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void RumblePlayer::StartLocked(RumbleWaveform waveform, Clock::time_point now)
+{
+    m_waveform = std::move(waveform);
+    m_active = !m_waveform.steps.empty();
+    m_start = now;
+    m_last_update = now;
+    m_error_ms = 0.0;
+    m_stats.commands++;
+    m_stats.error_ms = 0.0;
+}
+
+float RumblePlayer::IntensityAtLocked(Clock::time_point now, bool& finished) const
+{
+    finished = false;
+
+    uint64_t total_ms = 0;
+    for (const RumbleStep& step : m_waveform.steps)
+        total_ms += step.duration_ms;
+    if (total_ms == 0)
+    {
+        finished = true;
+        return 0.0f;
+    }
+
+    double t = std::chrono::duration<double, std::milli>(now - m_start).count();
+    if (m_waveform.loop)
+    {
+        t = std::fmod(std::max(t, 0.0), static_cast<double>(total_ms));
+    }
+    else if (t >= total_ms)
+    {
+        finished = true;
+        return 0.0f;
+    }
+
+    for (const RumbleStep& step : m_waveform.steps)
+    {
+        if (t < step.duration_ms)
+        {
+            const double progress = t / step.duration_ms;
+            const double intensity = step.intensity_start + (step.intensity_end - step.intensity_start) * progress;
+            return static_cast<float>(std::clamp(intensity, 0.0, 1.0));
+        }
+        t -= step.duration_ms;
+    }
+    return 0.0f;
+}
+
+bool RumblePlayer::StepLocked(Clock::time_point now)
+{
+    // Charge the time since the last step to the state the motor was in
+    const double elapsed_ms = std::chrono::duration<double, std::milli>(now - m_last_update).count();
+    m_last_update = now;
+    m_error_ms += (m_intensity - (m_on ? 1.0 : 0.0)) * elapsed_ms;
+
+    bool finished;
+    m_intensity = IntensityAtLocked(now, finished);
+    if (finished)
+        m_active = false;
+
+    // Pick the state for the next slot that brings the accumulated error
+    // closest to zero; full and zero intensity need no modulation
+    bool on;
+    if (m_intensity <= 0.0f)
+        on = false;
+    else if (m_intensity >= 1.0f)
+        on = true;
+    else
+        on = m_error_ms + (m_intensity - 0.5) * m_config.slot.count() > 0.0;
+
+    m_stats.error_ms = -m_error_ms;
+    m_stats.max_error_ms = std::max(m_stats.max_error_ms, std::abs(m_error_ms));
+
+    if (on == m_on)
+        return false;
+    m_on = on;
+    m_stats.toggles++;
+    return true;
+}
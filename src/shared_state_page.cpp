@@ -0,0 +1,142 @@
+#include "shared_state_page.h"
+#include "wiimote_status_cache.h"
+#include "debug_log.h"
+#include <cmath>
+#include <cstring>
+
+SharedStatePage::SharedStatePage()
+    : m_layout(nullptr), m_open_attempted(false), m_published(0)
+{
+}
+
+void SharedStatePage::Publish(int slot, uint64_t bt_address, const WiimoteInputState& input,
+                              const ExtensionState& extension)
+{
+    if (slot < 0 || slot >= MAX_SLOTS)
+        return;
+    Layout* layout = EnsureOpen();
+    if (!layout)
+        return;
+
+    // Built on the stack first so the slot is odd for as short as possible
+    SharedRemoteState state = {};
+    state.bt_address = bt_address;
+    state.timestamp_us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        input.sampled.time_since_epoch()).count());
+    state.report_count = layout->slots[slot].state.report_count + 1;
+    state.buttons = input.buttons;
+    state.connected = 1;
+
+    WiimoteStatus status;
+    if (WiimoteStatusCache::Instance().Get(slot, status))
+    {
+        state.battery_percent = static_cast<uint8_t>(status.battery_percent);
+        state.battery_low = status.battery_low ? 1 : 0;
+    }
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        state.accel_raw[axis] = input.accel[axis];
+        state.accel_g[axis] = input.accel_g[axis];
+    }
+    state.accel_calibrated = input.accel_calibrated ? 1 : 0;
+    if (input.accel_calibrated)
+    {
+        const float* g = input.accel_g;
+        state.pitch = std::atan2(g[1], std::sqrt(g[0] * g[0] + g[2] * g[2]));
+        state.roll = std::atan2(g[0], g[2]);
+    }
+
+    if (input.has_ir)
+    {
+        for (int dot = 0; dot < 4; ++dot)
+        {
+            state.ir_x[dot] = input.ir[dot].x;
+            state.ir_y[dot] = input.ir[dot].y;
+            state.ir_size[dot] = input.ir[dot].size;
+            if (input.ir[dot].valid)
+                state.ir_valid |= static_cast<uint8_t>(1 << dot);
+        }
+    }
+    state.pointer_visible = input.pointer.visible ? 1 : 0;
+    state.pointer_x = input.pointer.x;
+    state.pointer_y = input.pointer.y;
+    state.pointer_roll = input.pointer.roll;
+    state.pointer_distance_m = input.pointer.distance_m;
+
+    state.extension_type = static_cast<uint8_t>(extension.type);
+    state.extension_size = input.extension_size;
+    memcpy(state.extension, input.extension, sizeof(state.extension));
+    state.nunchuk_stick[0] = extension.nunchuk.stick_x;
+    state.nunchuk_stick[1] = extension.nunchuk.stick_y;
+    for (int axis = 0; axis < 3; ++axis)
+        state.nunchuk_accel_g[axis] = extension.nunchuk.accel_g[axis];
+    state.classic_buttons = extension.classic.buttons;
+    for (int sensor = 0; sensor < BALANCE_SENSOR_COUNT; ++sensor)
+        state.balance_kg[sensor] = extension.balance_board.sensor_kg[sensor];
+    state.balance_weight_kg = extension.balance_board.weight_kg;
+    state.balance_center[0] = extension.balance_board.center_x;
+    state.balance_center[1] = extension.balance_board.center_y;
+
+    Write(layout->slots[slot], state);
+    m_published.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SharedStatePage::Clear(int slot)
+{
+    if (slot < 0 || slot >= MAX_SLOTS)
+        return;
+    Layout* layout = m_layout.load(std::memory_order_acquire);
+    if (!layout)
+        return;
+
+    const SharedRemoteState state = {};
+    Write(layout->slots[slot], state);
+}
+
+SharedStatePage::Stats SharedStatePage::GetStats() const
+{
+    Stats stats;
+    stats.published = m_published.load(std::memory_order_relaxed);
+    stats.open = m_layout.load(std::memory_order_acquire) != nullptr;
+    return stats;
+}
+
+SharedStatePage::Layout* SharedStatePage::EnsureOpen()
+{
+    Layout* layout = m_layout.load(std::memory_order_acquire);
+    if (layout)
+        return layout;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    layout = m_layout.load(std::memory_order_relaxed);
+    if (layout || m_open_attempted)
+        return layout;
+    m_open_attempted = true;
+
+    if (!m_region.OpenShared(GetName(), sizeof(Layout), true))
+        return nullptr;
+
+    // The region outlives the bridge while readers hold it open; start from
+    // a clean page either way
+    memset(m_region.GetData(), 0, sizeof(Layout));
+    layout = static_cast<Layout*>(m_region.GetData());
+    layout->header.slot_count = MAX_SLOTS;
+    layout->header.slot_size = sizeof(Slot);
+    layout->header.version = VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    layout->header.magic = MAGIC;
+
+    LOG_INFO("Publishing Wiimote state to shared memory");
+    m_layout.store(layout, std::memory_order_release);
+    return layout;
+}
+
+void SharedStatePage::Write(Slot& slot, const SharedRemoteState& state)
+{
+    const uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.state = state;
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+}
@@ -0,0 +1,197 @@
+#include "speaker_streamer.h"
+#include "debug_log.h"
+#include <algorithm>
+
+SpeakerStreamer::SpeakerStreamer()
+    : m_speakers(), m_count(0), m_input(), m_block(), m_running(false), m_total_jitter_ms(0.0)
+{
+}
+
+SpeakerStreamer::~SpeakerStreamer()
+{
+    m_running = false;
+    m_timer.Cancel();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+bool SpeakerStreamer::Configure(const SpeakerConfig& config)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_count > 0 || config.sample_rate == 0)
+        return false;
+    m_config = config;
+    return true;
+}
+
+SpeakerConfig SpeakerStreamer::GetConfig() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_config;
+}
+
+bool SpeakerStreamer::Add(WiimoteSpeaker* speaker)
+{
+    std::lock_guard<std::mutex> thread_lock(m_thread_mutex);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (std::find(std::begin(m_speakers), std::end(m_speakers), speaker) != std::end(m_speakers))
+            return true;
+
+        auto free_lane = std::find(std::begin(m_speakers), std::end(m_speakers), nullptr);
+        if (free_lane == std::end(m_speakers))
+        {
+            LOG_ERROR("No free speaker stream for another Wiimote");
+            return false;
+        }
+        *free_lane = speaker;
+        m_count++;
+        // A freshly set up speaker decodes from the initial state
+        m_encoder.Reset(static_cast<size_t>(free_lane - std::begin(m_speakers)));
+    }
+
+    if (m_running)
+        return true;
+    if (!m_timer.Open())
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        *std::find(std::begin(m_speakers), std::end(m_speakers), speaker) = nullptr;
+        m_count--;
+        return false;
+    }
+    m_running = true;
+    m_thread = std::thread([this]() { ThreadProc(); });
+    return true;
+}
+
+void SpeakerStreamer::Remove(WiimoteSpeaker* speaker)
+{
+    std::lock_guard<std::mutex> thread_lock(m_thread_mutex);
+    {
+        // Waits for a period in progress, so the speaker is not used after
+        // this returns
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto lane = std::find(std::begin(m_speakers), std::end(m_speakers), speaker);
+        if (lane == std::end(m_speakers))
+            return;
+        *lane = nullptr;
+        if (--m_count > 0)
+            return;
+    }
+
+    m_running = false;
+    m_timer.Cancel();
+    if (m_thread.joinable())
+        m_thread.join();
+    m_timer.Close();
+}
+
+SpeakerStreamer::Stats SpeakerStreamer::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats = m_stats;
+    stats.speakers = m_count;
+    return stats;
+}
+
+SpeakerStreamer::Clock::duration SpeakerStreamer::GetPeriod() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)) *
+           m_config.SamplesPerReport() / m_config.sample_rate;
+}
+
+void SpeakerStreamer::ThreadProc()
+{
+    const Clock::duration period = GetPeriod();
+    Clock::time_point deadline = Clock::now();
+
+    while (m_running)
+    {
+        deadline += period;
+        if (!m_timer.WaitUntil(deadline))
+            break;
+
+        const Clock::time_point now = Clock::now();
+        const double jitter_ms = std::chrono::duration<double, std::milli>(now - deadline).count();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.periods++;
+            m_total_jitter_ms += jitter_ms;
+            m_stats.average_jitter_ms = m_total_jitter_ms / m_stats.periods;
+            m_stats.max_jitter_ms = std::max(m_stats.max_jitter_ms, jitter_ms);
+            // Catching up on missed periods would only send a burst the
+            // remote cannot play any faster
+            if (now - deadline >= period)
+            {
+                m_stats.overruns++;
+                deadline = now;
+            }
+        }
+
+        RunPeriod();
+    }
+}
+
+void SpeakerStreamer::RunPeriod()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    const size_t samples = m_config.SamplesPerReport();
+    size_t lanes = 0;
+    for (size_t lane = 0; lane < MAX_SPEAKERS; ++lane)
+    {
+        if (m_speakers[lane])
+            lanes = lane + 1;
+    }
+    if (lanes == 0)
+        return;
+
+    int16_t* const input = m_input;
+    std::fill(input, input + samples * lanes, static_cast<int16_t>(0));
+    bool active[MAX_SPEAKERS] = {};
+    for (size_t lane = 0; lane < lanes; ++lane)
+    {
+        if (!m_speakers[lane] || !m_speakers[lane]->Pull(m_block, samples))
+            continue;
+        active[lane] = true;
+        for (size_t i = 0; i < samples; ++i)
+            input[i * lanes + lane] = m_block[i];
+    }
+
+    uint8_t data[MAX_SPEAKERS][WiimoteProtocol::SPEAKER_DATA_BYTES] = {};
+    if (m_config.format == SpeakerFormat::Adpcm)
+    {
+        AdpcmEncoder::LaneState idle[MAX_SPEAKERS];
+        uint8_t* outputs[MAX_SPEAKERS];
+        for (size_t lane = 0; lane < lanes; ++lane)
+        {
+            idle[lane] = m_encoder.GetState(lane);
+            outputs[lane] = data[lane];
+        }
+
+        m_encoder.Encode(input, lanes, samples, outputs);
+
+        // Nothing is sent for idle lanes, so the remote's decoder has not
+        // moved either
+        for (size_t lane = 0; lane < lanes; ++lane)
+        {
+            if (!active[lane])
+                m_encoder.SetState(lane, idle[lane]);
+        }
+    }
+    else
+    {
+        for (size_t lane = 0; lane < lanes; ++lane)
+        {
+            for (size_t i = 0; i < samples; ++i)
+                data[lane][i] = static_cast<uint8_t>(input[i * lanes + lane] >> 8);
+        }
+    }
+
+    for (size_t lane = 0; lane < lanes; ++lane)
+    {
+        if (active[lane] && m_speakers[lane]->SendData(data[lane], WiimoteProtocol::SPEAKER_DATA_BYTES, samples))
+            m_stats.reports++;
+    }
+}
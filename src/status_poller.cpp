@@ -0,0 +1,130 @@
+#include "status_poller.h"
+#include "debug_log.h"
+#include <algorithm>
+#include <cstdlib>
+
+using namespace std::chrono_literals;
+
+// Poll interval bounds. Remotes start at the minimum and double up to the
+// maximum while the battery level stays put.
+constexpr auto MIN_POLL_INTERVAL = std::chrono::duration_cast<StatusPoller::Clock::duration>(30s);
+constexpr auto MAX_POLL_INTERVAL = std::chrono::duration_cast<StatusPoller::Clock::duration>(5min);
+// Readings in a row with a steady battery before the interval is doubled
+constexpr int STEADY_READINGS_BEFORE_BACKOFF = 2;
+// Battery byte change still considered steady
+constexpr int STEADY_BATTERY_DELTA = 2;
+// Minimum gap between status requests to any two remotes
+constexpr auto REQUEST_SPACING = std::chrono::duration_cast<StatusPoller::Clock::duration>(250ms);
+// How long a request may go unanswered before it is sent again
+constexpr auto REPLY_TIMEOUT = std::chrono::duration_cast<StatusPoller::Clock::duration>(2s);
+// Random spread applied to every interval, in percent
+constexpr int JITTER_PERCENT = 20;
+
+StatusPoller::StatusPoller()
+    : m_random(static_cast<unsigned>(Clock::now().time_since_epoch().count()))
+{
+}
+
+StatusPoller::Clock::duration StatusPoller::Jitter(Clock::duration interval)
+{
+    const auto spread = interval.count() * JITTER_PERCENT / 100;
+    if (spread <= 0)
+        return Clock::duration::zero();
+    std::uniform_int_distribution<Clock::rep> distribution(-spread, spread);
+    return Clock::duration(distribution(m_random));
+}
+
+void StatusPoller::AddDevice(int slot, Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // The device requests status itself when it opens, so the first poll is
+    // a full interval away. Slots are staggered so remotes connected
+    // together do not stay in step.
+    Entry entry;
+    entry.interval = MIN_POLL_INTERVAL;
+    entry.next_poll = now + MIN_POLL_INTERVAL + REQUEST_SPACING * slot + Jitter(MIN_POLL_INTERVAL);
+    m_entries[slot] = entry;
+}
+
+void StatusPoller::RemoveDevice(int slot)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.erase(slot);
+}
+
+bool StatusPoller::ShouldPoll(int slot, Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_entries.find(slot);
+    if (it == m_entries.end())
+        return false;
+
+    Entry& entry = it->second;
+    if (now < entry.next_poll)
+        return false;
+
+    if (entry.request_pending)
+    {
+        ++m_stats.timeouts;
+        entry.request_pending = false;
+    }
+
+    // Another remote was polled moments ago; take the next free gap
+    if (now - m_last_request < REQUEST_SPACING)
+    {
+        entry.next_poll = m_last_request + REQUEST_SPACING + Jitter(REQUEST_SPACING);
+        ++m_stats.deferred;
+        return false;
+    }
+
+    m_last_request = now;
+    entry.request_pending = true;
+    entry.request_time = now;
+    entry.next_poll = now + REPLY_TIMEOUT;
+    ++m_stats.requests;
+    return true;
+}
+
+void StatusPoller::HandleStatus(int slot, uint8_t battery, bool battery_low, Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_entries.find(slot);
+    if (it == m_entries.end())
+        return;
+
+    Entry& entry = it->second;
+    if (entry.request_pending)
+        ++m_stats.replies;
+    else
+        ++m_stats.unsolicited;
+    entry.request_pending = false;
+
+    const bool steady = entry.last_battery >= 0 && !battery_low &&
+                        std::abs(battery - entry.last_battery) <= STEADY_BATTERY_DELTA;
+    if (!steady)
+    {
+        entry.steady_readings = 0;
+        entry.interval = MIN_POLL_INTERVAL;
+    }
+    else if (++entry.steady_readings >= STEADY_READINGS_BEFORE_BACKOFF)
+    {
+        entry.steady_readings = 0;
+        entry.interval = std::min(entry.interval * 2, MAX_POLL_INTERVAL);
+    }
+
+    if (battery_low && !entry.battery_low)
+        LOG_NOTICE(LogFormat("Wiimote in slot %d reports low battery", slot));
+
+    entry.last_battery = battery;
+    entry.battery_low = battery_low;
+    entry.next_poll = now + entry.interval + Jitter(entry.interval);
+}
+
+StatusPoller::Stats StatusPoller::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
@@ -3,6 +3,7 @@
 #include "toast_notification.h"
 #include "wiimote_manager.h"
 #include "wiimote_led_setter.h"
+#include "wiimote_status_cache.h"
 #include <sstream>
 
 #pragma comment(lib, "shell32.lib")
@@ -138,7 +139,18 @@ HMENU SystemTray::BuildDevicesSubmenu()
     AppendMenuW(deviceMenu, MFT_STRING, ID_DISCONNECT_BASE + i, L"Disconnect");
     AppendMenuW(deviceMenu, MFT_STRING, ID_FORGET_BASE + i, L"Forget");
     
-    AppendMenuW(submenu, MF_POPUP, (UINT_PTR)deviceMenu, devices[i].device_name.c_str());
+    std::wstring label = devices[i].device_name;
+    WiimoteStatus status;
+    if (devices[i].has_bt_address &&
+        WiimoteStatusCache::Instance().FindByAddress(devices[i].bt_address.ullLong, status))
+    {
+      label += L" (Battery " + std::to_wstring(status.battery_percent) + L"%";
+      if (status.battery_low)
+        label += L", low";
+      label += L")";
+    }
+
+    AppendMenuW(submenu, MF_POPUP, (UINT_PTR)deviceMenu, label.c_str());
   }
 
   return submenu;
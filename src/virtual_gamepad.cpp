@@ -0,0 +1,307 @@
+#include "virtual_gamepad.h"
+#include "wiimote_device_registry.h"
+#include "debug_log.h"
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+#endif
+
+// evdev event types and codes, from linux/input-event-codes.h; repeated here
+// so the events are also built for the null sink elsewhere
+constexpr uint16_t EVENT_SYN = 0x00;
+constexpr uint16_t EVENT_KEY = 0x01;
+constexpr uint16_t EVENT_ABS = 0x03;
+constexpr uint16_t CODE_SYN_REPORT = 0x00;
+
+constexpr uint16_t CODE_BTN_SOUTH = 0x130;
+constexpr uint16_t CODE_BTN_EAST = 0x131;
+constexpr uint16_t CODE_BTN_NORTH = 0x133;
+constexpr uint16_t CODE_BTN_WEST = 0x134;
+constexpr uint16_t CODE_BTN_TL = 0x136;
+constexpr uint16_t CODE_BTN_TR = 0x137;
+constexpr uint16_t CODE_BTN_TL2 = 0x138;
+constexpr uint16_t CODE_BTN_TR2 = 0x139;
+constexpr uint16_t CODE_BTN_SELECT = 0x13A;
+constexpr uint16_t CODE_BTN_START = 0x13B;
+constexpr uint16_t CODE_BTN_MODE = 0x13C;
+constexpr uint16_t CODE_BTN_THUMBL = 0x13D;
+constexpr uint16_t CODE_BTN_THUMBR = 0x13E;
+constexpr uint16_t CODE_BTN_DPAD_UP = 0x220;
+constexpr uint16_t CODE_BTN_DPAD_DOWN = 0x221;
+constexpr uint16_t CODE_BTN_DPAD_LEFT = 0x222;
+constexpr uint16_t CODE_BTN_DPAD_RIGHT = 0x223;
+
+constexpr uint16_t CODE_ABS_X = 0x00;
+constexpr uint16_t CODE_ABS_Y = 0x01;
+constexpr uint16_t CODE_ABS_Z = 0x02;
+constexpr uint16_t CODE_ABS_RX = 0x03;
+constexpr uint16_t CODE_ABS_RY = 0x04;
+constexpr uint16_t CODE_ABS_RZ = 0x05;
+
+constexpr int32_t AXIS_MAX = 255;
+
+// Indexed by the bit of the GamepadButton; face buttons by position
+static const uint16_t KEY_MAP[VirtualGamepad::KEY_COUNT] = {
+    CODE_BTN_SOUTH, CODE_BTN_EAST, CODE_BTN_WEST, CODE_BTN_NORTH,
+    CODE_BTN_SELECT, CODE_BTN_START, CODE_BTN_MODE,
+    CODE_BTN_DPAD_UP, CODE_BTN_DPAD_DOWN, CODE_BTN_DPAD_LEFT, CODE_BTN_DPAD_RIGHT,
+    CODE_BTN_TL, CODE_BTN_TR, CODE_BTN_TL2, CODE_BTN_TR2, CODE_BTN_THUMBL, CODE_BTN_THUMBR
+};
+
+// Indexed by GamepadAxis
+static const uint16_t AXIS_MAP[VirtualGamepad::AXIS_COUNT] = {
+    CODE_ABS_X, CODE_ABS_Y, CODE_ABS_RX, CODE_ABS_RY, CODE_ABS_Z, CODE_ABS_RZ
+};
+
+struct GamepadEvent
+{
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+VirtualGamepad::VirtualGamepad(int slot)
+    : m_slot(slot), m_fd(-1), m_first(true), m_keys(), m_axes()
+{
+}
+
+VirtualGamepad::~VirtualGamepad()
+{
+#ifndef _WIN32
+    if (m_fd >= 0)
+    {
+        ioctl(m_fd, UI_DEV_DESTROY);
+        close(m_fd);
+    }
+#endif
+}
+
+bool VirtualGamepad::Open()
+{
+#ifdef _WIN32
+    return false;
+#else
+    const int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (fd < 0)
+    {
+        LOG_INFO(LogFormat("No uinput for the Wiimote in slot %d, using a null sink", m_slot));
+        return false;
+    }
+
+    bool ok = ioctl(fd, UI_SET_EVBIT, EV_KEY) == 0 && ioctl(fd, UI_SET_EVBIT, EV_ABS) == 0;
+    for (uint16_t key : KEY_MAP)
+        ok = ok && ioctl(fd, UI_SET_KEYBIT, key) == 0;
+    for (uint16_t axis : AXIS_MAP)
+    {
+        uinput_abs_setup setup = {};
+        setup.code = axis;
+        setup.absinfo.minimum = 0;
+        setup.absinfo.maximum = AXIS_MAX;
+        setup.absinfo.flat = 4;
+        setup.absinfo.value = axis == CODE_ABS_Z || axis == CODE_ABS_RZ ? 0 : AXIS_MAX / 2 + 1;
+        ok = ok && ioctl(fd, UI_SET_ABSBIT, axis) == 0 && ioctl(fd, UI_ABS_SETUP, &setup) == 0;
+    }
+
+    uinput_setup setup = {};
+    setup.id.bustype = BUS_BLUETOOTH;
+    setup.id.vendor = 0x057E;
+    setup.id.product = 0x0306;
+    snprintf(setup.name, sizeof(setup.name), "Wii Remote %d (WiimoteBridge)", m_slot + 1);
+    ok = ok && ioctl(fd, UI_DEV_SETUP, &setup) == 0 && ioctl(fd, UI_DEV_CREATE) == 0;
+    if (!ok)
+    {
+        LOG_ERROR(LogFormat("Failed to create uinput gamepad for the Wiimote in slot %d", m_slot));
+        close(fd);
+        return false;
+    }
+
+    m_fd = fd;
+    LOG_INFO(LogFormat("Created uinput gamepad for the Wiimote in slot %d", m_slot));
+    return true;
+#endif
+}
+
+int VirtualGamepad::Emit(const GamepadState& state)
+{
+    bool keys[KEY_COUNT];
+    for (size_t i = 0; i < KEY_COUNT; ++i)
+        keys[i] = (state.buttons >> i) & 1;
+
+    // Sticks from -1 to 1 onto 0 - 255, with evdev's Y axes growing
+    // downwards; triggers from 0 to 1
+    int32_t axes[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+    {
+        const float value = i == GAMEPAD_AXIS_LEFT_Y || i == GAMEPAD_AXIS_RIGHT_Y ? -state.axes[i] : state.axes[i];
+        axes[i] = i >= GAMEPAD_AXIS_LEFT_TRIGGER
+            ? static_cast<int32_t>(value * AXIS_MAX + 0.5f)
+            : static_cast<int32_t>((value + 1.0f) * 0.5f * AXIS_MAX + 0.5f);
+    }
+
+    // Only what changed, then one SYN_REPORT, all in one write
+    GamepadEvent events[KEY_COUNT + AXIS_COUNT + 1];
+    size_t count = 0;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < KEY_COUNT; ++i)
+    {
+        if (m_first || keys[i] != m_keys[i])
+            events[count++] = { EVENT_KEY, KEY_MAP[i], keys[i] ? 1 : 0 };
+        m_keys[i] = keys[i];
+    }
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+    {
+        if (m_first || axes[i] != m_axes[i])
+            events[count++] = { EVENT_ABS, AXIS_MAP[i], axes[i] };
+        m_axes[i] = axes[i];
+    }
+    m_first = false;
+    if (count == 0)
+        return 0;
+    events[count++] = { EVENT_SYN, CODE_SYN_REPORT, 0 };
+
+#ifndef _WIN32
+    if (m_fd >= 0)
+    {
+        input_event buffer[KEY_COUNT + AXIS_COUNT + 1] = {};
+        for (size_t i = 0; i < count; ++i)
+        {
+            buffer[i].type = events[i].type;
+            buffer[i].code = events[i].code;
+            buffer[i].value = events[i].value;
+        }
+        const ssize_t size = static_cast<ssize_t>(sizeof(input_event) * count);
+        if (write(m_fd, buffer, static_cast<size_t>(size)) != size)
+            return -1;
+    }
+#endif
+    return static_cast<int>(count - 1);
+}
+
+VirtualGamepadBackend::VirtualGamepadBackend()
+    : m_running(false), m_subscription(0), m_total_latency_us(0.0), m_total_sample_age_us(0.0)
+{
+}
+
+bool VirtualGamepadBackend::Start()
+{
+#ifdef _WIN32
+    return false;
+#else
+    if (access("/dev/uinput", W_OK) != 0)
+    {
+        LOG_INFO("No writable /dev/uinput, virtual gamepads are off");
+        return false;
+    }
+    if (m_running.exchange(true))
+        return true;
+    // The remotes report what the profiles read, e.g. IR for the pointer,
+    // and follow the profiles when they are reloaded
+    std::lock_guard<std::mutex> lock(m_subscription_mutex);
+    m_subscription = WiimoteDeviceRegistry::Instance().Subscribe(
+        InputRemapper::Instance().GetFeatures(),
+        [this](WiimoteDevice& device, const WiimoteInputState& input, const ExtensionState& extension) {
+            HandleInput(device.GetSlot(), device.GetBluetoothAddress(), input, extension);
+        });
+    InputRemapper::Instance().SetChangedCallback([this]() {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        if (m_running)
+            WiimoteDeviceRegistry::Instance().SetFeatures(m_subscription, InputRemapper::Instance().GetFeatures());
+    });
+    return true;
+#endif
+}
+
+void VirtualGamepadBackend::Stop()
+{
+    if (!m_running.exchange(false))
+        return;
+    InputRemapper::Instance().SetChangedCallback(nullptr);
+    {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        WiimoteDeviceRegistry::Instance().Unsubscribe(m_subscription);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& gamepad : m_gamepads)
+        gamepad.reset();
+}
+
+void VirtualGamepadBackend::HandleInput(int slot, uint64_t bt_address, const WiimoteInputState& input,
+                                        const ExtensionState& extension)
+{
+    if (slot < 0 || slot >= MAX_SLOTS || !m_running)
+        return;
+
+    std::shared_ptr<VirtualGamepad> gamepad;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        gamepad = m_gamepads[slot];
+    }
+    if (!gamepad)
+    {
+        // Created outside the lock; uinput device creation takes a while
+        auto created = std::make_shared<VirtualGamepad>(slot);
+        const bool uinput = created->Open();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_gamepads[slot])
+        {
+            m_gamepads[slot] = created;
+            (uinput ? m_stats.uinput_devices : m_stats.null_devices)++;
+        }
+        gamepad = m_gamepads[slot];
+    }
+
+    GamepadState state;
+    InputRemapper::Instance().Remap(slot, bt_address, input, extension, state);
+    const int events = gamepad->Emit(state);
+    const Clock::time_point written = Clock::now();
+    const double latency_us = std::chrono::duration<double, std::micro>(written - input.received).count();
+    const double sample_age_us = std::chrono::duration<double, std::micro>(written - input.sampled).count();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.reports++;
+    if (events < 0)
+    {
+        m_stats.write_errors++;
+        return;
+    }
+    if (events == 0)
+        return;
+    m_stats.events += static_cast<uint64_t>(events);
+    m_stats.writes++;
+    m_total_latency_us += latency_us;
+    m_stats.average_latency_us = m_total_latency_us / m_stats.writes;
+    if (latency_us > m_stats.max_latency_us)
+        m_stats.max_latency_us = latency_us;
+    m_total_sample_age_us += sample_age_us;
+    m_stats.average_sample_age_us = m_total_sample_age_us / m_stats.writes;
+    if (sample_age_us > m_stats.max_sample_age_us)
+        m_stats.max_sample_age_us = sample_age_us;
+}
+
+void VirtualGamepadBackend::Remove(int slot)
+{
+    if (slot < 0 || slot >= MAX_SLOTS)
+        return;
+
+    std::shared_ptr<VirtualGamepad> gamepad;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        gamepad.swap(m_gamepads[slot]);
+        if (gamepad)
+            (gamepad->IsUinput() ? m_stats.uinput_devices : m_stats.null_devices)--;
+    }
+    // The uinput device is destroyed once the last report using it is done
+}
+
+VirtualGamepadBackend::Stats VirtualGamepadBackend::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
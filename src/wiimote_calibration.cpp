@@ -0,0 +1,280 @@
+#include "wiimote_calibration.h"
+#include "calibration_cache.h"
+#include "debug_log.h"
+#include <algorithm>
+
+using namespace WiimoteProtocol;
+
+// Accelerometer calibration in EEPROM, with its checksum in the last byte
+constexpr uint32_t ACCEL_CALIBRATION_ADDRESS = 0x0016;
+constexpr uint8_t ACCEL_CALIBRATION_SIZE = 10;
+
+AccelCalibration AccelCalibration::Parse(const uint8_t* block)
+{
+    AccelCalibration calibration;
+    calibration.zero[0] = static_cast<uint16_t>((block[0] << 2) | ((block[3] >> 4) & 0x03));
+    calibration.zero[1] = static_cast<uint16_t>((block[1] << 2) | ((block[3] >> 2) & 0x03));
+    calibration.zero[2] = static_cast<uint16_t>((block[2] << 2) | (block[3] & 0x03));
+    calibration.one_g[0] = static_cast<uint16_t>((block[4] << 2) | ((block[7] >> 4) & 0x03));
+    calibration.one_g[1] = static_cast<uint16_t>((block[5] << 2) | ((block[7] >> 2) & 0x03));
+    calibration.one_g[2] = static_cast<uint16_t>((block[6] << 2) | (block[7] & 0x03));
+    calibration.valid = calibration.one_g[0] != calibration.zero[0] &&
+                        calibration.one_g[1] != calibration.zero[1] &&
+                        calibration.one_g[2] != calibration.zero[2];
+    return calibration;
+}
+
+void AccelCalibration::Apply(const uint16_t raw[3], float out_g[3]) const
+{
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const float range = static_cast<float>(one_g[axis]) - static_cast<float>(zero[axis]);
+        out_g[axis] = range != 0.0f ? (static_cast<float>(raw[axis]) - zero[axis]) / range : 0.0f;
+    }
+}
+
+// The Balance Board block starts with four bytes before the sensor points
+constexpr size_t BALANCE_POINTS_OFFSET = 4;
+// Below this the center of balance is noise
+constexpr float BALANCE_MIN_WEIGHT_KG = 1.0f;
+
+BalanceBoardCalibration BalanceBoardCalibration::Parse(const uint8_t* block)
+{
+    BalanceBoardCalibration calibration;
+    const uint8_t* points = block + BALANCE_POINTS_OFFSET;
+    calibration.valid = true;
+    for (int sensor = 0; sensor < BALANCE_SENSOR_COUNT; ++sensor)
+    {
+        for (int point = 0; point < POINT_COUNT; ++point)
+        {
+            const uint8_t* value = points + (point * BALANCE_SENSOR_COUNT + sensor) * 2;
+            calibration.points[point][sensor] = static_cast<uint16_t>((value[0] << 8) | value[1]);
+        }
+        calibration.valid = calibration.valid &&
+                            calibration.points[0][sensor] < calibration.points[1][sensor] &&
+                            calibration.points[1][sensor] < calibration.points[2][sensor];
+        if (!calibration.valid)
+            continue;
+        for (int segment = 0; segment < POINT_COUNT - 1; ++segment)
+        {
+            calibration.kg_per_count[segment][sensor] =
+                POINT_SPACING_KG / (calibration.points[segment + 1][sensor] - calibration.points[segment][sensor]);
+        }
+    }
+    return calibration;
+}
+
+void BalanceBoardCalibration::Apply(BalanceBoardState& state) const
+{
+    // All four sensors go through the same arithmetic, so the compiler does
+    // the interpolation as one vector operation instead of four branches on
+    // which segment each reading falls in. The segment is picked by
+    // weighting both with 0 or 1; a choice between them is kept as a branch,
+    // which a board at rest near 17 kg per sensor mispredicts half the time.
+    float kg[BALANCE_SENSOR_COUNT];
+    for (int sensor = 0; sensor < BALANCE_SENSOR_COUNT; ++sensor)
+    {
+        const float raw = state.sensors[sensor];
+        const float p0 = points[0][sensor];
+        const float p17 = points[1][sensor];
+        const float upper = static_cast<float>(raw >= p17);
+        const float base = p0 + upper * (p17 - p0);
+        const float scale = kg_per_count[0][sensor] + upper * (kg_per_count[1][sensor] - kg_per_count[0][sensor]);
+        kg[sensor] = std::max(0.0f, upper * POINT_SPACING_KG + (raw - base) * scale);
+    }
+
+    const float right = kg[BALANCE_TOP_RIGHT] + kg[BALANCE_BOTTOM_RIGHT];
+    const float left = kg[BALANCE_TOP_LEFT] + kg[BALANCE_BOTTOM_LEFT];
+    const float top = kg[BALANCE_TOP_RIGHT] + kg[BALANCE_TOP_LEFT];
+    const float bottom = kg[BALANCE_BOTTOM_RIGHT] + kg[BALANCE_BOTTOM_LEFT];
+    const float weight = right + left;
+
+    std::copy(kg, kg + BALANCE_SENSOR_COUNT, state.sensor_kg);
+    state.weight_kg = weight;
+    state.center_x = weight >= BALANCE_MIN_WEIGHT_KG ? (right - left) / weight : 0.0f;
+    state.center_y = weight >= BALANCE_MIN_WEIGHT_KG ? (top - bottom) / weight : 0.0f;
+    state.calibrated = true;
+}
+
+static bool IsAccelBlockValid(const std::vector<uint8_t>& block)
+{
+    if (block.size() < ACCEL_CALIBRATION_SIZE)
+        return false;
+    uint8_t sum = 0x55;
+    for (int i = 0; i < 9; ++i)
+        sum = static_cast<uint8_t>(sum + block[i]);
+    return sum == block[9];
+}
+
+static uint8_t GetExtensionCalibrationSize(ExtensionType type)
+{
+    switch (type)
+    {
+    case ExtensionType::None:
+    case ExtensionType::Unknown:
+        return 0;
+    case ExtensionType::BalanceBoard:
+    case ExtensionType::MotionPlus:
+        return 32;
+    default:
+        return 16;
+    }
+}
+
+WiimoteCalibration::WiimoteCalibration(WiimoteRegisterEngine& registers, uint64_t cache_key, int slot)
+    : m_registers(registers), m_cache_key(cache_key), m_slot(slot), m_extension_generation(0),
+      m_from_cache(false), m_latency_recorded(false)
+{
+}
+
+void WiimoteCalibration::Load(Clock::time_point connect_time)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_connect_time = connect_time;
+        m_from_cache = false;
+        m_latency_recorded = false;
+        m_accel = AccelCalibration();
+    }
+
+    LoadBlock(CalibrationCache::CORE_CALIBRATION, ADDRESS_SPACE_EEPROM, ACCEL_CALIBRATION_ADDRESS,
+              ACCEL_CALIBRATION_SIZE, 1, [this](const std::vector<uint8_t>& block) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_accel = AccelCalibration::Parse(block.data());
+    });
+}
+
+void WiimoteCalibration::LoadExtension(ExtensionType type, uint64_t extension_id)
+{
+    uint32_t generation;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        generation = ++m_extension_generation;
+        m_extension_block.clear();
+        m_nunchuk_accel = AccelCalibration();
+        m_balance_board = BalanceBoardCalibration();
+    }
+
+    const uint8_t size = GetExtensionCalibrationSize(type);
+    if (size == 0)
+        return;
+
+    // Extension blocks end in two checksum bytes
+    LoadBlock(extension_id, ADDRESS_SPACE_REGISTER, EXTENSION_CALIBRATION, size, 2,
+        [this, type, generation](const std::vector<uint8_t>& block) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (generation != m_extension_generation)
+                return;
+            m_extension_block = block;
+            if (type == ExtensionType::Nunchuk)
+                m_nunchuk_accel = AccelCalibration::Parse(block.data());
+            else if (type == ExtensionType::BalanceBoard)
+                m_balance_board = BalanceBoardCalibration::Parse(block.data());
+        });
+}
+
+void WiimoteCalibration::LoadBlock(uint64_t extension_id, uint8_t address_space, uint32_t address,
+                                   uint8_t size, uint8_t check_bytes, ApplyFunction apply)
+{
+    std::vector<uint8_t> cached;
+    if (!CalibrationCache::Instance().Lookup(m_cache_key, extension_id, cached) || cached.size() != size)
+    {
+        ReadFullBlock(extension_id, address_space, address, size, apply);
+        return;
+    }
+
+    if (extension_id == CalibrationCache::CORE_CALIBRATION)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_from_cache = true;
+    }
+    apply(cached);
+
+    // Confirm the cached copy by reading only its checksum bytes
+    const uint32_t check_address = address + size - check_bytes;
+    m_registers.Read(address_space, check_address, check_bytes,
+        [this, extension_id, address_space, address, size, check_bytes, cached, apply](
+            const RegisterReadResult& result) {
+            if (result.status != RegisterStatus::Ok)
+                return;
+            if (std::equal(result.data.begin(), result.data.end(), cached.end() - check_bytes))
+                return;
+
+            LOG_INFO(LogFormat("Cached calibration for Wiimote in slot %d is stale, reloading", m_slot));
+            if (extension_id == CalibrationCache::CORE_CALIBRATION)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_from_cache = false;
+            }
+            CalibrationCache::Instance().RecordStale();
+            CalibrationCache::Instance().Invalidate(m_cache_key, extension_id);
+            ReadFullBlock(extension_id, address_space, address, size, apply);
+        });
+}
+
+void WiimoteCalibration::ReadFullBlock(uint64_t extension_id, uint8_t address_space, uint32_t address,
+                                       uint8_t size, ApplyFunction apply)
+{
+    m_registers.Read(address_space, address, size,
+        [this, extension_id, apply](const RegisterReadResult& result) {
+            if (result.status != RegisterStatus::Ok)
+            {
+                LOG_ERROR(LogFormat("Failed to read calibration from Wiimote in slot %d", m_slot));
+                return;
+            }
+            if (extension_id == CalibrationCache::CORE_CALIBRATION && !IsAccelBlockValid(result.data))
+            {
+                LOG_ERROR(LogFormat("Accelerometer calibration of Wiimote in slot %d has a bad checksum", m_slot));
+                return;
+            }
+
+            apply(result.data);
+            CalibrationCache::Instance().Store(m_cache_key, extension_id, result.data.data(), result.data.size());
+        });
+}
+
+bool WiimoteCalibration::GetAccel(AccelCalibration& calibration) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    calibration = m_accel;
+    return calibration.valid;
+}
+
+bool WiimoteCalibration::GetNunchukAccel(AccelCalibration& calibration) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    calibration = m_nunchuk_accel;
+    return calibration.valid;
+}
+
+bool WiimoteCalibration::GetBalanceBoard(BalanceBoardCalibration& calibration) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    calibration = m_balance_board;
+    return calibration.valid;
+}
+
+bool WiimoteCalibration::GetExtensionBlock(std::vector<uint8_t>& block) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    block = m_extension_block;
+    return !block.empty();
+}
+
+void WiimoteCalibration::NoteCalibratedSample(Clock::time_point now)
+{
+    bool from_cache;
+    double latency;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_latency_recorded)
+            return;
+        m_latency_recorded = true;
+        from_cache = m_from_cache;
+        latency = std::chrono::duration<double, std::milli>(now - m_connect_time).count();
+    }
+
+    CalibrationCache::Instance().RecordLatency(from_cache, latency);
+    LOG_NOTICE(LogFormat("First calibrated sample from Wiimote in slot %d after %.1f ms (%s)",
+                         m_slot, latency, from_cache ? "cached calibration" : "read from EEPROM"));
+}
@@ -0,0 +1,452 @@
+#include "wiimote_device.h"
+#include "calibration_cache.h"
+#include "status_poller.h"
+#include "wiimote_status_cache.h"
+#include "io_reactor.h"
+#include "led_animator.h"
+#include "debug_log.h"
+#include <vector>
+#include <chrono>
+
+#ifdef _WIN32
+#include <hidsdi.h>
+#pragma comment(lib, "Hid.lib")
+static const HidWriter::NativeHandle NO_HANDLE = INVALID_HANDLE_VALUE;
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+constexpr HidWriter::NativeHandle NO_HANDLE = -1;
+#endif
+
+// Period of the reactor timer that services register, extension and output timers
+constexpr int IO_TICK_MS = 10;
+// Longest Close waits for the rumble-off to be written
+constexpr int CLOSE_WRITE_TIMEOUT_MS = 100;
+
+static void CloseNativeHandle(HidWriter::NativeHandle handle)
+{
+#ifdef _WIN32
+    CloseHandle(handle);
+#else
+    close(handle);
+#endif
+}
+
+WiimoteDevice::WiimoteDevice(const std::wstring& device_path, const std::wstring& device_name,
+                             uint64_t bt_address, int slot)
+    : m_device_path(device_path), m_device_name(device_name), m_bt_address(bt_address),
+      m_slot(slot), m_handle(NO_HANDLE), m_reactor_id(-1), m_tick_timer_id(-1),
+      m_drain_timer_id(-1),
+      m_input_report_size(WiimoteProtocol::MAX_REPORT_SIZE),
+      m_output_report_size(WiimoteProtocol::MAX_REPORT_SIZE),
+      m_connected(false), m_battery_low(false),
+      m_output([this](const uint8_t* report, size_t size) { return WriteToDevice(report, size); }),
+      m_rumble([this](bool on, RumblePlayer::Clock::duration slack) { m_output.SetRumble(on, slack); }),
+      m_reporting_mode(WiimoteProtocol::INPUT_CORE), m_continuous_reporting(false),
+      m_ir_mode(IrMode::Off),
+      m_registers([this](const uint8_t* report, size_t size) { return WriteReport(report, size); }),
+      m_extension(m_registers, slot),
+      m_calibration(m_registers, CalibrationCache::KeyFor(bt_address, device_path), slot),
+      m_speaker(m_registers, [this](const uint8_t* report, size_t size) { return WriteReport(report, size); },
+                [this](const uint8_t* report, size_t size) { return m_connected && m_output.SendNow(report, size); })
+{
+    m_extension.SetChangedCallback([this](ExtensionType type) { HandleExtensionChanged(type); });
+    m_output.SetWakeFunction([this](OutputScheduler::Clock::time_point when) {
+        IoReactor::Instance().ArmTimer(m_drain_timer_id, when);
+    });
+}
+
+WiimoteDevice::~WiimoteDevice()
+{
+    Close();
+}
+
+bool WiimoteDevice::Open()
+{
+    if (m_reactor_id >= 0)
+        return true;
+
+#ifdef _WIN32
+    m_handle = CreateFileW(
+        m_device_path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+
+    if (m_handle == INVALID_HANDLE_VALUE)
+    {
+        LOG_ERROR(LogFormat("Failed to open Wiimote HID device, error: %lu", GetLastError()));
+        return false;
+    }
+
+    PHIDP_PREPARSED_DATA preparsed = nullptr;
+    if (HidD_GetPreparsedData(m_handle, &preparsed))
+    {
+        HIDP_CAPS caps;
+        if (HidP_GetCaps(preparsed, &caps) == HIDP_STATUS_SUCCESS)
+        {
+            if (caps.InputReportByteLength > 0)
+                m_input_report_size = caps.InputReportByteLength;
+            if (caps.OutputReportByteLength > 0)
+                m_output_report_size = caps.OutputReportByteLength;
+        }
+        HidD_FreePreparsedData(preparsed);
+    }
+#else
+    // A hidraw node; its reports carry no padding, so both sizes stay at
+    // the largest Wiimote report
+    const std::string path(m_device_path.begin(), m_device_path.end());
+    m_handle = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (m_handle == NO_HANDLE)
+    {
+        LOG_ERROR(LogFormat("Failed to open Wiimote HID device %s, error: %d", path.c_str(), errno));
+        return false;
+    }
+#endif
+
+    // Find out whether this stack takes output reports through WriteFile or
+    // HidD_SetOutputReport. Rumble off is safe to send repeatedly.
+    m_writer.Attach(m_handle, m_output_report_size);
+    const uint8_t probe[2] = { WiimoteProtocol::OUTPUT_RUMBLE, 0x00 };
+    if (!m_writer.Probe(probe, sizeof(probe)))
+        LOG_ERROR(LogFormat("Wiimote in slot %d accepted no output report during the probe", m_slot));
+
+    const auto connect_time = std::chrono::steady_clock::now();
+    m_connected = true;
+    // Before the reactor can deliver a report, which would otherwise be
+    // timed against the last connection's clock and then reset under it
+    m_report_clock.Reset();
+
+    // From here on the reactor owns the handle and reads from it
+    IoReactor& reactor = IoReactor::Instance();
+    m_reactor_id = reactor.Register(m_handle, m_input_report_size,
+        [this](const uint8_t* report, size_t size) { HandleInputReport(report, size); },
+        [this](unsigned long error) {
+            LOG_ERROR(LogFormat("Wiimote in slot %d disconnected, error: %lu", m_slot, error));
+            m_connected = false;
+        });
+    if (m_reactor_id < 0)
+    {
+        m_connected = false;
+        m_writer.Detach();
+        CloseNativeHandle(m_handle);
+        m_handle = NO_HANDLE;
+        return false;
+    }
+
+    m_writer.SetAsyncWrite([this](const uint8_t* report, size_t size, HidWriter::WriteCompletion completion) {
+        return IoReactor::Instance().Write(m_reactor_id, report, size, std::move(completion));
+    });
+    m_tick_timer_id = reactor.AddTimer(std::chrono::milliseconds(IO_TICK_MS),
+                                       [this](std::chrono::steady_clock::time_point) { Tick(); });
+    // Output is paced by its own deadlines, not the tick
+    m_drain_timer_id = reactor.AddTimer(std::chrono::steady_clock::duration::zero(),
+                                        [this](std::chrono::steady_clock::time_point) { m_output.Drain(); });
+
+    // The status reply tells us whether an extension is already plugged in
+    // and triggers the first reporting mode update.
+    StatusPoller::Instance().AddDevice(m_slot, connect_time);
+    RequestStatus();
+    m_calibration.Load(connect_time);
+
+    LOG_INFO(LogFormat("Opened Wiimote in slot %d", m_slot));
+    return true;
+}
+
+void WiimoteDevice::Close()
+{
+    // Leave the motor and speaker off rather than running until the remote
+    // is switched off
+    if (m_connected)
+    {
+        m_rumble.Stop();
+        m_speaker.Disable();
+        // The scheduler may hold the rumble-off back behind the rate cap or
+        // an ack, and Clear drops what it still holds, or a report built
+        // before Stop can overtake it. This one goes out after everything
+        // already written, and nothing is written after it.
+        const uint8_t rumble_off[2] = { WiimoteProtocol::OUTPUT_RUMBLE, 0x00 };
+        if (!m_writer.WriteFinal(rumble_off, sizeof(rumble_off), std::chrono::milliseconds(CLOSE_WRITE_TIMEOUT_MS)))
+            LOG_DEBUG(LogFormat("Wiimote in slot %d: rumble off on close not confirmed", m_slot));
+    }
+    m_connected = false;
+
+    // Both calls wait for a handler of this device that is still running
+    if (m_tick_timer_id >= 0)
+    {
+        IoReactor::Instance().RemoveTimer(m_tick_timer_id);
+        m_tick_timer_id = -1;
+    }
+    const int drain_timer_id = m_drain_timer_id.exchange(-1);
+    if (drain_timer_id >= 0)
+        IoReactor::Instance().RemoveTimer(drain_timer_id);
+    if (m_reactor_id >= 0)
+    {
+        IoReactor::Instance().Unregister(m_reactor_id);
+        m_reactor_id = -1;
+        m_handle = NO_HANDLE;
+    }
+
+    m_registers.CancelAll();
+    m_output.Clear();
+    m_writer.Detach();
+    StatusPoller::Instance().RemoveDevice(m_slot);
+    WiimoteStatusCache::Instance().Clear(m_slot);
+    if (m_battery_low)
+    {
+        LedAnimator::Instance().StopAnimation(m_device_path);
+        m_battery_low = false;
+    }
+
+    if (m_handle != NO_HANDLE)
+    {
+        CloseNativeHandle(m_handle);
+        m_handle = NO_HANDLE;
+    }
+}
+
+bool WiimoteDevice::WriteReport(const uint8_t* report, size_t size, bool acknowledged)
+{
+    if (!m_connected)
+        return false;
+    return m_output.Submit(report, size, acknowledged);
+}
+
+void WiimoteDevice::RequestStatus()
+{
+    m_output.RequestStatus();
+}
+
+void WiimoteDevice::SetLeds(uint8_t mask, OutputScheduler::DeliveryCallback on_delivered)
+{
+    m_output.SetLeds(mask, std::move(on_delivered));
+}
+
+void WiimoteDevice::SetRumble(bool on)
+{
+    if (on)
+        m_rumble.SetIntensity(1.0f);
+    else
+        m_rumble.Stop();
+}
+
+void WiimoteDevice::SetRumbleIntensity(float intensity)
+{
+    m_rumble.SetIntensity(intensity);
+}
+
+void WiimoteDevice::PlayRumble(const RumbleWaveform& waveform)
+{
+    m_rumble.Play(waveform);
+}
+
+bool WiimoteDevice::WriteToDevice(const uint8_t* report, size_t size)
+{
+    if (!m_connected || size == 0)
+        return false;
+
+    m_mode_manager.RecordOutput(size, std::chrono::steady_clock::now());
+    return m_writer.Write(report, size);
+}
+
+void WiimoteDevice::SetInputCallback(InputCallback callback)
+{
+    std::lock_guard<std::mutex> lock(m_state_mutex);
+    m_input_callback = std::move(callback);
+}
+
+void WiimoteDevice::SetRequestedFeatures(uint32_t features)
+{
+    m_mode_manager.SetFeatures(features);
+    UpdateReportingMode();
+}
+
+ReportingModeManager::Traffic WiimoteDevice::GetTraffic() const
+{
+    return m_mode_manager.GetTraffic(std::chrono::steady_clock::now());
+}
+
+WiimoteInputState WiimoteDevice::GetInputState()
+{
+    std::lock_guard<std::mutex> lock(m_state_mutex);
+    return m_input_state;
+}
+
+ExtensionState WiimoteDevice::GetExtensionState()
+{
+    std::lock_guard<std::mutex> lock(m_state_mutex);
+    return m_extension_state;
+}
+
+void WiimoteDevice::Tick()
+{
+    const auto now = std::chrono::steady_clock::now();
+    m_registers.Tick(now);
+    m_extension.Tick(now);
+    // Drain first so a rumble change deferred on the last tick is sent before
+    // the player moves on to the next slot
+    m_output.Drain();
+    m_rumble.Update(now);
+
+    if (StatusPoller::Instance().ShouldPoll(m_slot, now))
+        RequestStatus();
+}
+
+void WiimoteDevice::HandleInputReport(const uint8_t* report, size_t size)
+{
+    if (size == 0)
+        return;
+
+    m_mode_manager.RecordInput(WiimoteProtocol::GetInputReportSize(report[0]),
+                               std::chrono::steady_clock::now());
+
+    if (m_registers.HandleInputReport(report, size))
+        return;
+    if (m_output.HandleAck(report, size))
+        return;
+
+    if (report[0] == WiimoteProtocol::INPUT_STATUS)
+    {
+        HandleStatusReport(report, size);
+        return;
+    }
+
+    WiimoteInputState state;
+    if (!DecodeInputReport(report, size, state))
+        return;
+    state.received = std::chrono::steady_clock::now();
+    state.sampled = m_report_clock.Update(state.received, m_continuous_reporting);
+
+    AccelCalibration calibration;
+    if (state.has_accel && m_calibration.GetAccel(calibration))
+    {
+        calibration.Apply(state.accel, state.accel_g);
+        state.accel_calibrated = true;
+        m_calibration.NoteCalibratedSample(state.received);
+    }
+
+    if (state.has_ir)
+        m_ir_tracker.Update(state.ir, state.sampled, state.pointer);
+
+    ExtensionState extension_state;
+    bool has_extension = state.extension_size > 0 &&
+        m_extension.Decode(state.extension, state.extension_size, extension_state, state.received);
+    if (has_extension && extension_state.type == ExtensionType::Nunchuk &&
+        m_calibration.GetNunchukAccel(calibration))
+    {
+        calibration.Apply(extension_state.nunchuk.accel, extension_state.nunchuk.accel_g);
+        extension_state.nunchuk.accel_calibrated = true;
+    }
+
+    BalanceBoardCalibration board_calibration;
+    if (has_extension && extension_state.type == ExtensionType::BalanceBoard &&
+        m_calibration.GetBalanceBoard(board_calibration))
+    {
+        board_calibration.Apply(extension_state.balance_board);
+    }
+
+    InputCallback callback;
+    {
+        std::lock_guard<std::mutex> lock(m_state_mutex);
+        m_input_state = state;
+        if (has_extension)
+            m_extension_state = extension_state;
+        extension_state = m_extension_state;
+        callback = m_input_callback;
+    }
+
+    if (callback)
+        callback(*this, state, extension_state);
+}
+
+void WiimoteDevice::HandleStatusReport(const uint8_t* report, size_t size)
+{
+    // 20 BB BB LF 00 00 VV
+    if (size < 7)
+        return;
+
+    const uint8_t flags = report[3];
+    const uint8_t battery = report[6];
+    const bool battery_low = (flags & WiimoteProtocol::STATUS_BATTERY_LOW) != 0;
+    const auto now = std::chrono::steady_clock::now();
+    WiimoteStatusCache::Instance().Publish(m_slot, m_bt_address, flags, battery);
+    StatusPoller::Instance().HandleStatus(m_slot, battery, battery_low, now);
+
+    if (battery_low != m_battery_low)
+    {
+        m_battery_low = battery_low;
+        if (battery_low)
+            LedAnimator::Instance().Play(m_device_path, LedAnimator::LowBatteryBlink());
+        else
+            LedAnimator::Instance().StopAnimation(m_device_path);
+    }
+    m_extension.HandleStatus((flags & WiimoteProtocol::STATUS_EXTENSION) != 0, now);
+
+    SendReportingMode();
+}
+
+void WiimoteDevice::HandleExtensionChanged(ExtensionType type)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_state_mutex);
+        m_extension_state = ExtensionState();
+        m_extension_state.type = type;
+    }
+
+    m_calibration.LoadExtension(type, m_extension.GetId());
+    UpdateReportingMode();
+}
+
+void WiimoteDevice::UpdateReportingMode()
+{
+    std::lock_guard<std::mutex> lock(m_mode_mutex);
+
+    m_mode_manager.SetExtensionBytes(GetExtensionDataSize(m_extension.GetType()));
+    ReportingModeManager::Selection selection;
+    if (!m_mode_manager.Update(selection))
+        return;
+
+    if (selection.ir_mode != m_ir_mode)
+        ApplyIrMode(selection.ir_mode);
+
+    m_reporting_mode = selection.mode;
+    m_continuous_reporting = selection.continuous;
+    SendReportingMode();
+
+    LOG_DEBUG(LogFormat("Wiimote in slot %d reporting mode 0x%02X (%s)", m_slot, selection.mode,
+                        selection.continuous ? "continuous" : "on change"));
+}
+
+void WiimoteDevice::ApplyIrMode(IrMode ir_mode)
+{
+    using namespace WiimoteProtocol;
+
+    m_ir_mode = ir_mode;
+    m_ir_tracker.Reset();
+    const uint8_t enable = ir_mode != IrMode::Off ? OUTPUT_FLAG_ENABLE : 0x00;
+    const uint8_t pixel_clock[2] = { OUTPUT_IR_PIXEL_CLOCK, enable };
+    const uint8_t logic[2] = { OUTPUT_IR_LOGIC, enable };
+    WriteReport(pixel_clock, sizeof(pixel_clock), true);
+    WriteReport(logic, sizeof(logic), true);
+
+    if (ir_mode == IrMode::Off)
+        return;
+
+    // Camera setup from WiiBrew, sensitivity level 3. The writes are queued
+    // together and pipelined by the register engine.
+    static const uint8_t sensitivity1[9] = { 0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0xAA, 0x00, 0x64 };
+    static const uint8_t sensitivity2[2] = { 0x63, 0x03 };
+    const uint8_t control = IR_CONTROL_ENABLE;
+    const uint8_t mode = static_cast<uint8_t>(ir_mode);
+    m_registers.Write(ADDRESS_SPACE_REGISTER, IR_CONTROL, &control, 1);
+    m_registers.Write(ADDRESS_SPACE_REGISTER, IR_SENSITIVITY_BLOCK1, sensitivity1, sizeof(sensitivity1));
+    m_registers.Write(ADDRESS_SPACE_REGISTER, IR_SENSITIVITY_BLOCK2, sensitivity2, sizeof(sensitivity2));
+    m_registers.Write(ADDRESS_SPACE_REGISTER, IR_MODE, &mode, 1);
+    m_registers.Write(ADDRESS_SPACE_REGISTER, IR_CONTROL, &control, 1);
+}
+
+void WiimoteDevice::SendReportingMode()
+{
+    m_output.SetReportingMode(m_continuous_reporting, m_reporting_mode);
+}
@@ -0,0 +1,238 @@
+#include "wiimote_device_registry.h"
+#include "shared_state_page.h"
+#include "input_event_bus.h"
+#include "virtual_gamepad.h"
+#include "debug_log.h"
+#include <algorithm>
+
+std::shared_ptr<WiimoteDevice> WiimoteDeviceRegistry::Open(const std::wstring& device_path,
+                                                           const std::wstring& device_name,
+                                                           uint64_t bt_address)
+{
+    std::shared_ptr<WiimoteDevice> device;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // A second Open of a path being opened waits for the first one
+        m_opened.wait(lock, [&]() { return m_opening.find(device_path) == m_opening.end(); });
+
+        auto it = m_devices.find(device_path);
+        if (it != m_devices.end())
+            return it->second;
+
+        // The path and slot are reserved; opening probes the device with
+        // blocking writes and runs without the lock
+        const int slot = AllocateSlotLocked();
+        m_opening[device_path] = slot;
+        device = std::make_shared<WiimoteDevice>(device_path, device_name, bt_address, slot);
+    }
+
+    device->SetInputCallback([this](WiimoteDevice& source, const WiimoteInputState& input,
+                                    const ExtensionState& extension) {
+        DispatchInput(source, input, extension);
+    });
+    const bool opened = device->Open();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_opening.erase(device_path);
+        if (opened)
+            m_devices[device_path] = device;
+    }
+    m_opened.notify_all();
+    if (!opened)
+        return nullptr;
+
+    device->SetRequestedFeatures(GetFeaturesForSlot(device->GetSlot()));
+    return device;
+}
+
+void WiimoteDeviceRegistry::Close(const std::wstring& device_path)
+{
+    std::shared_ptr<WiimoteDevice> device;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_devices.find(device_path);
+        if (it == m_devices.end())
+            return;
+        device = it->second;
+        m_devices.erase(it);
+    }
+    device->Close();
+    ReleaseSlot(device->GetSlot());
+}
+
+void WiimoteDeviceRegistry::CloseAll()
+{
+    std::map<std::wstring, std::shared_ptr<WiimoteDevice>> devices;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        devices.swap(m_devices);
+    }
+    for (auto& pair : devices)
+    {
+        pair.second->Close();
+        ReleaseSlot(pair.second->GetSlot());
+    }
+}
+
+int WiimoteDeviceRegistry::RemoveDisconnected()
+{
+    std::vector<std::shared_ptr<WiimoteDevice>> removed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_devices.begin(); it != m_devices.end();)
+        {
+            if (!it->second->IsConnected())
+            {
+                removed.push_back(it->second);
+                it = m_devices.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    for (auto& device : removed)
+    {
+        LOG_INFO(LogFormat("Closing disconnected Wiimote in slot %d", device->GetSlot()));
+        device->Close();
+        ReleaseSlot(device->GetSlot());
+    }
+    return static_cast<int>(removed.size());
+}
+
+void WiimoteDeviceRegistry::ReleaseSlot(int slot)
+{
+    SharedStatePage::Instance().Clear(slot);
+    VirtualGamepadBackend::Instance().Remove(slot);
+}
+
+std::shared_ptr<WiimoteDevice> WiimoteDeviceRegistry::Find(const std::wstring& device_path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_devices.find(device_path);
+    return it != m_devices.end() ? it->second : nullptr;
+}
+
+std::vector<std::shared_ptr<WiimoteDevice>> WiimoteDeviceRegistry::GetDevices()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<std::shared_ptr<WiimoteDevice>> devices;
+    devices.reserve(m_devices.size());
+    for (const auto& pair : m_devices)
+        devices.push_back(pair.second);
+    return devices;
+}
+
+int WiimoteDeviceRegistry::AllocateSlotLocked() const
+{
+    // Lowest slot not held by an open or opening device, so player numbers
+    // stay small
+    for (int slot = 0;; ++slot)
+    {
+        bool taken = false;
+        for (const auto& pair : m_devices)
+        {
+            if (pair.second->GetSlot() == slot)
+            {
+                taken = true;
+                break;
+            }
+        }
+        for (const auto& pair : m_opening)
+        {
+            if (pair.second == slot)
+            {
+                taken = true;
+                break;
+            }
+        }
+        if (!taken)
+            return slot;
+    }
+}
+
+int WiimoteDeviceRegistry::Subscribe(uint32_t features, InputCallback callback, int slot)
+{
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        auto subscriptions = std::make_shared<SubscriptionList>(*m_subscriptions);
+        id = m_next_subscription_id++;
+        subscriptions->push_back({ id, features, slot, std::move(callback) });
+        m_subscriptions = subscriptions;
+    }
+    UpdateRequestedFeatures();
+    return id;
+}
+
+void WiimoteDeviceRegistry::SetFeatures(int subscription_id, uint32_t features)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        auto subscriptions = std::make_shared<SubscriptionList>(*m_subscriptions);
+        auto subscription = std::find_if(subscriptions->begin(), subscriptions->end(),
+            [subscription_id](const Subscription& candidate) {
+                return candidate.id == subscription_id;
+            });
+        if (subscription == subscriptions->end() || subscription->features == features)
+            return;
+        subscription->features = features;
+        m_subscriptions = subscriptions;
+    }
+    UpdateRequestedFeatures();
+}
+
+void WiimoteDeviceRegistry::Unsubscribe(int subscription_id)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        auto subscriptions = std::make_shared<SubscriptionList>(*m_subscriptions);
+        subscriptions->erase(std::remove_if(subscriptions->begin(), subscriptions->end(),
+            [subscription_id](const Subscription& subscription) {
+                return subscription.id == subscription_id;
+            }), subscriptions->end());
+        m_subscriptions = subscriptions;
+    }
+    UpdateRequestedFeatures();
+}
+
+uint32_t WiimoteDeviceRegistry::GetFeaturesForSlot(int slot)
+{
+    std::lock_guard<std::mutex> lock(m_subscription_mutex);
+    uint32_t features = DEFAULT_FEATURES;
+    for (const auto& subscription : *m_subscriptions)
+    {
+        if (subscription.slot < 0 || subscription.slot == slot)
+            features |= subscription.features;
+    }
+    return features;
+}
+
+void WiimoteDeviceRegistry::UpdateRequestedFeatures()
+{
+    for (const auto& device : GetDevices())
+        device->SetRequestedFeatures(GetFeaturesForSlot(device->GetSlot()));
+}
+
+void WiimoteDeviceRegistry::DispatchInput(WiimoteDevice& device, const WiimoteInputState& input,
+                                          const ExtensionState& extension)
+{
+    std::shared_ptr<const SubscriptionList> subscriptions;
+    {
+        std::lock_guard<std::mutex> lock(m_subscription_mutex);
+        subscriptions = m_subscriptions;
+    }
+
+    const int slot = device.GetSlot();
+    SharedStatePage::Instance().Publish(slot, device.GetBluetoothAddress(), input, extension);
+    InputEventBus::Instance().Publish(slot, input, extension);
+
+    for (const auto& subscription : *subscriptions)
+    {
+        if (subscription.slot < 0 || subscription.slot == slot)
+            subscription.callback(device, input, extension);
+    }
+}
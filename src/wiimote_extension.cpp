@@ -0,0 +1,490 @@
+#include "wiimote_extension.h"
+#include "debug_log.h"
+
+using namespace WiimoteProtocol;
+
+// Attempts at initialising an extension that is still being seated
+constexpr int MAX_INIT_ATTEMPTS = 3;
+constexpr std::chrono::milliseconds INIT_RETRY_DELAY{ 20 };
+
+// MotionPlus rates: 8192 at rest, nominally 20 units per degree per second
+// in slow mode and 2000/440 times coarser in fast mode
+constexpr float MOTION_PLUS_ZERO = 8192.0f;
+constexpr float MOTION_PLUS_SLOW_SCALE = 1.0f / 20.0f;
+constexpr float MOTION_PLUS_FAST_SCALE = MOTION_PLUS_SLOW_SCALE * 2000.0f / 440.0f;
+
+// An inactive MotionPlus at 0xA600FA, whatever mode it was last in, and an
+// active one at 0xA400FA; byte 4 of the ID is the mode
+constexpr uint64_t MOTION_PLUS_ID_MASK = 0xFFFFFFFF00FFULL;
+constexpr uint64_t MOTION_PLUS_INACTIVE_ID = 0x0000A6200005ULL;
+constexpr uint64_t MOTION_PLUS_ACTIVE_ID = 0x0000A4200005ULL;
+// Bit 1 of the last byte of a frame in passthrough mode: MotionPlus data
+// when set, the passed-through extension's when clear. Bit 0 of byte 4 of
+// MotionPlus data tells whether an extension is plugged into it.
+constexpr uint8_t PASSTHROUGH_MOTION_PLUS_FRAME = 0x02;
+constexpr uint8_t PASSTHROUGH_EXTENSION_CONNECTED = 0x01;
+
+struct ExtensionIdEntry
+{
+    uint64_t id;
+    ExtensionType type;
+};
+
+// 6-byte IDs read from 0xA400FA, packed big-endian
+static const ExtensionIdEntry EXTENSION_IDS[] = {
+    { 0x0000A4200000ULL, ExtensionType::Nunchuk },
+    { 0x0000A4200101ULL, ExtensionType::ClassicController },
+    { 0x0100A4200101ULL, ExtensionType::ClassicControllerPro },
+    { 0x0000A4200103ULL, ExtensionType::Guitar },
+    { 0x0100A4200103ULL, ExtensionType::Drums },
+    { 0x0000A4200402ULL, ExtensionType::BalanceBoard },
+    { 0x0000A4200405ULL, ExtensionType::MotionPlus },
+    { 0x0000A4200505ULL, ExtensionType::MotionPlus },
+    { 0x0000A4200705ULL, ExtensionType::MotionPlus },
+};
+
+const char* GetExtensionName(ExtensionType type)
+{
+    switch (type)
+    {
+    case ExtensionType::None:                 return "None";
+    case ExtensionType::Nunchuk:              return "Nunchuk";
+    case ExtensionType::ClassicController:    return "Classic Controller";
+    case ExtensionType::ClassicControllerPro: return "Classic Controller Pro";
+    case ExtensionType::Guitar:               return "Guitar";
+    case ExtensionType::Drums:                return "Drums";
+    case ExtensionType::BalanceBoard:         return "Balance Board";
+    case ExtensionType::MotionPlus:           return "MotionPlus";
+    default:                                  return "Unknown";
+    }
+}
+
+ExtensionType GetControllerType(const ExtensionState& state)
+{
+    return state.type == ExtensionType::MotionPlus ? state.passthrough : state.type;
+}
+
+size_t GetExtensionDataSize(ExtensionType type)
+{
+    switch (type)
+    {
+    case ExtensionType::None:
+        return 0;
+    case ExtensionType::BalanceBoard:
+        // Four 16-bit sensors, temperature and battery
+        return 11;
+    case ExtensionType::Unknown:
+        return 8;
+    default:
+        return 6;
+    }
+}
+
+void GetMotionPlusRates(const MotionPlusState& state, float rates_dps[3])
+{
+    rates_dps[0] = (state.pitch - MOTION_PLUS_ZERO) *
+                   (state.pitch_slow ? MOTION_PLUS_SLOW_SCALE : MOTION_PLUS_FAST_SCALE);
+    rates_dps[1] = (state.roll - MOTION_PLUS_ZERO) *
+                   (state.roll_slow ? MOTION_PLUS_SLOW_SCALE : MOTION_PLUS_FAST_SCALE);
+    rates_dps[2] = (state.yaw - MOTION_PLUS_ZERO) *
+                   (state.yaw_slow ? MOTION_PLUS_SLOW_SCALE : MOTION_PLUS_FAST_SCALE);
+}
+
+WiimoteExtension::WiimoteExtension(WiimoteRegisterEngine& registers, int slot)
+    : m_registers(registers), m_slot(slot), m_connected(false), m_type(ExtensionType::None),
+      m_id(0), m_generation(0), m_init_attempts(0), m_retry_pending(false),
+      m_awaiting_first_sample(false), m_motion_plus_mode(MotionPlusMode::NunchukPassthrough),
+      m_motion_plus_active(false), m_probe_pending(false)
+{
+}
+
+void WiimoteExtension::SetChangedCallback(ChangedCallback callback)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_changed_callback = std::move(callback);
+}
+
+void WiimoteExtension::SetMotionPlusMode(MotionPlusMode mode)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_motion_plus_mode = mode;
+}
+
+void WiimoteExtension::HandleStatus(bool extension_connected, Clock::time_point now)
+{
+    uint32_t generation = 0;
+    bool removed = false;
+    bool probe = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (extension_connected == m_connected)
+            return;
+
+        m_connected = extension_connected;
+        m_generation++;
+        generation = m_generation;
+        m_retry_pending = false;
+        m_probe_pending = false;
+        m_awaiting_first_sample = false;
+
+        if (extension_connected)
+        {
+            m_stats.hotplugs++;
+            m_plug_time = now;
+            m_init_attempts = 0;
+            m_type = ExtensionType::Unknown;
+            // An extension plugged into an inactive MotionPlus shows up
+            // like any other; the MotionPlus has to be looked for
+            probe = m_motion_plus_mode != MotionPlusMode::Off && !m_motion_plus_active;
+        }
+        else
+        {
+            removed = m_type != ExtensionType::None;
+            m_type = ExtensionType::None;
+            m_id = 0;
+            m_next_probe = now;
+        }
+    }
+
+    if (extension_connected && probe)
+    {
+        BeginProbe(generation, now);
+    }
+    else if (extension_connected)
+    {
+        BeginInit(generation);
+    }
+    else if (removed)
+    {
+        LOG_NOTICE(LogFormat("Extension removed from Wiimote in slot %d", m_slot));
+        NotifyChanged(ExtensionType::None);
+    }
+}
+
+void WiimoteExtension::Tick(Clock::time_point now)
+{
+    uint32_t generation = 0;
+    bool probe = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_retry_pending && now >= m_retry_time)
+        {
+            m_retry_pending = false;
+        }
+        else if (!m_connected && !m_probe_pending && m_motion_plus_mode != MotionPlusMode::Off &&
+                 now >= m_next_probe)
+        {
+            probe = true;
+        }
+        else
+        {
+            return;
+        }
+        generation = m_generation;
+    }
+
+    if (probe)
+        BeginProbe(generation, now);
+    else
+        BeginInit(generation);
+}
+
+void WiimoteExtension::BeginInit(uint32_t generation)
+{
+    bool motion_plus = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_init_attempts++;
+        motion_plus = m_motion_plus_active;
+    }
+
+    // Both init writes and the ID read go out without waiting for each
+    // other; the remote executes them in order. An active MotionPlus needs
+    // no init, and the first write would deactivate it.
+    if (!motion_plus)
+    {
+        const uint8_t init1 = EXTENSION_INIT1_VALUE;
+        const uint8_t init2 = EXTENSION_INIT2_VALUE;
+        m_registers.Write(ADDRESS_SPACE_REGISTER, EXTENSION_INIT1, &init1, 1);
+        m_registers.Write(ADDRESS_SPACE_REGISTER, EXTENSION_INIT2, &init2, 1);
+    }
+    m_registers.Read(ADDRESS_SPACE_REGISTER, EXTENSION_ID, EXTENSION_ID_SIZE,
+        [this, generation](const RegisterReadResult& result) { HandleIdRead(generation, result); });
+}
+
+void WiimoteExtension::BeginProbe(uint32_t generation, Clock::time_point now)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_probe_pending = true;
+        m_next_probe = now + MOTION_PLUS_PROBE_PERIOD;
+    }
+    m_registers.Read(ADDRESS_SPACE_REGISTER, MOTION_PLUS_ID, EXTENSION_ID_SIZE,
+        [this, generation, now](const RegisterReadResult& result) { HandleProbe(generation, now, result); });
+}
+
+void WiimoteExtension::HandleProbe(uint32_t generation, Clock::time_point sent, const RegisterReadResult& result)
+{
+    uint8_t mode = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (generation != m_generation)
+            return;
+        m_probe_pending = false;
+
+        // Without a MotionPlus the read fails or comes back empty
+        uint64_t id = 0;
+        if (result.status == RegisterStatus::Ok && result.data.size() == EXTENSION_ID_SIZE)
+        {
+            for (uint8_t byte : result.data)
+                id = (id << 8) | byte;
+        }
+        const bool found = (id & MOTION_PLUS_ID_MASK) == MOTION_PLUS_INACTIVE_ID;
+
+        if (!found && !m_connected)
+            return;
+        if (found)
+        {
+            mode = m_motion_plus_mode == MotionPlusMode::Alone            ? MOTION_PLUS_MODE_ALONE
+                   : m_motion_plus_mode == MotionPlusMode::ClassicPassthrough ? MOTION_PLUS_MODE_CLASSIC
+                                                                          : MOTION_PLUS_MODE_NUNCHUK;
+            m_motion_plus_active = true;
+            m_stats.motion_plus_activations++;
+            if (!m_connected)
+            {
+                // Plugged in alone, found by a periodic probe: count it from
+                // when the probe went out, the latest it can have been plugged
+                m_connected = true;
+                m_stats.hotplugs++;
+                m_plug_time = sent;
+                m_init_attempts = 0;
+                m_type = ExtensionType::Unknown;
+            }
+        }
+    }
+
+    if (mode != 0)
+    {
+        LOG_INFO(LogFormat("Activating MotionPlus on Wiimote in slot %d in mode 0x%02X", m_slot, mode));
+        const uint8_t init = MOTION_PLUS_INIT_VALUE;
+        m_registers.Write(ADDRESS_SPACE_REGISTER, MOTION_PLUS_INIT, &init, 1);
+        m_registers.Write(ADDRESS_SPACE_REGISTER, MOTION_PLUS_MODE, &mode, 1);
+    }
+    BeginInit(generation);
+}
+
+void WiimoteExtension::HandleIdRead(uint32_t generation, const RegisterReadResult& result)
+{
+    ExtensionType type = ExtensionType::Unknown;
+    double identify_ms = 0.0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (generation != m_generation || !m_connected)
+            return;
+
+        uint64_t id = 0;
+        bool valid = result.status == RegisterStatus::Ok && result.data.size() == EXTENSION_ID_SIZE;
+        if (valid)
+        {
+            for (uint8_t byte : result.data)
+                id = (id << 8) | byte;
+            // A half-inserted extension answers with all bits set
+            valid = id != 0xFFFFFFFFFFFFULL;
+        }
+
+        if (!valid)
+        {
+            if (m_init_attempts < MAX_INIT_ATTEMPTS)
+            {
+                m_retry_pending = true;
+                m_retry_time = Clock::now() + INIT_RETRY_DELAY;
+            }
+            else
+            {
+                m_stats.init_failures++;
+                m_motion_plus_active = false;
+                LOG_ERROR(LogFormat("Failed to identify extension on Wiimote in slot %d", m_slot));
+            }
+            return;
+        }
+
+        if (m_motion_plus_active && (id & MOTION_PLUS_ID_MASK) != MOTION_PLUS_ACTIVE_ID)
+        {
+            // The MotionPlus went away and something else was plugged in,
+            // which has to be initialised after all
+            m_motion_plus_active = false;
+            m_retry_pending = true;
+            m_retry_time = Clock::now();
+            return;
+        }
+
+        for (const auto& entry : EXTENSION_IDS)
+        {
+            if (entry.id == id)
+            {
+                type = entry.type;
+                break;
+            }
+        }
+
+        m_id = id;
+        m_type = type;
+        m_passthrough_state = ExtensionState();
+        m_awaiting_first_sample = true;
+        identify_ms = std::chrono::duration<double, std::milli>(Clock::now() - m_plug_time).count();
+        m_stats.last_identify_ms = identify_ms;
+    }
+
+    LOG_INFO(LogFormat("Identified %s on Wiimote in slot %d after %.1f ms",
+                       GetExtensionName(type), m_slot, identify_ms));
+    NotifyChanged(type);
+}
+
+bool WiimoteExtension::Decode(const uint8_t* data, size_t size, ExtensionState& state,
+                              Clock::time_point now)
+{
+    ExtensionType type;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        type = m_type;
+        if (type == ExtensionType::None || type == ExtensionType::Unknown)
+            return false;
+        if (size < GetExtensionDataSize(type))
+            return false;
+        if (type == ExtensionType::MotionPlus)
+            DecodeMotionPlusLocked(data, state);
+
+        if (m_awaiting_first_sample)
+        {
+            m_awaiting_first_sample = false;
+            const double latency = std::chrono::duration<double, std::milli>(now - m_plug_time).count();
+            m_stats.last_first_sample_ms = latency;
+            if (latency > m_stats.max_first_sample_ms)
+                m_stats.max_first_sample_ms = latency;
+            LOG_NOTICE(LogFormat("%s ready on Wiimote in slot %d, first sample %.1f ms after plug-in",
+                                 GetExtensionName(type), m_slot, latency));
+        }
+    }
+
+    state.type = type;
+    switch (type)
+    {
+    case ExtensionType::Nunchuk:
+    {
+        NunchukState& nunchuk = state.nunchuk;
+        nunchuk.stick_x = data[0];
+        nunchuk.stick_y = data[1];
+        nunchuk.accel[0] = static_cast<uint16_t>((data[2] << 2) | ((data[5] >> 2) & 0x03));
+        nunchuk.accel[1] = static_cast<uint16_t>((data[3] << 2) | ((data[5] >> 4) & 0x03));
+        nunchuk.accel[2] = static_cast<uint16_t>((data[4] << 2) | ((data[5] >> 6) & 0x03));
+        nunchuk.button_z = (data[5] & 0x01) == 0;
+        nunchuk.button_c = (data[5] & 0x02) == 0;
+        break;
+    }
+    case ExtensionType::ClassicController:
+    case ExtensionType::ClassicControllerPro:
+    {
+        ClassicControllerState& classic = state.classic;
+        classic.left_x = data[0] & 0x3F;
+        classic.left_y = data[1] & 0x3F;
+        classic.right_x = static_cast<uint8_t>(((data[0] & 0xC0) >> 3) | ((data[1] & 0xC0) >> 5) | ((data[2] & 0x80) >> 7));
+        classic.right_y = data[2] & 0x1F;
+        classic.left_trigger = static_cast<uint8_t>(((data[2] & 0x60) >> 2) | ((data[3] & 0xE0) >> 5));
+        classic.right_trigger = data[3] & 0x1F;
+        classic.buttons = static_cast<uint16_t>(~((data[4] << 8) | data[5]));
+        break;
+    }
+    case ExtensionType::BalanceBoard:
+    {
+        BalanceBoardState& board = state.balance_board;
+        for (int sensor = 0; sensor < BALANCE_SENSOR_COUNT; ++sensor)
+            board.sensors[sensor] = static_cast<uint16_t>((data[sensor * 2] << 8) | data[sensor * 2 + 1]);
+        board.temperature = data[8];
+        board.battery = data[10];
+        break;
+    }
+    default:
+        break;
+    }
+    return true;
+}
+
+void WiimoteExtension::DecodeMotionPlusLocked(const uint8_t* data, ExtensionState& state)
+{
+    ExtensionState& merged = m_passthrough_state;
+    const uint8_t mode = static_cast<uint8_t>(m_id >> 8);
+    if (mode == MOTION_PLUS_MODE_ALONE || (data[5] & PASSTHROUGH_MOTION_PLUS_FRAME))
+    {
+        MotionPlusState& motion_plus = merged.motion_plus;
+        motion_plus.yaw = static_cast<uint16_t>(data[0] | ((data[3] & 0xFC) << 6));
+        motion_plus.roll = static_cast<uint16_t>(data[1] | ((data[4] & 0xFC) << 6));
+        motion_plus.pitch = static_cast<uint16_t>(data[2] | ((data[5] & 0xFC) << 6));
+        motion_plus.yaw_slow = (data[3] & 0x02) != 0;
+        motion_plus.pitch_slow = (data[3] & 0x01) != 0;
+        motion_plus.roll_slow = (data[4] & 0x02) != 0;
+        const bool connected = mode != MOTION_PLUS_MODE_ALONE && (data[4] & PASSTHROUGH_EXTENSION_CONNECTED);
+        merged.passthrough = !connected                        ? ExtensionType::None
+                             : mode == MOTION_PLUS_MODE_CLASSIC ? ExtensionType::ClassicController
+                                                               : ExtensionType::Nunchuk;
+    }
+    else if (mode == MOTION_PLUS_MODE_NUNCHUK)
+    {
+        // The lowest accelerometer bits make room for the frame flags
+        NunchukState& nunchuk = merged.nunchuk;
+        nunchuk.stick_x = data[0];
+        nunchuk.stick_y = data[1];
+        nunchuk.accel[0] = static_cast<uint16_t>((data[2] << 2) | ((data[5] >> 3) & 0x02));
+        nunchuk.accel[1] = static_cast<uint16_t>((data[3] << 2) | ((data[5] >> 4) & 0x02));
+        nunchuk.accel[2] = static_cast<uint16_t>(((data[4] & 0xFE) << 2) | ((data[5] >> 5) & 0x06));
+        nunchuk.button_z = (data[5] & 0x04) == 0;
+        nunchuk.button_c = (data[5] & 0x08) == 0;
+    }
+    else if (mode == MOTION_PLUS_MODE_CLASSIC)
+    {
+        // Up and left of the pad move to bit 0 of the stick bytes, whose
+        // lowest bit of the left stick is lost
+        ClassicControllerState& classic = merged.classic;
+        classic.left_x = data[0] & 0x3E;
+        classic.left_y = data[1] & 0x3E;
+        classic.right_x = static_cast<uint8_t>(((data[0] & 0xC0) >> 3) | ((data[1] & 0xC0) >> 5) | ((data[2] & 0x80) >> 7));
+        classic.right_y = data[2] & 0x1F;
+        classic.left_trigger = static_cast<uint8_t>(((data[2] & 0x60) >> 2) | ((data[3] & 0xE0) >> 5));
+        classic.right_trigger = data[3] & 0x1F;
+        const uint8_t low = static_cast<uint8_t>((data[5] & 0xFC) | ((data[1] & 0x01) << 1) | (data[0] & 0x01));
+        classic.buttons = static_cast<uint16_t>(~((data[4] << 8) | low));
+    }
+
+    state.passthrough = merged.passthrough;
+    state.nunchuk = merged.nunchuk;
+    state.classic = merged.classic;
+    state.motion_plus = merged.motion_plus;
+}
+
+ExtensionType WiimoteExtension::GetType() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_type;
+}
+
+uint64_t WiimoteExtension::GetId() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_id;
+}
+
+WiimoteExtension::Stats WiimoteExtension::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void WiimoteExtension::NotifyChanged(ExtensionType type)
+{
+    ChangedCallback callback;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        callback = m_changed_callback;
+    }
+    if (callback)
+        callback(type);
+}
@@ -0,0 +1,74 @@
+#include "wiimote_input.h"
+#include <cstring>
+
+using namespace WiimoteProtocol;
+
+static void DecodeBasicIr(const uint8_t* data, IrDot* dots)
+{
+    // Two 5-byte blocks, each holding a pair of dots without size information
+    for (int pair = 0; pair < 2; ++pair)
+    {
+        const uint8_t* block = data + pair * 5;
+        IrDot& first = dots[pair * 2];
+        IrDot& second = dots[pair * 2 + 1];
+
+        first.x = static_cast<uint16_t>(block[0] | ((block[2] & 0x30) << 4));
+        first.y = static_cast<uint16_t>(block[1] | ((block[2] & 0xC0) << 2));
+        second.x = static_cast<uint16_t>(block[3] | ((block[2] & 0x03) << 8));
+        second.y = static_cast<uint16_t>(block[4] | ((block[2] & 0x0C) << 6));
+        first.size = second.size = 0;
+        first.valid = first.y != 0x3FF;
+        second.valid = second.y != 0x3FF;
+    }
+}
+
+static void DecodeExtendedIr(const uint8_t* data, IrDot* dots)
+{
+    // Four 3-byte blocks: X low, Y low, then Y high / X high / size
+    for (int i = 0; i < 4; ++i)
+    {
+        const uint8_t* block = data + i * 3;
+        dots[i].x = static_cast<uint16_t>(block[0] | ((block[2] & 0x30) << 4));
+        dots[i].y = static_cast<uint16_t>(block[1] | ((block[2] & 0xC0) << 2));
+        dots[i].size = block[2] & 0x0F;
+        dots[i].valid = !(block[0] == 0xFF && block[1] == 0xFF && block[2] == 0xFF);
+    }
+}
+
+bool DecodeInputReport(const uint8_t* report, size_t size, WiimoteInputState& state)
+{
+    const ReportLayout* layout = FindReportLayout(report[0]);
+    if (!layout || size < layout->size)
+        return false;
+
+    state.report_id = report[0];
+
+    // Mode 0x3D is extension-only and carries no button bytes
+    if (layout->id != INPUT_EXT21)
+        state.buttons = static_cast<uint16_t>(((report[1] << 8) | report[2]) & BUTTON_MASK);
+
+    state.has_accel = layout->accel_offset != 0;
+    if (state.has_accel)
+    {
+        // The low accelerometer bits are stored in the unused button bits
+        const uint8_t* accel = report + layout->accel_offset;
+        state.accel[0] = static_cast<uint16_t>((accel[0] << 2) | ((report[1] >> 5) & 0x03));
+        state.accel[1] = static_cast<uint16_t>((accel[1] << 2) | ((report[2] >> 4) & 0x02));
+        state.accel[2] = static_cast<uint16_t>((accel[2] << 2) | ((report[2] >> 5) & 0x02));
+    }
+
+    state.has_ir = layout->ir_offset != 0;
+    if (state.has_ir)
+    {
+        if (layout->ir_size == 12)
+            DecodeExtendedIr(report + layout->ir_offset, state.ir);
+        else
+            DecodeBasicIr(report + layout->ir_offset, state.ir);
+    }
+
+    state.extension_size = layout->ext_size;
+    if (layout->ext_size > 0)
+        memcpy(state.extension, report + layout->ext_offset, layout->ext_size);
+
+    return true;
+}
@@ -1,5 +1,8 @@
 #include "wiimote_manager.h"
 #include "wiimote_led_setter.h"
+#include "wiimote_device_registry.h"
+#include "dsu_server.h"
+#include "virtual_gamepad.h"
 #include "debug_log.h"
 
 WiimoteManager::WiimoteManager()
@@ -10,8 +13,11 @@ WiimoteManager::WiimoteManager()
     m_last_detection_check = std::chrono::steady_clock::now();
     
     WiimoteLedSetter::Instance().StartBlinking();
+    DsuServer::Instance().Start();
+    VirtualGamepadBackend::Instance().Start();
     
     CheckForPrePairedDevices();
+    SyncDevices();
     
     LOG_INFO("WiimoteManager created");
 }
@@ -23,6 +29,9 @@ WiimoteManager::~WiimoteManager()
         EndPairing();
     }
     WiimoteLedSetter::Instance().StopBlinking();
+    DsuServer::Instance().Stop();
+    VirtualGamepadBackend::Instance().Stop();
+    WiimoteDeviceRegistry::Instance().CloseAll();
     LOG_INFO("WiimoteManager destroyed");
 }
 
@@ -89,6 +98,7 @@ void WiimoteManager::Tick()
     if (now - m_last_detection_check >= std::chrono::seconds(5))
     {
         CheckForPrePairedDevices();
+        SyncDevices();
         m_last_detection_check = now;
     }
 }
@@ -108,4 +118,36 @@ void WiimoteManager::CheckForPrePairedDevices()
     {
         LOG_NOTICE(LogFormat("Detected %d pre-paired Wiimote(s), LED animation started", detected));
     }
+}
+
+void WiimoteManager::SyncDevices()
+{
+    auto& registry = WiimoteDeviceRegistry::Instance();
+    registry.RemoveDisconnected();
+
+    auto tracked = WiimoteLedSetter::Instance().GetConnectedDevices();
+    for (const auto& info : tracked)
+    {
+        if (!registry.Find(info.device_path))
+        {
+            registry.Open(info.device_path, info.device_name,
+                          info.has_bt_address ? info.bt_address.ullLong : 0);
+        }
+    }
+
+    // Close connections to devices that are no longer tracked
+    for (const auto& device : registry.GetDevices())
+    {
+        bool still_tracked = false;
+        for (const auto& info : tracked)
+        {
+            if (info.device_path == device->GetPath())
+            {
+                still_tracked = true;
+                break;
+            }
+        }
+        if (!still_tracked)
+            registry.Close(device->GetPath());
+    }
 }
\ No newline at end of file
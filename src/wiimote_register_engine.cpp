@@ -0,0 +1,522 @@
+#include "wiimote_register_engine.h"
+#include "debug_log.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace WiimoteProtocol;
+
+WiimoteRegisterEngine::WiimoteRegisterEngine(SendFunction send)
+    : WiimoteRegisterEngine(std::move(send), Config{})
+{
+}
+
+WiimoteRegisterEngine::WiimoteRegisterEngine(SendFunction send, const Config& config)
+    : m_send(std::move(send)), m_config(config), m_draining(false)
+{
+    if (m_config.max_reads_in_flight == 0)
+        m_config.max_reads_in_flight = 1;
+    if (m_config.read_segment_size < MEMORY_READ_CHUNK_BYTES)
+        m_config.read_segment_size = MEMORY_READ_CHUNK_BYTES;
+}
+
+WiimoteRegisterEngine::~WiimoteRegisterEngine() = default;
+
+void WiimoteRegisterEngine::Read(uint8_t address_space, uint32_t address, uint16_t size,
+                                 ReadCallback callback)
+{
+    Transaction transaction;
+    transaction.is_read = true;
+    transaction.address_space = address_space;
+    transaction.address = address;
+    transaction.size = size;
+    transaction.data.resize(size);
+    transaction.read_callback = std::move(callback);
+    transaction.submitted = Clock::now();
+
+    std::vector<PendingRequest> parts;
+    for (uint32_t offset = 0; offset < size; offset += m_config.read_segment_size)
+    {
+        PendingRequest request;
+        request.is_read = true;
+        request.segment.address = address + offset;
+        request.segment.size = static_cast<uint16_t>(
+            std::min<uint32_t>(m_config.read_segment_size, size - offset));
+        parts.push_back(request);
+    }
+
+    Submit(std::move(transaction), std::move(parts));
+}
+
+void WiimoteRegisterEngine::Write(uint8_t address_space, uint32_t address, const uint8_t* data,
+                                  size_t size, WriteCallback callback)
+{
+    Transaction transaction;
+    transaction.is_read = false;
+    transaction.address_space = address_space;
+    transaction.address = address;
+    transaction.size = size;
+    transaction.write_callback = std::move(callback);
+    transaction.submitted = Clock::now();
+
+    std::vector<PendingRequest> parts;
+    for (size_t offset = 0; offset < size; offset += MEMORY_WRITE_MAX_BYTES)
+    {
+        PendingRequest request;
+        request.is_read = false;
+        request.chunk.address = address + static_cast<uint32_t>(offset);
+        request.chunk.size = static_cast<uint8_t>(std::min(MEMORY_WRITE_MAX_BYTES, size - offset));
+        memcpy(request.chunk.data, data + offset, request.chunk.size);
+        parts.push_back(request);
+    }
+
+    Submit(std::move(transaction), std::move(parts));
+}
+
+std::future<RegisterReadResult> WiimoteRegisterEngine::ReadAsync(uint8_t address_space,
+                                                                 uint32_t address, uint16_t size)
+{
+    auto promise = std::make_shared<std::promise<RegisterReadResult>>();
+    auto future = promise->get_future();
+    Read(address_space, address, size, [promise](const RegisterReadResult& result) {
+        promise->set_value(result);
+    });
+    return future;
+}
+
+std::future<RegisterStatus> WiimoteRegisterEngine::WriteAsync(uint8_t address_space,
+                                                              uint32_t address,
+                                                              const uint8_t* data, size_t size)
+{
+    auto promise = std::make_shared<std::promise<RegisterStatus>>();
+    auto future = promise->get_future();
+    Write(address_space, address, data, size, [promise](RegisterStatus status) {
+        promise->set_value(status);
+    });
+    return future;
+}
+
+void WiimoteRegisterEngine::Submit(Transaction&& transaction, std::vector<PendingRequest>&& parts)
+{
+    std::vector<Completion> done;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_transactions.push_back(std::move(transaction));
+        Transaction* owner = &m_transactions.back();
+        owner->pending_parts = parts.size();
+
+        if (parts.empty())
+        {
+            done.push_back(MakeCompletionLocked(owner));
+        }
+        else
+        {
+            for (auto& part : parts)
+            {
+                part.segment.owner = owner;
+                part.chunk.owner = owner;
+                m_pending.push_back(part);
+            }
+            IssuePendingLocked(Clock::now());
+        }
+    }
+
+    DrainOutbox();
+    RunCompletions(done);
+}
+
+void WiimoteRegisterEngine::IssuePendingLocked(Clock::time_point now)
+{
+    // Requests leave strictly in submission order; a full window for the
+    // request at the head of the queue holds back everything behind it.
+    while (!m_pending.empty())
+    {
+        PendingRequest& request = m_pending.front();
+        if (request.is_read)
+        {
+            if (m_reads_in_flight.size() >= m_config.max_reads_in_flight)
+                break;
+            if (SegmentOverlapsInFlightLocked(request.segment))
+                break;
+
+            request.segment.deadline = now + m_config.timeout;
+            m_reads_in_flight.push_back(request.segment);
+            QueueReadRequestLocked(request.segment, 0);
+        }
+        else
+        {
+            if (!m_writes_in_flight.empty())
+                break;
+
+            request.chunk.deadline = now + m_config.timeout;
+            m_writes_in_flight.push_back(request.chunk);
+            QueueWriteRequestLocked(request.chunk);
+        }
+        m_pending.pop_front();
+    }
+}
+
+bool WiimoteRegisterEngine::SegmentOverlapsInFlightLocked(const ReadSegment& segment) const
+{
+    // 0x21 replies only carry the low 16 bits of the address, so two segments
+    // whose low halves overlap cannot be told apart and must not share the link.
+    const uint32_t begin = segment.address & 0xFFFF;
+    const uint32_t end = begin + segment.size;
+    for (const auto& other : m_reads_in_flight)
+    {
+        const uint32_t other_begin = other.address & 0xFFFF;
+        const uint32_t other_end = other_begin + other.size;
+        if (begin < other_end && other_begin < end)
+            return true;
+        // Account for a segment that wraps past 0xFFFF
+        if (end > 0x10000 && other_begin < end - 0x10000)
+            return true;
+        if (other_end > 0x10000 && begin < other_end - 0x10000)
+            return true;
+    }
+    return false;
+}
+
+void WiimoteRegisterEngine::QueueReadRequestLocked(const ReadSegment& segment, uint32_t offset)
+{
+    const uint32_t address = segment.address + offset;
+    const uint16_t size = static_cast<uint16_t>(segment.size - offset);
+
+    std::vector<uint8_t> report = {
+        OUTPUT_READ_MEMORY,
+        segment.owner->address_space,
+        static_cast<uint8_t>((address >> 16) & 0xFF),
+        static_cast<uint8_t>((address >> 8) & 0xFF),
+        static_cast<uint8_t>(address & 0xFF),
+        static_cast<uint8_t>((size >> 8) & 0xFF),
+        static_cast<uint8_t>(size & 0xFF),
+    };
+    m_outbox.push_back(std::move(report));
+}
+
+void WiimoteRegisterEngine::QueueWriteRequestLocked(const WriteChunk& chunk)
+{
+    std::vector<uint8_t> report(MAX_REPORT_SIZE, 0);
+    report[0] = OUTPUT_WRITE_MEMORY;
+    report[1] = chunk.owner ? chunk.owner->address_space : ADDRESS_SPACE_REGISTER;
+    report[2] = static_cast<uint8_t>((chunk.address >> 16) & 0xFF);
+    report[3] = static_cast<uint8_t>((chunk.address >> 8) & 0xFF);
+    report[4] = static_cast<uint8_t>(chunk.address & 0xFF);
+    report[5] = chunk.size;
+    memcpy(&report[6], chunk.data, chunk.size);
+    m_outbox.push_back(std::move(report));
+}
+
+bool WiimoteRegisterEngine::HandleInputReport(const uint8_t* report, size_t size)
+{
+    if (size < 1 || (report[0] != INPUT_READ_DATA && report[0] != INPUT_ACK))
+        return false;
+
+    std::vector<Completion> done;
+    bool consumed = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (report[0] == INPUT_READ_DATA)
+            consumed = HandleReadDataLocked(report, size, done);
+        else
+            consumed = HandleAckLocked(report, size, done);
+
+        if (consumed)
+            IssuePendingLocked(Clock::now());
+    }
+
+    DrainOutbox();
+    RunCompletions(done);
+    return consumed;
+}
+
+bool WiimoteRegisterEngine::HandleReadDataLocked(const uint8_t* report, size_t size,
+                                                 std::vector<Completion>& done)
+{
+    // 21 BB BB SE AA AA DD*16
+    if (size < 6 + MEMORY_READ_CHUNK_BYTES)
+        return false;
+
+    const uint8_t chunk_size = static_cast<uint8_t>((report[3] >> 4) + 1);
+    const uint8_t error = report[3] & 0x0F;
+    const uint16_t chunk_address = static_cast<uint16_t>((report[4] << 8) | report[5]);
+
+    // Only the next expected chunk of a segment is accepted, which drops the
+    // duplicates a retransmitted request can produce.
+    auto it = std::find_if(m_reads_in_flight.begin(), m_reads_in_flight.end(),
+        [chunk_address](const ReadSegment& segment) {
+            return ((segment.address + segment.received) & 0xFFFF) == chunk_address;
+        });
+
+    if (it == m_reads_in_flight.end())
+    {
+        m_stats.unmatched_replies++;
+        return true;
+    }
+
+    Transaction* owner = it->owner;
+    if (error != ERROR_NONE)
+    {
+        FailTransactionLocked(owner, RegisterStatus::DeviceError, error, done);
+        return true;
+    }
+
+    const uint16_t count = std::min<uint16_t>(chunk_size, it->size - it->received);
+    const size_t offset = (it->address - owner->address) + it->received;
+    memcpy(owner->data.data() + offset, &report[6], count);
+    it->received = static_cast<uint16_t>(it->received + count);
+    it->deadline = Clock::now() + m_config.timeout;
+    m_stats.bytes_read += count;
+
+    if (it->received >= it->size)
+    {
+        m_reads_in_flight.erase(it);
+        PartFinishedLocked(owner, done);
+    }
+    return true;
+}
+
+bool WiimoteRegisterEngine::HandleAckLocked(const uint8_t* report, size_t size,
+                                            std::vector<Completion>& done)
+{
+    // 22 BB BB RR EE
+    if (size < 5 || report[3] != OUTPUT_WRITE_MEMORY)
+        return false;
+
+    if (m_writes_in_flight.empty())
+    {
+        m_stats.unmatched_replies++;
+        return true;
+    }
+
+    WriteChunk chunk = m_writes_in_flight.front();
+    m_writes_in_flight.pop_front();
+
+    // A chunk of a transaction that already failed stays in flight only so
+    // that its acknowledgement is not taken for the next write's.
+    if (!chunk.owner)
+        return true;
+
+    if (report[4] != ERROR_NONE)
+    {
+        FailTransactionLocked(chunk.owner, RegisterStatus::DeviceError, report[4], done);
+        return true;
+    }
+
+    m_stats.bytes_written += chunk.size;
+    PartFinishedLocked(chunk.owner, done);
+    return true;
+}
+
+void WiimoteRegisterEngine::Tick(Clock::time_point now)
+{
+    std::vector<Completion> done;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        std::vector<Transaction*> expired;
+        for (auto& segment : m_reads_in_flight)
+        {
+            if (now < segment.deadline)
+                continue;
+
+            if (segment.retries < m_config.max_retries)
+            {
+                // Ask again for whatever part of the segment has not arrived
+                segment.retries++;
+                segment.deadline = now + m_config.timeout;
+                m_stats.retries++;
+                QueueReadRequestLocked(segment, segment.received);
+            }
+            else if (std::find(expired.begin(), expired.end(), segment.owner) == expired.end())
+            {
+                expired.push_back(segment.owner);
+            }
+        }
+
+        if (!m_writes_in_flight.empty() && now >= m_writes_in_flight.front().deadline)
+        {
+            WriteChunk& front = m_writes_in_flight.front();
+            if (!front.owner)
+            {
+                m_writes_in_flight.pop_front();
+            }
+            else if (front.retries < m_config.max_retries)
+            {
+                front.retries++;
+                front.deadline = now + m_config.timeout;
+                QueueWriteRequestLocked(front);
+                m_stats.retries++;
+            }
+            else
+            {
+                Transaction* owner = front.owner;
+                m_writes_in_flight.pop_front();
+                expired.push_back(owner);
+            }
+        }
+
+        for (Transaction* transaction : expired)
+        {
+            LOG_DEBUG(LogFormat("Register %s at 0x%06X timed out",
+                                transaction->is_read ? "read" : "write", transaction->address));
+            FailTransactionLocked(transaction, RegisterStatus::Timeout, 0, done);
+        }
+
+        IssuePendingLocked(now);
+    }
+
+    DrainOutbox();
+    RunCompletions(done);
+}
+
+void WiimoteRegisterEngine::CancelAll()
+{
+    std::vector<Completion> done;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        while (!m_transactions.empty())
+            FailTransactionLocked(&m_transactions.front(), RegisterStatus::Cancelled, 0, done);
+        m_writes_in_flight.clear();
+        m_outbox.clear();
+    }
+    RunCompletions(done);
+}
+
+bool WiimoteRegisterEngine::IsIdle() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_transactions.empty();
+}
+
+WiimoteRegisterEngine::Stats WiimoteRegisterEngine::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void WiimoteRegisterEngine::PartFinishedLocked(Transaction* transaction, std::vector<Completion>& done)
+{
+    if (transaction->pending_parts > 0)
+        transaction->pending_parts--;
+    if (transaction->pending_parts == 0)
+        done.push_back(MakeCompletionLocked(transaction));
+}
+
+void WiimoteRegisterEngine::FailTransactionLocked(Transaction* transaction, RegisterStatus status,
+                                                  uint8_t device_error,
+                                                  std::vector<Completion>& done)
+{
+    transaction->failed = true;
+    transaction->status = status;
+    transaction->device_error = device_error;
+
+    m_pending.erase(std::remove_if(m_pending.begin(), m_pending.end(),
+        [transaction](const PendingRequest& request) {
+            return request.is_read ? request.segment.owner == transaction
+                                   : request.chunk.owner == transaction;
+        }), m_pending.end());
+
+    m_reads_in_flight.remove_if([transaction](const ReadSegment& segment) {
+        return segment.owner == transaction;
+    });
+
+    for (auto& chunk : m_writes_in_flight)
+    {
+        if (chunk.owner == transaction)
+            chunk.owner = nullptr;
+    }
+
+    done.push_back(MakeCompletionLocked(transaction));
+}
+
+WiimoteRegisterEngine::Completion WiimoteRegisterEngine::MakeCompletionLocked(Transaction* transaction)
+{
+    Completion completion;
+    const auto elapsed = std::chrono::duration<double>(Clock::now() - transaction->submitted).count();
+
+    if (transaction->is_read)
+    {
+        RegisterReadResult result;
+        result.status = transaction->status;
+        result.address_space = transaction->address_space;
+        result.address = transaction->address;
+        result.device_error = transaction->device_error;
+        if (!transaction->failed)
+        {
+            result.data = std::move(transaction->data);
+            m_stats.reads_completed++;
+            m_stats.last_read_ms = elapsed * 1000.0;
+            if (elapsed > 0.0)
+                m_stats.last_read_bytes_per_second = transaction->size / elapsed;
+        }
+        else
+        {
+            m_stats.reads_failed++;
+        }
+        completion = [callback = std::move(transaction->read_callback), result = std::move(result)]() {
+            if (callback)
+                callback(result);
+        };
+    }
+    else
+    {
+        if (!transaction->failed)
+            m_stats.writes_completed++;
+        else
+            m_stats.writes_failed++;
+        completion = [callback = std::move(transaction->write_callback), status = transaction->status]() {
+            if (callback)
+                callback(status);
+        };
+    }
+
+    auto it = std::find_if(m_transactions.begin(), m_transactions.end(),
+        [transaction](const Transaction& candidate) { return &candidate == transaction; });
+    if (it != m_transactions.end())
+        m_transactions.erase(it);
+
+    return completion;
+}
+
+void WiimoteRegisterEngine::DrainOutbox()
+{
+    // A single thread at a time pushes queued reports to the device so that
+    // the wire order always matches the order the engine queued them in.
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_draining)
+        return;
+
+    m_draining = true;
+    bool send_failed = false;
+    while (!m_outbox.empty() && !send_failed)
+    {
+        std::vector<uint8_t> report = std::move(m_outbox.front());
+        m_outbox.pop_front();
+
+        lock.unlock();
+        send_failed = !m_send || !m_send(report.data(), report.size());
+        lock.lock();
+    }
+    m_draining = false;
+
+    if (!send_failed)
+        return;
+
+    // The device is unreachable; nothing in flight will be answered.
+    LOG_ERROR("Register request could not be sent, failing outstanding requests");
+    std::vector<Completion> done;
+    while (!m_transactions.empty())
+        FailTransactionLocked(&m_transactions.front(), RegisterStatus::SendFailed, 0, done);
+    m_writes_in_flight.clear();
+    m_outbox.clear();
+    lock.unlock();
+
+    RunCompletions(done);
+}
+
+void WiimoteRegisterEngine::RunCompletions(std::vector<Completion>& done)
+{
+    for (auto& completion : done)
+        completion();
+    done.clear();
+}
@@ -0,0 +1,195 @@
+#include "wiimote_speaker.h"
+#include "speaker_streamer.h"
+#include "debug_log.h"
+#include <memory>
+#include <algorithm>
+
+using namespace WiimoteProtocol;
+
+size_t SpeakerConfig::SamplesPerReport() const
+{
+    return format == SpeakerFormat::Adpcm ? SPEAKER_DATA_BYTES * 2 : SPEAKER_DATA_BYTES;
+}
+
+WiimoteSpeaker::WiimoteSpeaker(WiimoteRegisterEngine& registers, SendFunction send, SendFunction send_data)
+    : m_registers(registers), m_send(std::move(send)), m_send_data(std::move(send_data)),
+      m_state(State::Off), m_generation(0),
+      m_playing(false)
+{
+}
+
+WiimoteSpeaker::~WiimoteSpeaker()
+{
+    // The owner disables the speaker while it can still send; just make sure
+    // the streamer lets go of it
+    if (IsEnabled())
+        SpeakerStreamer::Instance().Remove(this);
+}
+
+void WiimoteSpeaker::Enable(uint8_t volume)
+{
+    const SpeakerConfig config = SpeakerStreamer::Instance().GetConfig();
+    uint32_t generation;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_state != State::Off)
+            return;
+        m_state = State::Starting;
+        generation = ++m_generation;
+    }
+
+    const uint8_t enable[2] = { OUTPUT_SPEAKER_ENABLE, OUTPUT_FLAG_ENABLE };
+    const uint8_t mute[2] = { OUTPUT_SPEAKER_MUTE, OUTPUT_FLAG_ENABLE };
+    m_send(enable, sizeof(enable));
+    m_send(mute, sizeof(mute));
+
+    const bool adpcm = config.format == SpeakerFormat::Adpcm;
+    const uint32_t rate = (adpcm ? SPEAKER_ADPCM_CLOCK : SPEAKER_PCM8_CLOCK) / std::max<uint32_t>(config.sample_rate, 1);
+    const uint8_t on = 0x01;
+    const uint8_t reset = 0x08;
+    const uint8_t setup[7] = {
+        0x00, adpcm ? SPEAKER_FORMAT_ADPCM : SPEAKER_FORMAT_PCM8,
+        static_cast<uint8_t>(rate & 0xFF), static_cast<uint8_t>(rate >> 8),
+        volume, 0x00, 0x00
+    };
+
+    // The writes are pipelined by the register engine; the setup has worked
+    // only if every one of them has
+    auto failure = std::make_shared<RegisterStatus>(RegisterStatus::Ok);
+    auto record = [failure](RegisterStatus status) {
+        if (status != RegisterStatus::Ok && *failure == RegisterStatus::Ok)
+            *failure = status;
+    };
+    m_registers.Write(ADDRESS_SPACE_REGISTER, SPEAKER_ENABLE, &on, 1, record);
+    m_registers.Write(ADDRESS_SPACE_REGISTER, SPEAKER_CONFIG, &reset, 1, record);
+    m_registers.Write(ADDRESS_SPACE_REGISTER, SPEAKER_CONFIG, setup, sizeof(setup), record);
+    m_registers.Write(ADDRESS_SPACE_REGISTER, SPEAKER_PLAY, &on, 1,
+        [this, generation, failure, record](RegisterStatus status) {
+            record(status);
+            HandleSetupDone(generation, *failure);
+        });
+}
+
+void WiimoteSpeaker::HandleSetupDone(uint32_t generation, RegisterStatus status)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (generation != m_generation || m_state != State::Starting)
+            return;
+        if (status != RegisterStatus::Ok)
+        {
+            m_state = State::Off;
+            LOG_ERROR(LogFormat("Wiimote speaker setup failed (status %d)", static_cast<int>(status)));
+            return;
+        }
+        m_state = State::On;
+        m_playing = false;
+    }
+
+    const uint8_t unmute[2] = { OUTPUT_SPEAKER_MUTE, 0x00 };
+    m_send(unmute, sizeof(unmute));
+
+    if (!SpeakerStreamer::Instance().Add(this))
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (generation == m_generation)
+            m_state = State::Off;
+        return;
+    }
+
+    // Disabled while being added: take it out again
+    bool superseded;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        superseded = generation != m_generation;
+    }
+    if (superseded)
+        SpeakerStreamer::Instance().Remove(this);
+    else
+        LOG_DEBUG("Wiimote speaker enabled");
+}
+
+void WiimoteSpeaker::Disable()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_state == State::Off)
+            return;
+        m_state = State::Off;
+        ++m_generation;
+        m_buffer.clear();
+    }
+
+    SpeakerStreamer::Instance().Remove(this);
+
+    const uint8_t mute[2] = { OUTPUT_SPEAKER_MUTE, OUTPUT_FLAG_ENABLE };
+    const uint8_t disable[2] = { OUTPUT_SPEAKER_ENABLE, 0x00 };
+    m_send(mute, sizeof(mute));
+    m_send(disable, sizeof(disable));
+}
+
+bool WiimoteSpeaker::IsEnabled() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_state != State::Off;
+}
+
+size_t WiimoteSpeaker::Queue(const int16_t* samples, size_t count)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const size_t accepted = std::min(count, MAX_BUFFERED_SAMPLES - std::min(m_buffer.size(), MAX_BUFFERED_SAMPLES));
+    m_buffer.insert(m_buffer.end(), samples, samples + accepted);
+    m_stats.dropped_samples += count - accepted;
+    return accepted;
+}
+
+void WiimoteSpeaker::ClearQueue()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_buffer.clear();
+}
+
+WiimoteSpeaker::Stats WiimoteSpeaker::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats = m_stats;
+    stats.buffered_samples = m_buffer.size();
+    return stats;
+}
+
+bool WiimoteSpeaker::Pull(int16_t* samples, size_t count)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_state != State::On || m_buffer.empty())
+    {
+        // Running dry in the middle of a stream is an underrun; an empty
+        // queue between streams is just silence and costs no reports
+        if (m_playing)
+            m_stats.underruns++;
+        m_playing = false;
+        return false;
+    }
+
+    const size_t available = std::min(count, m_buffer.size());
+    std::copy(m_buffer.begin(), m_buffer.begin() + available, samples);
+    std::fill(samples + available, samples + count, static_cast<int16_t>(0));
+    m_buffer.erase(m_buffer.begin(), m_buffer.begin() + available);
+    if (available < count && m_playing)
+        m_stats.underruns++;
+    m_playing = available == count;
+    return true;
+}
+
+bool WiimoteSpeaker::SendData(const uint8_t* data, size_t size, size_t samples)
+{
+    // 18 LL DD x 20, length in the top five bits
+    uint8_t report[2 + SPEAKER_DATA_BYTES] = { OUTPUT_SPEAKER_DATA, static_cast<uint8_t>(size << 3) };
+    std::copy(data, data + std::min(size, SPEAKER_DATA_BYTES), report + 2);
+    if (!m_send_data(report, sizeof(report)))
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.reports_sent++;
+    m_stats.samples_played += samples;
+    return true;
+}